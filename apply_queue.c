@@ -0,0 +1,226 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A queue of verified updates waiting to be applied */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "event_loop.h"
+#include "apply_queue.h"
+
+#define MAX_PIPELINE_DEPTH  8
+
+static int pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+
+
+void set_pipeline_depth(int depth)
+{
+    if ( depth > MAX_PIPELINE_DEPTH ) {
+        depth = MAX_PIPELINE_DEPTH;
+    }
+    if ( depth < 0 ) {
+        depth = 0;
+    }
+    pipeline_depth = depth;
+}
+
+int get_pipeline_depth(void)
+{
+    return(pipeline_depth);
+}
+
+apply_queue *create_apply_queue(update_callback update, void *udata,
+                                applied_callback applied, void *data)
+{
+    apply_queue *queue;
+
+    queue = (apply_queue *)safe_malloc(sizeof *queue);
+    queue->list = NULL;
+    queue->current = NULL;
+    queue->job.process = NULL;
+    queue->failed = 0;
+    queue->update = update;
+    queue->udata = udata;
+    queue->applied = applied;
+    queue->applied_data = data;
+    return(queue);
+}
+
+static void free_ready_update(ready_update *ready)
+{
+    free(ready->file);
+    free(ready->install_path);
+    free(ready);
+}
+
+/* Throw away the updates that haven't been started */
+static void discard_updates(apply_queue *queue)
+{
+    ready_update *ready;
+
+    while ( queue->list ) {
+        ready = queue->list;
+        queue->list = ready->next;
+        log(LOG_DEBUG, "Not applying %s\n", ready->file);
+        free_ready_update(ready);
+    }
+}
+
+/* Let the UI know how the current update went */
+static void finish_current(apply_queue *queue, int status)
+{
+    ready_update *ready;
+
+    ready = queue->current;
+    queue->current = NULL;
+    if ( status != 0 ) {
+        /* The later updates depend on this one */
+        queue->failed = 1;
+        discard_updates(queue);
+    }
+    if ( queue->applied ) {
+        queue->applied(ready->patch, ready->file, status,
+                       queue->applied_data);
+    }
+    free_ready_update(ready);
+}
+
+/* Start applying the next update in the queue, if there is one */
+static void start_next(apply_queue *queue)
+{
+    while ( ! queue->current && queue->list && ! queue->failed ) {
+        queue->current = queue->list;
+        queue->list = queue->current->next;
+        update_message(LOG_STATUS, _("Performing update"),
+                       queue->update, queue->udata);
+        if ( perform_update_start(queue->current->file,
+                                  queue->current->install_path, &queue->job,
+                                  queue->update, queue->udata) < 0 ) {
+            finish_current(queue, -1);
+        }
+    }
+}
+
+int apply_queue_full(apply_queue *queue)
+{
+    int count;
+    ready_update *ready;
+
+    /* The update being applied counts, so a depth of 0 means the
+       updates are downloaded and applied one at a time */
+    count = queue->current ? 1 : 0;
+    for ( ready = queue->list; ready; ready = ready->next ) {
+        ++count;
+    }
+    return(count > pipeline_depth);
+}
+
+void queue_update(apply_queue *queue, patch *patch,
+                  const char *file, const char *install_path)
+{
+    ready_update *ready, *last;
+
+    if ( queue->failed ) {
+        return;
+    }
+    ready = (ready_update *)safe_malloc(sizeof *ready);
+    ready->patch = patch;
+    ready->file = safe_strdup(file);
+    ready->install_path = safe_strdup(install_path);
+    ready->next = NULL;
+    if ( queue->list ) {
+        for ( last = queue->list; last->next; last = last->next ) {
+            continue;
+        }
+        last->next = ready;
+    } else {
+        queue->list = ready;
+    }
+    start_next(queue);
+}
+
+int poll_apply_queue(apply_queue *queue)
+{
+    if ( queue->current &&
+         (perform_update_poll(&queue->job, queue->update, queue->udata) == 0) ) {
+        finish_current(queue, queue->job.status);
+    }
+    start_next(queue);
+    return(queue->current || queue->list);
+}
+
+/* Pass the progress of the current update on to the update callback,
+   stopping it and the rest of the queue if the callback says to.
+   Returns 1 if the updates were cancelled.
+ */
+static int cancel_apply_queue(apply_queue *queue)
+{
+    if ( queue->current && queue->update &&
+         queue->update(0, NULL, queue->job.percentage, 0, 0, 0.0f,
+                       queue->udata) ) {
+        perform_update_abort(&queue->job);
+        finish_current(queue, queue->job.status);
+        return(1);
+    }
+    return(0);
+}
+
+int wait_apply_queue(apply_queue *queue)
+{
+    ready_update *current;
+
+    current = queue->current;
+    while ( current && (queue->current == current) ) {
+        if ( cancel_apply_queue(queue) ) {
+            return(-1);
+        }
+        event_poll(100);
+        poll_apply_queue(queue);
+    }
+    return(0);
+}
+
+int finish_apply_queue(apply_queue *queue)
+{
+    while ( poll_apply_queue(queue) ) {
+        if ( wait_apply_queue(queue) < 0 ) {
+            break;
+        }
+    }
+    return(queue->failed ? -1 : 0);
+}
+
+void free_apply_queue(apply_queue *queue)
+{
+    if ( queue->current ) {
+        perform_update_abort(&queue->job);
+        finish_current(queue, queue->job.status);
+    }
+    discard_updates(queue);
+    free(queue);
+}
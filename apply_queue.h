@@ -0,0 +1,100 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A queue of verified updates waiting to be applied, so the next few
+   updates can be downloaded and verified while one is being applied.
+   The updates are always applied in the order they were added.
+*/
+
+#ifndef _apply_queue_h
+#define _apply_queue_h
+
+#include "update.h"
+#include "patchset.h"
+
+/* The number of updates downloaded ahead of the one being applied */
+#define DEFAULT_PIPELINE_DEPTH  2
+
+/* Set the number of updates to download ahead, or 0 to apply each one
+   before the next one is downloaded.
+ */
+extern void set_pipeline_depth(int depth);
+extern int get_pipeline_depth(void);
+
+/* Called as each update finishes, with the exit status of the update */
+typedef void (*applied_callback)(patch *patch, const char *file,
+                                 int status, void *data);
+
+typedef struct ready_update {
+    patch *patch;
+    char *file;
+    char *install_path;
+    struct ready_update *next;
+} ready_update;
+
+typedef struct {
+    ready_update *list;         /* Updates waiting to be applied */
+    ready_update *current;      /* The update being applied, if any */
+    update_job job;
+    int failed;
+
+    /* Where the output of the updates goes */
+    update_callback update;
+    void *udata;
+
+    applied_callback applied;
+    void *applied_data;
+} apply_queue;
+
+extern apply_queue *create_apply_queue(update_callback update, void *udata,
+                                       applied_callback applied, void *data);
+
+/* Returns true if the queue has as many updates as it should hold */
+extern int apply_queue_full(apply_queue *queue);
+
+/* Add a verified update to the end of the queue, starting it right away
+   if nothing else is being applied.  Once an update has failed, no more
+   updates are applied and this does nothing.
+ */
+extern void queue_update(apply_queue *queue, patch *patch,
+                         const char *file, const char *install_path);
+
+/* Pass on any output from the update being applied, starting the next one
+   when it finishes.  Returns 1 if there are updates still to be applied,
+   or 0 if the queue is empty.
+ */
+extern int poll_apply_queue(apply_queue *queue);
+
+/* Wait for the update being applied to finish.  The update callback is
+   called while waiting, and if it returns nonzero the update is stopped,
+   the rest of the queue is thrown away and -1 is returned.
+ */
+extern int wait_apply_queue(apply_queue *queue);
+
+/* Apply all the updates in the queue, returning 0 if they all succeeded.
+   The update callback is called while waiting and may cancel the updates.
+ */
+extern int finish_apply_queue(apply_queue *queue);
+
+/* Stop the update being applied and free the queue */
+extern void free_apply_queue(apply_queue *queue);
+
+#endif /* _apply_queue_h */
@@ -0,0 +1,537 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* A store of verified updates, so they aren't downloaded and verified
+   again when an update is retried or needed by another product.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "safe_malloc.h"
+#include "prefpath.h"
+#include "log_output.h"
+#include "get_url.h"
+#include "urlset.h"
+#include "artifact_cache.h"
+
+#define ARTIFACT_DIR    "artifacts"
+#define INDEX_FILE      "index.txt"
+#define LOCK_FILE       "lock"
+
+/* The longest update file name or URL kept in the index */
+#define MAX_FIELD       1024
+
+static int cache_size = DEFAULT_ARTIFACT_CACHE_SIZE;
+
+/* An entry in the index, and the update stored for it */
+typedef struct artifact {
+    char sha256[SHA256_DIGEST_SIZE*2+1];
+    char md5[MD5_DIGEST_SIZE*2+1];
+    unsigned long size;
+    unsigned long inode;
+    long mtime;
+    long used;
+    verify_result verified;
+    gpg_result gpg;
+    char *name;
+    char *url;
+    char *sig;
+    struct artifact *next;
+} artifact;
+
+
+void set_artifact_cache_size(int megabytes)
+{
+    cache_size = (megabytes > 0) ? megabytes : 0;
+}
+
+int get_artifact_cache_size(void)
+{
+    return(cache_size);
+}
+
+/* Find the store directory and lock it, since several processes may be
+   downloading updates at once.  Returns the lock file descriptor, or -1
+   if the store can't be used.
+ */
+static int lock_store(char *dir, int maxlen)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    preferences_path(get_tmppath(get_session()), dir, maxlen);
+    mkdir(dir, 0700);
+    if ( maxlen < (strlen(dir)+1+strlen(ARTIFACT_DIR)+1+
+                   SHA256_DIGEST_SIZE*2+1) ) {
+        return(-1);
+    }
+    strcat(dir, "/" ARTIFACT_DIR);
+    mkdir(dir, 0700);
+    sprintf(path, "%s/%s", dir, LOCK_FILE);
+    fd = open(path, O_RDWR|O_CREAT, 0600);
+    if ( fd < 0 ) {
+        log(LOG_DEBUG, "Unable to open %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+    if ( flock(fd, LOCK_EX) < 0 ) {
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+static void unlock_store(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static void free_artifact(artifact *entry)
+{
+    free(entry->name);
+    free(entry->url);
+    free(entry->sig);
+    free(entry);
+}
+
+static void free_index(artifact *list)
+{
+    artifact *freeable;
+
+    while ( list ) {
+        freeable = list;
+        list = list->next;
+        free_artifact(freeable);
+    }
+}
+
+/* Index fields are separated by spaces, so anything else is left out */
+static char *index_field(const char *text)
+{
+    if ( ! text || ! *text || (strlen(text) >= MAX_FIELD) ||
+         strpbrk(text, " \t\r\n") ) {
+        text = "-";
+    }
+    return(safe_strdup(text));
+}
+
+static artifact *load_index(const char *dir)
+{
+    char path[PATH_MAX];
+    char line[3*MAX_FIELD];
+    char name[MAX_FIELD];
+    char url[MAX_FIELD];
+    artifact *list, *last, *entry;
+    int verified, gpg, len;
+    char *newline;
+    FILE *fp;
+
+    list = NULL;
+    last = NULL;
+    sprintf(path, "%s/%s", dir, INDEX_FILE);
+    fp = fopen(path, "r");
+    if ( ! fp ) {
+        return(NULL);
+    }
+    while ( fgets(line, sizeof(line), fp) ) {
+        newline = strchr(line, '\n');
+        if ( newline ) {
+            *newline = '\0';
+        }
+        entry = (artifact *)safe_malloc(sizeof *entry);
+        len = 0;
+        if ( (sscanf(line, "%64s %32s %lu %lu %ld %ld %d %d %1023s %1023s %n",
+                     entry->sha256, entry->md5, &entry->size, &entry->inode,
+                     &entry->mtime, &entry->used, &verified, &gpg,
+                     name, url, &len) < 10) || ! len ||
+             (strlen(entry->sha256) != SHA256_DIGEST_SIZE*2) ) {
+            free(entry);
+            continue;
+        }
+        entry->verified = (verify_result)verified;
+        entry->gpg = (gpg_result)gpg;
+        entry->name = safe_strdup(name);
+        entry->url = safe_strdup(url);
+        entry->sig = safe_strdup(line+len);
+        entry->next = NULL;
+        if ( last ) {
+            last->next = entry;
+        } else {
+            list = entry;
+        }
+        last = entry;
+    }
+    fclose(fp);
+    return(list);
+}
+
+/* Write out the index, replacing the old one all at once */
+static void save_index(const char *dir, artifact *list)
+{
+    char path[PATH_MAX];
+    char newpath[PATH_MAX];
+    artifact *entry;
+    FILE *fp;
+    int okay;
+
+    sprintf(path, "%s/%s", dir, INDEX_FILE);
+    sprintf(newpath, "%s.new", path);
+    fp = fopen(newpath, "w");
+    if ( ! fp ) {
+        log(LOG_DEBUG, "Unable to write %s: %s\n", newpath, strerror(errno));
+        return;
+    }
+    for ( entry = list; entry; entry = entry->next ) {
+        fprintf(fp, "%s %s %lu %lu %ld %ld %d %d %s %s %s\n",
+                entry->sha256, entry->md5, entry->size, entry->inode,
+                entry->mtime, entry->used, entry->verified, entry->gpg,
+                entry->name, entry->url, entry->sig);
+    }
+    okay = ! ferror(fp);
+    if ( (fclose(fp) != 0) || ! okay || (rename(newpath, path) < 0) ) {
+        unlink(newpath);
+    }
+}
+
+/* See if a stored update is still the file that was verified */
+static int valid_artifact(const char *dir, artifact *entry)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+
+    sprintf(path, "%s/%s", dir, entry->sha256);
+    return((stat(path, &sb) == 0) &&
+           ((unsigned long)sb.st_size == entry->size) &&
+           ((unsigned long)sb.st_ino == entry->inode) &&
+           ((long)sb.st_mtime == entry->mtime));
+}
+
+static void remove_artifact(const char *dir, artifact *entry)
+{
+    char path[PATH_MAX];
+
+    sprintf(path, "%s/%s", dir, entry->sha256);
+    unlink(path);
+    free_artifact(entry);
+}
+
+/* Drop the updates that have changed since they were verified, and then
+   the ones used least recently, until the store is within its limit.
+ */
+static void trim_store(const char *dir, artifact **list)
+{
+    artifact *entry, **prev, **oldest;
+    unsigned long total, limit;
+
+    total = 0;
+    prev = list;
+    while ( (entry = *prev) ) {
+        if ( ! valid_artifact(dir, entry) ) {
+            log(LOG_DEBUG, "Dropping changed update %s\n", entry->name);
+            *prev = entry->next;
+            remove_artifact(dir, entry);
+        } else {
+            total += (entry->size + 1023) / 1024;
+            prev = &entry->next;
+        }
+    }
+    limit = (unsigned long)cache_size * 1024;
+    while ( *list && (total > limit) ) {
+        oldest = list;
+        for ( prev = &(*list)->next; *prev; prev = &(*prev)->next ) {
+            if ( (*prev)->used < (*oldest)->used ) {
+                oldest = prev;
+            }
+        }
+        entry = *oldest;
+        *oldest = entry->next;
+        total -= (entry->size + 1023) / 1024;
+        log(LOG_DEBUG, "Removing cached update %s\n", entry->name);
+        remove_artifact(dir, entry);
+    }
+}
+
+static int matches_artifact(artifact *entry,
+                            const char *sha256, const char *md5)
+{
+    if ( sha256 ) {
+        return(digest_check(sha256, entry->sha256) == 1);
+    }
+    return((strlen(entry->md5) == MD5_DIGEST_SIZE*2) &&
+           (digest_check(md5, entry->md5) == 1));
+}
+
+/* See if an update was stored from one of the mirrors it's wanted from */
+static int from_mirrors(artifact *entry, const char *name, urlset *mirrors)
+{
+    struct mirror_url *mirror;
+    int len;
+
+    if ( strcmp(name, entry->name) != 0 ) {
+        return(0);
+    }
+    for ( mirror = mirrors->list; mirror; mirror = mirror->next ) {
+        len = strlen(mirror->url);
+        if ( (strncmp(entry->url, mirror->url, len) == 0) &&
+             (entry->url[len] == '/') &&
+             (strcmp(entry->url+len+1, name) == 0) ) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/* When the update list has no checksum, find an update stored under the
+   same name from one of its mirrors, and check it against the checksum
+   file on that mirror now, in case the update there has changed.  The
+   checksum file is fetched with the store unlocked.
+   Returns 1 and fills in 'sha256' if the stored update is still current.
+ */
+static int checked_artifact(const char *name, urlset *mirrors, char *sha256,
+                            update_callback update, void *udata)
+{
+    char dir[PATH_MAX];
+    char url[PATH_MAX];
+    char md5[MD5_DIGEST_SIZE*2+1];
+    artifact *list, *entry;
+    char *data;
+    int lock, size, checked;
+
+    lock = lock_store(dir, sizeof(dir));
+    if ( lock < 0 ) {
+        return(0);
+    }
+    list = load_index(dir);
+    for ( entry = list; entry; entry = entry->next ) {
+        if ( from_mirrors(entry, name, mirrors) &&
+             valid_artifact(dir, entry) ) {
+            strcpy(url, entry->url);
+            strcpy(sha256, entry->sha256);
+            strcpy(md5, entry->md5);
+            break;
+        }
+    }
+    free_index(list);
+    unlock_store(lock);
+    if ( ! entry ) {
+        return(0);
+    }
+
+    checked = -1;
+    strcat(url, ".sha256");
+    if ( get_url_data(url, &data, &size, MAX_SUM_DOWNLOAD,
+                      update, udata) == 0 ) {
+        checked = digest_check(data, sha256);
+        free(data);
+    } else
+    if ( strlen(md5) == MD5_DIGEST_SIZE*2 ) {
+        strcpy(strrchr(url, '.'), ".md5");
+        if ( get_url_data(url, &data, &size, MAX_SUM_DOWNLOAD,
+                          update, udata) == 0 ) {
+            checked = digest_check(data, md5);
+            free(data);
+        }
+    }
+    if ( checked == 0 ) {
+        log(LOG_VERBOSE, _("The stored copy of %s has changed on the mirror\n"),
+            name);
+    }
+    return(checked == 1);
+}
+
+int find_artifact(const char *name, const char *sha256, const char *md5,
+                  urlset *mirrors, const char *file, verify_result *verified,
+                  char *sig, int maxsig,
+                  update_callback update, void *udata)
+{
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    char stored_sha256[SHA256_DIGEST_SIZE*2+1];
+    struct stat sb, file_sb;
+    artifact *list, *entry;
+    int lock, found;
+
+    if ( ! cache_size ) {
+        return(0);
+    }
+    if ( ! sha256 && ! md5 ) {
+        if ( ! name || ! mirrors ||
+             ! checked_artifact(name, mirrors, stored_sha256, update, udata) ) {
+            return(0);
+        }
+        sha256 = stored_sha256;
+    }
+    lock = lock_store(dir, sizeof(dir));
+    if ( lock < 0 ) {
+        return(0);
+    }
+    list = load_index(dir);
+    for ( entry = list; entry; entry = entry->next ) {
+        if ( matches_artifact(entry, sha256, md5) &&
+             valid_artifact(dir, entry) ) {
+            break;
+        }
+    }
+    found = 0;
+    if ( entry ) {
+        /* Link the stored update to where it would have been downloaded,
+           unless it's already there */
+        sprintf(path, "%s/%s", dir, entry->sha256);
+        if ( (stat(path, &sb) == 0) && (stat(file, &file_sb) == 0) &&
+             (sb.st_dev == file_sb.st_dev) && (sb.st_ino == file_sb.st_ino) ) {
+            found = 1;
+        } else {
+            unlink(file);
+            if ( link(path, file) == 0 ) {
+                found = 1;
+            } else {
+                log(LOG_DEBUG, "Unable to link %s to %s: %s\n",
+                    path, file, strerror(errno));
+            }
+        }
+    }
+    if ( found ) {
+        log(LOG_VERBOSE, _("Using the verified copy of %s\n"), file);
+        *verified = entry->verified;
+        if ( sig ) {
+            if ( entry->gpg == GPG_VERIFYOK ) {
+                strncpy(sig, entry->sig, maxsig);
+                sig[maxsig-1] = '\0';
+            } else {
+                *sig = '\0';
+            }
+        }
+        entry->used = (long)time(NULL);
+        save_index(dir, list);
+    }
+    free_index(list);
+    unlock_store(lock);
+    return(found);
+}
+
+int store_artifact(const char *url, const char *name, const char *file,
+                   const digest_sums *sums, verify_result verified,
+                   gpg_result gpg, const char *sig)
+{
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    digest_context ctx;
+    digest_sums file_sums;
+    struct stat sb;
+    artifact *list, *entry, **prev;
+    int lock, status;
+
+    if ( ! cache_size ||
+         ((verified != VERIFY_OK) && (verified != VERIFY_UNKNOWN)) ||
+         (stat(file, &sb) < 0) ) {
+        return(-1);
+    }
+    lock = lock_store(dir, sizeof(dir));
+    if ( lock < 0 ) {
+        return(-1);
+    }
+    status = -1;
+    list = load_index(dir);
+
+    /* See if this is a stored update, which has already been checksummed */
+    for ( entry = list; entry; entry = entry->next ) {
+        if ( ((unsigned long)sb.st_ino == entry->inode) &&
+             ((unsigned long)sb.st_size == entry->size) &&
+             ((long)sb.st_mtime == entry->mtime) &&
+             valid_artifact(dir, entry) ) {
+            break;
+        }
+    }
+    if ( ! entry ) {
+        if ( ! sums || ! *sums->sha256 ) {
+            digest_init(&ctx);
+            if ( digest_file(&ctx, file, sb.st_size) < 0 ) {
+                goto done;
+            }
+            digest_final(&ctx, &file_sums);
+            sums = &file_sums;
+        }
+
+        /* Replace any other copy of the same update */
+        prev = &list;
+        while ( (entry = *prev) ) {
+            if ( strcmp(entry->sha256, sums->sha256) == 0 ) {
+                *prev = entry->next;
+                free_artifact(entry);
+            } else {
+                prev = &entry->next;
+            }
+        }
+        sprintf(path, "%s/%s", dir, sums->sha256);
+        unlink(path);
+        if ( link(file, path) < 0 ) {
+            log(LOG_DEBUG, "Unable to link %s to %s: %s\n",
+                file, path, strerror(errno));
+            goto done;
+        }
+
+        entry = (artifact *)safe_malloc(sizeof *entry);
+        strcpy(entry->sha256, sums->sha256);
+        strcpy(entry->md5, *sums->md5 ? sums->md5 : "-");
+        entry->size = (unsigned long)sb.st_size;
+        entry->inode = (unsigned long)sb.st_ino;
+        entry->mtime = (long)sb.st_mtime;
+        entry->verified = verified;
+        entry->gpg = gpg;
+        entry->name = index_field(name);
+        entry->url = index_field(url);
+        entry->sig = safe_strdup("");
+        entry->next = NULL;
+        *prev = entry;
+    }
+
+    /* A good signature isn't forgotten if it couldn't be checked later */
+    if ( (verified == VERIFY_OK) || (entry->verified != VERIFY_OK) ) {
+        entry->verified = verified;
+        entry->gpg = gpg;
+        free(entry->sig);
+        entry->sig = safe_strdup((sig && (gpg == GPG_VERIFYOK)) ? sig : "");
+        entry->sig[strcspn(entry->sig, "\r\n")] = '\0';
+    }
+    if ( url && (strcmp(entry->url, "-") == 0) ) {
+        free(entry->url);
+        entry->url = index_field(url);
+    }
+    entry->used = (long)time(NULL);
+    trim_store(dir, &list);
+    save_index(dir, list);
+    status = 0;
+done:
+    free_index(list);
+    unlock_store(lock);
+    return(status);
+}
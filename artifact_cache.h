@@ -0,0 +1,77 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* A store of downloaded updates that have already been verified, kept
+   in the "artifacts" directory under the temporary download path.  Each
+   update is stored by its SHA-256 checksum, so it's found again for any
+   product or install path that needs it, and it's linked back to the
+   download path rather than copied.
+
+   The index file has a line for each update, with its checksums, size,
+   inode and modification time, when it was last used, how it was
+   verified, the update file and URL, and who signed it.  An update is
+   only trusted again while its size, inode and modification time match
+   the index, so it doesn't need to be checksummed again.  The updates
+   used least recently are removed when the store grows past its limit.
+*/
+
+#ifndef _artifact_cache_h
+#define _artifact_cache_h
+
+#include "digest.h"
+#include "gpg_verify.h"
+#include "urlset.h"
+#include "update.h"
+
+/* The default size limit of the store, in megabytes */
+#define DEFAULT_ARTIFACT_CACHE_SIZE     200
+
+/* Set the size limit of the store in megabytes, or 0 to turn it off */
+extern void set_artifact_cache_size(int megabytes);
+extern int get_artifact_cache_size(void);
+
+/* Look for a verified copy of an update, matching the checksum from the
+   update list if there is one.  Otherwise the copy must have the same
+   file name and have come from one of 'mirrors', and still match the
+   checksum file on that mirror, which is fetched with the update callback.
+   If one is found, it's linked to 'file', the path the update would have
+   been downloaded to, and the result of verifying it is returned, along
+   with the signer if the GPG signature was good.  Returns 1 if the update
+   was found, or 0 if it needs to be downloaded.
+ */
+extern int find_artifact(const char *name, const char *sha256, const char *md5,
+                         urlset *mirrors, const char *file,
+                         verify_result *verified, char *sig, int maxsig,
+                         update_callback update, void *udata);
+
+/* Add a verified download to the store.  'gpg' is the result of checking
+   its signature, GPG_NOTINSTALLED if it wasn't checked, and 'sig' is
+   the signer when it was good.  If the file is already stored, only its
+   verification is updated, otherwise 'sums' may be NULL if the file needs
+   to be checksummed.  The URL may be NULL if it isn't known.
+   Returns 0, or -1 if the file couldn't be stored.
+ */
+extern int store_artifact(const char *url, const char *name, const char *file,
+                          const digest_sums *sums, verify_result verified,
+                          gpg_result gpg, const char *sig);
+
+#endif /* _artifact_cache_h */
@@ -0,0 +1,173 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to check each block of a file as it is downloaded */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "text_parse.h"
+#include "get_url.h"
+#include "block_sums.h"
+
+block_sums *load_block_sums(char *data, int size)
+{
+    struct text_fp *file;
+    block_sums *blocks;
+    char key[1024], val[1024];
+    int i, max_blocks;
+
+    file = text_open_data(data, size);
+    if ( ! file ) {
+        return(NULL);
+    }
+    blocks = (block_sums *)safe_malloc(sizeof *blocks);
+    blocks->block_size = 0;
+    blocks->num_blocks = 0;
+    blocks->sha256 = NULL;
+    max_blocks = 0;
+    while ( text_parsefield(file, key, sizeof(key), val, sizeof(val)) ) {
+        if ( strcasecmp(key, "Block-Size") == 0 ) {
+            blocks->block_size = (off_t)strtoll(val, NULL, 10);
+        } else
+        if ( strcasecmp(key, "SHA256") == 0 ) {
+            for ( i=0; isxdigit((int)val[i]); ++i ) {
+                val[i] = tolower(val[i]);
+            }
+            if ( (i != SHA256_DIGEST_SIZE*2) || val[i] ) {
+                log(LOG_WARNING, _("Invalid block checksum: %s\n"), val);
+                blocks->num_blocks = 0;
+                break;
+            }
+            if ( blocks->num_blocks == max_blocks ) {
+                max_blocks += 64;
+                blocks->sha256 = safe_realloc(blocks->sha256,
+                                    max_blocks*(sizeof *blocks->sha256));
+            }
+            strcpy(blocks->sha256[blocks->num_blocks++], val);
+        }
+    }
+    text_close(file);
+
+    if ( (blocks->block_size <= 0) || (blocks->num_blocks == 0) ) {
+        free_block_sums(blocks);
+        return(NULL);
+    }
+    log(LOG_DEBUG, "Loaded %d block checksums, %lld bytes per block\n",
+        blocks->num_blocks, (long long)blocks->block_size);
+    return(blocks);
+}
+
+block_sums *get_block_sums(const char *url,
+                           update_callback update, void *udata)
+{
+    char blocks_url[PATH_MAX];
+    char *data;
+    int size;
+
+    snprintf(blocks_url, sizeof(blocks_url), "%s.blocks", url);
+    if ( get_url_data(blocks_url, &data, &size, MAX_TEXT_DOWNLOAD,
+                      update, udata) < 0 ) {
+        log(LOG_VERBOSE, _("No block list at %s\n"), blocks_url);
+        return(NULL);
+    }
+    return(load_block_sums(data, size));
+}
+
+void free_block_sums(block_sums *blocks)
+{
+    if ( blocks ) {
+        safe_free(blocks->sha256);
+        free(blocks);
+    }
+}
+
+void block_check_init(block_checker *check, block_sums *blocks, off_t offset)
+{
+    check->blocks = blocks;
+    check->offset = offset;
+    check->used = 0;
+    sha256_init(&check->sha256);
+}
+
+/* Compare the block we've just finished with the list */
+static int check_block(block_checker *check)
+{
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    char sum[SHA256_DIGEST_SIZE*2+1];
+    int block;
+
+    block = (int)(check->offset / check->blocks->block_size);
+    sha256_final(&check->sha256, digest);
+    sha256_init(&check->sha256);
+    digest_hex(digest, SHA256_DIGEST_SIZE, sum);
+    if ( strcmp(sum, check->blocks->sha256[block]) != 0 ) {
+        log(LOG_WARNING, _("Block %d of the download is corrupt\n"), block+1);
+        check->used = 0;
+        return(-1);
+    }
+    check->offset += check->used;
+    check->used = 0;
+    return(0);
+}
+
+int block_check_update(block_checker *check, const void *data, int len)
+{
+    const unsigned char *input = (const unsigned char *)data;
+    off_t count;
+
+    while ( len > 0 ) {
+        if ( (check->offset / check->blocks->block_size) >=
+             check->blocks->num_blocks ) {
+            /* We're past the end of the list, nothing more to check */
+            check->offset += len;
+            break;
+        }
+        count = check->blocks->block_size - check->used;
+        if ( count > len ) {
+            count = len;
+        }
+        sha256_update(&check->sha256, input, (unsigned int)count);
+        check->used += count;
+        input += count;
+        len -= (int)count;
+        if ( (check->used == check->blocks->block_size) &&
+             (check_block(check) < 0) ) {
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+int block_check_final(block_checker *check)
+{
+    if ( check->used &&
+         ((check->offset / check->blocks->block_size) <
+          check->blocks->num_blocks) ) {
+        return(check_block(check));
+    }
+    return(0);
+}
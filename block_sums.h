@@ -0,0 +1,91 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to check each block of a file as it is downloaded, so a bad
+   mirror is caught as soon as it sends a corrupt block.
+
+   The block list is a text file next to the patch, with the extension
+   ".blocks", in the form:
+
+   Block-Size: 1048576
+   SHA256: <checksum of the first block>
+   SHA256: <checksum of the second block>
+   ...
+
+   The last block may be shorter than the block size.
+*/
+
+#ifndef _block_sums_h
+#define _block_sums_h
+
+#include <sys/types.h>
+
+#include "update.h"
+#include "digest.h"
+
+/* Block lists for patches smaller than this (in K) aren't fetched */
+#define BLOCK_SUMS_THRESHOLD    1024
+
+typedef struct {
+    off_t block_size;
+    int num_blocks;
+    char (*sha256)[SHA256_DIGEST_SIZE*2+1];
+} block_sums;
+
+/* Parse a block list downloaded into memory.  The data is freed.
+   Returns NULL if the data isn't a valid block list.
+ */
+extern block_sums *load_block_sums(char *data, int size);
+extern void free_block_sums(block_sums *blocks);
+
+/* Download and parse the block list for a URL, or return NULL if there
+   isn't one.
+ */
+extern block_sums *get_block_sums(const char *url,
+                                  update_callback update, void *udata);
+
+/* The block containing a given offset in the file */
+#define BLOCK_START(blocks, offset) \
+    (((offset) / (blocks)->block_size) * (blocks)->block_size)
+
+/* The state of checking a file, block by block, as the data arrives */
+typedef struct {
+    block_sums *blocks;
+    off_t offset;               /* The start of the current block */
+    off_t used;                 /* The amount of the block seen so far */
+    sha256_context sha256;
+} block_checker;
+
+/* Start checking a file at 'offset', which must be the start of a block */
+extern void block_check_init(block_checker *check, block_sums *blocks,
+                             off_t offset);
+
+/* Check the next data in the file.  Returns 0, or -1 if a block didn't
+   match, in which case the rest of the data is ignored and the checker
+   is left at the start of the bad block, so check->offset is where the
+   good data ends.  Data past the end of the block list isn't checked.
+ */
+extern int block_check_update(block_checker *check, const void *data, int len);
+
+/* Check the last block at the end of the file, as block_check_update() */
+extern int block_check_final(block_checker *check);
+
+#endif /* _block_sums_h */
@@ -0,0 +1,312 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Run another program in the background, reading its output a line at a
+   time from the event loop.
+
+   The output is read a buffer at a time as it arrives, and the program
+   is known to have exited by a pidfd where the kernel has them.  Some
+   programs leave children behind that keep the output pipe open, so the
+   pipe is closed as soon as the program itself exits.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "log_output.h"
+#include "event_loop.h"
+#include "child_process.h"
+
+/* Pass a whole line of output to the output function */
+static void output_line(child_process *child)
+{
+    child->line[child->len] = '\0';
+    child->len = 0;
+    if ( child->line[0] && child->output ) {
+        child->output(child, child->line, child->data);
+    }
+}
+
+/* Let the update callback know about any progress, once per read */
+static void report_progress(child_process *child)
+{
+    if ( child->update && (child->percentage != child->reported) ) {
+        child->reported = child->percentage;
+        child->update(0, NULL, child->percentage, 0, 0, 0.0f, child->udata);
+    }
+}
+
+/* Read a buffer of output and split it into lines.
+   Returns the number of bytes read, 0 at the end, or -1 if none are ready.
+ */
+static int read_lines(child_process *child)
+{
+    char buf[BUFSIZ];
+    int i, count;
+
+    count = read(child->fd, buf, sizeof(buf));
+    if ( count < 0 ) {
+        return(-1);
+    }
+    for ( i=0; i<count; ++i ) {
+        if ( (buf[i] == '\r') || (buf[i] == '\n') ) {
+            output_line(child);
+        } else {
+            child->line[child->len++] = buf[i];
+            if ( child->len == (sizeof(child->line)-1) ) {
+                output_line(child);
+            }
+        }
+    }
+    return(count);
+}
+
+static void close_output(child_process *child)
+{
+    if ( child->len > 0 ) {
+        output_line(child);
+    }
+    event_unwatch(child->fd);
+    close(child->fd);
+    child->fd = -1;
+}
+
+/* The program has exited, pick up its status and any output left */
+static void child_exited(child_process *child)
+{
+    if ( child->pidfd >= 0 ) {
+        event_unwatch(child->pidfd);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    child->pid = -1;
+    if ( child->fd >= 0 ) {
+        /* Anything it left behind may still have the pipe open */
+        fcntl(child->fd, F_SETFL, fcntl(child->fd, F_GETFL, 0)|O_NONBLOCK);
+        while ( read_lines(child) > 0 ) {
+            continue;
+        }
+        close_output(child);
+    }
+    report_progress(child);
+}
+
+/* Called from the event loop when the program has exited */
+static void read_exit(int fd, void *data)
+{
+    child_process *child = (child_process *)data;
+
+    if ( waitpid(child->pid, &child->status, WNOHANG) == child->pid ) {
+        child_exited(child);
+    }
+}
+
+/* Called from the event loop when there is output to read */
+static void read_output(int fd, void *data)
+{
+    child_process *child = (child_process *)data;
+    int count;
+
+    count = read_lines(child);
+    if ( count > 0 ) {
+        report_progress(child);
+        return;
+    }
+    if ( (count < 0) && ((errno == EINTR) || (errno == EAGAIN)) ) {
+        return;
+    }
+
+    /* The pipe was closed, so it's probably on its way out */
+    close_output(child);
+    if ( child->pid > 0 ) {
+        waitpid(child->pid, &child->status, 0);
+        child_exited(child);
+    }
+}
+
+/* Open /dev/null on a file descriptor the program doesn't use */
+static void null_fd(int fd)
+{
+    int null;
+
+    null = open("/dev/null", O_RDWR);
+    if ( (null >= 0) && (null != fd) ) {
+        dup2(null, fd);
+        close(null);
+    }
+}
+
+int child_start(child_process *child, char *const argv[], int flags,
+                const char *input, int inputlen,
+                child_output output, void *data,
+                update_callback update, void *udata)
+{
+    int pipefd[2];
+    int inputfd[2];
+    int count;
+
+    child->pid = -1;
+    child->fd = -1;
+    child->pidfd = -1;
+    child->status = -1;
+    child->killed = 0;
+    child->output = output;
+    child->data = data;
+    child->update = update;
+    child->udata = udata;
+    child->percentage = 0.0f;
+    child->reported = 0.0f;
+    child->len = 0;
+
+    /* First create a pipe for communicating between child and parent */
+    signal(SIGPIPE, SIG_IGN);
+    if ( pipe(pipefd) < 0 ) {
+        update_message(LOG_ERROR, _("Couldn't create IPC pipe"), update, udata);
+        return(-1);
+    }
+    if ( input && (pipe(inputfd) < 0) ) {
+        update_message(LOG_ERROR, _("Couldn't create IPC pipe"), update, udata);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return(-1);
+    }
+
+    fflush(stdout);
+    child->pid = fork();
+    switch (child->pid) {
+        case -1:
+            /* Fork failed */
+            update_message(LOG_ERROR, _("Couldn't fork process"), update, udata);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            if ( input ) {
+                close(inputfd[0]);
+                close(inputfd[1]);
+            }
+            return(-1);
+        case 0:
+            /* Child process */
+            close(pipefd[0]);
+            if ( input ) {
+                close(inputfd[1]);
+                dup2(inputfd[0], 0);
+                close(inputfd[0]);
+            } else {
+                null_fd(0);
+            }
+            if ( flags & CHILD_STDOUT ) {
+                dup2(pipefd[1], 1);
+            } else {
+                null_fd(1);
+            }
+            if ( flags & CHILD_STDERR ) {
+                dup2(pipefd[1], 2);
+            } else {
+                null_fd(2);
+            }
+            close(pipefd[1]);
+            execvp(argv[0], argv);
+            _exit(127);
+        default:
+            break;
+    }
+    close(pipefd[1]);
+    child->fd = pipefd[0];
+
+    /* Feed the input to the program */
+    if ( input ) {
+        close(inputfd[0]);
+        while ( inputlen > 0 ) {
+            count = write(inputfd[1], input, inputlen);
+            if ( count <= 0 ) {
+                break;
+            }
+            input += count;
+            inputlen -= count;
+        }
+        close(inputfd[1]);
+    }
+
+#ifdef SYS_pidfd_open
+    child->pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+    if ( child->pidfd >= 0 ) {
+        event_watch(child->pidfd, read_exit, child);
+    }
+#endif
+    event_watch(child->fd, read_output, child);
+    return(0);
+}
+
+int child_poll(child_process *child)
+{
+    if ( child->pid > 0 ) {
+        event_poll(0);
+    }
+    /* Without a pidfd, check whether it has left the pipe open */
+    if ( (child->pid > 0) && (child->pidfd < 0) ) {
+        read_exit(-1, child);
+    }
+    return(child->pid > 0);
+}
+
+int child_wait(child_process *child, update_callback update, void *udata)
+{
+    while ( child_poll(child) ) {
+        if ( update && update(0, NULL, child->percentage, 0, 0, 0.0f, udata) ) {
+            child_kill(child);
+            return(child->status);
+        }
+        event_poll(100);
+    }
+    return(child->status);
+}
+
+void child_kill(child_process *child)
+{
+    if ( child->pid > 0 ) {
+        kill(child->pid, SIGTERM);
+        waitpid(child->pid, NULL, 0);
+        child->pid = -1;
+        child->status = 256;
+        child->killed = 1;
+    }
+    if ( child->pidfd >= 0 ) {
+        event_unwatch(child->pidfd);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    if ( child->fd >= 0 ) {
+        event_unwatch(child->fd);
+        close(child->fd);
+        child->fd = -1;
+    }
+}
@@ -0,0 +1,90 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Run another program in the background, reading its output a line at a
+   time from the event loop.
+*/
+
+#ifndef _child_process_h
+#define _child_process_h
+
+#include <sys/types.h>
+
+#include "update.h"
+
+/* Which of the program's output goes to the output function */
+#define CHILD_STDOUT    0x01
+#define CHILD_STDERR    0x02
+
+struct child_process;
+
+/* Called with each line of output, without the line ending */
+typedef void (*child_output)(struct child_process *child, char *line,
+                             void *data);
+
+typedef struct child_process {
+    pid_t pid;                  /* -1 once the program has finished */
+    int fd;                     /* Its output, -1 once closed */
+    int pidfd;                  /* Readable when it exits, or -1 */
+    int status;                 /* As returned by waitpid() */
+    int killed;                 /* Set if it was stopped with child_kill() */
+
+    child_output output;
+    void *data;
+
+    /* The output function sets the percentage, and the update callback
+       is told when it changes, at most once for each read of the output.
+     */
+    update_callback update;
+    void *udata;
+    float percentage;
+    float reported;
+
+    char line[1024];
+    int len;
+} child_process;
+
+/* Start running a program, with 'input' fed to it on stdin if it's not
+   NULL.  The update callback is used for error messages and progress.
+   Returns 0, or -1 if the program couldn't be started.  If the program
+   can't be found, it exits with status 127.
+ */
+extern int child_start(child_process *child, char *const argv[], int flags,
+                       const char *input, int inputlen,
+                       child_output output, void *data,
+                       update_callback update, void *udata);
+
+/* Run the event loop without waiting, and return 1 if the program is
+   still running, or 0 once it has finished.
+ */
+extern int child_poll(child_process *child);
+
+/* Wait for the program to finish and return its status as given by
+   waitpid().  The update callback is called while waiting, and if it
+   returns nonzero the program is killed and 256 is returned.
+ */
+extern int child_wait(child_process *child,
+                      update_callback update, void *udata);
+
+/* Kill the program if it's still running */
+extern void child_kill(child_process *child);
+
+#endif /* _child_process_h */
@@ -0,0 +1,649 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* Find the legacy products with a single scan of the install directories.
+
+   This does what detect/detect.sh does for each product, but instead of
+   running the script once per product, every directory that might hold
+   a product is read once and checked against the binary names of all
+   the products, and then all the binaries found are checksummed at once.
+
+   The products found are saved along with the size, modification time
+   and inode of their binary, and next time a product is taken from the
+   saved list as long as a stat() of its binary still matches.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "prefpath.h"
+#include "digest.h"
+#include "detect_products.h"
+
+/* The directory with the checksum files and detection scripts */
+#define DETECT_DIR  DATADIR "/detect"
+
+/* The products found by the last run */
+#define DETECT_CACHE_FILE   "detected.txt"
+
+/* The most directories searched for products */
+#define MAX_SEARCH_PATHS    8
+
+/* A known checksum of a product binary */
+typedef struct product_sum {
+    char sum[MD5_DIGEST_SIZE*2+1];
+    char *version;
+} product_sum;
+
+/* A binary found in the install directories, the best match for one
+   binary name in one search path */
+typedef struct candidate {
+    char *file;
+    int direct;                 /* Found in the path, not a subdirectory */
+    int digest;                 /* Index into the files checksummed */
+} candidate;
+
+/* What we know about a product being looked for */
+typedef struct detect_info {
+    const char *product;
+    char *description;
+    char *update_url;
+    int num_binaries;
+    char **binaries;
+    int num_sums;
+    product_sum *sums;
+    candidate *candidates;      /* [binary * num_paths + path] */
+} detect_info;
+
+static char *get_line(char *line, int maxlen, FILE *file)
+{
+    line = fgets(line, maxlen, file);
+    if ( line ) {
+        line[strcspn(line, "\r\n")] = '\0';
+    }
+    return(line);
+}
+
+int has_detect_script(const char *product)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s.sh", DETECT_DIR, product);
+    return(access(path, R_OK) == 0);
+}
+
+/* The modification time of a product's checksum file, since the same
+   binary may be a different version once the checksums are updated */
+static time_t get_sums_mtime(const char *product)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+
+    snprintf(path, sizeof(path), "%s/%s.md5", DETECT_DIR, product);
+    if ( stat(path, &sb) < 0 ) {
+        return(0);
+    }
+    return(sb.st_mtime);
+}
+
+static detected_product *new_detected_product(const char *product,
+                                              const char *version,
+                                              const char *description,
+                                              const char *root,
+                                              const char *update_url)
+{
+    detected_product *found;
+
+    found = (detected_product *)safe_malloc(sizeof *found);
+    found->product = safe_strdup(product);
+    found->version = safe_strdup(version);
+    found->description = safe_strdup(description);
+    found->root = safe_strdup(root);
+    found->update_url = safe_strdup(update_url);
+    found->binary = NULL;
+    found->size = 0;
+    found->mtime = 0;
+    found->inode = 0;
+    found->sums_mtime = get_sums_mtime(product);
+    found->next = NULL;
+    return(found);
+}
+
+/* Remember the binary a product was found by, so it can be checked
+   quickly next time */
+static void set_detected_binary(detected_product *found, const char *binary)
+{
+    struct stat sb;
+
+    if ( stat(binary, &sb) == 0 ) {
+        found->binary = safe_strdup(binary);
+        found->size = sb.st_size;
+        found->mtime = sb.st_mtime;
+        found->inode = sb.st_ino;
+    }
+}
+
+/* Read the binary names, description, update URL and known checksums
+   of a product from its checksum file */
+static int load_detect_info(detect_info *info, const char *product)
+{
+    FILE *file;
+    char path[PATH_MAX];
+    char line[1024];
+    char sum[1024], version[1024];
+    char *word;
+
+    memset(info, 0, sizeof(*info));
+    info->product = product;
+    snprintf(path, sizeof(path), "%s/%s.md5", DETECT_DIR, product);
+    file = fopen(path, "r");
+    if ( ! file ) {
+        /* This is a product that isn't covered by the detection scripts */
+        return(-1);
+    }
+
+    /* The first line is the names the product binary can have */
+    if ( get_line(line, sizeof(line), file) ) {
+        for ( word = strtok(line, " \t"); word; word = strtok(NULL, " \t") ) {
+            info->binaries = (char **)safe_realloc(info->binaries,
+                (info->num_binaries+1)*(sizeof *info->binaries));
+            info->binaries[info->num_binaries++] = safe_strdup(word);
+        }
+    }
+    if ( get_line(line, sizeof(line), file) ) {
+        info->description = safe_strdup(line);
+    }
+    if ( get_line(line, sizeof(line), file) ) {
+        info->update_url = safe_strdup(line);
+    }
+
+    /* The rest of the file lists the checksum of each version */
+    while ( get_line(line, sizeof(line), file) ) {
+        if ( sscanf(line, "%1023s %1023s", sum, version) != 2 ) {
+            continue;
+        }
+        info->sums = (product_sum *)safe_realloc(info->sums,
+            (info->num_sums+1)*(sizeof *info->sums));
+        strncpy(info->sums[info->num_sums].sum, sum,
+                sizeof(info->sums[info->num_sums].sum)-1);
+        info->sums[info->num_sums].sum[MD5_DIGEST_SIZE*2] = '\0';
+        info->sums[info->num_sums].version = safe_strdup(version);
+        ++info->num_sums;
+    }
+    fclose(file);
+
+    if ( !info->num_binaries || !info->description || !info->update_url ) {
+        log(LOG_DEBUG, "Incomplete checksum file for %s\n", product);
+        return(-1);
+    }
+    return(0);
+}
+
+static void free_detect_info(detect_info *info, int num_paths)
+{
+    int i;
+
+    for ( i=0; i<info->num_binaries; ++i ) {
+        free(info->binaries[i]);
+    }
+    safe_free(info->binaries);
+    safe_free(info->description);
+    safe_free(info->update_url);
+    for ( i=0; i<info->num_sums; ++i ) {
+        free(info->sums[i].version);
+    }
+    safe_free(info->sums);
+    if ( info->candidates ) {
+        for ( i=0; i<info->num_binaries*num_paths; ++i ) {
+            safe_free(info->candidates[i].file);
+        }
+        free(info->candidates);
+    }
+}
+
+/* The directories searched, in the order detect.sh searches them */
+static int get_search_paths(char paths[][PATH_MAX])
+{
+    const char *cwd, *home;
+    int i, j, num_paths;
+
+    cwd = getenv("UPDATE_CWD");
+    home = getenv("HOME");
+    num_paths = 0;
+    if ( cwd && *cwd ) {
+        strncpy(paths[num_paths++], cwd, PATH_MAX-1);
+    }
+    strcpy(paths[num_paths++], "/opt");
+    strcpy(paths[num_paths++], "/opt/games");
+    strcpy(paths[num_paths++], "/usr/games");
+    strcpy(paths[num_paths++], "/usr/local/games");
+    if ( home && *home ) {
+        snprintf(paths[num_paths++], PATH_MAX, "%s/games", home);
+        strncpy(paths[num_paths++], home, PATH_MAX-1);
+    }
+
+    /* A directory that's searched twice won't turn up anything new */
+    for ( i=1; i<num_paths; ++i ) {
+        for ( j=0; j<i; ++j ) {
+            if ( strcmp(paths[i], paths[j]) == 0 ) {
+                memmove(paths[i], paths[i+1], (num_paths-i-1)*PATH_MAX);
+                --num_paths;
+                --i;
+                break;
+            }
+        }
+    }
+    return(num_paths);
+}
+
+/* See if a directory entry is one of the binaries we're looking for.
+   A binary directly in the search path is used over one in a
+   subdirectory, and otherwise the first subdirectory in sorted order
+   is used, as the shell glob in detect.sh would.
+ */
+static void match_binary(detect_info *infos, int count, int path,
+                         int num_paths, const char *dir, const char *name,
+                         int direct)
+{
+    char file[PATH_MAX];
+    struct stat sb;
+    candidate *match;
+    int i, b, checked;
+
+    snprintf(file, sizeof(file), "%s/%s", dir, name);
+    checked = 0;
+    for ( i=0; i<count; ++i ) {
+        for ( b=0; b<infos[i].num_binaries; ++b ) {
+            if ( strcmp(name, infos[i].binaries[b]) != 0 ) {
+                continue;
+            }
+            match = &infos[i].candidates[b*num_paths+path];
+            if ( match->file && (match->direct ||
+                 (!direct && (strcmp(match->file, file) < 0))) ) {
+                continue;
+            }
+
+            /* Only regular files count, as with 'test -f' */
+            if ( ! checked ) {
+                if ( (stat(file, &sb) < 0) || !S_ISREG(sb.st_mode) ) {
+                    return;
+                }
+                checked = 1;
+            }
+            safe_free(match->file);
+            match->file = safe_strdup(file);
+            match->direct = direct;
+        }
+    }
+}
+
+/* Read a search path and each of its subdirectories once, looking for
+   the binaries of all the products at the same time */
+static void scan_path(detect_info *infos, int count, int path, int num_paths,
+                      const char *dir)
+{
+    DIR *top, *sub;
+    struct dirent *entry, *subentry;
+    struct stat sb;
+    char subdir[PATH_MAX];
+
+    top = opendir(dir);
+    if ( ! top ) {
+        return;
+    }
+    while ( (entry = readdir(top)) != NULL ) {
+        if ( entry->d_name[0] == '.' ) {
+            continue;
+        }
+        match_binary(infos, count, path, num_paths, dir, entry->d_name, 1);
+
+        snprintf(subdir, sizeof(subdir), "%s/%s", dir, entry->d_name);
+        if ( (stat(subdir, &sb) < 0) || !S_ISDIR(sb.st_mode) ) {
+            continue;
+        }
+        sub = opendir(subdir);
+        if ( ! sub ) {
+            continue;
+        }
+        while ( (subentry = readdir(sub)) != NULL ) {
+            if ( subentry->d_name[0] != '.' ) {
+                match_binary(infos, count, path, num_paths,
+                             subdir, subentry->d_name, 0);
+            }
+        }
+        closedir(sub);
+    }
+    closedir(top);
+}
+
+detected_product *detect_products(const char *products[], int count)
+{
+    char paths[MAX_SEARCH_PATHS][PATH_MAX];
+    char real[PATH_MAX], root[PATH_MAX];
+    detect_info *infos;
+    detected_product *list, *found;
+    candidate *match;
+    const char **files;
+    digest_sums *sums;
+    int num_paths, num_files;
+    int i, b, p, s, f, num;
+
+    if ( count == 0 ) {
+        return(NULL);
+    }
+
+    /* Load the checksum files of the products we can look for */
+    infos = (detect_info *)safe_malloc(count*(sizeof *infos));
+    num_paths = get_search_paths(paths);
+    num = 0;
+    for ( i=0; i<count; ++i ) {
+        if ( load_detect_info(&infos[num], products[i]) < 0 ) {
+            free_detect_info(&infos[num], num_paths);
+            continue;
+        }
+        infos[num].candidates = (candidate *)safe_malloc(
+            infos[num].num_binaries*num_paths*(sizeof *match));
+        memset(infos[num].candidates, 0,
+               infos[num].num_binaries*num_paths*(sizeof *match));
+        ++num;
+    }
+    count = num;
+
+    /* Look for all of the binaries in each directory at once */
+    for ( p=0; p<num_paths; ++p ) {
+        scan_path(infos, count, p, num_paths, paths[p]);
+    }
+
+    /* Collect the binaries in writable directories for checksumming */
+    files = NULL;
+    num_files = 0;
+    for ( i=0; i<count; ++i ) {
+        for ( b=0; b<infos[i].num_binaries*num_paths; ++b ) {
+            match = &infos[i].candidates[b];
+            match->digest = -1;
+            if ( !match->file || !realpath(match->file, real) ) {
+                continue;
+            }
+            free(match->file);
+            match->file = safe_strdup(real);
+            *strrchr(real, '/') = '\0';
+            if ( access(real, W_OK) < 0 ) {
+                continue;
+            }
+            for ( f=0; f<num_files; ++f ) {
+                if ( strcmp(files[f], match->file) == 0 ) {
+                    break;
+                }
+            }
+            if ( f == num_files ) {
+                files = (const char **)safe_realloc(files,
+                                        (num_files+1)*(sizeof *files));
+                files[num_files++] = match->file;
+            }
+            match->digest = f;
+        }
+    }
+    sums = NULL;
+    if ( num_files > 0 ) {
+        sums = (digest_sums *)safe_malloc(num_files*(sizeof *sums));
+        digest_files(files, sums, num_files);
+    }
+
+    /* Each product is the first binary found with a known checksum */
+    list = NULL;
+    for ( i=0; i<count; ++i ) {
+        found = NULL;
+        for ( b=0; (b<infos[i].num_binaries*num_paths) && !found; ++b ) {
+            match = &infos[i].candidates[b];
+            if ( (match->digest < 0) || !sums[match->digest].md5[0] ) {
+                continue;
+            }
+            for ( s=0; s<infos[i].num_sums; ++s ) {
+                if ( strcasecmp(infos[i].sums[s].sum,
+                                sums[match->digest].md5) == 0 ) {
+                    break;
+                }
+            }
+            if ( s == infos[i].num_sums ) {
+                continue;
+            }
+            strcpy(root, match->file);
+            *strrchr(root, '/') = '\0';
+
+            found = new_detected_product(infos[i].product,
+                                         infos[i].sums[s].version,
+                                         infos[i].description, root,
+                                         infos[i].update_url);
+            set_detected_binary(found, match->file);
+            found->next = list;
+            list = found;
+            log(LOG_DEBUG, "Found %s %s in %s\n",
+                found->product, found->version, found->root);
+        }
+        if ( ! found ) {
+            log(LOG_DEBUG, _("Failed scan for product '%s'\n"),
+                infos[i].product);
+        }
+    }
+
+    /* Clean up and we're done */
+    safe_free(sums);
+    safe_free(files);
+    for ( i=0; i<count; ++i ) {
+        free_detect_info(&infos[i], num_paths);
+    }
+    free(infos);
+    return(list);
+}
+
+void free_detected_products(detected_product *list)
+{
+    detected_product *next;
+
+    while ( list ) {
+        next = list->next;
+        free(list->product);
+        free(list->version);
+        free(list->description);
+        free(list->root);
+        free(list->update_url);
+        safe_free(list->binary);
+        free(list);
+        list = next;
+    }
+}
+
+detected_product *run_detect_script(const char *product)
+{
+    FILE *detect;
+    char command[1024];
+    char version[1024];
+    char description[1024];
+    char root[1024];
+    char update_url[1024];
+    char binary[PATH_MAX];
+    detect_info info;
+    detected_product *found;
+    int i;
+
+#ifdef MD5SUM
+   setenv("DETECT_MD5SUM", MD5SUM, 1);
+#endif
+
+    found = NULL;
+    snprintf(command, sizeof(command), "sh %s/detect.sh %s",
+             DETECT_DIR, product);
+    detect = popen(command, "r");
+    if ( detect ) {
+        if ( get_line(version, sizeof(version), detect) &&
+             get_line(description, sizeof(description), detect) &&
+             get_line(root, sizeof(root), detect) &&
+             get_line(update_url, sizeof(update_url), detect) ) {
+            found = new_detected_product(product, version, description,
+                                         root, update_url);
+        } else {
+            log(LOG_DEBUG, _("Failed scan for product '%s'\n"), product);
+        }
+        pclose(detect);
+    }
+
+    /* The script doesn't say which binary it checked, so remember the
+       first binary from the checksum file that's in the install path */
+    if ( found ) {
+        load_detect_info(&info, product);
+        for ( i=0; (i<info.num_binaries) && !found->binary; ++i ) {
+            snprintf(binary, sizeof(binary), "%s/%s", root, info.binaries[i]);
+            if ( access(binary, F_OK) == 0 ) {
+                set_detected_binary(found, binary);
+            }
+        }
+        free_detect_info(&info, 0);
+    }
+    return(found);
+}
+
+/* Split a tab separated line into fields, returning the number found */
+static int split_fields(char *line, char *fields[], int max)
+{
+    int num;
+
+    num = 0;
+    while ( line && (num < max) ) {
+        fields[num++] = line;
+        line = strchr(line, '\t');
+        if ( line ) {
+            *line++ = '\0';
+        }
+    }
+    return(num);
+}
+
+detected_product *load_detect_cache(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char line[4096];
+    char *fields[10];
+    detected_product *list, *found;
+
+    list = NULL;
+    preferences_path(DETECT_CACHE_FILE, path, sizeof(path));
+    fp = fopen(path, "r");
+    if ( ! fp ) {
+        return(list);
+    }
+    while ( get_line(line, sizeof(line), fp) ) {
+        if ( split_fields(line, fields, 10) != 10 ) {
+            continue;
+        }
+        found = new_detected_product(fields[0], fields[1], fields[2],
+                                     fields[3], fields[4]);
+        found->binary = safe_strdup(fields[5]);
+        found->size = (off_t)atol(fields[6]);
+        found->mtime = (time_t)atol(fields[7]);
+        found->inode = (ino_t)atol(fields[8]);
+        found->sums_mtime = (time_t)atol(fields[9]);
+        found->next = list;
+        list = found;
+    }
+    fclose(fp);
+    return(list);
+}
+
+detected_product *take_cached_product(detected_product **cache,
+                                      const char *product)
+{
+    detected_product *found, *prev;
+    struct stat sb;
+
+    prev = NULL;
+    for ( found = *cache; found; found = found->next ) {
+        if ( strcasecmp(found->product, product) == 0 ) {
+            break;
+        }
+        prev = found;
+    }
+    if ( ! found ) {
+        return(NULL);
+    }
+    if ( prev ) {
+        prev->next = found->next;
+    } else {
+        *cache = found->next;
+    }
+    found->next = NULL;
+
+    /* Make sure it's still the same binary that was checksummed */
+    if ( (stat(found->binary, &sb) < 0) ||
+         (sb.st_size != found->size) ||
+         (sb.st_mtime != found->mtime) ||
+         (sb.st_ino != found->inode) ||
+         (get_sums_mtime(product) != found->sums_mtime) ) {
+        log(LOG_DEBUG, "%s has changed, looking for %s again\n",
+            found->binary, product);
+        free_detected_products(found);
+        return(NULL);
+    }
+    log(LOG_DEBUG, "Using saved %s %s in %s\n",
+        found->product, found->version, found->root);
+    return(found);
+}
+
+void save_detect_cache(detected_product *list)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+
+    preferences_path(DETECT_CACHE_FILE, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    fp = fopen(temp, "w");
+    if ( ! fp ) {
+        log(LOG_WARNING, _("Unable to write to %s\n"), temp);
+        return;
+    }
+    for ( ; list; list = list->next ) {
+        /* Products we can't check quickly have to be looked for again */
+        if ( ! list->binary ) {
+            continue;
+        }
+        fprintf(fp, "%s\t%s\t%s\t%s\t%s\t%s\t%ld\t%ld\t%ld\t%ld\n",
+                list->product, list->version, list->description,
+                list->root, list->update_url, list->binary,
+                (long)list->size, (long)list->mtime,
+                (long)list->inode, (long)list->sums_mtime);
+    }
+    fclose(fp);
+
+    /* Replace the old list all at once, in case another run is reading it */
+    if ( rename(temp, path) < 0 ) {
+        unlink(temp);
+    }
+}
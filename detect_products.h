@@ -0,0 +1,82 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* Functions to find the legacy products, those installed without setupdb,
+   by scanning the usual install directories for their binaries once and
+   checksumming all of the binaries found at the same time.  The products
+   found are remembered, and aren't looked for again until their binary
+   changes.
+*/
+
+#ifndef _detect_products_h
+#define _detect_products_h
+
+#include <sys/types.h>
+#include <time.h>
+
+/* A legacy product that was found */
+typedef struct detected_product {
+    char *product;
+    char *version;
+    char *description;
+    char *root;
+    char *update_url;
+    char *binary;               /* The binary that was checksummed */
+
+    /* What the binary and checksum file looked like when it was found */
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    time_t sums_mtime;
+
+    struct detected_product *next;
+} detected_product;
+
+/* Look for the products listed, using the binary names and checksums in
+   their .md5 files in the detect directory, and return the ones found.
+   Products with their own detection script are skipped, since only the
+   script knows how to find them.
+ */
+extern detected_product *detect_products(const char *products[], int count);
+
+/* Returns true if the product has its own detection script */
+extern int has_detect_script(const char *product);
+
+/* Run detect.sh for a product with its own detection script */
+extern detected_product *run_detect_script(const char *product);
+
+/* Load the products found by earlier runs */
+extern detected_product *load_detect_cache(void);
+
+/* Remove a product from the loaded results and return it, if its binary
+   and checksum file haven't changed since it was found, or NULL if the
+   product needs to be looked for again.
+ */
+extern detected_product *take_cached_product(detected_product **cache,
+                                             const char *product);
+
+/* Save the products found, for the next run */
+extern void save_detect_cache(detected_product *list);
+
+extern void free_detected_products(detected_product *list);
+
+#endif /* _detect_products_h */
@@ -0,0 +1,929 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to checksum data incrementally, as it is downloaded.
+
+   The MD5 code is derived from the RSA Data Security, Inc. MD5
+   Message-Digest Algorithm, as described in RFC 1321, and the SHA-256
+   code follows FIPS 180-2.
+
+   On x86 processors a batch of files can have their MD5 rounds run four
+   at a time in SSE2 registers, and SHA-256 uses the SHA instructions
+   when they are available.  The choice is made at run time, so the same
+   binary runs on processors without them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "log_output.h"
+#include "safe_malloc.h"
+#include "digest.h"
+
+#if defined(__GNUC__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define USE_X86_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* The number of files checksummed side by side by one process */
+#define LANES           4
+#define LANE_CHUNK      (64*1024)
+
+/* The most processes used to checksum a batch of files */
+#define MAX_WORKERS     16
+
+static int accel_enabled = 1;
+static int accel_checked = 0;
+static int have_sse2 = 0;
+static int have_sha = 0;
+
+static void check_acceleration(void)
+{
+#ifdef USE_X86_SIMD
+    unsigned int a, b, c, d;
+
+    if ( __get_cpuid(1, &a, &b, &c, &d) ) {
+        have_sse2 = ((d >> 26) & 1);
+        /* The SHA code also needs SSSE3 and SSE4.1 */
+        if ( ((c >> 9) & 1) && ((c >> 19) & 1) &&
+             (__get_cpuid_max(0, NULL) >= 7) ) {
+            __cpuid_count(7, 0, a, b, c, d);
+            have_sha = ((b >> 29) & 1);
+        }
+    }
+#endif
+    accel_checked = 1;
+}
+
+void set_digest_acceleration(int enabled)
+{
+    accel_enabled = enabled;
+}
+
+const char *get_digest_acceleration(void)
+{
+    if ( ! accel_checked ) {
+        check_acceleration();
+    }
+    if ( ! accel_enabled ) {
+        return("none");
+    }
+    if ( have_sha ) {
+        return("SSE2 MD5, SHA-NI SHA-256");
+    }
+    if ( have_sse2 ) {
+        return("SSE2 MD5");
+    }
+    return("none");
+}
+
+static int use_sse2(void)
+{
+    if ( ! accel_checked ) {
+        check_acceleration();
+    }
+    return(accel_enabled && have_sse2);
+}
+
+static int use_sha(void)
+{
+    if ( ! accel_checked ) {
+        check_acceleration();
+    }
+    return(accel_enabled && have_sha);
+}
+
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, data, s) \
+    ( w += f(x, y, z) + data,  w = (w<<s | w>>(32-s)) & 0xffffffff,  w += x )
+
+static void md5_transform(unsigned int state[4], const unsigned char block[64])
+{
+    unsigned int a, b, c, d;
+    unsigned int in[16];
+    int i;
+
+    for ( i=0; i<16; ++i ) {
+        in[i] = ((unsigned int)block[i*4+0]) |
+                ((unsigned int)block[i*4+1] << 8) |
+                ((unsigned int)block[i*4+2] << 16) |
+                ((unsigned int)block[i*4+3] << 24);
+    }
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+
+    MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+    MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+    MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+    MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+    MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+    MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+    MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+    MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+    MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+    MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+    MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+    MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+    MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+    MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+    MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+    MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+    MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
+    MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+    MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+    MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+    MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+    MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+    MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+    MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+    MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+    MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+    MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+    MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+    MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+    MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+    MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+    MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+    MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+    MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+    MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+    MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+    MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+    MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+    MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+    MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+    MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+    MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+    MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+    MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+    MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+    MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+    MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+    MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+    MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+    MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+    state[0] = (state[0] + a) & 0xffffffff;
+    state[1] = (state[1] + b) & 0xffffffff;
+    state[2] = (state[2] + c) & 0xffffffff;
+    state[3] = (state[3] + d) & 0xffffffff;
+}
+
+void md5_init(md5_context *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count[0] = 0;
+    ctx->count[1] = 0;
+}
+
+/* Add to the 64-bit count of bits hashed so far */
+static void add_count(unsigned int count[2], unsigned int len)
+{
+    count[0] = (count[0] + (len << 3)) & 0xffffffff;
+    if ( count[0] < (len << 3) ) {
+        ++count[1];
+    }
+    count[1] += (len >> 29);
+}
+
+void md5_update(md5_context *ctx, const void *data, unsigned int len)
+{
+    const unsigned char *input = (const unsigned char *)data;
+    unsigned int used, left;
+
+    /* Update the bit count */
+    used = (ctx->count[0] >> 3) & 0x3f;
+    add_count(ctx->count, len);
+
+    /* Finish any partial block left from last time */
+    if ( used ) {
+        left = 64 - used;
+        if ( len < left ) {
+            memcpy(&ctx->buffer[used], input, len);
+            return;
+        }
+        memcpy(&ctx->buffer[used], input, left);
+        md5_transform(ctx->state, ctx->buffer);
+        input += left;
+        len -= left;
+    }
+
+    /* Process whole blocks directly from the input */
+    while ( len >= 64 ) {
+        md5_transform(ctx->state, input);
+        input += 64;
+        len -= 64;
+    }
+
+    /* Save the rest for later */
+    memcpy(ctx->buffer, input, len);
+}
+
+void md5_final(md5_context *ctx, unsigned char digest[MD5_DIGEST_SIZE])
+{
+    static const unsigned char padding[64] = { 0x80 };
+    unsigned char bits[8];
+    unsigned int used;
+    int i;
+
+    for ( i=0; i<4; ++i ) {
+        bits[i] = (ctx->count[0] >> (i*8)) & 0xff;
+        bits[i+4] = (ctx->count[1] >> (i*8)) & 0xff;
+    }
+    used = (ctx->count[0] >> 3) & 0x3f;
+    md5_update(ctx, padding, (used < 56) ? (56 - used) : (120 - used));
+    md5_update(ctx, bits, 8);
+    for ( i=0; i<4; ++i ) {
+        digest[i*4+0] = (ctx->state[i] >> 0) & 0xff;
+        digest[i*4+1] = (ctx->state[i] >> 8) & 0xff;
+        digest[i*4+2] = (ctx->state[i] >> 16) & 0xff;
+        digest[i*4+3] = (ctx->state[i] >> 24) & 0xff;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+#ifdef USE_X86_SIMD
+#define V1(x, y, z) _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define V2(x, y, z) V1(z, x, y)
+#define V3(x, y, z) _mm_xor_si128(x, _mm_xor_si128(y, z))
+#define V4(x, y, z) _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, ones)))
+
+#define MD5STEP4(f, w, x, y, z, data, k, s) \
+    ( w = _mm_add_epi32(w, _mm_add_epi32(f(x, y, z), \
+                        _mm_add_epi32(data, _mm_set1_epi32((int)k)))), \
+      w = _mm_or_si128(_mm_slli_epi32(w, s), _mm_srli_epi32(w, 32-s)), \
+      w = _mm_add_epi32(w, x) )
+
+/* Run the MD5 rounds on four separate streams at once, one in each 32-bit
+   lane of the SSE2 registers.  Each stream advances by 'blocks' blocks.
+ */
+__attribute__((target("sse2")))
+static void md5_transform4(unsigned int *state[LANES],
+                           const unsigned char *data[LANES], int blocks)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i a, b, c, d, sa, sb, sc, sd;
+    __m128i in[16];
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+    unsigned int lanes[4][LANES];
+    int i, j, offset;
+
+    a = _mm_set_epi32(state[3][0], state[2][0], state[1][0], state[0][0]);
+    b = _mm_set_epi32(state[3][1], state[2][1], state[1][1], state[0][1]);
+    c = _mm_set_epi32(state[3][2], state[2][2], state[1][2], state[0][2]);
+    d = _mm_set_epi32(state[3][3], state[2][3], state[1][3], state[0][3]);
+
+    for ( offset = 0; blocks > 0; --blocks, offset += 64 ) {
+        /* Gather word N of every stream into in[N] */
+        for ( j=0; j<4; ++j ) {
+            r0 = _mm_loadu_si128((const __m128i *)(data[0]+offset+j*16));
+            r1 = _mm_loadu_si128((const __m128i *)(data[1]+offset+j*16));
+            r2 = _mm_loadu_si128((const __m128i *)(data[2]+offset+j*16));
+            r3 = _mm_loadu_si128((const __m128i *)(data[3]+offset+j*16));
+            t0 = _mm_unpacklo_epi32(r0, r1);
+            t1 = _mm_unpacklo_epi32(r2, r3);
+            t2 = _mm_unpackhi_epi32(r0, r1);
+            t3 = _mm_unpackhi_epi32(r2, r3);
+            in[j*4+0] = _mm_unpacklo_epi64(t0, t1);
+            in[j*4+1] = _mm_unpackhi_epi64(t0, t1);
+            in[j*4+2] = _mm_unpacklo_epi64(t2, t3);
+            in[j*4+3] = _mm_unpackhi_epi64(t2, t3);
+        }
+        sa = a;
+        sb = b;
+        sc = c;
+        sd = d;
+
+        MD5STEP4(V1, a, b, c, d, in[0], 0xd76aa478, 7);
+        MD5STEP4(V1, d, a, b, c, in[1], 0xe8c7b756, 12);
+        MD5STEP4(V1, c, d, a, b, in[2], 0x242070db, 17);
+        MD5STEP4(V1, b, c, d, a, in[3], 0xc1bdceee, 22);
+        MD5STEP4(V1, a, b, c, d, in[4], 0xf57c0faf, 7);
+        MD5STEP4(V1, d, a, b, c, in[5], 0x4787c62a, 12);
+        MD5STEP4(V1, c, d, a, b, in[6], 0xa8304613, 17);
+        MD5STEP4(V1, b, c, d, a, in[7], 0xfd469501, 22);
+        MD5STEP4(V1, a, b, c, d, in[8], 0x698098d8, 7);
+        MD5STEP4(V1, d, a, b, c, in[9], 0x8b44f7af, 12);
+        MD5STEP4(V1, c, d, a, b, in[10], 0xffff5bb1, 17);
+        MD5STEP4(V1, b, c, d, a, in[11], 0x895cd7be, 22);
+        MD5STEP4(V1, a, b, c, d, in[12], 0x6b901122, 7);
+        MD5STEP4(V1, d, a, b, c, in[13], 0xfd987193, 12);
+        MD5STEP4(V1, c, d, a, b, in[14], 0xa679438e, 17);
+        MD5STEP4(V1, b, c, d, a, in[15], 0x49b40821, 22);
+
+        MD5STEP4(V2, a, b, c, d, in[1], 0xf61e2562, 5);
+        MD5STEP4(V2, d, a, b, c, in[6], 0xc040b340, 9);
+        MD5STEP4(V2, c, d, a, b, in[11], 0x265e5a51, 14);
+        MD5STEP4(V2, b, c, d, a, in[0], 0xe9b6c7aa, 20);
+        MD5STEP4(V2, a, b, c, d, in[5], 0xd62f105d, 5);
+        MD5STEP4(V2, d, a, b, c, in[10], 0x02441453, 9);
+        MD5STEP4(V2, c, d, a, b, in[15], 0xd8a1e681, 14);
+        MD5STEP4(V2, b, c, d, a, in[4], 0xe7d3fbc8, 20);
+        MD5STEP4(V2, a, b, c, d, in[9], 0x21e1cde6, 5);
+        MD5STEP4(V2, d, a, b, c, in[14], 0xc33707d6, 9);
+        MD5STEP4(V2, c, d, a, b, in[3], 0xf4d50d87, 14);
+        MD5STEP4(V2, b, c, d, a, in[8], 0x455a14ed, 20);
+        MD5STEP4(V2, a, b, c, d, in[13], 0xa9e3e905, 5);
+        MD5STEP4(V2, d, a, b, c, in[2], 0xfcefa3f8, 9);
+        MD5STEP4(V2, c, d, a, b, in[7], 0x676f02d9, 14);
+        MD5STEP4(V2, b, c, d, a, in[12], 0x8d2a4c8a, 20);
+
+        MD5STEP4(V3, a, b, c, d, in[5], 0xfffa3942, 4);
+        MD5STEP4(V3, d, a, b, c, in[8], 0x8771f681, 11);
+        MD5STEP4(V3, c, d, a, b, in[11], 0x6d9d6122, 16);
+        MD5STEP4(V3, b, c, d, a, in[14], 0xfde5380c, 23);
+        MD5STEP4(V3, a, b, c, d, in[1], 0xa4beea44, 4);
+        MD5STEP4(V3, d, a, b, c, in[4], 0x4bdecfa9, 11);
+        MD5STEP4(V3, c, d, a, b, in[7], 0xf6bb4b60, 16);
+        MD5STEP4(V3, b, c, d, a, in[10], 0xbebfbc70, 23);
+        MD5STEP4(V3, a, b, c, d, in[13], 0x289b7ec6, 4);
+        MD5STEP4(V3, d, a, b, c, in[0], 0xeaa127fa, 11);
+        MD5STEP4(V3, c, d, a, b, in[3], 0xd4ef3085, 16);
+        MD5STEP4(V3, b, c, d, a, in[6], 0x04881d05, 23);
+        MD5STEP4(V3, a, b, c, d, in[9], 0xd9d4d039, 4);
+        MD5STEP4(V3, d, a, b, c, in[12], 0xe6db99e5, 11);
+        MD5STEP4(V3, c, d, a, b, in[15], 0x1fa27cf8, 16);
+        MD5STEP4(V3, b, c, d, a, in[2], 0xc4ac5665, 23);
+
+        MD5STEP4(V4, a, b, c, d, in[0], 0xf4292244, 6);
+        MD5STEP4(V4, d, a, b, c, in[7], 0x432aff97, 10);
+        MD5STEP4(V4, c, d, a, b, in[14], 0xab9423a7, 15);
+        MD5STEP4(V4, b, c, d, a, in[5], 0xfc93a039, 21);
+        MD5STEP4(V4, a, b, c, d, in[12], 0x655b59c3, 6);
+        MD5STEP4(V4, d, a, b, c, in[3], 0x8f0ccc92, 10);
+        MD5STEP4(V4, c, d, a, b, in[10], 0xffeff47d, 15);
+        MD5STEP4(V4, b, c, d, a, in[1], 0x85845dd1, 21);
+        MD5STEP4(V4, a, b, c, d, in[8], 0x6fa87e4f, 6);
+        MD5STEP4(V4, d, a, b, c, in[15], 0xfe2ce6e0, 10);
+        MD5STEP4(V4, c, d, a, b, in[6], 0xa3014314, 15);
+        MD5STEP4(V4, b, c, d, a, in[13], 0x4e0811a1, 21);
+        MD5STEP4(V4, a, b, c, d, in[4], 0xf7537e82, 6);
+        MD5STEP4(V4, d, a, b, c, in[11], 0xbd3af235, 10);
+        MD5STEP4(V4, c, d, a, b, in[2], 0x2ad7d2bb, 15);
+        MD5STEP4(V4, b, c, d, a, in[9], 0xeb86d391, 21);
+
+        a = _mm_add_epi32(a, sa);
+        b = _mm_add_epi32(b, sb);
+        c = _mm_add_epi32(c, sc);
+        d = _mm_add_epi32(d, sd);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes[0], a);
+    _mm_storeu_si128((__m128i *)lanes[1], b);
+    _mm_storeu_si128((__m128i *)lanes[2], c);
+    _mm_storeu_si128((__m128i *)lanes[3], d);
+    for ( i=0; i<LANES; ++i ) {
+        for ( j=0; j<4; ++j ) {
+            state[i][j] = lanes[j][i];
+        }
+    }
+}
+#endif /* USE_X86_SIMD */
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32-(n))))
+#define S0(x)       (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)       (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)       (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)       (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+static void sha256_transform_c(unsigned int state[8],
+                               const unsigned char *data, int blocks)
+{
+    unsigned int a, b, c, d, e, f, g, h, t1, t2;
+    unsigned int w[64];
+    int i;
+
+    for ( ; blocks > 0; --blocks, data += 64 ) {
+        for ( i=0; i<16; ++i ) {
+            w[i] = ((unsigned int)data[i*4+0] << 24) |
+                   ((unsigned int)data[i*4+1] << 16) |
+                   ((unsigned int)data[i*4+2] << 8) |
+                   ((unsigned int)data[i*4+3]);
+        }
+        for ( i=16; i<64; ++i ) {
+            w[i] = (s1(w[i-2]) + w[i-7] + s0(w[i-15]) + w[i-16]) & 0xffffffff;
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+        for ( i=0; i<64; ++i ) {
+            t1 = h + S1(e) + CH(e, f, g) + sha256_k[i] + w[i];
+            t2 = S0(a) + MAJ(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = (d + t1) & 0xffffffff;
+            d = c;
+            c = b;
+            b = a;
+            a = (t1 + t2) & 0xffffffff;
+        }
+        state[0] = (state[0] + a) & 0xffffffff;
+        state[1] = (state[1] + b) & 0xffffffff;
+        state[2] = (state[2] + c) & 0xffffffff;
+        state[3] = (state[3] + d) & 0xffffffff;
+        state[4] = (state[4] + e) & 0xffffffff;
+        state[5] = (state[5] + f) & 0xffffffff;
+        state[6] = (state[6] + g) & 0xffffffff;
+        state[7] = (state[7] + h) & 0xffffffff;
+    }
+}
+
+#ifdef USE_X86_SIMD
+/* SHA-256 using the SHA extensions.  The state is kept as ABEF and CDGH
+   pairs, the order the sha256rnds2 instruction works in.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_transform_ni(unsigned int state[8],
+                                const unsigned char *data, int blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp;
+    __m128i w[4];
+    int i;
+
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for ( ; blocks > 0; --blocks, data += 64 ) {
+        abef = state0;
+        cdgh = state1;
+        for ( i=0; i<4; ++i ) {
+            w[i] = _mm_shuffle_epi8(
+                       _mm_loadu_si128((const __m128i *)(data+i*16)), mask);
+        }
+
+        /* Four rounds at a time, extending the message schedule as we go */
+        for ( i=0; i<16; ++i ) {
+            msg = _mm_add_epi32(w[i%4],
+                      _mm_loadu_si128((const __m128i *)&sha256_k[i*4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if ( (i >= 3) && (i <= 14) ) {
+                tmp = _mm_alignr_epi8(w[i%4], w[(i+3)%4], 4);
+                w[(i+1)%4] = _mm_add_epi32(w[(i+1)%4], tmp);
+                w[(i+1)%4] = _mm_sha256msg2_epu32(w[(i+1)%4], w[i%4]);
+            }
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if ( (i >= 1) && (i <= 12) ) {
+                w[(i+3)%4] = _mm_sha256msg1_epu32(w[(i+3)%4], w[i%4]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif /* USE_X86_SIMD */
+
+static void sha256_transform(unsigned int state[8],
+                             const unsigned char *data, int blocks)
+{
+#ifdef USE_X86_SIMD
+    if ( use_sha() ) {
+        sha256_transform_ni(state, data, blocks);
+        return;
+    }
+#endif
+    sha256_transform_c(state, data, blocks);
+}
+
+void sha256_init(sha256_context *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count[0] = 0;
+    ctx->count[1] = 0;
+}
+
+void sha256_update(sha256_context *ctx, const void *data, unsigned int len)
+{
+    const unsigned char *input = (const unsigned char *)data;
+    unsigned int used, left;
+
+    /* Update the bit count */
+    used = (ctx->count[0] >> 3) & 0x3f;
+    add_count(ctx->count, len);
+
+    /* Finish any partial block left from last time */
+    if ( used ) {
+        left = 64 - used;
+        if ( len < left ) {
+            memcpy(&ctx->buffer[used], input, len);
+            return;
+        }
+        memcpy(&ctx->buffer[used], input, left);
+        sha256_transform(ctx->state, ctx->buffer, 1);
+        input += left;
+        len -= left;
+    }
+
+    /* Process whole blocks directly from the input */
+    if ( len >= 64 ) {
+        sha256_transform(ctx->state, input, len / 64);
+        input += (len & ~63);
+        len &= 63;
+    }
+
+    /* Save the rest for later */
+    memcpy(ctx->buffer, input, len);
+}
+
+void sha256_final(sha256_context *ctx, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    static const unsigned char padding[64] = { 0x80 };
+    unsigned char bits[8];
+    unsigned int used;
+    int i;
+
+    for ( i=0; i<4; ++i ) {
+        bits[i] = (ctx->count[1] >> (24-i*8)) & 0xff;
+        bits[i+4] = (ctx->count[0] >> (24-i*8)) & 0xff;
+    }
+    used = (ctx->count[0] >> 3) & 0x3f;
+    sha256_update(ctx, padding, (used < 56) ? (56 - used) : (120 - used));
+    sha256_update(ctx, bits, 8);
+    for ( i=0; i<8; ++i ) {
+        digest[i*4+0] = (ctx->state[i] >> 24) & 0xff;
+        digest[i*4+1] = (ctx->state[i] >> 16) & 0xff;
+        digest[i*4+2] = (ctx->state[i] >> 8) & 0xff;
+        digest[i*4+3] = (ctx->state[i] >> 0) & 0xff;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void digest_hex(const unsigned char *digest, int len, char *text)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for ( i=0; i<len; ++i ) {
+        *text++ = hex[digest[i] >> 4];
+        *text++ = hex[digest[i] & 0x0f];
+    }
+    *text = '\0';
+}
+
+void digest_init(digest_context *ctx)
+{
+    md5_init(&ctx->md5);
+    sha256_init(&ctx->sha256);
+}
+
+void digest_update(digest_context *ctx, const void *data, int len)
+{
+    md5_update(&ctx->md5, data, len);
+    sha256_update(&ctx->sha256, data, len);
+}
+
+void digest_final(digest_context *ctx, digest_sums *sums)
+{
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    md5_final(&ctx->md5, digest);
+    digest_hex(digest, MD5_DIGEST_SIZE, sums->md5);
+    sha256_final(&ctx->sha256, digest);
+    digest_hex(digest, SHA256_DIGEST_SIZE, sums->sha256);
+}
+
+int digest_file(digest_context *ctx, const char *file, off_t length)
+{
+    char buf[64*1024];
+    int fd, count;
+
+    fd = open(file, O_RDONLY);
+    if ( fd < 0 ) {
+        log(LOG_ERROR, _("Unable to open %s: %s\n"), file, strerror(errno));
+        return(-1);
+    }
+    while ( length > 0 ) {
+        count = read(fd, buf, (length < sizeof(buf)) ? length : sizeof(buf));
+        if ( count <= 0 ) {
+            log(LOG_ERROR, _("Unable to read %s\n"), file);
+            close(fd);
+            return(-1);
+        }
+        digest_update(ctx, buf, count);
+        length -= count;
+    }
+    close(fd);
+    return(0);
+}
+
+/* Read as much of a chunk as the file has left, returning the length */
+static int read_chunk(int fd, unsigned char *buf, int len)
+{
+    int total, count;
+
+    for ( total = 0; total < len; total += count ) {
+        count = read(fd, buf+total, len-total);
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                count = 0;
+                continue;
+            }
+            return(-1);
+        }
+        if ( count == 0 ) {
+            break;
+        }
+    }
+    return(total);
+}
+
+/* Checksum files first, first+step, first+step*2, ... of a batch, keeping
+   up to four files going at once so full chunks can share the MD5 rounds.
+ */
+static void digest_lanes(const char *files[], digest_sums sums[], int count,
+                         int first, int step)
+{
+    struct {
+        int fd;
+        int index;
+        int len;
+        unsigned char *buf;
+        digest_context ctx;
+    } lane[LANES];
+    unsigned char *buffers;
+    unsigned int spare[4];
+    unsigned int *states[LANES];
+    const unsigned char *data[LANES];
+    int i, next, active, full, shared;
+
+    buffers = (unsigned char *)safe_malloc(LANES*LANE_CHUNK);
+    for ( i=0; i<LANES; ++i ) {
+        lane[i].fd = -1;
+        lane[i].buf = buffers + i*LANE_CHUNK;
+    }
+    next = first;
+    do {
+        /* Start the next files in any empty lanes */
+        active = 0;
+        for ( i=0; i<LANES; ++i ) {
+            while ( (lane[i].fd < 0) && (next < count) ) {
+                lane[i].fd = open(files[next], O_RDONLY);
+                if ( lane[i].fd < 0 ) {
+                    log(LOG_ERROR, _("Unable to open %s: %s\n"),
+                        files[next], strerror(errno));
+                    sums[next].md5[0] = '\0';
+                    sums[next].sha256[0] = '\0';
+                } else {
+                    lane[i].index = next;
+                    digest_init(&lane[i].ctx);
+                }
+                next += step;
+            }
+            if ( lane[i].fd >= 0 ) {
+                ++active;
+            }
+        }
+
+        /* Read the next chunk of every file */
+        full = 0;
+        for ( i=0; i<LANES; ++i ) {
+            if ( lane[i].fd < 0 ) {
+                continue;
+            }
+            lane[i].len = read_chunk(lane[i].fd, lane[i].buf, LANE_CHUNK);
+            if ( lane[i].len < 0 ) {
+                log(LOG_ERROR, _("Unable to read %s\n"), files[lane[i].index]);
+                sums[lane[i].index].md5[0] = '\0';
+                sums[lane[i].index].sha256[0] = '\0';
+                close(lane[i].fd);
+                lane[i].fd = -1;
+            } else if ( lane[i].len == LANE_CHUNK ) {
+                ++full;
+            }
+        }
+
+        /* Full chunks are whole blocks, so they can go through together.
+           Lanes without a full chunk hash the first full chunk again
+           into a spare state that is thrown away.
+         */
+        shared = 0;
+#ifdef USE_X86_SIMD
+        if ( (full >= 2) && use_sse2() ) {
+            for ( i=0; (lane[i].fd < 0) || (lane[i].len != LANE_CHUNK); ++i ) {
+                continue;
+            }
+            data[0] = lane[i].buf;
+            for ( i=0; i<LANES; ++i ) {
+                if ( (lane[i].fd >= 0) && (lane[i].len == LANE_CHUNK) ) {
+                    states[i] = lane[i].ctx.md5.state;
+                    data[i] = lane[i].buf;
+                    add_count(lane[i].ctx.md5.count, LANE_CHUNK);
+                    sha256_update(&lane[i].ctx.sha256, lane[i].buf, LANE_CHUNK);
+                } else {
+                    states[i] = spare;
+                    data[i] = data[0];
+                }
+            }
+            md5_transform4(states, data, LANE_CHUNK/64);
+            shared = 1;
+        }
+#endif
+        for ( i=0; i<LANES; ++i ) {
+            if ( lane[i].fd < 0 ) {
+                continue;
+            }
+            if ( lane[i].len == LANE_CHUNK ) {
+                if ( ! shared ) {
+                    digest_update(&lane[i].ctx, lane[i].buf, LANE_CHUNK);
+                }
+            } else {
+                /* That was the end of this file */
+                digest_update(&lane[i].ctx, lane[i].buf, lane[i].len);
+                digest_final(&lane[i].ctx, &sums[lane[i].index]);
+                close(lane[i].fd);
+                lane[i].fd = -1;
+            }
+        }
+    } while ( active > 0 );
+
+    safe_free(buffers);
+}
+
+int digest_files(const char *files[], digest_sums sums[], int count)
+{
+    int workers, i, w, len, failed;
+    pid_t child[MAX_WORKERS];
+    int fd[MAX_WORKERS];
+    int pipes[2];
+
+    /* Use a process per processor, as long as each has a few files */
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( workers > ((count + LANES - 1) / LANES) ) {
+        workers = ((count + LANES - 1) / LANES);
+    }
+    if ( workers > MAX_WORKERS ) {
+        workers = MAX_WORKERS;
+    }
+    if ( workers <= 1 ) {
+        digest_lanes(files, sums, count, 0, 1);
+    } else {
+        for ( w=0; w<workers; ++w ) {
+            child[w] = -1;
+            fd[w] = -1;
+            if ( pipe(pipes) < 0 ) {
+                digest_lanes(files, sums, count, w, workers);
+                continue;
+            }
+            child[w] = fork();
+            switch (child[w]) {
+                case -1:
+                    close(pipes[0]);
+                    close(pipes[1]);
+                    digest_lanes(files, sums, count, w, workers);
+                    break;
+                case 0:
+                    close(pipes[0]);
+                    digest_lanes(files, sums, count, w, workers);
+                    for ( i=w; i<count; i+=workers ) {
+                        write(pipes[1], &sums[i], sizeof(sums[i]));
+                    }
+                    _exit(0);
+                default:
+                    close(pipes[1]);
+                    fd[w] = pipes[0];
+                    break;
+            }
+        }
+
+        /* Collect the checksums from each process */
+        for ( w=0; w<workers; ++w ) {
+            if ( child[w] <= 0 ) {
+                continue;
+            }
+            for ( i=w; i<count; i+=workers ) {
+                len = read_chunk(fd[w], (unsigned char *)&sums[i],
+                                 sizeof(sums[i]));
+                if ( len != sizeof(sums[i]) ) {
+                    sums[i].md5[0] = '\0';
+                    sums[i].sha256[0] = '\0';
+                }
+            }
+            close(fd[w]);
+            waitpid(child[w], NULL, 0);
+        }
+    }
+
+    failed = 0;
+    for ( i=0; i<count; ++i ) {
+        if ( ! sums[i].md5[0] ) {
+            ++failed;
+        }
+    }
+    return(failed);
+}
+
+int digest_check(const char *text, const char *sum)
+{
+    int len;
+
+    while ( isspace((int)*text) ) {
+        ++text;
+    }
+    if ( ! *text ) {
+        return(-1);
+    }
+    len = strlen(sum);
+    if ( (strncasecmp(text, sum, len) != 0) || isxdigit((int)text[len]) ) {
+        return(0);
+    }
+    return(1);
+}
@@ -0,0 +1,96 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to checksum data incrementally, as it is downloaded */
+
+#ifndef _digest_h
+#define _digest_h
+
+#include <sys/types.h>
+
+#define MD5_DIGEST_SIZE     16
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+    unsigned int state[4];
+    unsigned int count[2];
+    unsigned char buffer[64];
+} md5_context;
+
+extern void md5_init(md5_context *ctx);
+extern void md5_update(md5_context *ctx, const void *data, unsigned int len);
+extern void md5_final(md5_context *ctx, unsigned char digest[MD5_DIGEST_SIZE]);
+
+typedef struct {
+    unsigned int state[8];
+    unsigned int count[2];
+    unsigned char buffer[64];
+} sha256_context;
+
+extern void sha256_init(sha256_context *ctx);
+extern void sha256_update(sha256_context *ctx, const void *data, unsigned int len);
+extern void sha256_final(sha256_context *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/* Use the SSE2 and SHA instructions when the processor has them.
+   This is on by default, and is only turned off to compare speeds.
+ */
+extern void set_digest_acceleration(int enabled);
+extern const char *get_digest_acceleration(void);
+
+/* The checksums kept for a file while it's being downloaded */
+typedef struct {
+    md5_context md5;
+    sha256_context sha256;
+} digest_context;
+
+/* The final checksums as lowercase hex strings */
+typedef struct {
+    char md5[MD5_DIGEST_SIZE*2+1];
+    char sha256[SHA256_DIGEST_SIZE*2+1];
+} digest_sums;
+
+/* Convert a binary checksum to lowercase hex */
+extern void digest_hex(const unsigned char *digest, int len, char *text);
+
+extern void digest_init(digest_context *ctx);
+extern void digest_update(digest_context *ctx, const void *data, int len);
+extern void digest_final(digest_context *ctx, digest_sums *sums);
+
+/* Add the first 'length' bytes of a file to the checksums, used to pick up
+   where a partial download left off.  Returns 0, or -1 if the file couldn't
+   be read.
+ */
+extern int digest_file(digest_context *ctx, const char *file, off_t length);
+
+/* Checksum a whole batch of finished files at once, four files to a
+   processor with the MD5 rounds interleaved, and a process per processor.
+   Files that can't be read have their checksums set to empty strings.
+   Returns the number of files that couldn't be read.
+ */
+extern int digest_files(const char *files[], digest_sums sums[], int count);
+
+/* Compare the checksum at the start of a checksum file, as written by
+   md5sum or sha256sum, with a calculated checksum.
+   Returns 1 if they match, 0 if they don't, or -1 if the file is empty.
+ */
+extern int digest_check(const char *text, const char *sum);
+
+#endif /* _digest_h */
@@ -0,0 +1,149 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Compare the speed of the checksum code with md5_compute() from setupdb.
+
+   Usage: digest_bench file [file ...]
+
+   Use large files that have been read once already, so the times are
+   for the checksums and not the disk.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "md5.h"
+
+#include "log_output.h"
+#include "safe_malloc.h"
+#include "gpg_verify.h"
+#include "digest.h"
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+static void report(const char *name, double start, double total)
+{
+    double elapsed;
+
+    elapsed = now() - start;
+    if ( elapsed <= 0.0 ) {
+        elapsed = 0.000001;
+    }
+    printf("%-32s %8.3f s %10.1f MB/s\n", name, elapsed,
+           (total / (1024.0*1024.0)) / elapsed);
+}
+
+/* Checksum each file in turn with the digest code */
+static void digest_each(const char *files[], digest_sums sums[], int count)
+{
+    digest_context ctx;
+    struct stat sb;
+    int i;
+
+    for ( i=0; i<count; ++i ) {
+        digest_init(&ctx);
+        if ( (stat(files[i], &sb) == 0) &&
+             (digest_file(&ctx, files[i], sb.st_size) == 0) ) {
+            digest_final(&ctx, &sums[i]);
+        } else {
+            sums[i].md5[0] = '\0';
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char **files;
+    digest_sums *sums;
+    char md5_real[CHECKSUM_SIZE+1];
+    struct stat sb;
+    double start, total;
+    int i, count;
+
+    if ( argc < 2 ) {
+        fprintf(stderr, "Usage: %s file [file ...]\n", argv[0]);
+        return(1);
+    }
+    files = (const char **)&argv[1];
+    count = argc - 1;
+    sums = (digest_sums *)safe_malloc(count * sizeof(*sums));
+
+    total = 0.0;
+    for ( i=0; i<count; ++i ) {
+        if ( stat(files[i], &sb) < 0 ) {
+            fprintf(stderr, "Unable to stat %s\n", files[i]);
+            return(1);
+        }
+        total += sb.st_size;
+    }
+    printf("Checksumming %d files, %.1f MB, acceleration: %s\n",
+           count, total / (1024.0*1024.0), get_digest_acceleration());
+
+    /* The setupdb MD5 code used before */
+    start = now();
+    for ( i=0; i<count; ++i ) {
+        md5_compute(files[i], md5_real, 0);
+    }
+    report("md5_compute (MD5)", start, total);
+
+    /* MD5 and SHA-256 together, one file at a time */
+    set_digest_acceleration(0);
+    start = now();
+    digest_each(files, sums, count);
+    report("digest_file (MD5+SHA-256)", start, total);
+
+    set_digest_acceleration(1);
+    start = now();
+    digest_each(files, sums, count);
+    report("digest_file, accelerated", start, total);
+
+    /* The whole batch at once */
+    set_digest_acceleration(0);
+    start = now();
+    digest_files(files, sums, count);
+    report("digest_files (MD5+SHA-256)", start, total);
+
+    set_digest_acceleration(1);
+    start = now();
+    digest_files(files, sums, count);
+    report("digest_files, accelerated", start, total);
+
+    /* Make sure everything agrees */
+    for ( i=0; i<count; ++i ) {
+        md5_compute(files[i], md5_real, 0);
+        if ( strcmp(md5_real, sums[i].md5) != 0 ) {
+            printf("MD5 mismatch on %s: %s != %s\n",
+                   files[i], md5_real, sums[i].md5);
+            return(1);
+        }
+    }
+    safe_free(sums);
+    return(0);
+}
@@ -0,0 +1,208 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A single loop waiting on all the file descriptors being watched.
+
+   This uses epoll where it is available, and select() otherwise.
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include "safe_malloc.h"
+#include "event_loop.h"
+
+#define MAX_EVENTS  32
+
+typedef struct {
+    int fd;
+    event_handler handler;
+    void *data;
+} event_watcher;
+
+static event_watcher *watchers = NULL;
+static int num_watchers = 0;
+static int max_watchers = 0;
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+#endif
+
+
+static event_watcher *find_watcher(int fd)
+{
+    int i;
+
+    for ( i=0; i<num_watchers; ++i ) {
+        if ( watchers[i].fd == fd ) {
+            return(&watchers[i]);
+        }
+    }
+    return(NULL);
+}
+
+int event_watch(int fd, event_handler handler, void *data)
+{
+    event_watcher *watcher;
+#ifdef USE_EPOLL
+    struct epoll_event event;
+
+    if ( epoll_fd < 0 ) {
+        epoll_fd = epoll_create(MAX_EVENTS);
+        if ( epoll_fd < 0 ) {
+            return(-1);
+        }
+    }
+#endif
+    watcher = find_watcher(fd);
+    if ( ! watcher ) {
+        if ( num_watchers == max_watchers ) {
+            max_watchers += 16;
+            watchers = (event_watcher *)safe_realloc(watchers,
+                                        max_watchers*(sizeof *watchers));
+        }
+#ifdef USE_EPOLL
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 ) {
+            return(-1);
+        }
+#endif
+        watcher = &watchers[num_watchers++];
+        watcher->fd = fd;
+    }
+    watcher->handler = handler;
+    watcher->data = data;
+    return(0);
+}
+
+void event_unwatch(int fd)
+{
+    event_watcher *watcher;
+
+    watcher = find_watcher(fd);
+    if ( watcher ) {
+#ifdef USE_EPOLL
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+        *watcher = watchers[--num_watchers];
+    }
+}
+
+void event_loop_after_fork(void)
+{
+    int i;
+
+    for ( i=0; i<num_watchers; ++i ) {
+        close(watchers[i].fd);
+    }
+    num_watchers = 0;
+#ifdef USE_EPOLL
+    if ( epoll_fd >= 0 ) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+#endif
+}
+
+/* Call the handler for a file descriptor, if it's still being watched */
+static int dispatch(int fd)
+{
+    event_watcher *watcher;
+
+    watcher = find_watcher(fd);
+    if ( ! watcher ) {
+        return(0);
+    }
+    watcher->handler(fd, watcher->data);
+    return(1);
+}
+
+#ifdef USE_EPOLL
+
+int event_poll(int msecs)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, count, handled;
+
+    if ( num_watchers == 0 ) {
+        if ( msecs > 0 ) {
+            usleep(msecs*1000);
+        }
+        return(0);
+    }
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, msecs);
+    handled = 0;
+    for ( i=0; i<count; ++i ) {
+        handled += dispatch(events[i].data.fd);
+    }
+    return(handled);
+}
+
+#else
+
+int event_poll(int msecs)
+{
+    fd_set fdset;
+    struct timeval tv;
+    int i, maxfd, count, handled;
+    int *ready;
+
+    FD_ZERO(&fdset);
+    maxfd = -1;
+    for ( i=0; i<num_watchers; ++i ) {
+        FD_SET(watchers[i].fd, &fdset);
+        if ( watchers[i].fd > maxfd ) {
+            maxfd = watchers[i].fd;
+        }
+    }
+    tv.tv_sec = msecs / 1000;
+    tv.tv_usec = (msecs % 1000) * 1000;
+    count = select(maxfd+1, &fdset, NULL, NULL, &tv);
+    if ( count <= 0 ) {
+        return(0);
+    }
+
+    /* The handlers may change the list, so note which are ready first */
+    ready = (int *)safe_malloc(count*(sizeof *ready));
+    count = 0;
+    for ( i=0; i<num_watchers; ++i ) {
+        if ( FD_ISSET(watchers[i].fd, &fdset) ) {
+            ready[count++] = watchers[i].fd;
+        }
+    }
+    handled = 0;
+    for ( i=0; i<count; ++i ) {
+        handled += dispatch(ready[i]);
+    }
+    free(ready);
+    return(handled);
+}
+
+#endif /* USE_EPOLL */
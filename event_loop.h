@@ -0,0 +1,51 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A single loop waiting on all the file descriptors the update tool is
+   watching at once: downloads, lookups and the pipes from child processes.
+*/
+
+#ifndef _event_loop_h
+#define _event_loop_h
+
+/* Called when a watched file descriptor is readable, or has been closed */
+typedef void (*event_handler)(int fd, void *data);
+
+/* Start and stop watching a file descriptor.  A handler may stop watching
+   its own or any other file descriptor.  Returns 0, or -1 on error.
+ */
+extern int event_watch(int fd, event_handler handler, void *data);
+extern void event_unwatch(int fd);
+
+/* Wait up to 'msecs' milliseconds for any watched file descriptor to
+   become readable, and call the handlers for the ones that are.
+   Returns the number of handlers called.
+ */
+extern int event_poll(int msecs);
+
+/* Call in a child process right after a fork, before using the event
+   loop or exiting.  The descriptors the parent is watching are closed in
+   the child, and it starts out with an event loop of its own, so it
+   can't take events meant for the parent.
+ */
+extern void event_loop_after_fork(void);
+
+#endif /* _event_loop_h */
@@ -33,6 +33,8 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 /* We'll use snarf, since it's simpler and we have more control over the code */
 /*#define USE_WGET*/
@@ -51,14 +53,40 @@
 #include "prefpath.h"
 #include "log_output.h"
 #include "update.h"
+#include "get_url.h"
+#include "digest.h"
+#include "block_sums.h"
+#include "mirror_stats.h"
+#include "transfer.h"
+#include "child_process.h"
 #include "setupdb.h"
 
 #define WGET            "wget"
 #define UPDATE_PATH     "%s/" LOKI_DIRNAME "/loki_update"
 
-static const char *tmppath = "tmp";
+/* When to give up on a slow mirror, see set_stall_limits() */
+static int stall_timeout = DEFAULT_STALL_TIMEOUT;
+static float min_rate = 0.0f;
+static int rate_window = DEFAULT_RATE_WINDOW;
 
 #ifdef USE_WGET
+/* Parse a line of wget output, picking out the N% progress */
+static void parse_wget_output(child_process *child, char *line, void *data)
+{
+    char *spot;
+
+    spot = strchr(line, '%');
+    if ( spot ) {
+        while ( (spot > line) && isdigit(*(spot-1)) ) {
+            --spot;
+        }
+        child->percentage = (float)atoi(spot);
+    } else {
+        /* Log the download output */
+        log(LOG_DEBUG, "%s\n", line);
+    }
+}
+
 /* This was the default URL transport mechanism, but it's a little
    unwieldy because of the verboseness of the output.
 */
@@ -66,23 +94,15 @@ static int wget_url(const char *url, char *file, int maxpath,
                     update_callback update, void *udata)
 {
     const char *base;
-    int pipefd[2];
     char path[PATH_MAX];
     char text[PATH_MAX];
     int argc;
-    const char *args[32];
-    pid_t child;
+    char *args[32];
+    child_process child;
     int status;
-    int cancelled;
-    int len, count;
-    char line[1024];
-    char *spot;
-    float percentage;
-    fd_set fdset;
-    struct timeval tv;
 
     /* Get the path where files are stored */
-    preferences_path(tmppath, path, sizeof(path);
+    preferences_path(get_session()->tmppath, path, sizeof(path));
 
     /* Get the full output name */
     base = strrchr(url, '/');
@@ -97,123 +117,98 @@ static int wget_url(const char *url, char *file, int maxpath,
         return(-1);
     }
 
-    /* First create a pipe for communicating between child and parent */
-    if ( pipe(pipefd) < 0 ) {
-        update_message(LOG_ERROR, _("Couldn't create IPC pipe"), update, udata);
-        return(-1);
-    }
-
     /* Show what URL is being downloaded */
     sprintf(text, "URL: %s", url);
     update_message(LOG_VERBOSE, text, update, udata);
 
-    child = fork();
-    switch (child) {
-        case -1:
-            /* Fork failed */
-            update_message(LOG_ERROR, _("Couldn't fork process"), update, udata);
-            return(-1);
-        case 0:
-            /* Child process */
-            close(2);
-            dup(pipefd[1]);
-            close(1);
-            dup(pipefd[1]);
-            close(0);
-            close(pipefd[1]);
-            argc = 0;
-            args[argc++] = WGET;
-            args[argc++] = "-P";
-            args[argc++] = path;
-            args[argc++] = "-c";
-            args[argc++] = url;
-            args[argc] = NULL;
-            execvp(args[0], args);
-            fprintf(stderr, _("Couldn't exec %s\n"), WGET);
-            exit(-1);
-        default:
-            break;
-    }
-
-    /* Parent, read status from child */
-    cancelled = 0;
-    percentage = 0.0;
-    close(pipefd[1]);
-    len = 0;
-    while ( !cancelled ) {
-        count = 0;
-
-        /* See if there is data to read */
-        FD_ZERO(&fdset);
-        FD_SET(pipefd[0], &fdset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        if ( select(pipefd[0]+1, &fdset, NULL, NULL, &tv) ) {
-            count = read(pipefd[0], &line[len], 1);
-            if ( count <= 0 ) {
-                break;
-            }
-        }
+    argc = 0;
+    args[argc++] = WGET;
+    args[argc++] = "-P";
+    args[argc++] = path;
+    args[argc++] = "-c";
+    args[argc++] = (char *)url;
+    args[argc] = NULL;
+    if ( child_start(&child, args, CHILD_STDOUT|CHILD_STDERR, NULL, 0,
+                     parse_wget_output, NULL, update, udata) < 0 ) {
+        return(-1);
+    }
+    status = child_wait(&child, update, udata);
+    if ( status == 0 ) {
+        sprintf(file, "%s/%s", path, base);
+    }
+    return(status);
+}
 
-        /* Parse output lines */
-        if ( (len == (sizeof(line)-1)) || (line[len] == '\n') ) {
-            line[len] = '\0';
+/* wget can only write to a file, so small files are downloaded to a
+   temporary file and read back from there.
+*/
+static int wget_url_data(const char *url, char **data, int *size, int maxsize,
+                         update_callback update, void *udata)
+{
+    char path[PATH_MAX];
+    char text[PATH_MAX];
+    int argc;
+    char *args[32];
+    child_process child;
+    struct stat sb;
+    int fd, status;
 
-            /* Check for N% output */
-            spot = strchr(line, '%');
-            if ( spot ) {
-                while ( (spot > line) && isdigit(*(spot-1)) ) {
-                    --spot;
-                }
-                percentage = (float)atoi(spot);
-            } else {
-                /* Log the download output */
-                log(LOG_DEBUG, "%s\n", line);
-            }
-            len = 0;
-        } else {
-            len += count;
-        }
+    /* Get a temporary file where files are stored */
+    preferences_path(get_session()->tmppath, path, sizeof(path));
+    mkdir(path, 0700);
+    if ( sizeof(path) < (strlen(path)+sizeof("/.dataXXXXXX")) ) {
+        update_message(LOG_ERROR, _("Path too long for internal buffer"),
+                       update, udata);
+        return(-1);
+    }
+    strcat(path, "/.dataXXXXXX");
+    fd = mkstemp(path);
+    if ( fd < 0 ) {
+        update_message(LOG_ERROR, _("Couldn't create temporary file"),
+                       update, udata);
+        return(-1);
+    }
 
-        /* Update the UI */
-        if ( update ) {
-            cancelled = update(0, NULL, percentage, 0, 0, 0.0f, udata);
-        }
+    /* Show what URL is being downloaded */
+    sprintf(text, "URL: %s", url);
+    update_message(LOG_VERBOSE, text, update, udata);
 
-        /* Why doesn't the pipe close? */
-        if ( (count == 0) && (waitpid(child, &status, WNOHANG) == child) ) {
-            break;
+    argc = 0;
+    args[argc++] = WGET;
+    args[argc++] = "-O";
+    args[argc++] = path;
+    args[argc++] = (char *)url;
+    args[argc] = NULL;
+    status = -1;
+    if ( (child_start(&child, args, CHILD_STDOUT|CHILD_STDERR, NULL, 0,
+                      parse_wget_output, NULL, update, udata) == 0) &&
+         (child_wait(&child, update, udata) == 0) &&
+         (fstat(fd, &sb) == 0) && (sb.st_size <= maxsize) ) {
+        *data = (char *)malloc(sb.st_size+1);
+        if ( *data && (read(fd, *data, sb.st_size) == sb.st_size) ) {
+            (*data)[sb.st_size] = '\0';
+            *size = sb.st_size;
+            status = 0;
+        } else {
+            free(*data);
+            *data = NULL;
         }
     }
-    if ( cancelled ) {
-        kill(child, SIGTERM);
-    }
-    waitpid(child, &status, 0);
-    close(pipefd[0]);
-    if ( cancelled ) {
-        status = 256;
-    }
-    if ( status == 0 ) {
-        sprintf(file, "%s/%s", path, base);
-    }
+    close(fd);
+    unlink(path);
     return(status);
 }
 #endif /* USE_WGET */
 
-#ifdef USE_SNARF
-int default_opts = 0; /* For the snarf code */
-
-static int snarf_url(const char *url, char *file, int maxpath,
-                     update_callback update, void *udata)
+/* Get the temporary file a URL will be downloaded to */
+int get_url_path(const char *url, char *file, int maxpath,
+                 update_callback update, void *udata)
 {
     const char *base;
     char path[PATH_MAX];
-    char text[PATH_MAX];
-    UrlResource *rsrc;
-    int status;
 
     /* Get the path where files are stored */
-    preferences_path(tmppath, path, sizeof(path));
+    preferences_path(get_session()->tmppath, path, sizeof(path));
     mkdir(path, 0700);
 
     /* Get the full output name */
@@ -227,8 +222,109 @@ static int snarf_url(const char *url, char *file, int maxpath,
         update_message(LOG_ERROR, _("No file specified in URL"), update, udata);
         return(-1);
     }
-    strcat(path, "/");
-    strcat(path, base);
+    if ( maxpath < (strlen(path)+1+strlen(base)+1) ) {
+        update_message(LOG_ERROR, _("Path too long for internal buffer"),
+                       update, udata);
+        return(-1);
+    }
+    sprintf(file, "%s/%s", path, base);
+    return(0);
+}
+
+/* The checks run on a file as it is downloaded */
+typedef struct {
+    digest_context *digest;
+    block_checker *blocks;
+    int corrupt;
+} download_checks;
+
+static void init_checks(download_checks *checks)
+{
+    if ( checks->digest ) {
+        digest_init(checks->digest);
+    }
+    if ( checks->blocks ) {
+        block_check_init(checks->blocks, checks->blocks->blocks, 0);
+    }
+    checks->corrupt = 0;
+}
+
+/* Check the next data in the file, returning nonzero if it's corrupt */
+static int check_data(const char *data, int len, void *udata)
+{
+    download_checks *checks = (download_checks *)udata;
+
+    if ( checks->digest ) {
+        digest_update(checks->digest, data, len);
+    }
+    if ( checks->blocks && (block_check_update(checks->blocks, data, len) < 0) ) {
+        checks->corrupt = 1;
+    }
+    return(checks->corrupt);
+}
+
+/* Run the checks on the part of a file we already have.  If a block is
+   corrupt, the file is cut off at the start of it.  Returns the length of
+   the good data, or -1 if the file couldn't be read.
+ */
+static off_t check_partial(const char *path, off_t length,
+                           download_checks *checks)
+{
+    char buf[64*1024];
+    off_t done;
+    int fd, count;
+
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 ) {
+        return(-1);
+    }
+    for ( done = 0; done < length; done += count ) {
+        count = read(fd, buf, ((length-done) < sizeof(buf)) ?
+                              (int)(length-done) : sizeof(buf));
+        if ( count <= 0 ) {
+            close(fd);
+            return(-1);
+        }
+        if ( check_data(buf, count, checks) ) {
+            /* Keep the good blocks before the bad one */
+            close(fd);
+            length = checks->blocks->offset;
+            truncate(path, length);
+            checks->corrupt = 0;
+            if ( checks->digest ) {
+                digest_init(checks->digest);
+                if ( digest_file(checks->digest, path, length) < 0 ) {
+                    return(-1);
+                }
+            }
+            return(length);
+        }
+    }
+    close(fd);
+    return(length);
+}
+
+#ifdef USE_SNARF
+int default_opts = 0; /* For the snarf code */
+
+static int snarf_url(const char *url, char *file, int maxpath,
+                     digest_sums *sums, block_sums *blocks,
+                     update_callback update, void *udata)
+{
+    char path[PATH_MAX];
+    char text[PATH_MAX];
+    UrlResource *rsrc;
+    digest_context digest;
+    block_checker check;
+    download_checks checks;
+    mirror_host *mirror;
+    off_t offset;
+    int status;
+
+    /* Get the full output name */
+    if ( get_url_path(url, path, sizeof(path), update, udata) < 0 ) {
+        return(-1);
+    }
     if ( maxpath < (strlen(path)+1) ) {
         update_message(LOG_ERROR, _("Path too long for internal buffer"),
                        update, udata);
@@ -257,6 +353,23 @@ static int snarf_url(const char *url, char *file, int maxpath,
     }
     rsrc->outfile = strdup(path);
     rsrc->outfile_offset = get_file_size(rsrc->outfile);
+    checks.digest = sums ? &digest : NULL;
+    checks.blocks = blocks ? &check : NULL;
+    check.blocks = blocks;
+    init_checks(&checks);
+    if ( sums || blocks ) {
+        /* Pick up the checks where the partial download left off */
+        if ( rsrc->outfile_offset ) {
+            offset = check_partial(path, rsrc->outfile_offset, &checks);
+            if ( offset < 0 ) {
+                init_checks(&checks);
+                offset = 0;
+            }
+            rsrc->outfile_offset = offset;
+        }
+        rsrc->data_hook = check_data;
+        rsrc->data_hook_udata = &checks;
+    }
     if ( rsrc->outfile_offset ) {
         rsrc->options |= OPT_RESUME;
     }
@@ -265,33 +378,260 @@ static int snarf_url(const char *url, char *file, int maxpath,
     }
     rsrc->progress = update;
     rsrc->progress_udata = udata;
+    rsrc->stall_timeout = stall_timeout;
+    rsrc->min_rate = min_rate;
+    rsrc->rate_window = rate_window;
+    gethostbyname_hook = lookup_mirror_address;
+    connected_socket_hook = take_mirror_socket;
+    mirror = get_mirror_host(url);
+    if ( mirror ) {
+        ++mirror->connections;
+    }
     if ( transfer(rsrc) ) {
         status = 0;
+        if ( blocks && (block_check_final(&check) < 0) ) {
+            checks.corrupt = 1;
+            status = -1;
+        }
+        if ( sums ) {
+            digest_final(&digest, sums);
+        }
         if ( update ) {
             update(0, NULL, 100.0, 0, 0, 0.0f, udata);
         }
     } else {
         status = -1;
     }
+    if ( checks.corrupt ) {
+        /* Keep the good data, so another mirror can take it from there */
+        sprintf(text, _("Corrupt data from %s"), url);
+        update_message(LOG_WARNING, text, update, udata);
+        truncate(path, check.offset);
+    }
+    if ( rsrc->stalled ) {
+        /* Keep what we have, so another mirror can take it from there */
+        sprintf(text, _("Download from %s is too slow"), url);
+        update_message(LOG_WARNING, text, update, udata);
+        status = -2;
+    }
+    if ( mirror ) {
+        --mirror->connections;
+    }
+    if ( ! rsrc->cancelled ) {
+        record_mirror_transfer(url, rsrc->connect_time, rsrc->transfer_rate,
+                               rsrc->transfer_bytes, (status != 0));
+    }
     strcpy(file, path);
     url_resource_destroy(rsrc);
     return(status);
 }
+
+static int snarf_url_data(const char *url, char **data, int *size, int maxsize,
+                          update_callback update, void *udata)
+{
+    char text[PATH_MAX];
+    UrlResource *rsrc;
+    int status;
+
+    /* Show what URL is being downloaded */
+    sprintf(text, "URL: %s", url);
+    update_message(LOG_VERBOSE, text, update, udata);
+
+    rsrc = url_resource_new();
+    if ( ! rsrc ) {
+        log(LOG_ERROR, _("Out of memory\n"));
+        return(-1);
+    }
+    rsrc->url = url_new();
+    if ( ! rsrc->url ) {
+        log(LOG_ERROR, _("Out of memory\n"));
+        url_resource_destroy(rsrc);
+        return(-1);
+    }
+    if ( ! url_init(rsrc->url, url) ) {
+        update_message(LOG_ERROR, _("Malformed URL, aborting"), update, udata);
+        url_resource_destroy(rsrc);
+        return(-1);
+    }
+    /* The data is kept in memory, and snarf opens /dev/null for it */
+    rsrc->outfile = strdup("/dev/null");
+    rsrc->outbuf_max = maxsize;
+    if ( get_logging() == LOG_DEBUG ) {
+        rsrc->options |= OPT_VERBOSE;
+    }
+    rsrc->progress = update;
+    rsrc->progress_udata = udata;
+    rsrc->stall_timeout = stall_timeout;
+    gethostbyname_hook = lookup_mirror_address;
+    connected_socket_hook = take_mirror_socket;
+    if ( transfer(rsrc) ) {
+        status = 0;
+        if ( ! rsrc->outbuf ) {
+            rsrc->outbuf = (char *)malloc(1);
+            *rsrc->outbuf = '\0';
+        }
+        *data = rsrc->outbuf;
+        *size = rsrc->outbuf_len;
+        rsrc->outbuf = NULL;
+        if ( update ) {
+            update(0, NULL, 100.0, 0, 0, 0.0f, udata);
+        }
+    } else {
+        status = -1;
+    }
+    url_resource_destroy(rsrc);
+    return(status);
+}
 #endif /* USE_SNARF */
 
 int get_url(const char *url, char *file, int maxpath,
                      update_callback update, void *udata)
+{
+    return get_url_digest(url, file, maxpath, NULL, update, udata);
+}
+
+int get_url_digest(const char *url, char *file, int maxpath,
+                   digest_sums *sums, update_callback update, void *udata)
+{
+    return get_url_checked(url, file, maxpath, sums, NULL, update, udata);
+}
+
+int get_url_checked(const char *url, char *file, int maxpath,
+                    digest_sums *sums, block_sums *blocks,
+                    update_callback update, void *udata)
 {
 #if defined(USE_WGET)
-    return wget_url(url, file, maxpath, update, udata);
+    digest_context digest;
+    block_checker check;
+    download_checks checks;
+    struct stat sb;
+    int status;
+
+    /* wget writes the file itself, so check it afterwards */
+    status = wget_url(url, file, maxpath, update, udata);
+    if ( (status == 0) && (sums || blocks) ) {
+        checks.digest = sums ? &digest : NULL;
+        checks.blocks = blocks ? &check : NULL;
+        check.blocks = blocks;
+        init_checks(&checks);
+        if ( (stat(file, &sb) < 0) ||
+             (check_partial(file, sb.st_size, &checks) != sb.st_size) ||
+             (blocks && (block_check_final(&check) < 0)) ) {
+            return(-1);
+        }
+        if ( sums ) {
+            digest_final(&digest, sums);
+        }
+    }
+    return(status);
+#elif defined(USE_SNARF)
+    return snarf_url(url, file, maxpath, sums, blocks, update, udata);
+#else
+#error No URL transport mechanism
+#endif
+}
+
+/* Start downloading a URL into memory with the transfer engine */
+int get_url_start(const char *url, int maxsize, url_download *download,
+                  update_callback update, void *udata)
+{
+    download->child = -1;
+    download->fd = -1;
+    download->data = NULL;
+    download->size = 0;
+    download->transfer = transfer_start_data(url, maxsize, update, udata);
+    if ( ! download->transfer ) {
+        return(-1);
+    }
+    download->child = download->transfer->child;
+    download->fd = download->transfer->fd;
+    return(0);
+}
+
+/* See if a background download is done, collecting the data if it is */
+static int get_url_done(url_download *download, int status,
+                        char **data, int *size)
+{
+    if ( status == 0 ) {
+        *data = transfer_take_data(download->transfer, size);
+    }
+    transfer_free(download->transfer);
+    download->transfer = NULL;
+    download->child = -1;
+    download->fd = -1;
+    return(status);
+}
+
+int get_url_poll(url_download *download, char **data, int *size)
+{
+    int status;
+
+    if ( ! download->transfer ) {
+        return(-1);
+    }
+    status = transfer_poll(download->transfer);
+    if ( status > 0 ) {
+        return(status);
+    }
+    return(get_url_done(download, status, data, size));
+}
+
+/* Wait for a background download to finish */
+int get_url_finish(url_download *download, char **data, int *size,
+                   update_callback update, void *udata)
+{
+    int status;
+
+    if ( ! download->transfer ) {
+        return(-1);
+    }
+    status = transfer_wait(download->transfer, update, udata);
+    return(get_url_done(download, status, data, size));
+}
+
+/* Stop a background download that is no longer needed */
+void get_url_abort(url_download *download)
+{
+    transfer_free(download->transfer);
+    download->transfer = NULL;
+    download->child = -1;
+    download->fd = -1;
+    if ( download->data ) {
+        free(download->data);
+        download->data = NULL;
+    }
+}
+
+int get_url_data(const char *url, char **data, int *size, int maxsize,
+                 update_callback update, void *udata)
+{
+#if defined(USE_WGET)
+    return wget_url_data(url, data, size, maxsize, update, udata);
 #elif defined(USE_SNARF)
-    return snarf_url(url, file, maxpath, update, udata);
+    return snarf_url_data(url, data, size, maxsize, update, udata);
 #else
 #error No URL transport mechanism
 #endif
 }
 
-void set_tmppath(const char *path)
+void set_tmppath(update_session *session, const char *path)
+{
+    session->tmppath = path;
+}
+
+const char *get_tmppath(update_session *session)
+{
+    return(session->tmppath);
+}
+
+void set_stall_limits(int timeout, float rate, int window)
+{
+    stall_timeout = timeout;
+    min_rate = rate;
+    rate_window = window;
+}
+
+int get_stall_timeout(void)
 {
-	tmppath = path;
+    return(stall_timeout);
 }
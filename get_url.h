@@ -23,9 +23,102 @@
    update directory.
 */
 
+#include <sys/types.h>
+
 #include "update.h"
+#include "session.h"
+#include "digest.h"
+#include "block_sums.h"
+
+/* Get the path in the update directory a URL will be downloaded to */
+extern int get_url_path(const char *url, char *file, int maxpath,
+                        update_callback update, void *udata);
 
 extern int get_url(const char *url, char *file, int maxpath,
                    update_callback update, void *udata);
 
-extern void set_tmppath(const char *path);
+/* Download a URL like get_url(), computing the checksums of the whole file
+   as the data arrives, so it doesn't need to be read again to verify it.
+ */
+extern int get_url_digest(const char *url, char *file, int maxpath,
+                          digest_sums *sums,
+                          update_callback update, void *udata);
+
+/* Download a URL like get_url_digest(), also checking each block of the
+   file against a block list as it arrives.  If a block is corrupt, the
+   download stops and the file is cut off at the start of that block, so
+   downloading it again, from another mirror, picks up from there.
+   Returns 0 on success, -1 on failure, or -2 if the mirror stalled or was
+   slower than the limits set with set_stall_limits(), in which case the
+   partial file is kept for the next mirror to resume.
+ */
+extern int get_url_checked(const char *url, char *file, int maxpath,
+                           digest_sums *sums, block_sums *blocks,
+                           update_callback update, void *udata);
+
+/* Largest files that are downloaded into memory rather than to disk */
+#define MAX_TEXT_DOWNLOAD   (1024*1024)     /* READMEs and update lists */
+#define MAX_SUM_DOWNLOAD    (64*1024)       /* Signatures and checksums */
+
+/* Download a small file into memory instead of the update directory.
+   On success, 'data' points to a buffer allocated with malloc() holding
+   'size' bytes plus a terminating nul, which the caller must free.
+   Downloads larger than 'maxsize' bytes fail.
+ */
+extern int get_url_data(const char *url, char **data, int *size, int maxsize,
+                        update_callback update, void *udata);
+
+/* A small file being downloaded into memory in the background.
+   'child' is greater than zero while the download is running.
+ */
+struct url_transfer;
+typedef struct {
+    pid_t child;
+    int fd;
+    char *data;
+    int size;
+    struct url_transfer *transfer;
+} url_download;
+
+/* Start downloading a URL into memory in the background, so several files
+   can be retrieved at once.  These are run by the transfer engine, so
+   running the event loop moves all of them along together.  The update
+   callback is given the messages and progress of the download whenever
+   the event loop runs, and may cancel it.  Returns 0, or -1 if the
+   download couldn't be started, in which case polling the download will
+   report failure.
+ */
+extern int get_url_start(const char *url, int maxsize, url_download *download,
+                         update_callback update, void *udata);
+
+/* Returns 1 if a background download is still running, 0 if it has
+   finished successfully, or -1 if it failed.  On success the data is
+   returned as with get_url_data().  Once this returns 0 or -1 the
+   download has been cleaned up and is no longer running.
+ */
+extern int get_url_poll(url_download *download, char **data, int *size);
+
+/* Wait for a background download, returning 0 if it was successful.
+   The update callback is called while waiting and may cancel the download.
+ */
+extern int get_url_finish(url_download *download, char **data, int *size,
+                          update_callback update, void *udata);
+
+/* Stop a background download that is no longer needed */
+extern void get_url_abort(url_download *download);
+
+/* Set the directory updates are downloaded to.  The downloads themselves
+   go to the directory of the calling thread's session.
+ */
+extern void set_tmppath(update_session *session, const char *path);
+extern const char *get_tmppath(update_session *session);
+
+/* Give up on a mirror when no data arrives for 'timeout' seconds, or when
+   less than 'rate' K/s arrives over the last 'window' seconds.  A timeout
+   or rate of 0 turns that check off.  Only the timeout applies to files
+   downloaded into memory.
+ */
+#define DEFAULT_STALL_TIMEOUT   60
+#define DEFAULT_RATE_WINDOW     30
+extern void set_stall_limits(int timeout, float rate, int window);
+extern int get_stall_timeout(void);
@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
@@ -28,13 +29,27 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 
+#include "safe_malloc.h"
 #include "prefpath.h"
 #include "log_output.h"
 #include "gpg_verify.h"
+#include "event_loop.h"
+#include "child_process.h"
 
 #define GPG         "gpg"
-static char *keyservers[] = {
+
+#define MAX_KEYSERVERS      16
+#define KEYSERVER_TIMEOUT   60              /* Seconds to wait for a key */
+#define KEY_CACHE_FILE      "keyserver_cache.txt"
+#define NOT_FOUND_EXPIRY    (24*60*60)      /* Seconds to remember them */
+#define UNREACHABLE_EXPIRY  (60*60)
+
+/* The error code GPG gives when a keyserver doesn't have a key */
+#define GPG_ERR_NO_DATA     58
+static char *default_keyservers[] = {
     "keyserver.lokigames.com",
     "www.keyserver.net",
     "wwwkeys.pgp.net",
@@ -42,298 +57,571 @@ static char *keyservers[] = {
     NULL
 };
 
-gpg_result gpg_verify(const char *file, char *sig, int maxsig,
-                      update_callback update, void *udata)
-{
-    int argc;
-    char *args[9];
-    pid_t child;
-    int cancelled;
-    int pipefd[2];
-    char *prefix;
-    int len, count;
-    char line[1024];
+/* What GPG has told us about a signature */
+typedef struct {
+    gpg_result result;
+    char *sig;
+    int maxsig;
     char signature[1024];
     char fingerprint[1024];
-    fd_set fdset;
-    struct timeval tv;
-    gpg_result result;
+} gpg_status;
 
-    /* First create a pipe for communicating between child and parent */
-    signal(SIGPIPE, SIG_IGN);
-    if ( pipe(pipefd) < 0 ) {
-        log(LOG_ERROR, _("Couldn't create IPC pipe\n"));
-        return(GPG_CANCELLED);
+/* Parse a line of the GPG status output */
+static void parse_verify_output(child_process *child, char *line, void *data)
+{
+    gpg_status *status = (gpg_status *)data;
+    char *prefix;
+
+    /* Only the first result counts */
+    if ( status->result != GPG_CANCELLED ) {
+        return;
     }
 
-    child = fork();
-    switch (child) {
-        case -1:
-            /* Fork failed */
-            log(LOG_ERROR, _("Couldn't fork process\n"));
-            return(GPG_CANCELLED);
-        case 0:
-            /* Child process */
-            close(2);
-            dup(pipefd[1]);     /* Copy the pipe to file descriptor 2 */
-            close(1);
-            close(0);
-            close(pipefd[0]);
-            close(pipefd[1]);
-            argc = 0;
-            args[argc++] = GPG;
-            args[argc++] = "--batch";
-            args[argc++] = "--logger-fd";
-            args[argc++] = "1";
-            args[argc++] = "--status-fd";
-            args[argc++] = "2";
-            args[argc++] = "--verify";
-            args[argc++] = strdup(file);
-            args[argc] = NULL;
-            execvp(args[0], args);
-            /* Uh oh, we couldn't run GPG */
-            prefix = "[GNUPG:] NOTINSTALLED\n";
-            write(2, prefix, strlen(prefix));
-            _exit(-1);
-        default:
-            break;
+    /* Check for needing a public key */
+    prefix = "[GNUPG:] NO_PUBKEY ";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        memset(status->sig, 0, status->maxsig);
+        strncpy(status->sig, line+strlen(prefix), status->maxsig);
+        status->result = GPG_NOPUBKEY;
+        return;
     }
 
-    /* Parent, read from child output (slow, but hey..) */
-    result = GPG_CANCELLED;
-    cancelled = 0;
-    close(pipefd[1]);
+    /* Handle signature verification fail */
+    prefix = "[GNUPG:] BADSIG";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        status->result = GPG_VERIFYFAIL;
+        return;
+    }
+
+    /* Handle signature verification succeeding */
+    prefix = "[GNUPG:] GOODSIG ";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        /* Skip the initial key ID */
+        prefix = line+strlen(prefix);
+        while ( *prefix && !isspace(*prefix) ) {
+            ++prefix;
+        }
+        while ( isspace(*prefix) ) {
+            ++prefix;
+        }
+        strncpy(status->signature, prefix, sizeof(status->signature)-1);
+    }
+    prefix = "[GNUPG:] VALIDSIG ";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        /* Copy the key fingerprint */
+        strncpy(status->fingerprint, line+strlen(prefix),
+                sizeof(status->fingerprint)-1);
+        prefix = status->fingerprint;
+        while ( *prefix && !isspace(*prefix) ) {
+            ++prefix;
+        }
+        *prefix = '\0';
+        status->result = GPG_VERIFYOK;
+    }
+}
+
+/* Run GPG on a signature file, or a signature held in memory */
+static gpg_result run_gpg_verify(const char *file,
+                                 const char *sigdata, int sigsize,
+                                 char *sig, int maxsig,
+                                 update_callback update, void *udata)
+{
+    int argc;
+    char *args[10];
+    child_process child;
+    gpg_status status;
+    int exit_status;
+
+    argc = 0;
+    args[argc++] = GPG;
+    args[argc++] = "--batch";
+    args[argc++] = "--logger-fd";
+    args[argc++] = "1";
+    args[argc++] = "--status-fd";
+    args[argc++] = "2";
+    args[argc++] = "--verify";
+    if ( sigdata ) {
+        args[argc++] = "-";
+    }
+    args[argc++] = (char *)file;
+    args[argc] = NULL;
+
     memset(sig, 0, maxsig);
-    memset(signature, 0, sizeof(signature));
-    memset(fingerprint, 0, sizeof(fingerprint));
+    memset(&status, 0, sizeof(status));
+    status.result = GPG_CANCELLED;
+    status.sig = sig;
+    status.maxsig = maxsig;
+    if ( child_start(&child, args, CHILD_STDERR, sigdata, sigsize,
+                     parse_verify_output, &status, NULL, NULL) < 0 ) {
+        return(GPG_CANCELLED);
+    }
+    exit_status = child_wait(&child, update, udata);
+    if ( WIFEXITED(exit_status) && (WEXITSTATUS(exit_status) == 127) ) {
+        return(GPG_NOTINSTALLED);
+    }
+    if ( status.result == GPG_VERIFYOK ) {
+        snprintf(sig, maxsig, "%s %s", status.fingerprint, status.signature);
+    }
+    return(status.result);
+}
+
+gpg_result gpg_verify(const char *file, char *sig, int maxsig,
+                      update_callback update, void *udata)
+{
+    return(run_gpg_verify(file, NULL, 0, sig, maxsig, update, udata));
+}
+
+gpg_result gpg_verify_data(const char *file, const char *sigdata, int sigsize,
+                           char *sig, int maxsig,
+                           update_callback update, void *udata)
+{
+    return(run_gpg_verify(file, sigdata, sigsize, sig, maxsig, update, udata));
+}
+
+/* Decode base64 text, returning the number of bytes written to 'out' */
+static int decode_base64(const char *text, unsigned char *out)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const char *digit;
+    unsigned long bits;
+    int nbits, len;
+
+    bits = 0;
+    nbits = 0;
     len = 0;
-    while ( !cancelled ) {
-        count = 0;
-
-        /* See if there is data to read */
-        FD_ZERO(&fdset);
-        FD_SET(pipefd[0], &fdset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        if ( select(pipefd[0]+1, &fdset, NULL, NULL, &tv) ) {
-            count = read(pipefd[0], &line[len], 1);
-            if ( count <= 0 ) {
-                break;
-            }
+    for ( ; *text && (*text != '='); ++text ) {
+        digit = strchr(digits, *text);
+        if ( ! digit ) {
+            continue;
         }
+        bits = (bits << 6) | (digit - digits);
+        nbits += 6;
+        if ( nbits >= 8 ) {
+            nbits -= 8;
+            out[len++] = (unsigned char)(bits >> nbits);
+        }
+    }
+    return(len);
+}
 
-        /* Parse output lines */
-        if ( (len == (sizeof(line)-1)) ||
-             (line[len] == '\r') || (line[len] == '\n') ) {
-            line[len] = '\0';
+/* Write a signature file as a signed message, with the signature packet
+   followed by the file itself in a literal data packet.  GPG can check
+   any number of these in one run, which it can't for detached signatures.
+ */
+static int write_signed_message(const char *file, const char *sigfile,
+                                const char *message)
+{
+    FILE *in, *out;
+    char line[1024];
+    unsigned char packet[1024];
+    unsigned long size;
+    int len, armored, in_body;
+    struct stat sb;
 
-            /* Check for GPG not installed */
-            prefix = "[GNUPG:] NOTINSTALLED";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                result = GPG_NOTINSTALLED;
-                break;
-            }
+    if ( stat(file, &sb) < 0 ) {
+        return(-1);
+    }
+    in = fopen(sigfile, "rb");
+    if ( ! in ) {
+        return(-1);
+    }
+    out = fopen(message, "wb");
+    if ( ! out ) {
+        fclose(in);
+        return(-1);
+    }
 
-            /* Check for needing a public key */
-            prefix = "[GNUPG:] NO_PUBKEY ";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                memset(sig, 0, maxsig);
-                strncpy(sig, line+strlen(prefix), maxsig);
-                result = GPG_NOPUBKEY;
-                break;
+    /* Copy the signature, removing the ASCII armor if it has any */
+    armored = 0;
+    in_body = 0;
+    while ( fgets(line, sizeof(line), in) ) {
+        if ( strncmp(line, "-----BEGIN PGP", 14) == 0 ) {
+            armored = 1;
+            continue;
+        }
+        if ( ! armored ) {
+            rewind(in);
+            while ( (len = fread(packet, 1, sizeof(packet), in)) > 0 ) {
+                fwrite(packet, 1, len, out);
             }
-
-            /* Handle signature verification fail */
-            prefix = "[GNUPG:] BADSIG";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                result = GPG_VERIFYFAIL;
-                break;
+            break;
+        }
+        if ( ! in_body ) {
+            /* The armor headers end with a blank line */
+            if ( (line[0] == '\r') || (line[0] == '\n') ) {
+                in_body = 1;
             }
+            continue;
+        }
+        if ( (line[0] == '=') || (line[0] == '-') ) {
+            break;
+        }
+        len = decode_base64(line, packet);
+        fwrite(packet, 1, len, out);
+    }
+    fclose(in);
+
+    /* The literal data packet header: binary, no file name or date */
+    size = 6 + sb.st_size;
+    packet[0] = 0xCB;
+    packet[1] = 0xFF;
+    packet[2] = (unsigned char)(size >> 24);
+    packet[3] = (unsigned char)(size >> 16);
+    packet[4] = (unsigned char)(size >> 8);
+    packet[5] = (unsigned char)size;
+    packet[6] = 'b';
+    memset(&packet[7], 0, 5);
+    fwrite(packet, 1, 12, out);
+    in = fopen(file, "rb");
+    if ( ! in ) {
+        fclose(out);
+        unlink(message);
+        return(-1);
+    }
+    while ( (len = fread(packet, 1, sizeof(packet), in)) > 0 ) {
+        fwrite(packet, 1, len, out);
+    }
+    fclose(in);
+    if ( fclose(out) != 0 ) {
+        unlink(message);
+        return(-1);
+    }
+    return(0);
+}
 
-            /* Handle signature verification succeeding */
-            prefix = "[GNUPG:] GOODSIG ";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                /* Skip the initial key ID */
-                prefix = line+strlen(prefix);
-                while ( !isspace(*prefix) ) {
-                    ++prefix;
-                }
-                while ( isspace(*prefix) ) {
-                    ++prefix;
-                }
-                strncpy(signature, prefix, sizeof(signature));
-                signature[strlen(prefix)] = '\0';
-            }
-            prefix = "[GNUPG:] VALIDSIG ";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                /* Copy the key fingerprint */
-                strncpy(fingerprint, line+strlen(prefix), sizeof(fingerprint));
-                prefix = fingerprint;
-                while ( !isspace(*prefix) ) {
-                    ++prefix;
-                }
-                *prefix = '\0';
-                result = GPG_VERIFYOK;
+/* The state of a batch of files being checked */
+typedef struct {
+    gpg_batch_file *files;
+    gpg_status *status;
+    char **messages;
+    int count;
+    int current;                /* The file GPG is working on, or -1 */
+    int last;                   /* The last file GPG started on */
+} gpg_batch;
+
+/* Parse a line of the GPG status output, for the file it's working on */
+static void parse_batch_output(child_process *child, char *line, void *data)
+{
+    gpg_batch *batch = (gpg_batch *)data;
+    char *prefix;
+    int i;
+
+    prefix = "[GNUPG:] FILE_START ";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        batch->current = -1;
+        prefix = strchr(line+strlen(prefix), ' ');
+        for ( i=0; prefix && (i < batch->count); ++i ) {
+            if ( batch->messages[i] &&
+                 (strcmp(prefix+1, batch->messages[i]) == 0) ) {
+                batch->current = i;
+                batch->last = i;
                 break;
             }
+        }
+        return;
+    }
+    if ( strncmp(line, "[GNUPG:] FILE_DONE", 18) == 0 ) {
+        batch->current = -1;
+        return;
+    }
+    if ( batch->current >= 0 ) {
+        parse_verify_output(child, line, &batch->status[batch->current]);
+    }
+}
 
-            len = 0;
-        } else {
-            len += count;
+/* Run GPG over the files from 'first' on, returning the index of the last
+   one it got to, or -1 if it didn't get anywhere.
+ */
+static int run_gpg_batch(gpg_batch *batch, int first,
+                         update_callback update, void *udata)
+{
+    char **args;
+    child_process child;
+    int i, argc, exit_status;
+
+    args = (char **)safe_malloc((batch->count+8)*(sizeof *args));
+    argc = 0;
+    args[argc++] = GPG;
+    args[argc++] = "--batch";
+    args[argc++] = "--logger-fd";
+    args[argc++] = "1";
+    args[argc++] = "--status-fd";
+    args[argc++] = "2";
+    args[argc++] = "--verify-files";
+    for ( i=first; i<batch->count; ++i ) {
+        if ( batch->messages[i] ) {
+            args[argc++] = batch->messages[i];
+        }
+    }
+    args[argc] = NULL;
+
+    batch->current = -1;
+    batch->last = -1;
+    if ( child_start(&child, args, CHILD_STDERR, NULL, 0,
+                     parse_batch_output, batch, NULL, NULL) < 0 ) {
+        free(args);
+        return(-1);
+    }
+    exit_status = child_wait(&child, update, udata);
+    free(args);
+    if ( WIFEXITED(exit_status) && (WEXITSTATUS(exit_status) == 127) ) {
+        for ( i=first; i<batch->count; ++i ) {
+            batch->files[i].result = GPG_NOTINSTALLED;
         }
+        return(-1);
+    }
+    if ( child.killed ) {
+        return(-1);
+    }
+    return(batch->last);
+}
 
-        /* Update the UI */
-        if ( update ) {
-            cancelled = update(0, NULL, 0.0f, 0, 0, 0.0f, udata);
+void gpg_verify_batch(gpg_batch_file *files, int count,
+                      update_callback update, void *udata)
+{
+    gpg_batch batch;
+    char message[PATH_MAX];
+    int i, first, last;
+
+    batch.files = files;
+    batch.count = count;
+    batch.status = (gpg_status *)safe_malloc(count*(sizeof *batch.status));
+    batch.messages = (char **)safe_malloc(count*(sizeof *batch.messages));
+    for ( i=0; i<count; ++i ) {
+        files[i].result = GPG_CANCELLED;
+        memset(files[i].sig, 0, sizeof(files[i].sig));
+        memset(&batch.status[i], 0, sizeof(batch.status[i]));
+        batch.status[i].result = GPG_CANCELLED;
+        batch.status[i].sig = files[i].sig;
+        batch.status[i].maxsig = sizeof(files[i].sig);
+        snprintf(message, sizeof(message), "%s.gpg", files[i].file);
+        if ( write_signed_message(files[i].file, files[i].sigfile,
+                                  message) == 0 ) {
+            batch.messages[i] = safe_strdup(message);
+        } else {
+            batch.messages[i] = NULL;
         }
+    }
 
-        /* Why doesn't the pipe close? */
-        if ( (count == 0) && (waitpid(child, NULL, WNOHANG) == child) ) {
+    /* GPG gives up after a bad signature, so start again after it */
+    for ( first = 0; first < count; first = last+1 ) {
+        last = run_gpg_batch(&batch, first, update, udata);
+        if ( last < first ) {
             break;
         }
     }
-    if ( result == GPG_VERIFYOK ) {
-        snprintf(sig, maxsig, "%s %s", fingerprint, signature);
-    }
-    if ( cancelled ) {
-        kill(child, SIGTERM);
+
+    for ( i=0; i<count; ++i ) {
+        if ( files[i].result == GPG_CANCELLED ) {
+            files[i].result = batch.status[i].result;
+        }
+        if ( files[i].result == GPG_VERIFYOK ) {
+            snprintf(files[i].sig, sizeof(files[i].sig), "%s %s",
+                     batch.status[i].fingerprint, batch.status[i].signature);
+        }
+        if ( batch.messages[i] ) {
+            unlink(batch.messages[i]);
+            free(batch.messages[i]);
+        }
     }
-    waitpid(child, NULL, 0);
-    close(pipefd[0]);
-    return(result);
+    free(batch.messages);
+    free(batch.status);
 }
 
-static int get_publickey_from(const char *key, const char *keyserver,
-                              update_callback update, void *udata)
+/* Keys a keyserver didn't have, and keyservers that didn't answer, are
+   remembered for a while so they aren't asked again on every run.
+   Each line of the cache is "<key> <keyserver> <expiry time>", with a
+   key of "*" for keyservers that couldn't be reached.
+ */
+typedef struct key_cache_entry {
+    char *key;
+    char *keyserver;
+    time_t expires;
+    struct key_cache_entry *next;
+} key_cache_entry;
+
+static key_cache_entry *key_cache = NULL;
+static int key_cache_loaded = 0;
+
+static void add_key_cache(const char *key, const char *keyserver,
+                          time_t expires)
 {
-    int argc;
-    char *args[16];
-    pid_t child;
-    int cancelled;
-    int pipefd[2];
-    char *prefix;
-    int len, count;
-    char line[1024];
-    fd_set fdset;
-    struct timeval tv;
-    gpg_result result;
+    key_cache_entry *entry;
+
+    entry = (key_cache_entry *)safe_malloc(sizeof *entry);
+    entry->key = safe_strdup(key);
+    entry->keyserver = safe_strdup(keyserver);
+    entry->expires = expires;
+    entry->next = key_cache;
+    key_cache = entry;
+}
 
-    /* First create a pipe for communicating between child and parent */
-    signal(SIGPIPE, SIG_IGN);
-    if ( pipe(pipefd) < 0 ) {
-        log(LOG_ERROR, _("Couldn't create IPC pipe\n"));
-        return(GPG_CANCELLED);
-    }
+static void load_key_cache(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char key[1024], keyserver[1024];
+    long expires;
 
-    child = fork();
-    switch (child) {
-        case -1:
-            /* Fork failed */
-            update_message(LOG_ERROR, _("Couldn't fork process"), update, udata);
-            return(GPG_CANCELLED);
-        case 0:
-            /* Child process */
-            close(2);
-            dup(pipefd[1]);     /* Copy the pipe to file descriptor 2 */
-            close(1);
-            close(0);
-            close(pipefd[0]);
-            close(pipefd[1]);
-            argc = 0;
-            args[argc++] = GPG;
-            args[argc++] = "--batch";
-            args[argc++] = "--logger-fd";
-            args[argc++] = "1";
-            args[argc++] = "--status-fd";
-            args[argc++] = "2";
-            args[argc++] = "--honor-http-proxy";
-            args[argc++] = "--keyserver";
-            args[argc++] = strdup(keyserver);
-            args[argc++] = "--recv-key";
-            args[argc++] = strdup(key);
-            args[argc] = NULL;
-            execvp(args[0], args);
-            /* Uh oh, we couldn't run GPG */
-            prefix = "[GNUPG:] NOTINSTALLED\n";
-            write(2, prefix, strlen(prefix));
-            _exit(-1);
-        default:
-            /* Parent, wait for child */
-            break;
+    key_cache_loaded = 1;
+    preferences_path(KEY_CACHE_FILE, path, sizeof(path));
+    fp = fopen(path, "r");
+    if ( ! fp ) {
+        return;
     }
+    while ( fgets(path, sizeof(path), fp) ) {
+        if ( (sscanf(path, "%1023s %1023s %ld", key, keyserver, &expires) == 3)
+             && (expires > time(NULL)) ) {
+            add_key_cache(key, keyserver, (time_t)expires);
+        }
+    }
+    fclose(fp);
+}
 
-    /* Parent, read from child output (slow, but hey..) */
-    result = GPG_CANCELLED;
-    cancelled = 0;
-    close(pipefd[1]);
-    len = 0;
-    while ( !cancelled ) {
-        count = 0;
-
-        /* See if there is data to read */
-        FD_ZERO(&fdset);
-        FD_SET(pipefd[0], &fdset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        if ( select(pipefd[0]+1, &fdset, NULL, NULL, &tv) ) {
-            count = read(pipefd[0], &line[len], 1);
-            if ( count <= 0 ) {
-                break;
-            }
+static void save_key_cache(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    key_cache_entry *entry;
+
+    preferences_path(KEY_CACHE_FILE, path, sizeof(path));
+    fp = fopen(path, "w");
+    if ( ! fp ) {
+        log(LOG_WARNING, _("Unable to write to %s\n"), path);
+        return;
+    }
+    for ( entry = key_cache; entry; entry = entry->next ) {
+        if ( entry->expires > time(NULL) ) {
+            fprintf(fp, "%s %s %ld\n", entry->key, entry->keyserver,
+                    (long)entry->expires);
         }
+    }
+    fclose(fp);
+}
 
-        /* Parse output lines */
-        if ( (len == (sizeof(line)-1)) ||
-             (line[len] == '\r') || (line[len] == '\n') ) {
-            line[len] = '\0';
+/* See if there's no point asking a keyserver for a key at the moment */
+static int skip_keyserver(const char *key, const char *keyserver)
+{
+    key_cache_entry *entry;
 
-            /* Check for GPG not installed */
-            prefix = "[GNUPG:] NOTINSTALLED";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                result = GPG_NOTINSTALLED;
-                break;
-            }
+    if ( ! key_cache_loaded ) {
+        load_key_cache();
+    }
+    for ( entry = key_cache; entry; entry = entry->next ) {
+        if ( (entry->expires > time(NULL)) &&
+             (strcasecmp(entry->keyserver, keyserver) == 0) &&
+             ((strcmp(entry->key, "*") == 0) ||
+              (strcasecmp(entry->key, key) == 0)) ) {
+            return(1);
+        }
+    }
+    return(0);
+}
 
-            /* Check for needing a public key */
-            prefix = "[GNUPG:] IMPORT_RES ";
-            if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
-                if ( line[strlen(prefix)] == '0' ) {
-                    result = GPG_NOPUBKEY;
-                } else {
-                    result = GPG_IMPORTED;
-                }
-                break;
-            }
+/* Parse a line of the GPG status output while importing a key */
+static void parse_import_output(child_process *child, char *line, void *data)
+{
+    gpg_result *result = (gpg_result *)data;
+    char *prefix;
 
-            len = 0;
+    if ( *result != GPG_CANCELLED ) {
+        return;
+    }
+    prefix = "[GNUPG:] IMPORT_RES ";
+    if ( strncmp(line, prefix, strlen(prefix)) == 0 ) {
+        if ( line[strlen(prefix)] == '0' ) {
+            *result = GPG_NOPUBKEY;
         } else {
-            len += count;
+            *result = GPG_IMPORTED;
         }
+    }
 
-        /* Update the UI */
-        if ( update ) {
-            cancelled = update(0, NULL, 0.0f, 0, 0, 0.0f, udata);
-        }
+    /* Newer versions of GPG report a missing key as a "no data" error */
+    prefix = "[GNUPG:] FAILURE recv-keys ";
+    if ( (strncmp(line, prefix, strlen(prefix)) == 0) &&
+         ((strtoul(line+strlen(prefix), NULL, 10) & 0xFFFF) == GPG_ERR_NO_DATA) ) {
+        *result = GPG_NOPUBKEY;
+    }
+}
 
-        /* Why doesn't the pipe close? */
-        if ( (count == 0) && (waitpid(child, NULL, WNOHANG) == child) ) {
-            break;
-        }
+/* A keyserver being asked for a key */
+typedef struct {
+    char *keyserver;
+    child_process child;
+    gpg_result result;
+    int running;
+} keyserver_request;
+
+static int start_keyserver_request(keyserver_request *request,
+                                   const char *key)
+{
+    int argc;
+    char *args[16];
+
+    argc = 0;
+    args[argc++] = GPG;
+    args[argc++] = "--batch";
+    args[argc++] = "--logger-fd";
+    args[argc++] = "1";
+    args[argc++] = "--status-fd";
+    args[argc++] = "2";
+    args[argc++] = "--honor-http-proxy";
+    args[argc++] = "--keyserver";
+    args[argc++] = request->keyserver;
+    args[argc++] = "--recv-key";
+    args[argc++] = (char *)key;
+    args[argc] = NULL;
+
+    request->result = GPG_CANCELLED;
+    request->running = 0;
+    if ( child_start(&request->child, args, CHILD_STDERR, NULL, 0,
+                     parse_import_output, &request->result, NULL, NULL) < 0 ) {
+        return(-1);
     }
-    if ( cancelled ) {
-        kill(child, SIGTERM);
+    request->running = 1;
+    return(0);
+}
+
+/* Note how a keyserver request went, once it has finished */
+static void finish_keyserver_request(keyserver_request *request,
+                                     const char *key)
+{
+    int status;
+
+    request->running = 0;
+    status = request->child.status;
+    if ( request->child.killed ) {
+        return;
+    }
+    if ( WIFEXITED(status) && (WEXITSTATUS(status) == 127) ) {
+        request->result = GPG_NOTINSTALLED;
+        return;
+    }
+    switch (request->result) {
+        case GPG_IMPORTED:
+            break;
+        case GPG_NOPUBKEY:
+            add_key_cache(key, request->keyserver,
+                          time(NULL)+NOT_FOUND_EXPIRY);
+            break;
+        default:
+            log(LOG_VERBOSE, _("Keyserver %s didn't answer\n"),
+                request->keyserver);
+            add_key_cache("*", request->keyserver,
+                          time(NULL)+UNREACHABLE_EXPIRY);
+            break;
     }
-    waitpid(child, NULL, 0);
-    close(pipefd[0]);
-    return(result);
 }
 
-int get_publickey(const char *key, update_callback update, void *udata)
+/* Read the list of keyservers, creating it if it's not there */
+static int read_keyservers(char *keyservers[], int max_keyservers,
+                           update_callback update, void *udata)
 {
     FILE *fp;
     char keyserver[PATH_MAX];
     char text[1024];
-    gpg_result status = GPG_CANCELLED;
+    int count;
 
     /* Open/create the list of keyservers */
     preferences_path("keyservers.txt", keyserver, sizeof(keyserver));
@@ -345,37 +633,313 @@ int get_publickey(const char *key, update_callback update, void *udata)
         if ( ! fp ) {
             sprintf(text, _("Unable to create %s"), keyserver);
             update_message(LOG_WARNING, text, update, udata);
-            return(status);
+            return(0);
         }
-        for ( i=0; keyservers[i]; ++i ) {
-            fprintf(fp, "%s\n", keyservers[i]);
+        for ( i=0; default_keyservers[i]; ++i ) {
+            fprintf(fp, "%s\n", default_keyservers[i]);
         }
         rewind(fp);
     }
-
-    /* Search the keyservers for the key */
-    while ( fgets(keyserver, sizeof(keyserver), fp) &&
-            (status != GPG_IMPORTED) ) {
+    count = 0;
+    while ( (count < max_keyservers) &&
+            fgets(keyserver, sizeof(keyserver), fp) ) {
         /* Trim the newline */
-        keyserver[strlen(keyserver)-1] = '\0';
-        if ( ! *keyserver ) {
+        keyserver[strcspn(keyserver, "\r\n")] = '\0';
+        if ( *keyserver ) {
+            keyservers[count++] = safe_strdup(keyserver);
+        }
+    }
+    fclose(fp);
+    return(count);
+}
+
+int get_publickey(const char *key, update_callback update, void *udata)
+{
+    char *keyservers[MAX_KEYSERVERS];
+    keyserver_request *requests;
+    char text[1024];
+    gpg_result status;
+    time_t start_time;
+    int i, count, running, cancelled;
+
+    count = read_keyservers(keyservers, MAX_KEYSERVERS, update, udata);
+    requests = (keyserver_request *)safe_malloc((count+1)*(sizeof *requests));
+
+    /* Ask all the keyservers at once, except ones we know won't help */
+    running = 0;
+    for ( i=0; i<count; ++i ) {
+        requests[i].keyserver = keyservers[i];
+        requests[i].result = GPG_NOPUBKEY;
+        requests[i].running = 0;
+        if ( skip_keyserver(key, keyservers[i]) ) {
             continue;
         }
-        /* Download the public key */
-        sprintf(text, _("Downloading public key %s from %s"), key, keyserver);
+        sprintf(text, _("Downloading public key %s from %s"),
+                key, keyservers[i]);
         update_message(LOG_VERBOSE, text, update, udata);
-        status = get_publickey_from(key, keyserver, update, udata);
-        switch (status) {
-            case GPG_NOPUBKEY:
-                update_message(LOG_VERBOSE, _("Key not found"), update, udata);
-                break;
-            case GPG_IMPORTED:
-                update_message(LOG_VERBOSE, _("Key downloaded"), update, udata);
-                break;
-            default:
-                break;
+        if ( start_keyserver_request(&requests[i], key) == 0 ) {
+            ++running;
         }
     }
-    fclose(fp);
+
+    /* The first one to come up with the key wins */
+    status = GPG_NOPUBKEY;
+    cancelled = 0;
+    start_time = time(NULL);
+    while ( running > 0 ) {
+        if ( update && update(0, NULL, 0.0f, 0, 0, 0.0f, udata) ) {
+            cancelled = 1;
+            break;
+        }
+        if ( (time(NULL) - start_time) > KEYSERVER_TIMEOUT ) {
+            break;
+        }
+        event_poll(100);
+        running = 0;
+        for ( i=0; i<count; ++i ) {
+            if ( ! requests[i].running ) {
+                continue;
+            }
+            if ( child_poll(&requests[i].child) ) {
+                ++running;
+                continue;
+            }
+            finish_keyserver_request(&requests[i], key);
+            if ( (requests[i].result == GPG_IMPORTED) ||
+                 (requests[i].result == GPG_NOTINSTALLED) ) {
+                status = requests[i].result;
+            }
+        }
+        if ( (status == GPG_IMPORTED) || (status == GPG_NOTINSTALLED) ) {
+            break;
+        }
+    }
+
+    /* Stop the rest, noting the ones that took too long */
+    for ( i=0; i<count; ++i ) {
+        if ( requests[i].running ) {
+            child_kill(&requests[i].child);
+            requests[i].running = 0;
+            if ( ! cancelled && (status != GPG_IMPORTED) ) {
+                log(LOG_VERBOSE, _("Keyserver %s didn't answer\n"),
+                    requests[i].keyserver);
+                add_key_cache("*", requests[i].keyserver,
+                              time(NULL)+UNREACHABLE_EXPIRY);
+            }
+        }
+        free(requests[i].keyserver);
+    }
+    free(requests);
+    save_key_cache();
+
+    if ( cancelled ) {
+        return(GPG_CANCELLED);
+    }
+    switch (status) {
+        case GPG_NOPUBKEY:
+            update_message(LOG_VERBOSE, _("Key not found"), update, udata);
+            break;
+        case GPG_IMPORTED:
+            update_message(LOG_VERBOSE, _("Key downloaded"), update, udata);
+            break;
+        default:
+            break;
+    }
     return(status);
 }
+
+/* Get the ID of the key a signature was made with, from its issuer */
+int get_signature_keyid(const char *sigdata, int sigsize,
+                        char *keyid, int maxlen)
+{
+    unsigned char *packet;
+    const unsigned char *issuer;
+    const char *body;
+    char *text;
+    int len, pos, end, sublen, subtype;
+
+    /* Take the ASCII armor off, if there is any */
+    text = (char *)safe_malloc(sigsize+1);
+    memcpy(text, sigdata, sigsize);
+    text[sigsize] = '\0';
+    body = text;
+    if ( strstr(text, "-----BEGIN PGP") ) {
+        body = strstr(text, "\n\n");
+        if ( ! body ) {
+            body = strstr(text, "\r\n\r\n");
+        }
+        if ( ! body ) {
+            free(text);
+            return(-1);
+        }
+    }
+    packet = (unsigned char *)safe_malloc(sigsize+1);
+    len = decode_base64(body, packet);
+    free(text);
+
+    /* Skip the packet header, old or new format */
+    issuer = NULL;
+    if ( (len < 2) || ! (packet[0] & 0x80) ) {
+        len = 0;
+    }
+    pos = 0;
+    if ( len && (packet[0] & 0x40) ) {
+        pos = 2;
+        if ( packet[1] >= 192 ) {
+            pos = (packet[1] == 255) ? 6 : 3;
+        }
+    } else
+    if ( len ) {
+        pos = 1 + (1 << (packet[0] & 0x03));
+    }
+
+    /* Version 3 signatures have the key ID in a fixed place */
+    if ( (pos + 15) <= len && (packet[pos] == 3) ) {
+        issuer = &packet[pos+7];
+    } else
+    if ( (pos + 6) <= len && (packet[pos] == 4) ) {
+        /* Look for an issuer in the hashed, then unhashed subpackets */
+        pos += 4;
+        while ( ! issuer && ((pos + 2) <= len) ) {
+            end = pos + 2 + ((packet[pos] << 8) | packet[pos+1]);
+            pos += 2;
+            if ( end > len ) {
+                break;
+            }
+            while ( pos < end ) {
+                sublen = packet[pos++];
+                if ( sublen >= 192 && sublen < 255 ) {
+                    sublen = ((sublen - 192) << 8) + packet[pos++] + 192;
+                } else
+                if ( sublen == 255 ) {
+                    sublen = (packet[pos] << 24) | (packet[pos+1] << 16) |
+                             (packet[pos+2] << 8) | packet[pos+3];
+                    pos += 4;
+                }
+                if ( (sublen < 1) || ((pos + sublen) > end) ) {
+                    break;
+                }
+                subtype = packet[pos] & 0x7F;
+                if ( (subtype == 16) && (sublen == 9) ) {
+                    issuer = &packet[pos+1];
+                } else
+                if ( (subtype == 33) && (sublen == 22) ) {
+                    /* The key ID is the end of the fingerprint */
+                    issuer = &packet[pos+14];
+                }
+                pos += sublen;
+            }
+            pos = end;
+        }
+    }
+    if ( ! issuer || (maxlen < 17) ) {
+        free(packet);
+        return(-1);
+    }
+    for ( pos=0; pos<8; ++pos ) {
+        sprintf(&keyid[pos*2], "%.2X", issuer[pos]);
+    }
+    free(packet);
+    return(0);
+}
+
+/* Parse the keys GPG lists, crossing them off the list of wanted keys */
+static void parse_list_output(child_process *child, char *line, void *data)
+{
+    char **keys = (char **)data;
+    char *field;
+    int i;
+
+    if ( (strncmp(line, "pub:", 4) != 0) && (strncmp(line, "sub:", 4) != 0) ) {
+        return;
+    }
+    /* The key ID is the fifth field */
+    field = line;
+    for ( i=0; field && (i<4); ++i ) {
+        field = strchr(field, ':');
+        if ( field ) {
+            ++field;
+        }
+    }
+    if ( ! field ) {
+        return;
+    }
+    for ( i=0; keys[i]; ++i ) {
+        if ( *keys[i] && (strncasecmp(field, keys[i], strlen(keys[i])) == 0) ) {
+            *keys[i] = '\0';
+        }
+    }
+}
+
+void prefetch_publickeys(char *keys[], int count)
+{
+    char **args;
+    char **missing;
+    child_process child;
+    pid_t pid;
+    int i, argc;
+
+    if ( count == 0 ) {
+        return;
+    }
+
+    /* See which keys aren't on the keyring already */
+    missing = (char **)safe_malloc((count+1)*(sizeof *missing));
+    args = (char **)safe_malloc((count+8)*(sizeof *args));
+    argc = 0;
+    args[argc++] = GPG;
+    args[argc++] = "--batch";
+    args[argc++] = "--with-colons";
+    args[argc++] = "--list-keys";
+    for ( i=0; i<count; ++i ) {
+        missing[i] = safe_strdup(keys[i]);
+        args[argc++] = missing[i];
+    }
+    missing[count] = NULL;
+    args[argc] = NULL;
+    if ( (child_start(&child, args, CHILD_STDOUT, NULL, 0,
+                      parse_list_output, missing, NULL, NULL) < 0) ||
+         (WIFEXITED(child_wait(&child, NULL, NULL)) &&
+          (WEXITSTATUS(child.status) == 127)) ) {
+        /* GPG isn't installed, so there's no point */
+        for ( i=0; i<count; ++i ) {
+            *missing[i] = '\0';
+        }
+    }
+    free(args);
+
+    /* Download the missing ones in the background, in a process of its
+       own so nobody has to wait for it to finish.
+     */
+    for ( i=0; (i<count) && ! *missing[i]; ++i ) {
+        continue;
+    }
+    if ( i < count ) {
+        fflush(stdout);
+        pid = fork();
+        if ( pid == 0 ) {
+            if ( fork() == 0 ) {
+                /* Don't touch the parent's event loop while it's running */
+                event_loop_after_fork();
+
+                /* Keep quiet, the user is busy with other things */
+                if ( get_logging() < LOG_WARNING ) {
+                    set_logging(LOG_WARNING);
+                }
+                for ( i=0; i<count; ++i ) {
+                    if ( *missing[i] ) {
+                        get_publickey(missing[i], NULL, NULL);
+                    }
+                }
+            }
+            _exit(0);
+        }
+        if ( pid > 0 ) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    for ( i=0; i<count; ++i ) {
+        free(missing[i]);
+    }
+    free(missing);
+}
@@ -21,6 +21,9 @@
 
 /* Verify that a file is not corrupt, and is signed correctly */
 
+#ifndef _gpg_verify_h
+#define _gpg_verify_h
+
 #include "update.h"
 
 #define CHECKSUM_SIZE   32
@@ -45,5 +48,46 @@ typedef enum {
 extern gpg_result gpg_verify(const char *file, char *sig, int maxsig,
                              update_callback update, void *udata);
 
-/* Get the given public key */
+/* Verify a file against a detached signature held in memory */
+extern gpg_result gpg_verify_data(const char *file,
+                                  const char *sigdata, int sigsize,
+                                  char *sig, int maxsig,
+                                  update_callback update, void *udata);
+
+/* A file to be verified with gpg_verify_batch() */
+typedef struct {
+    const char *file;
+    const char *sigfile;        /* Its detached signature */
+    gpg_result result;
+    char sig[1024];             /* As returned by gpg_verify() */
+} gpg_batch_file;
+
+/* Files up to this size in K are verified in batches */
+#define GPG_BATCH_MAX_SIZE      1024
+
+/* Verify several files against their detached signatures with a single
+   run of GPG, so it only has to start up and load the keyrings once.
+   The result for each file is filled in as gpg_verify() would return it.
+ */
+extern void gpg_verify_batch(gpg_batch_file *files, int count,
+                             update_callback update, void *udata);
+
+/* Get the given public key, asking all the keyservers in "keyservers.txt"
+   at once and taking it from the first one that has it.  Keyservers that
+   didn't have a key, or didn't answer at all, aren't asked again for a
+   while, which is remembered in "keyserver_cache.txt".
+ */
 int get_publickey(const char *key, update_callback update, void *udata);
+
+/* Get the ID of the key a signature was made with, as 16 hex digits.
+   Returns 0, or -1 if the signature couldn't be read.
+ */
+extern int get_signature_keyid(const char *sigdata, int sigsize,
+                               char *keyid, int maxlen);
+
+/* Start downloading any of the given keys that aren't on the keyring yet,
+   in the background, so they are there by the time they're needed.
+ */
+extern void prefetch_publickeys(char *keys[], int count);
+
+#endif /* _gpg_verify_h */
@@ -20,6 +20,7 @@
 */
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,8 +38,12 @@
 #include "load_patchset.h"
 #include "url_paths.h"
 #include "get_url.h"
-#include "md5.h"
+#include "multi_get.h"
+#include "mirror_race.h"
 #include "gpg_verify.h"
+#include "artifact_cache.h"
+#include "apply_queue.h"
+#include "schedule.h"
 #include "update.h"
 #include "log_output.h"
 #include "safe_malloc.h"
@@ -57,7 +62,10 @@ static patchset *update_patchset;
 static version_node *update_root;
 static patch_path *update_path;
 static patch *update_patch;
-static char readme_file[PATH_MAX];
+static char *readme_data = NULL;
+static int readme_size = 0;
+static url_download readme_download = { -1, -1, NULL, 0 };
+static gboolean have_readme = FALSE;
 static char update_url[PATH_MAX];
 
 /* The different notebook pages for the loki_update UI */
@@ -77,6 +85,7 @@ static enum {
 	FULLY_INTERACTIVE
 } interactive = FULLY_INTERACTIVE;
 static patchset *product_patchset = NULL;
+static update_session *session = NULL;
 static int update_proceeding = 0;
 static int download_pending = 0;
 static int switch_mirror = 0;
@@ -93,10 +102,16 @@ struct download_update_info
 };
 #define MAX_RATE_CHANGE 50.0f
 
+/* Updates being applied while the next ones download (automatic mode) */
+static apply_queue *update_queue = NULL;
+static struct download_update_info apply_info;
+static int polling_queue = 0;
+
 /* Forward declarations for the meat of the operation */
 void download_update_slot( GtkWidget* w, gpointer data );
 void perform_update_slot( GtkWidget* w, gpointer data );
 void action_button_slot( GtkWidget* w, gpointer data );
+static void cleanup_update(const char *status_msg, int update_obsolete);
 
 /* Extra GTk utility functions */
 
@@ -200,15 +215,30 @@ static void remove_readme(void)
 {
     GtkWidget *widget;
 
-    if ( readme_file[0] ) {
-        unlink(readme_file);
-        readme_file[0] = '\0';
+    get_url_abort(&readme_download);
+    if ( readme_data ) {
+        free(readme_data);
+        readme_data = NULL;
     }
     widget = glade_xml_get_widget(update_glade, "update_readme_button");
     if ( widget ) {
         gtk_button_set_sensitive(widget, FALSE);
     }
 }
+/* See if the README being fetched alongside the update has arrived */
+static void check_readme(void)
+{
+    GtkWidget *widget;
+
+    if ( get_url_poll(&readme_download, &readme_data, &readme_size) == 0 ) {
+        widget = glade_xml_get_widget(update_glade, "update_readme_button");
+        if ( widget ) {
+            gtk_button_set_sensitive(widget, TRUE);
+        }
+        have_readme = TRUE;
+    }
+}
+
 static void remove_update(void)
 {
     if ( update_url[0] ) {
@@ -462,24 +492,12 @@ static void update_balls(int which, int status)
     }
 }
 
-static gboolean load_file( GtkText *widget, GdkFont *font, const char *file )
+static void load_text( GtkText *widget, GdkFont *font, const char *text,
+                       int size )
 {
-    FILE *fp;
-    int pos;
-    
     gtk_editable_delete_text(GTK_EDITABLE(widget), 0, -1);
-    fp = fopen(file, "r");
-    if ( fp ) {
-        char line[BUFSIZ];
-        pos = 0;
-        while ( fgets(line, BUFSIZ-1, fp) ) {
-            gtk_text_insert(widget, font, NULL, NULL, line, strlen(line));
-        }
-        fclose(fp);
-    }
+    gtk_text_insert(widget, font, NULL, NULL, text, size);
     gtk_editable_set_position(GTK_EDITABLE(widget), 0);
-
-    return (fp != NULL);
 }
 
 void view_readme_slot( GtkWidget* w, gpointer data )
@@ -491,9 +509,9 @@ void view_readme_slot( GtkWidget* w, gpointer data )
     glade_xml_signal_autoconnect(readme_glade);
     readme = glade_xml_get_widget(readme_glade, "readme_dialog");
     widget = glade_xml_get_widget(readme_glade, "readme_area");
-    if ( readme_file[0] && readme && widget ) {
+    if ( readme_data && readme && widget ) {
         gtk_widget_hide(readme);
-        load_file(GTK_TEXT(widget), NULL, readme_file);
+        load_text(GTK_TEXT(widget), NULL, readme_data, readme_size);
         gtk_widget_show(readme);
         widget = glade_xml_get_widget(update_glade, "update_readme_button");
         gtk_button_set_sensitive(widget, FALSE);
@@ -565,7 +583,7 @@ static void open_save_details(void)
         char path[PATH_MAX];
 
         /* Set the initial working directory and show the dialog */
-        sprintf(path, "%s/", get_working_path());
+        sprintf(path, "%s/", get_working_path(session));
         gtk_file_selection_set_filename(GTK_FILE_SELECTION(widget), path);
         gtk_widget_show(widget);
 
@@ -775,6 +793,9 @@ static void fill_mirrors_list(urlset *mirrors)
             /* Create a pixmap status icon */
             if ( entry->status == URL_OK ) {
                 widget = gtk_pixmap_new(balls[1].pixmap, balls[1].bitmap);
+            } else
+            if ( entry->status == URL_SLOW ) {
+                widget = gtk_pixmap_new(balls[3].pixmap, balls[3].bitmap);
             } else {
                 widget = gtk_pixmap_new(balls[4].pixmap, balls[4].bitmap);
             }
@@ -788,7 +809,7 @@ static void fill_mirrors_list(urlset *mirrors)
             if ( entry == mirrors->current ) {
                 gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(widget), TRUE);
             }
-            if ( entry->status == URL_OK ) {
+            if ( (entry->status == URL_OK) || (entry->status == URL_SLOW) ) {
                 gtk_widget_set_sensitive(GTK_WIDGET(widget), TRUE);
             } else {
                 gtk_widget_set_sensitive(GTK_WIDGET(widget), FALSE);
@@ -838,6 +859,25 @@ static void failed_current_mirror(urlset *mirrors)
     set_url_status(mirrors, URL_FAILED);
 }
 
+static void slow_current_mirror(urlset *mirrors)
+{
+    GtkWidget *hbox;
+    GList *list;
+
+    /* A mirror that is too slow twice is marked failed */
+    set_url_status(mirrors, URL_SLOW);
+    if ( mirrors->current->status != URL_SLOW ) {
+        failed_current_mirror(mirrors);
+        return;
+    }
+    hbox = (GtkWidget *)mirrors->current->data;
+    if ( hbox ) {
+        list = gtk_container_children(GTK_CONTAINER(hbox));
+        gtk_pixmap_set(GTK_PIXMAP(list->data),
+                       balls[3].pixmap, balls[3].bitmap);
+    }
+}
+
 void show_mirrors_slot( GtkWidget* w, gpointer data )
 {
     GtkWidget *widget;
@@ -890,6 +930,10 @@ void choose_mirror_slot( GtkWidget* w, gpointer data )
             list = gtk_container_children(GTK_CONTAINER(hbox));
             list = list->next;
             if ( gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(list->data)) ) {
+                /* The user may want to give a slow mirror another try */
+                if ( entry->status == URL_SLOW ) {
+                    entry->status = URL_OK;
+                }
                 switch_mirror = 1;
                 mirrors->current = prev;
                 break;
@@ -990,6 +1034,16 @@ static int download_update(int status_level, const char *status,
 {
     struct download_update_info *info = (struct download_update_info *)udata;
 
+    /* Enable the README button as soon as it's available */
+    check_readme();
+
+    /* Keep any updates being applied in the background going */
+    if ( update_queue && ! polling_queue ) {
+        polling_queue = 1;
+        poll_apply_queue(update_queue);
+        polling_queue = 0;
+    }
+
     /* First show any status updates */
     if ( status ) {
         if ( status_level == LOG_STATUS ) {
@@ -1052,7 +1106,9 @@ static int download_update(int status_level, const char *status,
     return(download_cancelled || switch_mirror);
 }
 
-static gpg_result do_gpg_verify(const char *file, char *sig, int maxsig)
+static gpg_result do_gpg_verify(const char *file,
+                                const char *sigdata, int sigsize,
+                                char *sig, int maxsig)
 {
     gpg_result gpg_code;
     struct download_update_info info;
@@ -1065,12 +1121,14 @@ static gpg_result do_gpg_verify(const char *file, char *sig, int maxsig)
         gtk_main_iteration();
     }
     set_download_info(&info, status, NULL, NULL, NULL);
-    gpg_code = gpg_verify(file, sig, maxsig, download_update, &info);
+    gpg_code = gpg_verify_data(file, sigdata, sigsize, sig, maxsig,
+                               download_update, &info);
     if ( gpg_code == GPG_NOPUBKEY ) {
         verify = glade_xml_get_widget(update_glade, "verify_status_label");
         set_status_message(verify, _("Downloading public key"));
         get_publickey(sig, download_update, &info);
-        gpg_code = gpg_verify(file, sig, maxsig, download_update, &info);
+        gpg_code = gpg_verify_data(file, sigdata, sigsize, sig, maxsig,
+                                   download_update, &info);
     }
     return gpg_code;
 }
@@ -1176,11 +1234,76 @@ static patch *skip_to_selected_update(void)
     return(update_patch);
 }
 
+/* Called as each update applied in the background finishes */
+static void applied_update(patch *patch, const char *file,
+                           int status, void *data)
+{
+    GtkWidget *label;
+
+    select_node(patch->node, 0);
+    if ( status == 0 ) {
+        ++update_status;
+        unlink(file);
+        set_status_message(NULL, _("Update complete"));
+        update_balls(3, 2);
+    } else {
+        update_status = -1;
+        label = glade_xml_get_widget(update_glade, "update_status_label");
+        set_status_message(label, _("Update failed"));
+        update_balls(3, 4);
+        start_flash(1, 3);
+    }
+}
+
+/* Wait for the updates being applied in the background, until there's
+   room for another one, or if 'drain' is set, until they're all done.
+   Returns 0, or -1 if one of the updates failed.
+ */
+static int wait_for_update_queue(int drain)
+{
+    struct timeval tv;
+    int status;
+
+    while ( poll_apply_queue(update_queue) &&
+            (drain || apply_queue_full(update_queue)) ) {
+        download_update(0, NULL, 0.0f, 0, 0, 0.0f, &apply_info);
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+    status = update_queue->failed ? -1 : 0;
+    if ( drain ) {
+        free_apply_queue(update_queue);
+        update_queue = NULL;
+    }
+    return(status);
+}
+
+/* Apply the current update in the background, so the next one can be
+   downloaded and verified while it runs.
+ */
+static void queue_current_update(void)
+{
+    if ( ! update_queue ) {
+        set_download_info(&apply_info, NULL,
+            glade_xml_get_widget(update_glade, "update_patch_progress"),
+            NULL, NULL);
+        update_queue = create_apply_queue(download_update, &apply_info,
+                                          applied_update, NULL);
+    }
+    queue_update(update_queue, update_patch, update_url,
+                 get_handle_root(update_patchset->product));
+    update_url[0] = '\0';
+    wait_for_update_queue(0);
+    cleanup_update(_("Update complete"), 1);
+}
+
 static void cleanup_update(const char *status_msg, int update_obsolete)
 {
     GtkWidget *status;
     GtkWidget *action;
     GtkWidget *cancel;
+    int more;
 
     /* Remove the update patch file */
     close_readme_slot(NULL, NULL);
@@ -1192,11 +1315,22 @@ static void cleanup_update(const char *status_msg, int update_obsolete)
 
     /* Deselect the current patch path */
     select_node(update_patch->node, 0);
+    more = ((update_status >= 0) && skip_to_selected_update());
+
+    /* The updates already downloaded finish before we stop */
+    if ( update_queue && (! more || ! status_msg) ) {
+        status = glade_xml_get_widget(update_glade, "update_status_label");
+        set_status_message(status, _("Performing update"));
+        if ( (wait_for_update_queue(1) < 0) && status_msg ) {
+            status_msg = _("Update failed");
+        }
+        more = 0;
+    }
 
     /* We succeeded, enable the action button, and update the status */
     action = glade_xml_get_widget(update_glade, "update_action_button");
     cancel = glade_xml_get_widget(update_glade, "update_cancel_button");
-    if ( (update_status >= 0) && skip_to_selected_update() ) {
+    if ( more ) {
         if ( cancel ) {
             gtk_button_set_sensitive(cancel, TRUE);
         }
@@ -1261,6 +1395,101 @@ void cancel_button_slot(GtkWidget* w, gpointer data)
     }
 }
 
+/* Count the products with updates selected */
+static int selected_products(void)
+{
+    patchset *patchset;
+    version_node *root;
+    const char *roots[MAX_PRODUCT_ROOTS];
+    int count;
+
+    /* Each install path of a product counts, since they're all updated */
+    count = 0;
+    for ( patchset = product_patchset; patchset; patchset = patchset->next ) {
+        for ( root = patchset->root; root; root = root->sibling ) {
+            if ( root->selected ) {
+                count += get_product_roots(session, patchset->product_name,
+                                           roots, MAX_PRODUCT_ROOTS);
+                break;
+            }
+        }
+    }
+    return(count);
+}
+
+/* Download the updates for all the selected products at once */
+static void schedule_selected_updates(void)
+{
+    struct download_update_info info;
+    GtkWidget *notebook;
+    GtkWidget *widget;
+    GtkWidget *status;
+    GtkWidget *action;
+    GtkWidget *cancel;
+    GtkWidget *progress;
+
+    /* Set the current page to the product update page */
+    notebook = glade_xml_get_widget(update_glade, "update_notebook");
+    gtk_notebook_set_page(GTK_NOTEBOOK(notebook), UPDATE_PAGE);
+    status = glade_xml_get_widget(update_glade, "update_status_label");
+    action = glade_xml_get_widget(update_glade, "update_action_button");
+    cancel = glade_xml_get_widget(update_glade, "update_cancel_button");
+    gtk_button_set_text(GTK_BUTTON(action), _("Update"));
+    gtk_button_set_sensitive(action, FALSE);
+    if ( cancel ) {
+        gtk_button_set_sensitive(cancel, TRUE);
+    }
+    widget = glade_xml_get_widget(update_glade, "update_name_label");
+    add_details_text(LOG_VERBOSE, "\n");
+    set_status_message(widget, _("Updating all selected products"));
+    widget = glade_xml_get_widget(update_glade, "update_size_label");
+    if ( widget ) {
+        gtk_label_set_text(GTK_LABEL(widget), "");
+    }
+    mirror_buttons_sensitive(FALSE);
+    update_balls(-1, 0);
+    update_arrows(1, 1);
+    update_balls(1, 1);
+
+    /* Run the downloads and updates, showing the overall progress */
+    widget = glade_xml_get_widget(update_glade, "update_download_label");
+    if ( widget ) {
+        gtk_label_set_text(GTK_LABEL(widget), _("Downloading updates"));
+    }
+    progress = glade_xml_get_widget(update_glade, "update_download_progress");
+    if ( progress ) {
+        gtk_progress_set_percentage(GTK_PROGRESS(progress), 0.0);
+        gtk_progress_set_show_text(GTK_PROGRESS(progress), FALSE);
+    }
+    set_download_info(&info, status, progress,
+        glade_xml_get_widget(update_glade, "update_rate_label"),
+        glade_xml_get_widget(update_glade, "update_eta_label"));
+    download_pending = 1;
+    if ( schedule_updates(product_patchset, applied_update, NULL,
+                          download_update, &info) < 0 ) {
+        update_status = -1;
+    }
+    download_pending = 0;
+    update_proceeding = 0;
+
+    /* We're done, the action button finishes up */
+    if ( cancel ) {
+        gtk_button_set_sensitive(cancel, FALSE);
+    }
+    gtk_button_set_text(GTK_BUTTON(action), _("Finished"));
+    gtk_button_set_sensitive(action, TRUE);
+    if ( update_status < 0 ) {
+        update_balls(1, 4);
+        start_flash(1, 3);
+        set_status_message(status, download_cancelled ?
+                           _("Download cancelled") : _("Update failed"));
+    } else {
+        update_balls(1, 2);
+        start_flash(1, 1);
+        set_status_message(status, _("Update complete"));
+    }
+}
+
 void download_update_slot( GtkWidget* w, gpointer data )
 {
     struct download_update_info info;
@@ -1276,12 +1505,24 @@ void download_update_slot( GtkWidget* w, gpointer data )
     char text[1024];
     const char *url;
     char sig[1024];
-    char sum_file[PATH_MAX];
-    char md5_real[CHECKSUM_SIZE+1];
-    char md5_calc[CHECKSUM_SIZE+1];
-    FILE *fp;
-    gboolean have_readme;
+    char sum_url[PATH_MAX];
+    digest_sums sums;
+    char *data;
+    int size;
+    url_download sig_download = { -1, -1, NULL, 0 };
+    url_download sum_download = { -1, -1, NULL, 0 };
+    url_download sha_download = { -1, -1, NULL, 0 };
+    block_sums *blocks;
+    int segmented, checked, blocks_tried, downloaded;
     verify_result verified;
+    gpg_result gpg_code;
+
+    /* Unless the user is confirming each update, the updates for several
+       products are all downloaded at once */
+    if ( (interactive != FULLY_INTERACTIVE) && (selected_products() > 1) ) {
+        schedule_selected_updates();
+        return;
+    }
 
     /* Verify that we have an update to perform */
     patch = skip_to_selected_update();
@@ -1307,7 +1548,7 @@ void download_update_slot( GtkWidget* w, gpointer data )
     widget = glade_xml_get_widget(update_glade, "update_name_label");
     add_details_text(LOG_VERBOSE, "\n");
     snprintf(text, (sizeof text), "%s: %s",
-             get_product_description(patch->patchset->product_name),
+             get_handle_description(patch->patchset->product),
              patch->description);
     set_status_message(widget, text);
 
@@ -1318,16 +1559,44 @@ void download_update_slot( GtkWidget* w, gpointer data )
         gtk_label_set_text(GTK_LABEL(widget), text);
     }
 
+    /* Large updates are first tried from several mirrors at once */
+    segmented = (get_segmented_download() && (patch->size >= SEGMENT_THRESHOLD));
+    blocks = NULL;
+    blocks_tried = 0;
+
     /* Download the update from the server */
     update_arrows(1, 1);
     have_readme = FALSE;
+    remove_readme();
     verified = DOWNLOAD_FAILED;
+    gpg_code = GPG_NOTINSTALLED;
     download_pending = 1;
     randomize_urls(patch->patchset->mirrors);
     fill_mirrors_list(patch->patchset->mirrors);
-    do {
-        /* Grab the next URL to try */
-        url = get_next_url(patch->patchset->mirrors, patch->file);
+    set_download_info(&info, status, NULL, NULL, NULL);
+
+    /* Use a copy of the update verified earlier, if there is one */
+    if ( (get_url_path(patch->file, update_url, sizeof(update_url),
+                       download_update, &info) == 0) &&
+         find_artifact(patch->file, patch->sha256, patch->md5,
+                       patch->patchset->mirrors, update_url,
+                       &verified, sig, sizeof(sig), download_update, &info) ) {
+        set_status_message(status, _("Update was already downloaded"));
+        if ( verified == VERIFY_OK ) {
+            enable_gpg_details(update_url, sig);
+        }
+    }
+    while ( ((verified == DOWNLOAD_FAILED) || (verified == VERIFY_FAILED)) &&
+            !download_cancelled ) {
+        /* Grab the next URL to try, connecting to a few at once to find
+           one that answers, unless they'll all be used anyway or the
+           user picked the next mirror */
+        if ( segmented || switch_mirror ) {
+            url = get_next_url(patch->patchset->mirrors, patch->file);
+        } else {
+            url = race_next_url(patch->patchset->mirrors, patch->file,
+                                download_update, &info);
+        }
         if ( ! url ) {
             break;
         }
@@ -1382,29 +1651,25 @@ void download_update_slot( GtkWidget* w, gpointer data )
             mirror_buttons_sensitive(FALSE);
         }
 
-        /* Download the README and enable the button if we have a README */
-        if ( ! have_readme && (interactive != FULLY_AUTOMATIC) ) {
-            set_status_message(status, _("Downloading README"));
-            widget = glade_xml_get_widget(update_glade,"update_download_label");
-            if ( widget ) {
-                gtk_label_set_text(GTK_LABEL(widget), _("Downloading README"));
-            }
-            sprintf(readme_file, "%s.txt", url);
-            set_download_info(&info, status, NULL, NULL, NULL);
-            if ( get_url(readme_file, readme_file, sizeof(readme_file),
-                         download_update, &info) == 0 ) {
-                widget = glade_xml_get_widget(update_glade, "update_readme_button");
-                if ( widget ) {
-                    gtk_button_set_sensitive(widget, TRUE);
-                }
-                have_readme = TRUE;
-            } else {
-                if ( switch_mirror ) {
-                    continue;
-                }
-            }
+        /* Fetch the README, signature and checksum with the update,
+           unless the update list already has the signature and checksum */
+        if ( ! have_readme && (readme_download.child <= 0) &&
+             (interactive != FULLY_AUTOMATIC) ) {
+            sprintf(sum_url, "%s.txt", url);
+            get_url_start(sum_url, MAX_TEXT_DOWNLOAD, &readme_download,
+                          NULL, NULL);
         }
-    
+        if ( ! patch->signature ) {
+            sprintf(sum_url, "%s.sig", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sig_download, NULL, NULL);
+        }
+        if ( ! patch->sha256 && ! patch->md5 ) {
+            sprintf(sum_url, "%s.md5", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sum_download, NULL, NULL);
+            sprintf(sum_url, "%s.sha256", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sha_download, NULL, NULL);
+        }
+
         /* Download the update */
         update_balls(1, 1);
         set_status_message(status, _("Downloading update"));
@@ -1418,10 +1683,43 @@ void download_update_slot( GtkWidget* w, gpointer data )
         set_download_info(&info, status, progress,
             glade_xml_get_widget(update_glade, "update_rate_label"),
             glade_xml_get_widget(update_glade, "update_eta_label"));
-        if ( get_url(update_url, update_url, sizeof(update_url),
-                      download_update, &info) != 0 ) {
-            /* Switch to the next available mirror */
-            if ( switch_mirror ) {
+
+        /* Get the list of block checksums the first time through, so
+           a corrupt mirror can be caught while the update downloads */
+        if ( ! blocks_tried && (patch->size >= BLOCK_SUMS_THRESHOLD) ) {
+            blocks = get_block_sums(url, download_update, &info);
+            blocks_tried = 1;
+        }
+        if ( segmented ) {
+            /* If this fails, fall back to one mirror at a time */
+            segmented = 0;
+            if ( get_url_segmented(patch->patchset->mirrors, patch->file,
+                                   update_url, sizeof(update_url), &sums,
+                                   blocks,
+                                   download_update, &info) != 0 ) {
+                get_url_abort(&sig_download);
+                get_url_abort(&sum_download);
+                get_url_abort(&sha_download);
+                fill_mirrors_list(patch->patchset->mirrors);
+                continue;
+            }
+            mirror_buttons_sensitive(FALSE);
+            update_balls(1, 2);
+            verified = VERIFY_UNKNOWN;
+        } else
+        if ( (downloaded = get_url_checked(update_url, update_url,
+                                           sizeof(update_url), &sums, blocks,
+                                           download_update, &info)) != 0 ) {
+            /* Switch to the next available mirror, which picks up the
+               download where this one left off.  Mirrors that were too
+               slow are only tried again after the others. */
+            if ( switch_mirror || (downloaded == -2) ) {
+                if ( downloaded == -2 ) {
+                    slow_current_mirror(patch->patchset->mirrors);
+                }
+                get_url_abort(&sig_download);
+                get_url_abort(&sum_download);
+                get_url_abort(&sha_download);
                 continue;
             }
 
@@ -1442,11 +1740,20 @@ void download_update_slot( GtkWidget* w, gpointer data )
         /* First check the GPG signature */
         if ( verified == VERIFY_UNKNOWN ) {
             set_status_message(verify, _("Verifying GPG signature"));
-            sprintf(sum_file, "%s.sig", url);
             set_download_info(&info, status, NULL, NULL, NULL);
-            if ( get_url(sum_file, sum_file, sizeof(sum_file),
-                         download_update, &info) == 0 ) {
-                switch (do_gpg_verify(sum_file, sig, sizeof(sig))) {
+            if ( patch->signature ) {
+                data = safe_strdup(patch->signature);
+                size = strlen(data);
+            } else
+            if ( get_url_finish(&sig_download, &data, &size,
+                                download_update, &info) != 0 ) {
+                data = NULL;
+            }
+            gpg_code = GPG_NOTINSTALLED;
+            if ( data ) {
+                gpg_code = do_gpg_verify(update_url, data, size,
+                                         sig, sizeof(sig));
+                switch (gpg_code) {
                     case GPG_NOTINSTALLED:
                         set_status_message(gpg_status,
                                            _("GPG not installed"));
@@ -1474,47 +1781,61 @@ void download_update_slot( GtkWidget* w, gpointer data )
                     case GPG_VERIFYOK:
                         set_status_message(gpg_status,
                                            _("GPG verify succeeded"));
+                        store_artifact(url, patch->file, update_url, &sums,
+                                       VERIFY_OK, gpg_code, sig);
                         enable_gpg_details(update_url, sig);
                         verified = VERIFY_OK;
                         break;
                 }
+                free(data);
             } else {
                 set_status_message(gpg_status,
                                    _("GPG signature not available"));
             }
-            unlink(sum_file);
+        } else {
+            get_url_abort(&sig_download);
         }
-        /* Now download the MD5 checksum file */
+        /* Now check the checksum from the update list or checksum file,
+           using SHA-256 if there is one */
         if ( verified == VERIFY_UNKNOWN ) {
-            set_status_message(verify, _("Verifying MD5 checksum"));
-            sprintf(sum_file, "%s.md5", url);
+            set_status_message(verify, _("Verifying checksum"));
             set_download_info(&info, status, NULL, NULL, NULL);
-            if ( get_url(sum_file, sum_file, sizeof(sum_file),
-                         download_update, &info) == 0 ) {
-                fp = fopen(sum_file, "r");
-                if ( fp ) {
-                    if ( fgets(md5_calc, sizeof(md5_calc), fp) ) {
-                        set_status_message(status,
-                                _("Calculating MD5 checksum"));
-                        while( gtk_events_pending() ) {
-                            gtk_main_iteration();
-                        }
-                        md5_compute(update_url, md5_real, 0);
-                        if ( strcmp(md5_calc, md5_real) != 0 ) {
-                            failed_current_mirror(patch->patchset->mirrors);
-                            verified = VERIFY_FAILED;
-                        }
-                    }
-                    fclose(fp);
-                }
+            if ( patch->sha256 ) {
+                checked = digest_check(patch->sha256, sums.sha256);
+            } else
+            if ( patch->md5 ) {
+                checked = digest_check(patch->md5, sums.md5);
+            } else
+            if ( get_url_finish(&sha_download, &data, &size,
+                                download_update, &info) == 0 ) {
+                get_url_abort(&sum_download);
+                checked = digest_check(data, sums.sha256);
+                free(data);
+            } else
+            if ( get_url_finish(&sum_download, &data, &size,
+                                download_update, &info) == 0 ) {
+                checked = digest_check(data, sums.md5);
+                free(data);
             } else {
-                set_status_message(verify, _("MD5 checksum not available"));
+                set_status_message(verify, _("Checksum not available"));
+                checked = -1;
             }
-            unlink(sum_file);
+            if ( checked == 0 ) {
+                failed_current_mirror(patch->patchset->mirrors);
+                verified = VERIFY_FAILED;
+            } else
+            if ( checked > 0 ) {
+                store_artifact(url, patch->file, update_url, &sums,
+                               VERIFY_UNKNOWN, gpg_code, NULL);
+            }
+        } else {
+            get_url_abort(&sum_download);
+            get_url_abort(&sha_download);
         }
-    } while ( ((verified == DOWNLOAD_FAILED) || (verified == VERIFY_FAILED)) &&
-              !download_cancelled );
+    }
+    free_block_sums(blocks);
     download_pending = 0;
+    check_readme();
     mirror_buttons_sensitive(FALSE);
 
     /* We either ran out of update URLs or we downloaded a valid update */
@@ -1573,9 +1894,21 @@ void perform_update_slot( GtkWidget* w, gpointer data )
         gtk_button_set_sensitive(cancel, FALSE);
     }
     progress = glade_xml_get_widget(update_glade, "update_patch_progress");
+
+    /* Unless the user is confirming each update, apply it in the background */
+    if ( interactive != FULLY_INTERACTIVE ) {
+        queue_current_update();
+        return;
+    }
+
+    /* Any updates still being applied in the background go first */
+    if ( update_queue && (wait_for_update_queue(1) < 0) ) {
+        cleanup_update(_("Update failed"), 0);
+        return;
+    }
     set_download_info(&info, status, progress, NULL, NULL);
     if ( perform_update(update_url,
-                        get_product_root(update_patchset->product_name),
+                        get_handle_root(update_patchset->product),
                         download_update, &info) != 0 ) {
         update_balls(3, 4);
         update_status = -1;
@@ -1689,9 +2022,12 @@ void choose_update_slot( GtkWidget* w, gpointer data )
     GtkWidget *vbox;
     GtkWidget *button;
     GtkWidget *progress;
-    patchset *patchset;
+    patchset *patchset, *loaded, *last, *next;
     const char *product_name;
+    const char *list_url;
     char text[1024];
+    char *data;
+    int size;
     version_node *node, *root, *trunk;
     int selected;
 
@@ -1716,15 +2052,16 @@ void choose_update_slot( GtkWidget* w, gpointer data )
     add_details_text(LOG_VERBOSE, "\n");
     set_status_message(status, _("Listing product updates"));
 
-    /* Build the list of updates for all selected products */
-    selected = 0;
+    /* Get the list of updates for all selected products */
+    loaded = NULL;
+    last = NULL;
     while ( (product_name = selected_product()) != NULL ) {
 
         /* Deselect the product so it isn't caught the next time through */
         deselect_product();
 
         /* Create a patchset for this product */
-        patchset = create_patchset(product_name);
+        patchset = create_patchset(session, product_name);
         if ( ! patchset ) {
             log(LOG_WARNING, "Unable to open product '%s'\n", product_name);
         }
@@ -1732,7 +2069,8 @@ void choose_update_slot( GtkWidget* w, gpointer data )
         /* Reset the panel */
         add_details_text(LOG_VERBOSE, "\n");
         widget = glade_xml_get_widget(update_glade, "product_label");
-        set_status_message(widget, get_product_description(product_name));
+        set_status_message(widget,
+                           get_product_description(session, product_name));
         widget = glade_xml_get_widget(update_glade, "update_list_progress");
         if ( widget ) {
             gtk_progress_set_percentage(GTK_PROGRESS(widget), 0.0);
@@ -1761,15 +2099,14 @@ void choose_update_slot( GtkWidget* w, gpointer data )
         /* Download the patch list */
         update_arrows(0, 1);
         update_balls(0, 1);
-        strcpy(update_url, get_product_url(patchset->product_name));
+        list_url = get_product_url(session, patchset->product_name);
         progress = glade_xml_get_widget(update_glade, "update_list_progress");
-        set_progress_url(GTK_PROGRESS(progress), update_url);
+        set_progress_url(GTK_PROGRESS(progress), list_url);
         set_download_info(&info, status, progress,
             glade_xml_get_widget(update_glade, "list_rate_label"),
             glade_xml_get_widget(update_glade, "list_eta_label"));
-        if ( get_url(update_url, update_url, sizeof(update_url),
-                      download_update, &info) != 0 ) {
-            remove_update();
+        if ( get_url_data(list_url, &data, &size, MAX_TEXT_DOWNLOAD,
+                          download_update, &info) != 0 ) {
             update_balls(0, 4);
             /* Tell the user what happened, and wait before continuing */
             if ( download_cancelled ) {
@@ -1807,9 +2144,24 @@ void choose_update_slot( GtkWidget* w, gpointer data )
         }
     
         /* Turn the patch list into a set of patches */
-        load_patchset(patchset, update_url);
-        remove_update();
-    
+        read_patchset_data(patchset, data, size);
+        if ( last ) {
+            last->next = patchset;
+        } else {
+            loaded = patchset;
+        }
+        last = patchset;
+    }
+
+    /* Plan the updates for all of the products at once */
+    finish_patchsets(loaded);
+
+    /* Build the list of updates for all selected products */
+    selected = 0;
+    for ( patchset = loaded; patchset; patchset = next ) {
+        next = patchset->next;
+        patchset->next = NULL;
+
         /* If there are no patches, we're done with this product */
         if ( ! patchset->patches ) {
             free_patchset(patchset);
@@ -1818,8 +2170,8 @@ void choose_update_slot( GtkWidget* w, gpointer data )
     
         /* Add a frame and label for this product */
         snprintf(text, sizeof(text), "%s %s",
-                 get_product_description(product_name),
-                 get_product_version(product_name));
+                 get_product_description(session, patchset->product_name),
+                 get_product_version(session, patchset->product_name));
         frame = gtk_frame_new(text);
         gtk_container_set_border_width(GTK_CONTAINER(frame), 4);
         gtk_box_pack_start(GTK_BOX(update_vbox), frame, FALSE, TRUE, 0);
@@ -1944,7 +2296,7 @@ static int gtkui_detect(void)
     return (display && *display);
 }
 
-static int gtkui_init(int argc, char *argv[])
+static int gtkui_init(update_session *product_session, int argc, char *argv[])
 {
     GtkWidget *widget;
     GtkWidget *button;
@@ -1952,6 +2304,7 @@ static int gtkui_init(int argc, char *argv[])
     const char *product_name;
     const char *description;
 
+    session = product_session;
     gtk_init(&argc,&argv);
 
     /* Initialize Glade */
@@ -1973,10 +2326,10 @@ static int gtkui_init(int argc, char *argv[])
     /* Fill in the list of products */
     widget = glade_xml_get_widget(update_glade, "product_vbox");
     if ( widget ) {
-        for ( product_name=get_first_product();
+        for ( product_name=get_first_product(session);
               product_name;
-              product_name=get_next_product() ) {
-            description = get_product_description(product_name);
+              product_name=get_next_product(session) ) {
+            description = get_product_description(session, product_name);
             button = gtk_check_button_new_with_label(description);
             gtk_object_set_data(GTK_OBJECT(button), "data",
                                 (gpointer)product_name);
@@ -1987,7 +2340,7 @@ static int gtkui_init(int argc, char *argv[])
                 gtk_widget_show(button);
             }
         }
-        if ( get_num_products() == 0 ) {
+        if ( get_num_products(session) == 0 ) {
             label = gtk_label_new(
 _("No products found.\nAre you the one that installed the software?"));
             gtk_box_pack_start(GTK_BOX(widget), label, FALSE, TRUE, 0);
@@ -2035,7 +2388,7 @@ static int gtkui_perform_updates(const char *product)
     update_status = 0;
     interactive = load_interactive();
     if ( product ) {
-        if ( is_valid_product(product) ) {
+        if ( is_valid_product(session, product) ) {
             select_product(product);
             one_product = 1;
             choose_update_slot(NULL, NULL);
@@ -2063,6 +2416,12 @@ static int gtkui_perform_updates(const char *product)
 
 static void gtkui_cleanup(void)
 {
+    /* Stop any update still being applied */
+    if ( update_queue ) {
+        free_apply_queue(update_queue);
+        update_queue = NULL;
+    }
+
     /* Clean up any product patchset that may be around */
     if ( product_patchset ) {
         free_patchset(product_patchset);
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -30,6 +31,7 @@
 #include "url_paths.h"
 #include "load_products.h"
 #include "load_patchset.h"
+#include "gpg_verify.h"
 
 void print_patchset(patchset *patchset)
 {
@@ -49,33 +51,47 @@ void print_patchset(patchset *patchset)
     }
 }
 
-/* Variables used to store patch information during parsing */
-static char *component = NULL;
-static char *version = NULL;
-static char *arch = NULL;
-static char *libc = NULL;
-static char *applies = NULL;
-static char *note = NULL;
-static char *size = NULL;
-static char *file = NULL;
-struct {
+/* The patch information stored during parsing, kept by each parse so
+   several update lists can be parsed at once */
+typedef struct {
+    char *component;
+    char *version;
+    char *arch;
+    char *libc;
+    char *applies;
+    char *note;
+    char *size;
+    char *file;
+    char *md5;
+    char *sha256;
+    char *signature;
+} patch_fields;
+
+static const struct {
     const char *prefix;
     int optional;
     int expandable;
-    char **variable;
+    size_t offset;
 } parse_table[] = {
-    {   "Component", 1, 0, &component },
-    {   "Version", 0, 0, &version },
-    {   "Architecture", 1, 1, &arch },
-    {   "Libc", 1, 1, &libc },
-    {   "Applies", 0, 1, &applies },
-    {   "Note", 1, 0, &note },
-    {   "Size", 1, 0, &size },
-    {   "File", 0, 0, &file }
+    {   "Component", 1, 0, offsetof(patch_fields, component) },
+    {   "Version", 0, 0, offsetof(patch_fields, version) },
+    {   "Architecture", 1, 1, offsetof(patch_fields, arch) },
+    {   "Libc", 1, 1, offsetof(patch_fields, libc) },
+    {   "Applies", 0, 1, offsetof(patch_fields, applies) },
+    {   "Note", 1, 0, offsetof(patch_fields, note) },
+    {   "Size", 1, 0, offsetof(patch_fields, size) },
+    {   "File", 0, 0, offsetof(patch_fields, file) },
+    {   "MD5", 1, 0, offsetof(patch_fields, md5) },
+    {   "SHA256", 1, 0, offsetof(patch_fields, sha256) },
+    {   "Signature", 1, 0, offsetof(patch_fields, signature) }
 };
 
+/* The variable in a patch_fields structure for an entry in the table */
+#define FIELD(fields, i) \
+    (*(char **)((char *)(fields) + parse_table[i].offset))
+
 /* Verify all the parameters and add the current patch to the patchset */
-static int check_and_add_patch(patchset *patchset)
+static int check_and_add_patch(patchset *patchset, patch_fields *fields)
 {
     int i;
     int status;
@@ -83,7 +99,7 @@ static int check_and_add_patch(patchset *patchset)
     /* If there are no tags at all, that's fine, successful end of parse */
     status = 0;
     for ( i=0; i<sizeof(parse_table)/sizeof(parse_table[0]); ++i ) {
-        if ( *parse_table[i].variable ) {
+        if ( FIELD(fields, i) ) {
             ++status;
         }
     }
@@ -94,7 +110,7 @@ static int check_and_add_patch(patchset *patchset)
     /* Check for missing tags */
     status = 0;
     for ( i=0; i<sizeof(parse_table)/sizeof(parse_table[0]); ++i ) {
-        if ( ! *parse_table[i].variable && ! parse_table[i].optional ) {
+        if ( ! FIELD(fields, i) && ! parse_table[i].optional ) {
             log(LOG_ERROR, "Missing in parse: %s\n", parse_table[i].prefix);
             status = -1;
         }
@@ -103,37 +119,76 @@ static int check_and_add_patch(patchset *patchset)
         log(LOG_ERROR, "Parsed so far in this update for %s:\n",
             patchset->product_name);
         for ( i=0; i<sizeof(parse_table)/sizeof(parse_table[0]); ++i ) {
-            if ( *parse_table[i].variable ) {
+            if ( FIELD(fields, i) ) {
                 log(LOG_ERROR, "%s: %s\n",
-                    parse_table[i].prefix, *parse_table[i].variable);
+                    parse_table[i].prefix, FIELD(fields, i));
             }
         }
     }
 
     /* Add the patch to our patchset */
     if ( status == 0 ) {
-        add_patch(patchset->product_name, component, version,
-                  arch, libc, applies, note, size, file, patchset);
+        add_patch(patchset->product_name, fields->component, fields->version,
+                  fields->arch, fields->libc, fields->applies, fields->note,
+                  fields->size, fields->file,
+                  fields->md5, fields->sha256, fields->signature, patchset);
     }
 
     /* Clean up for the next patch */
     for ( i=0; i<sizeof(parse_table)/sizeof(parse_table[0]); ++i ) {
-        if ( *parse_table[i].variable ) {
-            free(*parse_table[i].variable);
-            *parse_table[i].variable = NULL;
+        if ( FIELD(fields, i) ) {
+            free(FIELD(fields, i));
+            FIELD(fields, i) = NULL;
         }
     }
 
     return(status);
 }
 
-patchset *load_patchset(patchset *patchset, const char *patchlist)
+/* Start getting the keys the updates are signed with, if we need them */
+static void prefetch_signing_keys(patchset *patchset)
 {
-    struct text_fp *file;
-    char url[PATH_MAX];
+    patch *patch;
+    char **keys;
+    char keyid[32];
+    int i, count;
 
-    /* Open the update list */
-    file = text_open(patchlist);
+    count = 0;
+    for ( patch = patchset->patches; patch; patch = patch->next ) {
+        ++count;
+    }
+    keys = (char **)malloc((count+1)*(sizeof *keys));
+    if ( ! keys ) {
+        return;
+    }
+    count = 0;
+    for ( patch = patchset->patches; patch; patch = patch->next ) {
+        if ( ! patch->signature ||
+             (get_signature_keyid(patch->signature, strlen(patch->signature),
+                                  keyid, sizeof(keyid)) < 0) ) {
+            continue;
+        }
+        for ( i=0; i<count; ++i ) {
+            if ( strcmp(keys[i], keyid) == 0 ) {
+                break;
+            }
+        }
+        if ( i == count ) {
+            keys[count++] = strdup(keyid);
+        }
+    }
+    prefetch_publickeys(keys, count);
+    for ( i=0; i<count; ++i ) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static patchset *parse_patchset(patchset *patchset, struct text_fp *file)
+{
+    patch_fields fields;
+
+    memset(&fields, 0, sizeof(fields));
     if ( file ) {
         int i;
         char key[1024], val[1024];
@@ -148,7 +203,7 @@ patchset *load_patchset(patchset *patchset, const char *patchlist)
             }
             /* If there's a new product tag, check it above */
             if ( strcasecmp(key, "product") == 0 ) {
-                if ( check_and_add_patch(patchset) < 0 ) {
+                if ( check_and_add_patch(patchset, &fields) < 0 ) {
                     /* Error, messages already output */
                     goto done_parse;
                 }
@@ -166,15 +221,15 @@ patchset *load_patchset(patchset *patchset, const char *patchlist)
             /* Look for known tags */
             for ( i=0; i<sizeof(parse_table)/sizeof(parse_table[0]); ++i ) {
                 if ( strcasecmp(parse_table[i].prefix, key) == 0 ) {
-                    if ( *parse_table[i].variable ) {
+                    if ( FIELD(&fields, i) ) {
                         if ( parse_table[i].expandable ) {
                             char tmp[1024];
                             snprintf(tmp, sizeof(tmp), "%s, %s",
-                                     *parse_table[i].variable, val);
+                                     FIELD(&fields, i), val);
                             strcpy(val, tmp);
-                            free(*parse_table[i].variable);
+                            free(FIELD(&fields, i));
                         } else {
-                            if ( check_and_add_patch(patchset) < 0 ) {
+                            if ( check_and_add_patch(patchset, &fields) < 0 ) {
                                 /* Error, messages already output */
                                 goto done_parse;
                             }
@@ -182,37 +237,80 @@ patchset *load_patchset(patchset *patchset, const char *patchlist)
                     } else
                     if ( strcasecmp(key, "Component") == 0 ) {
                         /* Look for version, if found, starting new entry */
-                        if ( *parse_table[1].variable ) {
-                            if ( check_and_add_patch(patchset) < 0 ) {
+                        if ( fields.version ) {
+                            if ( check_and_add_patch(patchset, &fields) < 0 ) {
                                 /* Error, messages already output */
                                 goto done_parse;
                             }
                         }
                     }
-                    *parse_table[i].variable = strdup(val);
+                    FIELD(&fields, i) = strdup(val);
                     break;
                 }
             }
         }
-        check_and_add_patch(patchset);
+        check_and_add_patch(patchset, &fields);
 done_parse:
         text_close(file);
     }
+    return patchset;
+}
+
+/* Choose the updates and mirrors once the patch paths are known */
+static patchset *finish_patchset(patchset *patchset)
+{
+    char url[PATH_MAX];
 
-    /* Build a tree of patches and reduce it to the most efficient set */
-    calculate_paths(patchset);
     autoselect_patches(patchset);
 #ifdef DEBUG
     print_patchset(patchset);
 #endif
 
     /* Add the product URL if it's on disk or there are no mirrors */
-    compose_url(get_product_url(patchset->product_name), "", url, sizeof(url));
+    compose_url(patchset->session, get_handle_url(patchset->product),
+                "", url, sizeof(url));
     if ( (*url == '/') || (patchset->mirrors->num_mirrors == 0) ) {
         add_url(patchset->mirrors, url);
     }
 
     /* Randomize the mirrors */
     randomize_urls(patchset->mirrors);
+
+    /* Get any keys we don't have while the user looks at the updates */
+    prefetch_signing_keys(patchset);
     return patchset;
 }
+
+patchset *load_patchset(patchset *patchset, const char *patchlist)
+{
+    parse_patchset(patchset, text_open(patchlist));
+
+    /* Build a tree of patches and reduce it to the most efficient set */
+    calculate_paths(patchset);
+    return finish_patchset(patchset);
+}
+
+patchset *load_patchset_data(patchset *patchset, char *data, int size)
+{
+    parse_patchset(patchset, text_open_data(data, size));
+
+    /* Build a tree of patches and reduce it to the most efficient set */
+    calculate_paths(patchset);
+    return finish_patchset(patchset);
+}
+
+patchset *read_patchset_data(patchset *patchset, char *data, int size)
+{
+    return parse_patchset(patchset, text_open_data(data, size));
+}
+
+void finish_patchsets(patchset *patchsets)
+{
+    patchset *patchset;
+
+    /* Plan the updates of all the products at the same time */
+    calculate_all_paths(patchsets);
+    for ( patchset = patchsets; patchset; patchset = patchset->next ) {
+        finish_patchset(patchset);
+    }
+}
@@ -22,4 +22,16 @@
 #include "patchset.h"
 
 extern patchset *load_patchset(patchset *patchset, const char *patchlist);
+
+/* Load the update list from memory, taking ownership of the data,
+   which must have been returned by get_url_data()
+ */
+extern patchset *load_patchset_data(patchset *patchset, char *data, int size);
+
+/* Read an update list like load_patchset_data(), but leave planning the
+   updates to finish_patchsets(), so several products can be read first
+   and then planned at the same time.
+ */
+extern patchset *read_patchset_data(patchset *patchset, char *data, int size);
+extern void finish_patchsets(patchset *patchsets);
 extern void print_patchset(patchset *patchset);
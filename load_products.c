@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 /* For product path stuff */
 #include <sys/param.h>
@@ -35,9 +36,20 @@
 #include "safe_malloc.h"
 #include "log_output.h"
 #include "update_ui.h"
+#include "session.h"
 #include "load_products.h"
 #include "mkdirhier.h"
+#include "prefpath.h"
+#include "detect_products.h"
 
+/* What was read from the product manifests by the last run */
+#define PRODUCT_CACHE_FILE  "installed.txt"
+
+/* Another install of a product, updated along with the first one */
+typedef struct product_root {
+    char *root;
+    struct product_root *next;
+} product_root;
 
 typedef struct product_entry {
     char *product;
@@ -46,19 +58,34 @@ typedef struct product_entry {
     char *root;
     char *update_url;
     char *default_component;
+    int num_components;         /* The add-on components installed */
+    char **component_names;
+    char **component_versions;
+    product_root *other_roots;
+    update_session *session;
+    struct product_entry *hash_next;
     struct product_entry *next;
 } product_entry;
 
-static int num_products;
-static const char *override_update_url;
-static product_entry *product_list = NULL;
-static product_entry *current = NULL;
+/* Hash a product name, ignoring case like the name comparisons do */
+static unsigned int hash_product_name(const char *product)
+{
+    unsigned int hash;
+
+    hash = 0;
+    while ( *product ) {
+        hash = (hash * 31) + tolower((unsigned char)*product++);
+    }
+    return(hash % PRODUCT_HASH_SIZE);
+}
 
-static product_entry *find_product(const char *product)
+static product_entry *find_product(update_session *session,
+                                   const char *product)
 {
     product_entry *entry;
 
-    for ( entry = product_list; entry; entry = entry->next ) {
+    for ( entry = session->product_hash[hash_product_name(product)];
+          entry; entry = entry->hash_next ) {
         if ( strcasecmp(entry->product, product) == 0 ) {
             break;
         }
@@ -66,11 +93,12 @@ static product_entry *find_product(const char *product)
     return(entry);
 }
 
-static void add_product(const char *product, const char *version,
+static product_entry *add_product(update_session *session,
+                        const char *product, const char *version,
                         const char *description, const char *root,
                         const char *update_url, const char *default_component)
 {
-    product_entry *new_entry, *entry, *prev;
+    product_entry *new_entry, *entry, **bucket;
 
     /* Create the entry */
     log(LOG_DEBUG, _("Adding product entry for '%s'\n"), product);
@@ -81,30 +109,96 @@ static void add_product(const char *product, const char *version,
     new_entry->root = safe_strdup(root);
     new_entry->update_url = safe_strdup(update_url);
     new_entry->default_component = safe_strdup(default_component);
+    new_entry->num_components = 0;
+    new_entry->component_names = NULL;
+    new_entry->component_versions = NULL;
+    new_entry->other_roots = NULL;
+    new_entry->session = session;
 
-    /* Insert it into the list, sorted alphabetically */
-    prev = NULL;
-    for ( entry = product_list; entry; entry = entry->next ) {
-        if ( strcasecmp(entry->product, product) > 0 ) {
-            new_entry->next = entry;
-            if ( prev ) {
-                prev->next = new_entry;
-            } else {
-                product_list = new_entry;
-            }
-            break;
+    /* Add it to the end of its hash bucket, so the first entry added
+       for a name is the one found */
+    new_entry->hash_next = NULL;
+    bucket = &session->product_hash[hash_product_name(product)];
+    while ( *bucket ) {
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = new_entry;
+
+    /* The list is sorted the next time it's iterated */
+    new_entry->next = session->product_list;
+    session->product_list = new_entry;
+    session->products_sorted = 0;
+    ++session->num_products;
+    return(new_entry);
+}
+
+/* Add an add-on component that's installed with a product */
+static void add_product_component(product_entry *entry,
+                                  const char *name, const char *version)
+{
+    entry->component_names = (char **)safe_realloc(entry->component_names,
+        (entry->num_components+1)*(sizeof *entry->component_names));
+    entry->component_versions = (char **)safe_realloc(
+        entry->component_versions,
+        (entry->num_components+1)*(sizeof *entry->component_versions));
+    entry->component_names[entry->num_components] = safe_strdup(name);
+    entry->component_versions[entry->num_components] = safe_strdup(version);
+    ++entry->num_components;
+}
+
+/* Sort the product list alphabetically, keeping products with the same
+   name in the order they were added */
+static product_entry *merge_products(product_entry *list, int count)
+{
+    product_entry *left, *right, *merged, **tail;
+    int i;
+
+    if ( count < 2 ) {
+        if ( list ) {
+            list->next = NULL;
         }
-        prev = entry;
+        return(list);
     }
-    if ( ! entry ) {
-        new_entry->next = NULL;
-        if ( prev ) {
-            prev->next = new_entry;
+    right = list;
+    for ( i=0; i<count/2; ++i ) {
+        right = right->next;
+    }
+    left = merge_products(list, count/2);
+    right = merge_products(right, count-count/2);
+
+    merged = NULL;
+    tail = &merged;
+    while ( left && right ) {
+        if ( strcasecmp(left->product, right->product) <= 0 ) {
+            *tail = left;
+            left = left->next;
         } else {
-            product_list = new_entry;
+            *tail = right;
+            right = right->next;
         }
+        tail = &(*tail)->next;
     }
-    ++num_products;
+    *tail = left ? left : right;
+    return(merged);
+}
+
+static void sort_products(update_session *session)
+{
+    product_entry *entry, *next, *list;
+
+    if ( session->products_sorted ) {
+        return;
+    }
+
+    /* New products are added at the front, so put them back in order */
+    list = NULL;
+    for ( entry = session->product_list; entry; entry = next ) {
+        next = entry->next;
+        entry->next = list;
+        list = entry;
+    }
+    session->product_list = merge_products(list, session->num_products);
+    session->products_sorted = 1;
 }
 
 static char *get_line(char *line, int maxlen, FILE *file)
@@ -116,76 +210,390 @@ static char *get_line(char *line, int maxlen, FILE *file)
     return(line);
 }
 
-static void detect_product(const char *product_name)
-{
-    FILE *detect;
-    char command[1024];
-    char version[1024];
-    char description[1024];
-    char root[1024];
-    char update_url[1024];
-
-#ifdef MD5SUM
-   setenv("DETECT_MD5SUM", MD5SUM, 1);
-#endif
-
-    sprintf(command, "sh " DATADIR "/detect/detect.sh %s", product_name);
-    detect = popen(command, "r");
-    if ( detect ) {
-        if ( get_line(version, sizeof(version), detect) &&
-             get_line(description, sizeof(description), detect) &&
-             get_line(root, sizeof(root), detect) &&
-             get_line(update_url, sizeof(update_url), detect) ) {
-            add_product(product_name, version,
-                        description, root, update_url, "Default Install");
-        } else {
-            log(LOG_DEBUG, _("Failed scan for product '%s'\n"), product_name);
-        }
-        pclose(detect);
-    }
+/* Add a legacy product we found to the list, and keep it for saving */
+static void add_detected_product(update_session *session,
+                                 detected_product **list,
+                                 detected_product *found)
+{
+    add_product(session, found->product, found->version,
+                found->description, found->root, found->update_url,
+                "Default Install");
+    found->next = *list;
+    *list = found;
 }
 
-static void load_detected_products(const char *wanted)
+static void load_detected_products(update_session *session,
+                                   const char *wanted)
 {
     FILE *list;
     char product_name[1024];
+    const char **products;
+    detected_product *cache, *found_list, *detected, *found, *next;
+    int i, count;
+
+    /* See what was found last time, it's still there if the binary
+       hasn't changed */
+    cache = load_detect_cache();
+    found_list = NULL;
+    products = NULL;
+    count = 0;
 
     /* If we want something in particular, look for that */
     if ( wanted ) {
-        detect_product(wanted);
-        return;
+        found = take_cached_product(&cache, wanted);
+        if ( found ) {
+            add_detected_product(session, &found_list, found);
+        } else
+        if ( has_detect_script(wanted) ) {
+            found = run_detect_script(wanted);
+            if ( found ) {
+                add_detected_product(session, &found_list, found);
+            }
+        } else {
+            products = (const char **)safe_malloc(sizeof *products);
+            products[count++] = safe_strdup(wanted);
+        }
+    } else {
+        /* Otherwise scan for all known legacy products */
+        list = fopen(DATADIR "/detect/products.txt", "r");
+        if ( ! list ) {
+            /* No worries, I guess there's nothing to detect */
+            free_detected_products(cache);
+            return;
+        }
+        while ( get_line(product_name, sizeof(product_name), list) ) {
+
+            /* If blank line, or we already have it, don't scan */
+            if ( ! *product_name || find_product(session, product_name) ) {
+                continue;
+            }
+
+            /* Use what we found last time, if it's still there */
+            found = take_cached_product(&cache, product_name);
+            if ( found ) {
+                add_detected_product(session, &found_list, found);
+                continue;
+            }
+
+            /* Products with their own script are found by running it,
+               the rest are all found by a single scan below */
+            if ( has_detect_script(product_name) ) {
+                found = run_detect_script(product_name);
+                if ( found ) {
+                    add_detected_product(session, &found_list, found);
+                }
+                continue;
+            }
+            products = (const char **)safe_realloc(products,
+                                        (count+1)*(sizeof *products));
+            products[count++] = safe_strdup(product_name);
+        }
+        fclose(list);
+
+        /* Anything left over is no longer a legacy product */
+        free_detected_products(cache);
+        cache = NULL;
     }
 
-    /* Otherwise scan for all known legacy products */
-    list = fopen(DATADIR "/detect/products.txt", "r");
-    if ( ! list ) {
-        /* No worries, I guess there's nothing to detect */
-        return;
+    /* Look for the binaries of all of the products at once */
+    detected = detect_products(products, count);
+    for ( found = detected; found; found = next ) {
+        next = found->next;
+        add_detected_product(session, &found_list, found);
+    }
+    for ( i=0; i<count; ++i ) {
+        free((char *)products[i]);
+    }
+    safe_free(products);
+
+    /* Save what we found, along with the products we didn't look for */
+    if ( cache ) {
+        for ( found = cache; found->next; found = found->next ) {
+            continue;
+        }
+        found->next = found_list;
+        found_list = cache;
     }
-    while ( get_line(product_name, sizeof(product_name), list) ) {
+    save_detect_cache(found_list);
+    free_detected_products(found_list);
+}
+
+/* What was read from an installed product's manifest, saved so the
+   manifest is only parsed again once it changes */
+typedef struct product_snapshot {
+    char *key;                  /* The name setupdb lists the product by */
+    time_t mtime;
+    off_t size;
+    char *product;
+    char *version;
+    char *description;
+    char *root;
+    char *update_url;
+    char *default_component;
+    int num_components;
+    char **component_names;
+    char **component_versions;
+    int used;
+    struct product_snapshot *next;
+} product_snapshot;
+
+static void free_product_snapshots(product_snapshot *list)
+{
+    product_snapshot *next;
+    int i;
+
+    while ( list ) {
+        next = list->next;
+        free(list->key);
+        free(list->product);
+        free(list->version);
+        free(list->description);
+        free(list->root);
+        free(list->update_url);
+        free(list->default_component);
+        for ( i=0; i<list->num_components; ++i ) {
+            free(list->component_names[i]);
+            free(list->component_versions[i]);
+        }
+        safe_free(list->component_names);
+        safe_free(list->component_versions);
+        free(list);
+        list = next;
+    }
+}
+
+static void add_snapshot_component(product_snapshot *snapshot,
+                                   const char *name, const char *version)
+{
+    snapshot->component_names = (char **)safe_realloc(
+        snapshot->component_names,
+        (snapshot->num_components+1)*(sizeof *snapshot->component_names));
+    snapshot->component_versions = (char **)safe_realloc(
+        snapshot->component_versions,
+        (snapshot->num_components+1)*(sizeof *snapshot->component_versions));
+    snapshot->component_names[snapshot->num_components] = safe_strdup(name);
+    snapshot->component_versions[snapshot->num_components] =
+                                                    safe_strdup(version);
+    ++snapshot->num_components;
+}
+
+/* Split a tab separated line into fields, returning the number found */
+static int split_fields(char *line, char *fields[], int max)
+{
+    int num;
+
+    num = 0;
+    while ( line && (num < max) ) {
+        fields[num++] = line;
+        line = strchr(line, '\t');
+        if ( line ) {
+            *line++ = '\0';
+        }
+    }
+    return(num);
+}
+
+/* Load the saved products.  Each product is a line starting with 'P',
+   followed by a line starting with 'C' for each add-on component. */
+static product_snapshot *load_product_snapshots(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char line[4096];
+    char *fields[10];
+    product_snapshot *list, *snapshot;
+    int num;
+
+    list = NULL;
+    snapshot = NULL;
+    preferences_path(PRODUCT_CACHE_FILE, path, sizeof(path));
+    fp = fopen(path, "r");
+    if ( ! fp ) {
+        return(list);
+    }
+    while ( get_line(line, sizeof(line), fp) ) {
+        num = split_fields(line, fields, 10);
+        if ( (num == 10) && (strcmp(fields[0], "P") == 0) ) {
+            snapshot = (product_snapshot *)safe_malloc(sizeof *snapshot);
+            snapshot->key = safe_strdup(fields[1]);
+            snapshot->mtime = (time_t)atol(fields[2]);
+            snapshot->size = (off_t)atol(fields[3]);
+            snapshot->product = safe_strdup(fields[4]);
+            snapshot->version = safe_strdup(fields[5]);
+            snapshot->description = safe_strdup(fields[6]);
+            snapshot->root = safe_strdup(fields[7]);
+            snapshot->update_url = safe_strdup(fields[8]);
+            snapshot->default_component = safe_strdup(fields[9]);
+            snapshot->num_components = 0;
+            snapshot->component_names = NULL;
+            snapshot->component_versions = NULL;
+            snapshot->used = 0;
+            snapshot->next = list;
+            list = snapshot;
+        } else
+        if ( (num == 3) && (strcmp(fields[0], "C") == 0) && snapshot ) {
+            add_snapshot_component(snapshot, fields[1], fields[2]);
+        }
+    }
+    fclose(fp);
+    return(list);
+}
 
-        /* If blank line, or we already have it, don't scan */
-        if ( ! *product_name || find_product(product_name) ) {
+static void save_product_snapshots(product_snapshot *list, int all)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    int i;
+
+    preferences_path(PRODUCT_CACHE_FILE, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    fp = fopen(temp, "w");
+    if ( ! fp ) {
+        log(LOG_WARNING, _("Unable to write to %s\n"), temp);
+        return;
+    }
+    for ( ; list; list = list->next ) {
+        /* Products that weren't listed by setupdb aren't installed now */
+        if ( ! all && ! list->used ) {
             continue;
         }
+        fprintf(fp, "P\t%s\t%ld\t%ld\t%s\t%s\t%s\t%s\t%s\t%s\n",
+                list->key, (long)list->mtime, (long)list->size,
+                list->product, list->version, list->description,
+                list->root, list->update_url, list->default_component);
+        for ( i=0; i<list->num_components; ++i ) {
+            fprintf(fp, "C\t%s\t%s\n",
+                    list->component_names[i], list->component_versions[i]);
+        }
+    }
+    fclose(fp);
 
-        /* Open up the detection routine */
-        detect_product(product_name);
+    /* Replace the old list all at once, in case another run is reading it */
+    if ( rename(temp, path) < 0 ) {
+        unlink(temp);
     }
 }
 
-void load_product_list(const char *wanted)
+/* Read a product from its manifest, returning NULL if it can't be read */
+static product_snapshot *read_product_manifest(const char *product_name,
+                                               struct stat *sb)
 {
-    int found;
-    const char *product_name;
     product_t *product;
-    product_component_t *component;
     product_info_t *info;
+    product_component_t *component;
+    product_snapshot *snapshot;
+
+    product = loki_openproduct(product_name);
+    if ( ! product ) {
+        return(NULL);
+    }
+    log(LOG_DEBUG, "Reading the manifest of %s\n", product_name);
+    info = loki_getinfo_product(product);
+    snapshot = (product_snapshot *)safe_malloc(sizeof *snapshot);
+    snapshot->key = safe_strdup(product_name);
+    snapshot->mtime = sb->st_mtime;
+    snapshot->size = sb->st_size;
+    snapshot->product = safe_strdup(info->name);
+    snapshot->description = safe_strdup(info->description);
+    snapshot->root = safe_strdup(info->root);
+    snapshot->update_url = safe_strdup(info->url);
+    component = loki_getdefault_component(product);
+    if ( component ) {
+        snapshot->version = safe_strdup(loki_getversion_component(component));
+        snapshot->default_component =
+                        safe_strdup(loki_getname_component(component));
+    } else {
+        /* Not really installed, like a version of "0" */
+        snapshot->version = safe_strdup("0");
+        snapshot->default_component = safe_strdup("");
+    }
+    snapshot->num_components = 0;
+    snapshot->component_names = NULL;
+    snapshot->component_versions = NULL;
+    for ( component = loki_getfirst_component(product);
+          component;
+          component = loki_getnext_component(component) ) {
+        if ( ! loki_isdefault_component(component) ) {
+            add_snapshot_component(snapshot,
+                                   loki_getname_component(component),
+                                   loki_getversion_component(component));
+        }
+    }
+    snapshot->used = 0;
+    snapshot->next = NULL;
+    loki_closeproduct(product);
+    return(snapshot);
+}
+
+/* Get a product from the saved list if its manifest hasn't changed since,
+   or read the manifest again and update the saved list.  Returns NULL if
+   the product can't be read.
+ */
+static product_snapshot *get_product_snapshot(product_snapshot **list,
+                                              const char *product_name,
+                                              int *changed)
+{
+    char manifest[PATH_MAX];
+    struct stat sb;
+    product_snapshot *snapshot, *prev, *fresh;
+
+    prev = NULL;
+    for ( snapshot = *list; snapshot; snapshot = snapshot->next ) {
+        if ( strcmp(snapshot->key, product_name) == 0 ) {
+            break;
+        }
+        prev = snapshot;
+    }
+
+    /* The manifest setupdb reads is linked into the installed directory */
+    snprintf(manifest, sizeof(manifest), "%s/%s/installed/%s.xml",
+             detect_home(), LOKI_DIRNAME, product_name);
+    if ( stat(manifest, &sb) < 0 ) {
+        memset(&sb, 0, sizeof(sb));
+    } else
+    if ( snapshot && (snapshot->mtime == sb.st_mtime) &&
+                     (snapshot->size == sb.st_size) ) {
+        return(snapshot);
+    }
+
+    fresh = read_product_manifest(product_name, &sb);
+    if ( ! fresh ) {
+        return(NULL);
+    }
+    if ( snapshot ) {
+        /* Replace the old snapshot with the new one */
+        fresh->next = snapshot->next;
+        if ( prev ) {
+            prev->next = fresh;
+        } else {
+            *list = fresh;
+        }
+        snapshot->next = NULL;
+        free_product_snapshots(snapshot);
+    } else {
+        fresh->next = *list;
+        *list = fresh;
+    }
+    *changed = 1;
+    return(fresh);
+}
+
+void load_product_list(update_session *session, const char *wanted)
+{
+    int found, changed;
+    const char *product_name;
+    product_snapshot *snapshots, *snapshot;
+    product_entry *entry;
+    int i;
 
     printf(_("Searching for installed products... ")); fflush(stdout);
 
-    /* First load the "official" installed product list */
-    num_products = 0;
+    /* First load the "official" installed product list, using what was
+       saved from the manifests that haven't changed since the last run */
+    snapshots = load_product_snapshots();
+    changed = 0;
+    session->num_products = 0;
     found = 0;
     for ( product_name = loki_getfirstproduct();
           product_name;
@@ -196,68 +604,88 @@ void load_product_list(const char *wanted)
              (strcasecmp(PRODUCT, product_name) != 0) ) {
             continue;
         }
-        product = loki_openproduct(product_name);
-        if ( product ) {
-            info = loki_getinfo_product(product);
-            component = loki_getdefault_component(product);
-            if ( component && 
-                 (strcmp(loki_getversion_component(component), "0") != 0) ) {
-                add_product(info->name,
-                            loki_getversion_component(component),
-                            info->description, info->root, info->url,
-                            loki_getname_component(component));
-                if ( wanted && (strcasecmp(wanted, product_name) == 0) ) {
-                    found = 1;
-                }
+        snapshot = get_product_snapshot(&snapshots, product_name, &changed);
+        if ( ! snapshot ) {
+            continue;
+        }
+        snapshot->used = 1;
+        if ( strcmp(snapshot->version, "0") != 0 ) {
+            entry = add_product(session, snapshot->product,
+                                snapshot->version, snapshot->description,
+                                snapshot->root, snapshot->update_url,
+                                snapshot->default_component);
+            for ( i=0; i<snapshot->num_components; ++i ) {
+                add_product_component(entry, snapshot->component_names[i],
+                                      snapshot->component_versions[i]);
+            }
+            if ( wanted && (strcasecmp(wanted, product_name) == 0) ) {
+                found = 1;
             }
-            loki_closeproduct(product);
         }
     }
 
+    /* Save the products for next time, keeping the ones we skipped */
+    if ( wanted ) {
+        if ( changed ) {
+            save_product_snapshots(snapshots, 1);
+        }
+    } else {
+        for ( snapshot = snapshots; snapshot; snapshot = snapshot->next ) {
+            if ( ! snapshot->used ) {
+                changed = 1;
+            }
+        }
+        if ( changed ) {
+            save_product_snapshots(snapshots, 0);
+        }
+    }
+    free_product_snapshots(snapshots);
+
     /* Now see what non-official products we should scan for */
     if ( ! found ) {
-        load_detected_products(wanted);
+        load_detected_products(session, wanted);
     }
 
     printf(_("done!\n"));
 }
 
-int get_num_products(void)
+int get_num_products(update_session *session)
 {
-    return(num_products);
+    return(session->num_products);
 }
 
-const char *get_first_product(void)
+const char *get_first_product(update_session *session)
 {
     const char *product;
 
-    current = product_list;
-    if ( current ) {
-        product = current->product;
+    sort_products(session);
+    session->current_product = session->product_list;
+    if ( session->current_product ) {
+        product = session->current_product->product;
     } else {
         product = NULL;
     }
     return(product);
 }
 
-const char *get_next_product(void)
+const char *get_next_product(update_session *session)
 {
     const char *product;
 
-    current = current->next;
-    if ( current ) {
-        product = current->product;
+    session->current_product = session->current_product->next;
+    if ( session->current_product ) {
+        product = session->current_product->product;
     } else {
         product = NULL;
     }
     return(product);
 }
 
-int is_valid_product(const char *product)
+int is_valid_product(update_session *session, const char *product)
 {
     int valid;
 
-    if ( find_product(product) ) {
+    if ( find_product(session, product) ) {
         valid = 1;
     } else {
         valid = 0;
@@ -265,86 +693,70 @@ int is_valid_product(const char *product)
     return(valid);
 }
 
-void set_override_url(const char *update_url)
+void set_override_url(update_session *session, const char *update_url)
 {
-    override_update_url = update_url;
+    session->override_update_url = update_url;
 }
 
-void set_product_root(const char *product, const char *root)
+void set_product_root(update_session *session,
+                      const char *product, const char *root)
 {
     product_entry *entry;
 
-    entry = find_product(product);
+    entry = find_product(session, product);
     if ( entry ) {
         free(entry->root);
         entry->root = safe_strdup(root);
     }
 }
 
-void set_product_url(const char *product, const char *url)
+void set_product_url(update_session *session,
+                     const char *product, const char *url)
 {
     product_entry *entry;
 
-    entry = find_product(product);
+    entry = find_product(session, product);
     if ( entry ) {
         free(entry->update_url);
         entry->update_url = safe_strdup(url);
     }
 }
 
-const char *get_product_version(const char *product)
+product_handle *get_product_handle(update_session *session,
+                                   const char *product)
 {
-    product_entry *entry;
-    const char *version;
-
-    entry = find_product(product);
-    if ( entry ) {
-        version = entry->version;
-    } else {
-        version = NULL;
-    }
-    return(version);
+    return(find_product(session, product));
 }
 
-const char *get_product_description(const char *product)
+const char *get_handle_name(product_handle *product)
 {
-    product_entry *entry;
-    const char *description;
+    return(product ? product->product : NULL);
+}
 
-    entry = find_product(product);
-    if ( entry ) {
-        description = entry->description;
-    } else {
-        description = NULL;
-    }
-    return(description);
+const char *get_handle_version(product_handle *product)
+{
+    return(product ? product->version : NULL);
 }
 
-const char *get_product_root(const char *product)
+const char *get_handle_description(product_handle *product)
 {
-    product_entry *entry;
-    const char *root;
+    return(product ? product->description : NULL);
+}
 
-    entry = find_product(product);
-    if ( entry ) {
-        root = entry->root;
-    } else {
-        root = NULL;
-    }
-    return(root);
+const char *get_handle_root(product_handle *product)
+{
+    return(product ? product->root : NULL);
 }
 
-const char *get_product_url(const char *product)
+const char *get_handle_url(product_handle *product)
 {
-    product_entry *entry;
     const char *url;
 
-    entry = find_product(product);
-    if ( entry ) {
-        if ( override_update_url ) {
-            url = override_update_url;
+    if ( product ) {
+        if ( product->session->override_update_url ) {
+            url = product->session->override_update_url;
         } else {
-            url = entry->update_url;
+            url = product->update_url;
         }
     } else {
         url = NULL;
@@ -352,35 +764,88 @@ const char *get_product_url(const char *product)
     return(url);
 }
 
-const char *get_default_component(const char *product)
+const char *get_handle_component(product_handle *product)
 {
-    product_entry *entry;
-    const char *component;
+    return(product ? product->default_component : NULL);
+}
 
-    entry = find_product(product);
-    if ( entry ) {
-        component = entry->default_component;
-    } else {
-        component = NULL;
-    }
-    return(component);
+int get_num_components(product_handle *product)
+{
+    return(product ? product->num_components : 0);
+}
+
+const char *get_component_name(product_handle *product, int component)
+{
+    return(product->component_names[component]);
+}
+
+const char *get_component_version(product_handle *product, int component)
+{
+    return(product->component_versions[component]);
+}
+
+const char *get_product_version(update_session *session, const char *product)
+{
+    return(get_handle_version(find_product(session, product)));
+}
+
+const char *get_product_description(update_session *session, const char *product)
+{
+    return(get_handle_description(find_product(session, product)));
 }
 
-void free_product_list(void)
+const char *get_product_root(update_session *session, const char *product)
+{
+    return(get_handle_root(find_product(session, product)));
+}
+
+const char *get_product_url(update_session *session, const char *product)
+{
+    return(get_handle_url(find_product(session, product)));
+}
+
+const char *get_default_component(update_session *session, const char *product)
+{
+    return(get_handle_component(find_product(session, product)));
+}
+
+void free_product_list(update_session *session)
 {
     product_entry *entry;
+    product_root *root;
+    int i;
 
-    while ( product_list ) {
-        entry = product_list;
-        product_list = product_list->next;
+    while ( session->product_list ) {
+        entry = session->product_list;
+        session->product_list = entry->next;
+        while ( entry->other_roots ) {
+            root = entry->other_roots;
+            entry->other_roots = root->next;
+            free(root->root);
+            free(root);
+        }
         free(entry->product);
         free(entry->version);
         free(entry->description);
         free(entry->root);
         free(entry->update_url);
         free(entry->default_component);
+        for ( i=0; i<entry->num_components; ++i ) {
+            free(entry->component_names[i]);
+            free(entry->component_versions[i]);
+        }
+        safe_free(entry->component_names);
+        safe_free(entry->component_versions);
         free(entry);
     }
+    memset(session->product_hash, 0, sizeof(session->product_hash));
+    session->products_sorted = 1;
+    session->current_product = NULL;
+    session->num_products = 0;
+    if ( session->linked_product ) {
+        free(session->linked_product);
+        session->linked_product = NULL;
+    }
 }
 
 int is_product_path(const char *product)
@@ -398,10 +863,10 @@ int is_product_path(const char *product)
     return status;
 }
 
-/* Warning: This function returns a pointer to a static variable */
-const char *link_product_path(const char *path)
+/* The product name returned is kept until the next call */
+const char *link_product_path(update_session *session, const char *path)
 {
-    static char *product_name = NULL;
+    char *product_name = NULL;
     char manifest[PATH_MAX];
     char home_manifest[MAXPATHLEN];
     char full_manifest[MAXPATHLEN];
@@ -411,9 +876,9 @@ const char *link_product_path(const char *path)
     char *spot;
 
     /* Reset the current product */
-    if ( product_name ) {
-        free(product_name);
-        product_name = NULL;
+    if ( session->linked_product ) {
+        free(session->linked_product);
+        session->linked_product = NULL;
     }
 
     /* Look for a product description file */
@@ -464,5 +929,132 @@ const char *link_product_path(const char *path)
         }
         closedir(dir);
     }
+    session->linked_product = product_name;
     return product_name;
 }
+
+/* Add another install directory of a product.  The product in it must be
+   the same version, so the same updates can be applied to it.
+ */
+int add_product_root(update_session *session,
+                     const char *product, const char *path)
+{
+    product_entry *entry;
+    product_root *root, *last;
+    char manifest[PATH_MAX];
+    char full_manifest[MAXPATHLEN];
+    DIR *dir;
+    struct dirent *file;
+    product_t *install;
+    product_info_t *info;
+    product_component_t *component;
+    const char *version;
+    char *spot;
+    int i, status;
+
+    entry = find_product(session, product);
+    if ( ! entry ) {
+        return(-1);
+    }
+
+    /* Look for the product in the directory's manifest */
+    status = -1;
+    sprintf(manifest, "%s/.manifest", path);
+    dir = opendir(manifest);
+    if ( ! dir ) {
+        log(LOG_ERROR, _("No products installed in %s\n"), path);
+        return(-1);
+    }
+    while ( (status < 0) && ((file = readdir(dir)) != NULL) ) {
+        if ( (strlen(file->d_name) < 4) ||
+             (strcmp(&file->d_name[strlen(file->d_name)-4], ".xml") != 0) ) {
+            continue;
+        }
+        sprintf(manifest, "%s/.manifest/%s", path, file->d_name);
+        if ( access(manifest, W_OK) != 0 ) {
+            continue;
+        }
+        install = loki_openproduct(manifest);
+        if ( ! install ) {
+            continue;
+        }
+        info = loki_getinfo_product(install);
+        component = loki_getdefault_component(install);
+        if ( component ) {
+            version = loki_getversion_component(component);
+        } else {
+            version = NULL;
+        }
+        if ( strcasecmp(info->name, entry->product) == 0 ) {
+            if ( ! version || (strcmp(version, entry->version) != 0) ) {
+                log(LOG_WARNING, _("%s has version %s of %s, not %s\n"),
+                    path, version ? version : "0",
+                    entry->product, entry->version);
+            } else
+            if ( realpath(manifest, full_manifest) != NULL ) {
+                /* Get the product install root */
+                for ( i=0; i<2; ++i ) {
+                    spot = strrchr(full_manifest, '/');
+                    if ( spot ) {
+                        *spot = '\0';
+                    }
+                }
+                status = 0;
+            }
+        }
+        loki_closeproduct(install);
+    }
+    closedir(dir);
+    if ( status < 0 ) {
+        log(LOG_ERROR, _("Couldn't add %s to the installs of %s\n"),
+            path, entry->product);
+        return(status);
+    }
+
+    /* Add it to the list, unless it's already there */
+    last = NULL;
+    if ( strcmp(entry->root, full_manifest) != 0 ) {
+        for ( root = entry->other_roots; root; root = root->next ) {
+            if ( strcmp(root->root, full_manifest) == 0 ) {
+                break;
+            }
+            last = root;
+        }
+        if ( ! root ) {
+            log(LOG_DEBUG, _("Adding install path %s for '%s'\n"),
+                full_manifest, entry->product);
+            root = (product_root *)safe_malloc(sizeof *root);
+            root->root = safe_strdup(full_manifest);
+            root->next = NULL;
+            if ( last ) {
+                last->next = root;
+            } else {
+                entry->other_roots = root;
+            }
+        }
+    }
+    return(status);
+}
+
+int get_product_roots(update_session *session,
+                      const char *product, const char *roots[], int maxroots)
+{
+    return(get_handle_roots(find_product(session, product), roots, maxroots));
+}
+
+int get_handle_roots(product_handle *product,
+                     const char *roots[], int maxroots)
+{
+    product_root *root;
+    int count;
+
+    count = 0;
+    if ( product && (maxroots > 0) ) {
+        roots[count++] = product->root;
+        for ( root = product->other_roots; root && (count < maxroots);
+              root = root->next ) {
+            roots[count++] = root->root;
+        }
+    }
+    return(count);
+}
@@ -19,25 +19,86 @@
     info@lokigames.com
 */
 
-extern void load_product_list(const char *wanted);
+/* The installed products are kept in an update session, see session.h */
 
-extern int get_num_products(void);
-extern const char *get_first_product(void);
-extern const char *get_next_product(void);
+#ifndef _load_products_h
+#define _load_products_h
 
-extern int is_valid_product(const char *product);
+#include "session.h"
 
-extern void set_override_url(const char *update_url);
-extern void set_product_root(const char *product, const char *root);
-extern void set_product_url(const char *product, const char *url);
+/* Load the installed products, or only the one wanted if it's not NULL.
+   What's read from each product's manifest is saved, so the manifests
+   are only parsed again after they change.
+ */
+extern void load_product_list(update_session *session, const char *wanted);
 
-extern const char *get_product_version(const char *product);
-extern const char *get_product_description(const char *product);
-extern const char *get_product_root(const char *product);
-extern const char *get_product_url(const char *product);
-extern const char *get_default_component(const char *product);
+extern int get_num_products(update_session *session);
+extern const char *get_first_product(update_session *session);
+extern const char *get_next_product(update_session *session);
 
-extern void free_product_list(void);
+extern int is_valid_product(update_session *session, const char *product);
+
+extern void set_override_url(update_session *session, const char *update_url);
+extern void set_product_root(update_session *session,
+                             const char *product, const char *root);
+extern void set_product_url(update_session *session,
+                            const char *product, const char *url);
+
+extern const char *get_product_version(update_session *session,
+                                       const char *product);
+extern const char *get_product_description(update_session *session,
+                                           const char *product);
+extern const char *get_product_root(update_session *session,
+                                    const char *product);
+extern const char *get_product_url(update_session *session,
+                                   const char *product);
+extern const char *get_default_component(update_session *session,
+                                         const char *product);
+
+/* A product that has been looked up, so it doesn't need to be found by
+   name every time.  Handles stay valid until the product list is freed,
+   and the functions taking them return NULL if the handle is NULL.
+ */
+typedef struct product_entry product_handle;
+
+extern product_handle *get_product_handle(update_session *session,
+                                          const char *product);
+extern const char *get_handle_name(product_handle *product);
+extern const char *get_handle_version(product_handle *product);
+extern const char *get_handle_description(product_handle *product);
+extern const char *get_handle_root(product_handle *product);
+extern const char *get_handle_url(product_handle *product);
+extern const char *get_handle_component(product_handle *product);
+
+/* The add-on components installed with a product, besides the default
+   one, as read from its manifest when the product list was loaded */
+extern int get_num_components(product_handle *product);
+extern const char *get_component_name(product_handle *product, int component);
+extern const char *get_component_version(product_handle *product,
+                                         int component);
+
+extern void free_product_list(update_session *session);
 
 extern int is_product_path(const char *product);
-extern const char *link_product_path(const char *path);
+extern const char *link_product_path(update_session *session, const char *path);
+
+/* The most install paths of one product updated at once */
+#define MAX_PRODUCT_ROOTS   32
+
+/* Add another install path of a product that has already been loaded,
+   so its updates are downloaded once and applied to all of them at once.
+   Returns 0, or -1 if the path doesn't hold the same version of the
+   product.
+ */
+extern int add_product_root(update_session *session,
+                            const char *product, const char *path);
+
+/* Fill in the install paths of a product, the usual one first, and
+   return how many there are.
+ */
+extern int get_product_roots(update_session *session, const char *product,
+                             const char *roots[], int maxroots);
+extern int get_handle_roots(product_handle *product,
+                            const char *roots[], int maxroots);
+
+#endif /* _load_products_h */
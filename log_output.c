@@ -22,23 +22,23 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+#include "session.h"
 #include "log_output.h"
 
-static int log_level = LOG_NORMAL;
-
+/* The log level belongs to the session of the thread doing the logging */
 void set_logging(int level)
 {
-    log_level = level;
+    get_session()->log_level = level;
 }
 
 int get_logging(void)
 {
-    return(log_level);
+    return(get_session()->log_level);
 }
 
 void log(int level, const char *fmt, ...)
 {
-    if ( level >= log_level ) {
+    if ( level >= get_session()->log_level ) {
         va_list ap;
 
         va_start(ap, fmt);
@@ -35,6 +35,11 @@
 #include "url_paths.h"
 #include "meta_url.h"
 #include "get_url.h"
+#include "multi_get.h"
+#include "mirror_race.h"
+#include "apply_queue.h"
+#include "schedule.h"
+#include "artifact_cache.h"
 #include "load_products.h"
 
 
@@ -44,11 +49,21 @@ static void print_usage(char *argv0)
 {
     fprintf(stderr,
 _("Loki Update Tool %s\n"
-  "Usage: %s [options] [product or install directory]\n"
+  "Usage: %s [options] [product or install directory...]\n"
   "The options can be any of:\n"
   "    --verbose               Print verbose messages to standard output\n"
   "    --noselfcheck           Skip check for updates for the update tool\n"
   "    --tmppath PATH          Use PATH as the temporary download path\n"
+  "    --segments NUM          Download large updates from NUM mirrors at once\n"
+  "    --race NUM              Connect to NUM mirrors at once, use the fastest\n"
+  "    --stall-timeout SECS    Try another mirror if no data arrives for SECS\n"
+  "    --min-rate RATE         Try another mirror if slower than RATE K/s\n"
+  "    --rate-window SECS      Measure the download rate over SECS seconds\n"
+  "    --pipeline NUM          Download NUM updates ahead of the one applied\n"
+  "    --downloads NUM         Download up to NUM updates at once\n"
+  "    --host-downloads NUM    Download up to NUM updates at once from a site\n"
+  "    --in-order              Download updates in order, not smallest first\n"
+  "    --cache-size MB         Keep up to MB of verified updates for reuse\n"
   "    --update_url URL        Use URL as the list of product updates\n"),
             VERSION, argv0);
 }
@@ -60,7 +75,7 @@ static void init_locale(void)
 	textdomain (PACKAGE);
 }
 
-static void goto_installpath(char *argv0)
+static void goto_installpath(update_session *session, char *argv0)
 {
     char temppath[PATH_MAX];
     char datapath[PATH_MAX];
@@ -69,7 +84,7 @@ static void goto_installpath(char *argv0)
     /* First save the original working directory (for file loading, etc.) */
     strcpy(temppath, ".");
     getcwd(temppath, sizeof(temppath));
-    set_working_path(temppath);
+    set_working_path(session, temppath);
     { static char env[PATH_MAX];
       sprintf(env, "UPDATE_CWD=%s", temppath);
       putenv(env);
@@ -156,8 +171,15 @@ int main(int argc, char *argv[])
     const char *tmppath;
     const char *meta_url;
     const char *update_url;
-    int i;
+    int stall_timeout, rate_window;
+    float min_rate;
+    int max_downloads, max_host_downloads;
+    int i, other_roots;
     update_UI *ui;
+    update_session *session;
+
+    /* The products are loaded and updated in the main thread's session */
+    session = get_session();
 
     /* Seed the random number generator for choosing URLs */
     srand(time(NULL));
@@ -173,6 +195,11 @@ int main(int argc, char *argv[])
     tmppath = NULL;
     meta_url = NULL;
     update_url = NULL;
+    stall_timeout = DEFAULT_STALL_TIMEOUT;
+    min_rate = 0.0f;
+    rate_window = DEFAULT_RATE_WINDOW;
+    max_downloads = DEFAULT_MAX_DOWNLOADS;
+    max_host_downloads = DEFAULT_MAX_HOST_DOWNLOADS;
     for ( i=1; argv[i] && (argv[i][0] == '-'); ++i ) {
         if ( strcmp(argv[i], "--") == 0 ) {
             break;
@@ -208,6 +235,72 @@ int main(int argc, char *argv[])
             }
             tmppath = argv[++i];
         } else
+        if ( strcmp(argv[i], "--segments") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            set_segmented_download(atoi(argv[++i]));
+        } else
+        if ( strcmp(argv[i], "--race") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            set_connect_race(atoi(argv[++i]));
+        } else
+        if ( strcmp(argv[i], "--stall-timeout") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            stall_timeout = atoi(argv[++i]);
+        } else
+        if ( strcmp(argv[i], "--min-rate") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            min_rate = (float)atof(argv[++i]);
+        } else
+        if ( strcmp(argv[i], "--rate-window") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            rate_window = atoi(argv[++i]);
+        } else
+        if ( strcmp(argv[i], "--pipeline") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            set_pipeline_depth(atoi(argv[++i]));
+        } else
+        if ( strcmp(argv[i], "--downloads") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            max_downloads = atoi(argv[++i]);
+        } else
+        if ( strcmp(argv[i], "--host-downloads") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            max_host_downloads = atoi(argv[++i]);
+        } else
+        if ( strcmp(argv[i], "--in-order") == 0 ) {
+            set_shortest_first(0);
+        } else
+        if ( strcmp(argv[i], "--cache-size") == 0 ) {
+            if ( ! argv[i+1] ) {
+                print_usage(argv[0]);
+                return(1);
+            }
+            set_artifact_cache_size(atoi(argv[++i]));
+        } else
         if ( strcmp(argv[i], "--meta_url") == 0 ) {
             if ( ! argv[i+1] ) {
                 print_usage(argv[0]);
@@ -247,15 +340,16 @@ int main(int argc, char *argv[])
         }
     }
     if ( !product && argv[i] && (argv[i][0] != '-') ) {
-        product = argv[i];
+        product = argv[i++];
     }
+    other_roots = i;
 
     /* If the product is a directory, see if it contains a .manifest
        that we can write to, and if so, add it to our list of products.
      */
     if ( is_product_path(product) ) {
         const char *new_product;
-        new_product = link_product_path(product);
+        new_product = link_product_path(session, product);
         if ( ! new_product ) {
             fprintf(stderr, _("Couldn't modify or link to %s\n"), product);
             exit(1);
@@ -264,22 +358,35 @@ int main(int argc, char *argv[])
     }
 
     /* Set correct run directory and scan for installed products */
-    goto_installpath(argv[0]);
-    load_product_list(product);
+    goto_installpath(session, argv[0]);
+    load_product_list(session, product);
     if ( product_path ) {
         if ( ! product ) {
             log(LOG_ERROR, _("Install path set, but no product specified\n"));
             return(1);
         }
-        set_product_root(product, product_path);
+        set_product_root(session, product, product_path);
+    }
+
+    /* Any other install directories of the product are updated with it */
+    for ( i=other_roots; argv[i] && (strcmp(argv[i], "--") != 0); ++i ) {
+        if ( ! product || ! is_valid_product(session, product) ) {
+            log(LOG_ERROR, _("Install path given, but no product found\n"));
+            return(1);
+        }
+        if ( add_product_root(session, product, argv[i]) < 0 ) {
+            return(1);
+        }
     }
     if ( tmppath ) {
-        set_tmppath(tmppath);
+        set_tmppath(session, tmppath);
     }
+    set_stall_limits(stall_timeout, min_rate, rate_window);
+    set_download_limits(max_downloads, max_host_downloads);
     if ( meta_url ) {
-        load_meta_url(meta_url);
+        load_meta_url(session, meta_url);
     }
-    set_override_url(update_url);
+    set_override_url(session, update_url);
 
     /* Initialize the UI */
     ui = NULL;
@@ -303,7 +410,7 @@ int main(int argc, char *argv[])
 #endif
     }
     if ( ui ) {
-        if ( ui->init(argc, argv) < 0 ) {
+        if ( ui->init(session, argc, argv) < 0 ) {
             return(3);
         }
     } else {
@@ -312,7 +419,7 @@ int main(int argc, char *argv[])
     }
 
     /* Stage 1: Update ourselves, if possible */
-    if ( self_check && (access(".", W_OK) == 0) && is_valid_product(PRODUCT) ) {
+    if ( self_check && (access(".", W_OK) == 0) && is_valid_product(session, PRODUCT) ) {
         switch (ui->auto_update(PRODUCT)) {
             /* An error? return an error code */
             case -1:
@@ -324,7 +431,7 @@ int main(int argc, char *argv[])
             /* Patched ourselves, restart */
             default:
                 ui->cleanup();
-                chdir(get_working_path());
+                chdir(get_working_path(session));
                 execvp(argv[0], argv);
                 fprintf(stderr, _("Couldn't exec ourselves!  Exiting\n"));
                 return(255);
@@ -336,7 +443,7 @@ int main(int argc, char *argv[])
         int status;
 
         if ( auto_update ) {
-            if ( product && ! is_valid_product(product) ) {
+            if ( product && ! is_valid_product(session, product) ) {
                 log(LOG_ERROR,
                     _("%s not found, are you the one who installed it?\n"),
                     product);
@@ -362,7 +469,7 @@ int main(int argc, char *argv[])
         for ( i=1; argv[i]; ++i ) {
             if ( strcmp(argv[i], "--") == 0 ) {
                 ++i;
-                chdir(get_working_path());
+                chdir(get_working_path(session));
                 execvp(argv[i], &argv[i]);
                 fprintf(stderr, _("Couldn't exec %s!  Exiting\n"), argv[i]);
                 return(255);
@@ -41,32 +41,32 @@ static int download_progress(int status_level, const char *status,
     return(0);
 }
 
-void load_meta_url(const char *meta_url)
+void load_meta_url(update_session *session, const char *meta_url)
 {
     char meta_file[PATH_MAX];
     struct text_fp *file;
+    char *data;
+    int size;
 
     /* Download the meta file so we can parse it */
-    compose_url(NULL, meta_url, meta_file, sizeof(meta_file));
-    if ( get_url(meta_file, meta_file, sizeof(meta_file),
-                 download_progress, NULL) != 0 ) {
-        unlink(meta_file);
+    compose_url(session, NULL, meta_url, meta_file, sizeof(meta_file));
+    if ( get_url_data(meta_file, &data, &size, MAX_TEXT_DOWNLOAD,
+                      download_progress, NULL) != 0 ) {
         return;
     }
 
     /* Open and parse the meta-file */
-    file = text_open(meta_file);
+    file = text_open_data(data, size);
     if ( file ) {
         char product_url[PATH_MAX];
         char key[1024], val[1024];
 
         while ( text_parsefield(file, key, sizeof(key), val, sizeof(val)) ) {
-            compose_url(meta_url, val, product_url, sizeof(product_url));
+            compose_url(session, meta_url, val, product_url, sizeof(product_url));
             log(LOG_DEBUG,
                 _("Setting product url for '%s' to: %s\n"), key, product_url);
-            set_product_url(key, product_url);
+            set_product_url(session, key, product_url);
         }
         text_close(file);
     }
-    unlink(meta_file);
 }
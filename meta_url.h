@@ -19,4 +19,6 @@
     info@lokigames.com
 */
 
-extern void load_meta_url(const char *meta_url);
+#include "session.h"
+
+extern void load_meta_url(update_session *session, const char *meta_url);
@@ -0,0 +1,396 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to connect to several mirrors at once and use the first one
+   that answers.
+
+   The connections are started a moment apart, in the order the mirrors
+   would have been tried, taking the first address of each mirror before
+   the second, and so on.  As soon as one connects the rest are closed.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef VERSION
+#undef VERSION
+#endif
+#include "config.h"
+#include "url.h"
+#include "util.h"
+/* We want our own versions of these, not the snarf macros */
+#undef safe_free
+#undef safe_strdup
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "mirror_stats.h"
+#include "mirror_race.h"
+#include "event_loop.h"
+#include "transfer.h"
+
+#ifndef INADDR_NONE
+#define INADDR_NONE     ((in_addr_t)-1)
+#endif
+
+#define MAX_RACE_MIRRORS    8
+#define MAX_RACE_ATTEMPTS   (MAX_RACE_MIRRORS*MAX_MIRROR_ADDRS)
+
+#define RACE_STAGGER        0.25        /* Seconds between connections */
+#define RACE_TIMEOUT        30.0        /* Seconds before giving up */
+
+static int race_mirrors = DEFAULT_RACE_MIRRORS;
+
+/* A mirror taking part in the race */
+typedef struct race_entry {
+    struct mirror_url *mirror;
+    char *host;
+    int port;
+    int num_addrs;
+    struct in_addr addrs[MAX_MIRROR_ADDRS];
+} race_entry;
+
+/* A single connection attempt */
+typedef struct race_attempt {
+    race_entry *entry;
+    struct in_addr addr;
+    int sock;                   /* -1 until started and after it fails */
+} race_attempt;
+
+
+void set_connect_race(int max_mirrors)
+{
+    if ( max_mirrors > MAX_RACE_MIRRORS ) {
+        max_mirrors = MAX_RACE_MIRRORS;
+    }
+    if ( max_mirrors < 2 ) {
+        max_mirrors = 0;
+    }
+    race_mirrors = max_mirrors;
+}
+
+int get_connect_race(void)
+{
+    return(race_mirrors);
+}
+
+/* Fill in the host and port for a mirror, returning 0 if it can't be raced */
+static int init_entry(race_entry *entry, struct mirror_url *mirror)
+{
+    Url *u;
+    int okay;
+
+    entry->mirror = mirror;
+    entry->host = NULL;
+    entry->num_addrs = 0;
+    okay = 0;
+    u = url_new();
+    if ( u && url_init(u, mirror->url) && u->host ) {
+        /* Proxied connections all go to the proxy, so there's no race */
+        switch (u->service_type) {
+            case SERVICE_HTTP:
+                if ( ! get_proxy("HTTP_PROXY") ) {
+                    entry->port = u->port ? u->port : 80;
+                    okay = 1;
+                }
+                break;
+            case SERVICE_FTP:
+                if ( ! get_proxy("FTP_PROXY") ) {
+                    entry->port = u->port ? u->port : 21;
+                    okay = 1;
+                }
+                break;
+            default:
+                break;
+        }
+        if ( okay ) {
+            entry->host = safe_strdup(u->host);
+        }
+    }
+    if ( u ) {
+        url_destroy(u);
+    }
+    return(okay);
+}
+
+/* Start connecting, returning 1 if connected already, 0 if in progress,
+   or -1 if the connection failed.
+ */
+static int start_attempt(race_attempt *attempt)
+{
+    struct sockaddr_in sa;
+    int flags;
+
+    attempt->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if ( attempt->sock < 0 ) {
+        return(-1);
+    }
+    flags = fcntl(attempt->sock, F_GETFL, 0);
+    fcntl(attempt->sock, F_SETFL, flags|O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(attempt->entry->port);
+    sa.sin_addr = attempt->addr;
+    log(LOG_DEBUG, "Connecting to %s (%s)\n",
+        attempt->entry->host, inet_ntoa(attempt->addr));
+    if ( connect(attempt->sock, (struct sockaddr *)&sa, sizeof(sa)) == 0 ) {
+        return(1);
+    }
+    if ( errno != EINPROGRESS ) {
+        close(attempt->sock);
+        attempt->sock = -1;
+        return(-1);
+    }
+    return(0);
+}
+
+/* Run the connection attempts, returning the index of the winner or -1 */
+static int run_race(race_attempt *attempts, int num_attempts,
+                    update_callback update, void *udata)
+{
+    fd_set wfds;
+    struct timeval tv;
+    double start_time, last_start, now;
+    int i, next, active, maxfd, winner, error;
+    socklen_t error_size;
+
+    start_time = double_time();
+    last_start = 0.0;
+    next = 0;
+    active = 0;
+    winner = -1;
+    while ( winner < 0 ) {
+        /* Start the next connection when it's due, or at once if all
+           the others have already failed */
+        now = double_time();
+        if ( (next < num_attempts) &&
+             ((active == 0) || ((now - last_start) >= RACE_STAGGER)) ) {
+            last_start = now;
+            switch (start_attempt(&attempts[next])) {
+                case 1:
+                    winner = next;
+                    break;
+                case 0:
+                    ++active;
+                    break;
+                default:
+                    break;
+            }
+            ++next;
+            continue;
+        }
+        if ( (active == 0) || ((now - start_time) >= RACE_TIMEOUT) ) {
+            break;
+        }
+
+        /* Wait for one of the connections to finish */
+        FD_ZERO(&wfds);
+        maxfd = -1;
+        for ( i=0; i<next; ++i ) {
+            if ( attempts[i].sock >= 0 ) {
+                FD_SET(attempts[i].sock, &wfds);
+                if ( attempts[i].sock > maxfd ) {
+                    maxfd = attempts[i].sock;
+                }
+            }
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+        if ( select(maxfd+1, NULL, &wfds, NULL, &tv) > 0 ) {
+            for ( i=0; (i<next) && (winner < 0); ++i ) {
+                if ( (attempts[i].sock < 0) ||
+                     ! FD_ISSET(attempts[i].sock, &wfds) ) {
+                    continue;
+                }
+                error_size = sizeof(error);
+                if ( (getsockopt(attempts[i].sock, SOL_SOCKET, SO_ERROR,
+                                 &error, &error_size) == 0) && ! error ) {
+                    winner = i;
+                } else {
+                    log(LOG_DEBUG, "Connection to %s failed\n",
+                        attempts[i].entry->host);
+                    close(attempts[i].sock);
+                    attempts[i].sock = -1;
+                    --active;
+                }
+            }
+        }
+        if ( update && update(0, NULL, 0.0f, 0, 0, 0.0f, udata) ) {
+            break;
+        }
+    }
+
+    /* Close all the connections except the winner */
+    for ( i=0; i<next; ++i ) {
+        if ( (i != winner) && (attempts[i].sock >= 0) ) {
+            close(attempts[i].sock);
+            attempts[i].sock = -1;
+        }
+    }
+    return(winner);
+}
+
+/* Look up all the mirrors that haven't been seen before at the same time,
+   so one slow name server doesn't hold up the others.
+ */
+static void lookup_entries(race_entry *entries, int num_entries,
+                           update_callback update, void *udata)
+{
+    url_transfer *lookups[MAX_RACE_MIRRORS];
+    int i, running;
+
+    running = 0;
+    for ( i=0; i<num_entries; ++i ) {
+        lookups[i] = NULL;
+        if ( (inet_addr(entries[i].host) == INADDR_NONE) &&
+             need_mirror_lookup(entries[i].host) ) {
+            lookups[i] = transfer_start_lookup(entries[i].host, NULL, NULL);
+            if ( lookups[i] ) {
+                ++running;
+            }
+        }
+    }
+    while ( running > 0 ) {
+        if ( update && update(0, NULL, 0.0f, 0, 0, 0.0f, udata) ) {
+            break;
+        }
+        event_poll(50);
+        running = 0;
+        for ( i=0; i<num_entries; ++i ) {
+            if ( lookups[i] && (transfer_poll(lookups[i]) > 0) ) {
+                ++running;
+            }
+        }
+    }
+    for ( i=0; i<num_entries; ++i ) {
+        if ( lookups[i] ) {
+            if ( (lookups[i]->state == TRANSFER_DONE) ||
+                 (lookups[i]->state == TRANSFER_FAILED) ) {
+                set_mirror_addresses(entries[i].host, lookups[i]->addrs,
+                                     lookups[i]->num_addrs);
+            }
+            transfer_free(lookups[i]);
+        }
+    }
+}
+
+const char *race_next_url(urlset *mirrors, const char *file,
+                          update_callback update, void *udata)
+{
+    const char *url;
+    struct mirror_url *first, *mirror;
+    race_entry entries[MAX_RACE_MIRRORS];
+    race_attempt attempts[MAX_RACE_ATTEMPTS];
+    int i, a, num_entries, num_attempts, winner, flags;
+    char text[1024];
+
+    url = get_next_url(mirrors, file);
+    if ( ! url || (race_mirrors < 2) ) {
+        return(url);
+    }
+
+    /* Race the mirror we'd have used against the next few good ones */
+    num_entries = 0;
+    first = mirrors->current;
+    mirror = first;
+    do {
+        if ( (mirror->status == URL_OK) &&
+             ((mirror == first) ||
+              (mirror->host && (mirror->host->health == MIRROR_OK))) ) {
+            if ( init_entry(&entries[num_entries], mirror) ) {
+                ++num_entries;
+            } else
+            if ( mirror == first ) {
+                /* Local files and proxied mirrors are just used */
+                return(url);
+            }
+        }
+        mirror = mirror->next;
+        if ( ! mirror ) {
+            mirror = mirrors->list;
+        }
+    } while ( (mirror != first) && (num_entries < race_mirrors) );
+    if ( num_entries < 2 ) {
+        for ( i=0; i<num_entries; ++i ) {
+            free(entries[i].host);
+        }
+        return(url);
+    }
+
+    /* Look up the mirrors, only the first time each one is seen */
+    lookup_entries(entries, num_entries, update, udata);
+    for ( i=0; i<num_entries; ++i ) {
+        entries[i].addrs[0].s_addr = inet_addr(entries[i].host);
+        if ( entries[i].addrs[0].s_addr != INADDR_NONE ) {
+            entries[i].num_addrs = 1;
+        } else {
+            entries[i].num_addrs =
+                lookup_mirror_addresses(entries[i].host, entries[i].addrs,
+                                        MAX_MIRROR_ADDRS, update, udata);
+        }
+    }
+
+    /* Take the first address of each mirror, then the second, ... */
+    num_attempts = 0;
+    for ( a=0; a<MAX_MIRROR_ADDRS; ++a ) {
+        for ( i=0; i<num_entries; ++i ) {
+            if ( a < entries[i].num_addrs ) {
+                attempts[num_attempts].entry = &entries[i];
+                attempts[num_attempts].addr = entries[i].addrs[a];
+                attempts[num_attempts].sock = -1;
+                ++num_attempts;
+            }
+        }
+    }
+
+    sprintf(text, _("Connecting to %d mirrors"), num_entries);
+    update_message(LOG_VERBOSE, text, update, udata);
+    winner = run_race(attempts, num_attempts, update, udata);
+    if ( winner >= 0 ) {
+        /* Hand the connection over for the download */
+        flags = fcntl(attempts[winner].sock, F_GETFL, 0);
+        fcntl(attempts[winner].sock, F_SETFL, flags & ~O_NONBLOCK);
+        mirror = attempts[winner].entry->mirror;
+        if ( mirror->host ) {
+            keep_mirror_socket(mirror->host, attempts[winner].sock,
+                               attempts[winner].entry->port);
+        } else {
+            close(attempts[winner].sock);
+        }
+        url = set_current_url(mirrors, mirror, file);
+        sprintf(text, _("%s answered first"), attempts[winner].entry->host);
+        update_message(LOG_VERBOSE, text, update, udata);
+    }
+    for ( i=0; i<num_entries; ++i ) {
+        free(entries[i].host);
+    }
+    return(url);
+}
@@ -0,0 +1,50 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to connect to several mirrors at once and use the first one
+   that answers, so a mirror that doesn't respond at all doesn't hold up
+   the download until the connection times out.
+*/
+
+#ifndef _mirror_race_h
+#define _mirror_race_h
+
+#include "update.h"
+#include "urlset.h"
+
+/* The number of mirrors raced by default */
+#define DEFAULT_RACE_MIRRORS    3
+
+/* Set the number of mirrors to connect to at once, or 0 to turn it off */
+extern void set_connect_race(int max_mirrors);
+extern int get_connect_race(void);
+
+/* Get the next URL to be tried for an update, like get_next_url(), but
+   connect to it and the few mirrors after it at the same time, trying
+   every address of each mirror a moment apart.  The first mirror to
+   accept a connection becomes the current mirror, and its connection is
+   used by the next download from it.  If none of them answer, this
+   returns the URL get_next_url() would have.
+ */
+extern const char *race_next_url(urlset *mirrors, const char *file,
+                                 update_callback update, void *udata);
+
+#endif /* _mirror_race_h */
@@ -0,0 +1,529 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A process-wide registry of mirror hosts
+
+   Child processes report back to the parent with lines of text:
+        S <failed> <connect time> <rate> <bytes> <url>  A finished download
+        H <health> <host>                               A host's health
+        U <status> <url>                                A mirror URL's status
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef VERSION
+#undef VERSION
+#endif
+#include "config.h"
+#include "url.h"
+#include "util.h"
+/* We want our own versions of these, not the snarf macros */
+#undef safe_free
+#undef safe_strdup
+
+#include "safe_malloc.h"
+#include "prefpath.h"
+#include "log_output.h"
+#include "urlset.h"
+#include "mirror_stats.h"
+
+#define MIRROR_STATS_FILE   "mirror_stats.txt"
+
+/* How much weight the latest transfer has in the averages */
+#define STATS_WEIGHT        0.3
+
+/* Downloads smaller than this are mostly connection setup, so their
+   speed doesn't say much about the mirror.
+ */
+#define MIN_RATE_BYTES      (64*1024)
+
+/* Mirrors that failed recently are avoided for this many seconds */
+#define RECENT_FAILURE      (60*60)
+
+/* Connections held for longer than this many seconds aren't used */
+#define MAX_IDLE_TIME       15
+
+#ifndef INADDR_NONE
+#define INADDR_NONE     ((in_addr_t)-1)
+#endif
+
+static mirror_host *host_list = NULL;
+static int stats_loaded = 0;
+
+static char *preferred_site = NULL;
+static int preferred_loaded = 0;
+
+/* The pipe back to the parent, in a child process */
+static int report_fd = -1;
+
+static mirror_host *add_mirror_host(const char *host)
+{
+    mirror_host *mirror;
+
+    mirror = (mirror_host *)safe_malloc(sizeof *mirror);
+    mirror->host = safe_strdup(host);
+    mirror->rate = 0.0;
+    mirror->latency = 0.0;
+    mirror->failure_rate = 0.0;
+    mirror->last_failure = 0;
+    mirror->transfers = 0;
+    mirror->health = MIRROR_OK;
+    mirror->lookup = LOOKUP_NONE;
+    mirror->num_addrs = 0;
+    mirror->connections = 0;
+    mirror->idle_sock = -1;
+    mirror->idle_port = 0;
+    mirror->idle_since = 0;
+    mirror->next = host_list;
+    host_list = mirror;
+    return(mirror);
+}
+
+static void load_mirror_stats(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char host[PATH_MAX];
+    double rate, latency, failure_rate;
+    long last_failure;
+    int transfers;
+    mirror_host *mirror;
+
+    stats_loaded = 1;
+    preferences_path(MIRROR_STATS_FILE, path, sizeof(path));
+    fp = fopen(path, "r");
+    if ( ! fp ) {
+        return;
+    }
+    while ( fgets(path, sizeof(path), fp) ) {
+        if ( sscanf(path, "%s %lf %lf %lf %ld %d", host, &rate, &latency,
+                    &failure_rate, &last_failure, &transfers) == 6 ) {
+            mirror = add_mirror_host(host);
+            mirror->rate = rate;
+            mirror->latency = latency;
+            mirror->failure_rate = failure_rate;
+            mirror->last_failure = (time_t)last_failure;
+            mirror->transfers = transfers;
+        }
+    }
+    fclose(fp);
+}
+
+/* Write out the statistics, replacing the old ones all at once.  Only
+   the parent process saves them, but another run of the update tool may
+   be saving at the same time, so each run writes a file of its own.
+ */
+static void save_mirror_stats(void)
+{
+    FILE *fp;
+    char path[PATH_MAX];
+    char newpath[PATH_MAX+32];
+    mirror_host *mirror;
+    int okay;
+
+    preferences_path(MIRROR_STATS_FILE, path, sizeof(path));
+    sprintf(newpath, "%s.%d", path, (int)getpid());
+    fp = fopen(newpath, "w");
+    if ( ! fp ) {
+        log(LOG_WARNING, _("Unable to write to %s\n"), newpath);
+        return;
+    }
+    for ( mirror = host_list; mirror; mirror = mirror->next ) {
+        if ( mirror->transfers ) {
+            fprintf(fp, "%s %.2f %.3f %.3f %ld %d\n", mirror->host,
+                    mirror->rate, mirror->latency, mirror->failure_rate,
+                    (long)mirror->last_failure, mirror->transfers);
+        }
+    }
+    okay = ! ferror(fp);
+    if ( (fclose(fp) != 0) || ! okay || (rename(newpath, path) < 0) ) {
+        log(LOG_WARNING, _("Unable to write to %s\n"), path);
+        unlink(newpath);
+    }
+}
+
+static void send_mirror_report(const char *fmt, ...)
+{
+    va_list ap;
+    char text[PATH_MAX+128];
+    const char *data;
+    int len, count;
+
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+
+    /* The parent is gone if the pipe is broken, so nothing else matters */
+    data = text;
+    len = strlen(text);
+    while ( len > 0 ) {
+        count = write(report_fd, data, len);
+        if ( count <= 0 ) {
+            _exit(1);
+        }
+        data += count;
+        len -= count;
+    }
+}
+
+static mirror_host *find_mirror_host(const char *host)
+{
+    mirror_host *mirror;
+
+    if ( ! stats_loaded ) {
+        load_mirror_stats();
+    }
+    for ( mirror = host_list; mirror; mirror = mirror->next ) {
+        if ( strcasecmp(mirror->host, host) == 0 ) {
+            break;
+        }
+    }
+    if ( ! mirror ) {
+        mirror = add_mirror_host(host);
+    }
+    return(mirror);
+}
+
+mirror_host *get_mirror_host(const char *url)
+{
+    char host[PATH_MAX];
+
+    if ( ! get_url_host(url, host, sizeof(host)) ) {
+        return(NULL);
+    }
+    return(find_mirror_host(host));
+}
+
+static double average(double value, double sample)
+{
+    return(value + STATS_WEIGHT * (sample - value));
+}
+
+void record_mirror_transfer(const char *url, double connect_time,
+                            float rate, long bytes, int failed)
+{
+    mirror_host *mirror;
+
+    /* Local files don't have a mirror host */
+    mirror = get_mirror_host(url);
+    if ( ! mirror ) {
+        return;
+    }
+
+    /* The first transfer sets the averages, later ones move them */
+    if ( mirror->transfers == 0 ) {
+        mirror->failure_rate = failed ? 1.0 : 0.0;
+        if ( connect_time >= 0.0 ) {
+            mirror->latency = connect_time;
+        }
+        if ( bytes >= MIN_RATE_BYTES ) {
+            mirror->rate = rate;
+        }
+    } else {
+        mirror->failure_rate = average(mirror->failure_rate, failed ? 1.0 : 0.0);
+        if ( connect_time >= 0.0 ) {
+            mirror->latency = average(mirror->latency, connect_time);
+        }
+        if ( bytes >= MIN_RATE_BYTES ) {
+            if ( mirror->rate > 0.0 ) {
+                mirror->rate = average(mirror->rate, rate);
+            } else {
+                mirror->rate = rate;
+            }
+        }
+    }
+    if ( failed ) {
+        mirror->last_failure = time(NULL);
+    } else {
+        mirror->health = MIRROR_OK;
+    }
+    ++mirror->transfers;
+
+    log(LOG_DEBUG, "Mirror %s: %.2f K/s, %.3f s latency, %.0f%% failures\n",
+        mirror->host, mirror->rate, mirror->latency, mirror->failure_rate*100.0);
+
+    /* Only the parent saves the statistics, so they aren't lost */
+    if ( report_fd >= 0 ) {
+        send_mirror_report("S %d %.3f %.2f %ld %s\n", failed, connect_time,
+                           (double)rate, bytes, url);
+    } else {
+        save_mirror_stats();
+    }
+}
+
+void set_mirror_health(mirror_host *mirror, enum mirror_health health)
+{
+    /* The parent may not have heard yet, even if we have */
+    if ( mirror && (report_fd >= 0) ) {
+        send_mirror_report("H %d %s\n", (int)health, mirror->host);
+    }
+    if ( mirror && (mirror->health != health) ) {
+        log(LOG_DEBUG, "Mirror %s is now %s\n", mirror->host,
+            (health == MIRROR_OK) ? "okay" :
+            (health == MIRROR_SLOW) ? "slow" : "failing");
+        mirror->health = health;
+    }
+}
+
+double score_mirror(const char *url)
+{
+    mirror_host *mirror;
+    double score;
+
+    mirror = get_mirror_host(url);
+    if ( ! mirror ) {
+        return(-1.0);
+    }
+
+    /* Hosts that have let us down during this run go to the back */
+    if ( mirror->health == MIRROR_FAILED ) {
+        return(0.0);
+    }
+    if ( mirror->transfers == 0 ) {
+        return(-1.0);
+    }
+
+    /* Fast mirrors that answer quickly and don't fail are best.
+       Mirrors we haven't seen complete a transfer count as slow.
+     */
+    score = (mirror->rate + 1.0) * (1.0 - mirror->failure_rate);
+    score /= (1.0 + mirror->latency);
+    if ( (time(NULL) - mirror->last_failure) < RECENT_FAILURE ) {
+        score /= 2.0;
+    }
+    if ( mirror->health == MIRROR_SLOW ) {
+        score /= 4.0;
+    }
+    return(score);
+}
+
+int need_mirror_lookup(const char *host)
+{
+    return(find_mirror_host(host)->lookup == LOOKUP_NONE);
+}
+
+void set_mirror_addresses(const char *host,
+                          const struct in_addr *addrs, int count)
+{
+    mirror_host *mirror;
+
+    mirror = find_mirror_host(host);
+    if ( count > 0 ) {
+        if ( count > MAX_MIRROR_ADDRS ) {
+            count = MAX_MIRROR_ADDRS;
+        }
+        memcpy(mirror->addrs, addrs, count*(sizeof *addrs));
+        mirror->num_addrs = count;
+        mirror->lookup = LOOKUP_OKAY;
+    } else {
+        /* Don't keep asking for a host that isn't there */
+        log(LOG_VERBOSE, _("Unable to look up %s\n"), host);
+        mirror->lookup = LOOKUP_FAILED;
+        set_mirror_health(mirror, MIRROR_FAILED);
+    }
+}
+
+int lookup_mirror_addresses(const char *host,
+                            struct in_addr *addrs, int max_addrs,
+                            update_callback update, void *udata)
+{
+    mirror_host *mirror;
+    struct in_addr found[MAX_MIRROR_ADDRS];
+    int count;
+
+    mirror = find_mirror_host(host);
+    if ( mirror->lookup == LOOKUP_NONE ) {
+        count = gethostbyname_list_async(host, found, MAX_MIRROR_ADDRS,
+                                         update, udata);
+        set_mirror_addresses(host, found, count);
+    }
+    if ( mirror->lookup != LOOKUP_OKAY ) {
+        return(-1);
+    }
+    if ( max_addrs > mirror->num_addrs ) {
+        max_addrs = mirror->num_addrs;
+    }
+    memcpy(addrs, mirror->addrs, max_addrs*(sizeof *addrs));
+    return(max_addrs);
+}
+
+int lookup_mirror_address(const char *host, struct sockaddr_in *sa,
+                          update_callback update, void *udata)
+{
+    if ( lookup_mirror_addresses(host, &sa->sin_addr, 1, update, udata) < 0 ) {
+        sa->sin_addr.s_addr = INADDR_NONE;
+        return(-1);
+    }
+    return(0);
+}
+
+void keep_mirror_socket(mirror_host *mirror, int sock, int port)
+{
+    if ( mirror->idle_sock >= 0 ) {
+        close(mirror->idle_sock);
+    }
+    mirror->idle_sock = sock;
+    mirror->idle_port = port;
+    mirror->idle_since = time(NULL);
+}
+
+int take_mirror_socket(const char *host, int port)
+{
+    mirror_host *mirror;
+    int len, sock;
+
+    /* The mirror host names include the port, if there is one */
+    len = strlen(host);
+    for ( mirror = host_list; mirror; mirror = mirror->next ) {
+        if ( (mirror->idle_sock >= 0) && (mirror->idle_port == port) &&
+             (strncasecmp(mirror->host, host, len) == 0) &&
+             ((mirror->host[len] == '\0') || (mirror->host[len] == ':')) ) {
+            break;
+        }
+    }
+    if ( ! mirror ) {
+        return(-1);
+    }
+    sock = mirror->idle_sock;
+    mirror->idle_sock = -1;
+
+    /* The server has probably given up on a connection this old */
+    if ( (time(NULL) - mirror->idle_since) > MAX_IDLE_TIME ) {
+        close(sock);
+        return(-1);
+    }
+    return(sock);
+}
+
+void forget_mirror_sockets(void)
+{
+    mirror_host *mirror;
+
+    for ( mirror = host_list; mirror; mirror = mirror->next ) {
+        if ( mirror->idle_sock >= 0 ) {
+            close(mirror->idle_sock);
+            mirror->idle_sock = -1;
+        }
+    }
+}
+
+void report_mirrors(int fd)
+{
+    report_fd = fd;
+}
+
+void report_url_status(const char *url, enum url_status status)
+{
+    if ( report_fd >= 0 ) {
+        send_mirror_report("U %d %s\n", (int)status, url);
+    }
+}
+
+int read_mirror_report(const char *line, urlset *mirrors)
+{
+    double connect_time, rate;
+    long bytes;
+    int value, failed, offset;
+
+    switch (line[0]) {
+        case 'S':
+            offset = 0;
+            if ( (sscanf(line+1, " %d %lf %lf %ld %n", &failed, &connect_time,
+                         &rate, &bytes, &offset) == 4) && offset ) {
+                record_mirror_transfer(line+1+offset, connect_time,
+                                       (float)rate, bytes, failed);
+            }
+            return(1);
+        case 'H':
+            offset = 0;
+            if ( (sscanf(line+1, " %d %n", &value, &offset) == 1) && offset ) {
+                set_mirror_health(find_mirror_host(line+1+offset),
+                                  (enum mirror_health)value);
+            }
+            return(1);
+        case 'U':
+            offset = 0;
+            if ( mirrors &&
+                 (sscanf(line+1, " %d %n", &value, &offset) == 1) && offset ) {
+                set_mirror_url_status(mirrors, line+1+offset,
+                                      (enum url_status)value);
+            }
+            return(1);
+        default:
+            break;
+    }
+    return(0);
+}
+
+const char *get_preferred_mirror(void)
+{
+    FILE *fp;
+    char preferred_mirror[PATH_MAX];
+
+    if ( ! preferred_loaded ) {
+        preferred_loaded = 1;
+        preferences_path("preferred_mirror.txt",
+                         preferred_mirror, sizeof(preferred_mirror));
+        fp = fopen(preferred_mirror, "r");
+        if ( fp ) {
+            if ( fgets(preferred_mirror, sizeof(preferred_mirror), fp) ) {
+                preferred_mirror[strlen(preferred_mirror)-1] = '\0';
+                if ( preferred_mirror[0] ) {
+                    preferred_site = safe_strdup(preferred_mirror);
+                }
+            }
+            fclose(fp);
+        }
+    }
+    return(preferred_site);
+}
+
+void set_preferred_mirror(const char *host)
+{
+    preferred_loaded = 1;
+    safe_free(preferred_site);
+    preferred_site = host ? safe_strdup(host) : NULL;
+}
+
+void save_preferred_mirror(void)
+{
+    FILE *fp;
+    char mirror_file[PATH_MAX];
+
+    /* Write it out to disk */
+    preferences_path("preferred_mirror.txt", mirror_file, sizeof(mirror_file));
+    fp = fopen(mirror_file, "w");
+    if ( fp ) {
+        fprintf(fp, "%s\n", preferred_site ? preferred_site : "");
+        fclose(fp);
+    } else {
+        log(LOG_WARNING, _("Unable to write to %s\n"), mirror_file);
+    }
+}
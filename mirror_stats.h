@@ -0,0 +1,152 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* A process-wide registry of mirror hosts, shared by all the sets of
+   mirror URLs, remembering how fast and reliable each host has been and
+   what has happened to it during this run.  A host that fails while one
+   product is being updated is then tried last for the other products.
+
+   The statistics are kept in "mirror_stats.txt" in the preferences
+   directory, one host per line.  Downloads running in child processes
+   send what they find out about the mirrors back to the parent, which
+   keeps it for the rest of the run and saves it.
+*/
+
+#ifndef _mirror_stats_h
+#define _mirror_stats_h
+
+#include <time.h>
+#include <netinet/in.h>
+
+#include "update.h"
+#include "urlset.h"
+
+/* The most addresses remembered for each host */
+#define MAX_MIRROR_ADDRS    4
+
+typedef struct mirror_host {
+    char *host;
+
+    /* Statistics saved between runs */
+    double rate;                /* Average download speed in K/s */
+    double latency;             /* Average seconds until data arrives */
+    double failure_rate;        /* Average of 1 for failure, 0 for success */
+    time_t last_failure;
+    int transfers;
+
+    /* The state of the host during this run */
+    enum mirror_health {
+        MIRROR_OK,
+        MIRROR_SLOW,
+        MIRROR_FAILED
+    } health;
+    enum {
+        LOOKUP_NONE,
+        LOOKUP_OKAY,
+        LOOKUP_FAILED
+    } lookup;
+    int num_addrs;
+    struct in_addr addrs[MAX_MIRROR_ADDRS];
+    int connections;            /* Transfers in progress */
+    int idle_sock;              /* A connection waiting to be used, or -1 */
+    int idle_port;
+    time_t idle_since;
+
+    struct mirror_host *next;
+} mirror_host;
+
+/* Get the registry entry for the host in a URL, adding it if needed.
+   Returns NULL if the URL doesn't have a host, e.g. local files.
+ */
+extern mirror_host *get_mirror_host(const char *url);
+
+/* Record how a download from a URL went.  'connect_time' is the time it
+   took for the data to start arriving, or less than zero if it never did,
+   and 'rate' is the average speed in K/s over 'bytes' bytes of data.
+   Downloads cancelled by the user shouldn't be recorded.
+ */
+extern void record_mirror_transfer(const char *url, double connect_time,
+                                   float rate, long bytes, int failed);
+
+/* Note a problem with a host, or that it's working again */
+extern void set_mirror_health(mirror_host *mirror, enum mirror_health health);
+
+/* How good a mirror is expected to be, higher is better.
+   Returns a negative number if nothing is known about the mirror.
+ */
+extern double score_mirror(const char *url);
+
+/* Look up the address of a host, only asking the DNS once per run.
+   The arguments are as for gethostbyname_async() in the snarf code.
+ */
+extern int lookup_mirror_address(const char *host, struct sockaddr_in *sa,
+                                 update_callback update, void *udata);
+
+/* Look up all the addresses of a host, up to 'max_addrs', returning the
+   number found or -1 if the host couldn't be found.
+ */
+extern int lookup_mirror_addresses(const char *host,
+                                   struct in_addr *addrs, int max_addrs,
+                                   update_callback update, void *udata);
+
+/* Returns 1 if a host hasn't been looked up yet during this run */
+extern int need_mirror_lookup(const char *host);
+
+/* Remember the addresses of a host looked up some other way, e.g. with a
+   lookup transfer.  A count of zero or less means the host wasn't found.
+ */
+extern void set_mirror_addresses(const char *host,
+                                 const struct in_addr *addrs, int count);
+
+/* Hold on to a connection to a host until the next transfer from it */
+extern void keep_mirror_socket(mirror_host *mirror, int sock, int port);
+
+/* Take a connection made with keep_mirror_socket(), or return -1 if there
+   isn't one for that host and port.
+ */
+extern int take_mirror_socket(const char *host, int port);
+
+/* Close all the connections being held, e.g. in a child process */
+extern void forget_mirror_sockets(void);
+
+/* In a child process, send what is found out about the mirrors to the
+   parent over a pipe instead of saving it.  The parent passes each line
+   it reads from the pipe to read_mirror_report().
+ */
+extern void report_mirrors(int fd);
+
+/* Pass a new status of a mirror URL on to the parent, in a child process
+   reporting to it.
+ */
+extern void report_url_status(const char *url, enum url_status status);
+
+/* Apply a line sent by a child process, with the set of mirrors its URLs
+   belong to, or NULL if there isn't one.  Returns 1 if the line was
+   about the mirrors, or 0 if it wasn't.
+ */
+extern int read_mirror_report(const char *line, urlset *mirrors);
+
+/* The preferred mirror site, read from "preferred_mirror.txt" once */
+extern const char *get_preferred_mirror(void);
+extern void set_preferred_mirror(const char *host);
+extern void save_preferred_mirror(void);
+
+#endif /* _mirror_stats_h */
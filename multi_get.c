@@ -0,0 +1,1160 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to retrieve files over several HTTP connections at once.
+
+   A segmented download first asks one mirror for the start of the file
+   to learn its size, then splits the rest into byte ranges which are
+   handed out to the other mirrors.  When a mirror finishes its range and
+   there is nothing left to hand out, it takes over the tail of the range
+   with the most data left, split in proportion to the two mirrors' speed,
+   so the faster mirrors end up carrying most of the file.
+
+   If there is a block list for the file, each block is checked once all
+   of it has arrived.  A bad block is fetched again, and the mirrors which
+   sent it are dropped, or given an error if several mirrors sent parts.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#ifdef VERSION
+#undef VERSION
+#endif
+#include "config.h"
+#include "url.h"
+#include "util.h"
+/* We want our own versions of these, not the snarf macros */
+#undef safe_free
+#undef safe_strdup
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "get_url.h"
+#include "mirror_stats.h"
+#include "multi_get.h"
+
+#ifndef INADDR_NONE
+#define INADDR_NONE 0xffffffff
+#endif
+
+#define SEGMENT_MIN_SIZE    (128*1024)  /* Smallest range given a mirror */
+#define SEGMENT_CHUNKS      4           /* Initial ranges per mirror */
+#define MAX_SEGMENT_MIRRORS 8
+#define MAX_SOURCE_ERRORS   3           /* Dropped connections allowed */
+#define USER_AGENT          "Loki_Update"
+
+static int segmented_mirrors = 0;
+
+/* A byte range of the file being downloaded, inclusive of the end */
+typedef struct byte_range {
+    off_t start;
+    off_t end;
+} byte_range;
+
+/* A single HTTP request for a range of the file */
+typedef struct segment_fetch {
+    enum {
+        FETCH_CONNECTING,
+        FETCH_SENDING,
+        FETCH_HEADER,
+        FETCH_BODY
+    } state;
+    int sock;
+    off_t start;
+    off_t pos;
+    off_t end;                  /* -1 if the file size isn't known yet */
+    char *request;
+    int request_len;
+    int request_sent;
+    char header[BUFSIZE+1];
+    int header_len;
+    double start_time;
+    double last_active;         /* When the socket was last ready */
+} segment_fetch;
+
+/* A mirror participating in the download */
+typedef struct segment_source {
+    struct mirror_url *mirror;
+    char *url;
+    Url *parsed;
+    struct sockaddr_in addr;
+    int usable;
+    int errors;
+    off_t received;
+    double busy_time;
+    segment_fetch *fetch;
+} segment_source;
+
+/* The state of the whole download */
+typedef struct segment_job {
+    int fd;
+    off_t offset;               /* Bytes already on disk when we started */
+    off_t total;                /* -1 until the first response arrives */
+    off_t received;
+    Url *proxy;
+    int num_sources;
+    segment_source *sources;
+    int num_pending;
+    int max_pending;
+    byte_range *pending;
+    digest_context *digest;     /* Checksums of the file, if wanted */
+    off_t digested;             /* Bytes of the file checksummed so far */
+    block_sums *blocks;         /* Block list for the file, if there is one */
+    block_checker check;
+    digest_context block_digest; /* Checksums up to the current block */
+    unsigned int *block_sources; /* The mirrors which sent each block */
+} segment_job;
+
+
+void set_segmented_download(int max_mirrors)
+{
+    if ( max_mirrors > MAX_SEGMENT_MIRRORS ) {
+        max_mirrors = MAX_SEGMENT_MIRRORS;
+    }
+    if ( max_mirrors < 2 ) {
+        max_mirrors = 0;
+    }
+    segmented_mirrors = max_mirrors;
+}
+
+int get_segmented_download(void)
+{
+    return(segmented_mirrors);
+}
+
+/* Return the value of an HTTP header line, or NULL if it isn't present */
+static const char *find_header(const char *header, const char *key)
+{
+    const char *line;
+    int keylen;
+
+    keylen = strlen(key);
+    for ( line = header; line && *line; ) {
+        if ( (strncasecmp(line, key, keylen) == 0) && (line[keylen] == ':') ) {
+            line += keylen+1;
+            while ( (*line == ' ') || (*line == '\t') ) {
+                ++line;
+            }
+            return(line);
+        }
+        line = strchr(line, '\n');
+        if ( line ) {
+            ++line;
+        }
+    }
+    return(NULL);
+}
+
+/* Parse a "Content-Range: bytes first-last/total" header */
+static int parse_content_range(const char *value,
+                               off_t *first, off_t *last, off_t *total)
+{
+    if ( ! value || (strncasecmp(value, "bytes", 5) != 0) ) {
+        return(-1);
+    }
+    value += 5;
+    while ( isspace(*value) ) {
+        ++value;
+    }
+    if ( *value == '*' ) {
+        *first = -1;
+        *last = -1;
+        ++value;
+    } else {
+        *first = (off_t)strtoll(value, (char **)&value, 10);
+        if ( *value++ != '-' ) {
+            return(-1);
+        }
+        *last = (off_t)strtoll(value, (char **)&value, 10);
+    }
+    if ( *value++ != '/' ) {
+        return(-1);
+    }
+    if ( *value == '*' ) {
+        *total = -1;
+    } else {
+        *total = (off_t)strtoll(value, NULL, 10);
+    }
+    return(0);
+}
+
+static void add_pending_range(segment_job *job, off_t start, off_t end)
+{
+    int i;
+
+    if ( start > end ) {
+        return;
+    }
+    if ( job->num_pending == job->max_pending ) {
+        job->max_pending += 16;
+        job->pending = (byte_range *)safe_realloc(job->pending,
+                                job->max_pending*(sizeof *job->pending));
+    }
+
+    /* Keep the list sorted, so the file fills in from the front */
+    for ( i=job->num_pending; (i > 0) && (job->pending[i-1].start > start); --i ) {
+        job->pending[i] = job->pending[i-1];
+    }
+    job->pending[i].start = start;
+    job->pending[i].end = end;
+    ++job->num_pending;
+}
+
+/* Split the unclaimed part of the file into ranges for the mirrors */
+static void split_pending_ranges(segment_job *job, off_t start)
+{
+    off_t chunk;
+    int i, usable;
+
+    usable = 0;
+    for ( i=0; i<job->num_sources; ++i ) {
+        if ( job->sources[i].usable ) {
+            ++usable;
+        }
+    }
+    chunk = (job->total - start) / (usable * SEGMENT_CHUNKS);
+    if ( chunk < SEGMENT_MIN_SIZE ) {
+        chunk = SEGMENT_MIN_SIZE;
+    }
+    while ( start < job->total ) {
+        if ( (start + chunk) > job->total ) {
+            chunk = job->total - start;
+        }
+        add_pending_range(job, start, start+chunk-1);
+        start += chunk;
+    }
+}
+
+/* Everything before this point in the file has been written */
+static off_t contiguous_offset(segment_job *job)
+{
+    off_t frontier;
+    int i;
+
+    if ( job->total < 0 ) {
+        frontier = job->offset;
+        for ( i=0; i<job->num_sources; ++i ) {
+            if ( job->sources[i].fetch ) {
+                frontier = job->sources[i].fetch->pos;
+            }
+        }
+        return(frontier);
+    }
+    frontier = job->total;
+    for ( i=0; i<job->num_pending; ++i ) {
+        if ( job->pending[i].start < frontier ) {
+            frontier = job->pending[i].start;
+        }
+    }
+    for ( i=0; i<job->num_sources; ++i ) {
+        segment_fetch *fetch = job->sources[i].fetch;
+        if ( fetch && (fetch->pos < frontier) ) {
+            frontier = fetch->pos;
+        }
+    }
+    return(frontier);
+}
+
+static char *build_request(segment_job *job, segment_source *source,
+                           off_t start, off_t end)
+{
+    Url *u;
+    char *request;
+    char *auth, *auth64;
+    char range[128];
+
+    u = source->parsed;
+    if ( job->proxy ) {
+        request = strconcat("GET ", source->url, " HTTP/1.0\r\n",
+                            "Host: ", u->host, "\r\n", NULL);
+    } else {
+        request = strconcat("GET ", u->path, u->file, " HTTP/1.0\r\n",
+                            "Host: ", u->host, "\r\n", NULL);
+    }
+    if ( u->username && u->password ) {
+        auth = strconcat(u->username, ":", u->password, NULL);
+        auth64 = base64(auth, strlen(auth));
+        request = strconcat(request, "Authorization: Basic ",
+                            auth64, "\r\n", NULL);
+        free(auth64);
+        free(auth);
+    }
+    if ( end < 0 ) {
+        sprintf(range, "%lld-", (long long)start);
+    } else {
+        sprintf(range, "%lld-%lld", (long long)start, (long long)end);
+    }
+    request = strconcat(request, "Range: bytes=", range, "\r\n",
+                        "User-Agent: ", USER_AGENT, "\r\n\r\n", NULL);
+    return(request);
+}
+
+/* Start fetching a range of the file from the given mirror */
+static int start_fetch(segment_job *job, segment_source *source,
+                       off_t start, off_t end)
+{
+    segment_fetch *fetch;
+    int flags;
+
+    fetch = (segment_fetch *)safe_malloc(sizeof *fetch);
+    fetch->state = FETCH_CONNECTING;
+    fetch->start = start;
+    fetch->pos = start;
+    fetch->end = end;
+    fetch->request = build_request(job, source, start, end);
+    fetch->request_len = strlen(fetch->request);
+    fetch->request_sent = 0;
+    fetch->header_len = 0;
+    fetch->start_time = double_time();
+    fetch->last_active = fetch->start_time;
+
+    fetch->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if ( fetch->sock < 0 ) {
+        free(fetch->request);
+        free(fetch);
+        return(-1);
+    }
+    flags = fcntl(fetch->sock, F_GETFL, 0);
+    fcntl(fetch->sock, F_SETFL, flags|O_NONBLOCK);
+    if ( (connect(fetch->sock, (struct sockaddr *)&source->addr,
+                  sizeof(source->addr)) < 0) && (errno != EINPROGRESS) ) {
+        close(fetch->sock);
+        free(fetch->request);
+        free(fetch);
+        return(-1);
+    }
+    source->fetch = fetch;
+    if ( source->mirror->host ) {
+        ++source->mirror->host->connections;
+    }
+    log(LOG_DEBUG, "Requesting bytes %lld-%lld from %s\n",
+        (long long)start, (long long)end, source->url);
+    return(0);
+}
+
+/* Finish a fetch, putting back any part of the range we didn't get */
+static void finish_fetch(segment_job *job, segment_source *source, int okay)
+{
+    segment_fetch *fetch;
+
+    fetch = source->fetch;
+    if ( (fetch->pos > fetch->start) || okay ) {
+        source->busy_time += double_time() - fetch->start_time;
+    }
+    if ( ! okay && (fetch->end >= 0) && (job->total >= 0) ) {
+        add_pending_range(job, fetch->pos, fetch->end);
+    }
+    close(fetch->sock);
+    free(fetch->request);
+    free(fetch);
+    source->fetch = NULL;
+    if ( source->mirror->host ) {
+        --source->mirror->host->connections;
+    }
+}
+
+/* Stop using a mirror for this download, marking it failed if it's bad */
+static void drop_source(segment_job *job, segment_source *source,
+                        int failed, const char *reason)
+{
+    log(LOG_VERBOSE, _("Not using %s for segmented download: %s\n"),
+        source->url, reason);
+    if ( source->fetch ) {
+        finish_fetch(job, source, 0);
+    }
+    source->usable = 0;
+    if ( failed ) {
+        source->mirror->status = URL_FAILED;
+        set_mirror_health(source->mirror->host, MIRROR_FAILED);
+    }
+}
+
+/* A transient error, the mirror gets a few chances before being dropped */
+static void source_error(segment_job *job, segment_source *source)
+{
+    finish_fetch(job, source, 0);
+    if ( ++source->errors >= MAX_SOURCE_ERRORS ) {
+        drop_source(job, source, 1, _("too many errors"));
+    }
+}
+
+/* A mirror that has stopped sending data is tried again only after the
+   others, and the range it was working on is handed to another mirror.
+ */
+static void stall_source(segment_job *job, segment_source *source)
+{
+    drop_source(job, source, 0, _("transfer stalled"));
+    source->mirror->status = URL_SLOW;
+    ++source->mirror->times_slow;
+    set_mirror_health(source->mirror->host, MIRROR_SLOW);
+}
+
+/* Bytes per second this mirror has managed so far */
+static double source_rate(segment_source *source)
+{
+    double elapsed;
+    off_t received;
+
+    elapsed = source->busy_time;
+    received = source->received;
+    if ( source->fetch ) {
+        elapsed += double_time() - source->fetch->start_time;
+    }
+    if ( elapsed < 0.1 ) {
+        return(0.0);
+    }
+    return((double)received / elapsed);
+}
+
+/* Give an idle mirror part of the file to download */
+static void dispatch_source(segment_job *job, segment_source *source)
+{
+    segment_source *victim;
+    off_t remaining, most, share, start, end;
+    double rate, victim_rate;
+    int i;
+
+    /* Until we know the file size, only one mirror asks for the start */
+    if ( job->total < 0 ) {
+        for ( i=0; i<job->num_sources; ++i ) {
+            if ( job->sources[i].fetch ) {
+                return;
+            }
+        }
+        if ( start_fetch(job, source, job->offset,
+                         job->offset+SEGMENT_MIN_SIZE-1) < 0 ) {
+            drop_source(job, source, 0, strerror(errno));
+        }
+        return;
+    }
+
+    /* Take the next range nobody is working on */
+    if ( job->num_pending > 0 ) {
+        start = job->pending[0].start;
+        end = job->pending[0].end;
+        --job->num_pending;
+        memmove(&job->pending[0], &job->pending[1],
+                job->num_pending*(sizeof *job->pending));
+        if ( start_fetch(job, source, start, end) < 0 ) {
+            add_pending_range(job, start, end);
+            drop_source(job, source, 0, strerror(errno));
+        }
+        return;
+    }
+
+    /* Otherwise help out the mirror with the most left to do */
+    victim = NULL;
+    most = 0;
+    for ( i=0; i<job->num_sources; ++i ) {
+        segment_fetch *fetch = job->sources[i].fetch;
+        if ( fetch && (fetch->end >= 0) ) {
+            remaining = fetch->end - fetch->pos + 1;
+            if ( remaining > most ) {
+                victim = &job->sources[i];
+                most = remaining;
+            }
+        }
+    }
+    if ( ! victim || (most < 2*SEGMENT_MIN_SIZE) ) {
+        return;
+    }
+
+    /* Split the remaining data in proportion to how fast each mirror is */
+    rate = source_rate(source);
+    victim_rate = source_rate(victim);
+    if ( (rate <= 0.0) || (victim_rate <= 0.0) ) {
+        share = most / 2;
+    } else {
+        share = (off_t)((double)most * (rate / (rate + victim_rate)));
+    }
+    if ( share < SEGMENT_MIN_SIZE ) {
+        return;
+    }
+    if ( share > (most - SEGMENT_MIN_SIZE) ) {
+        share = most - SEGMENT_MIN_SIZE;
+    }
+    end = victim->fetch->end;
+    start = end - share + 1;
+    if ( start_fetch(job, source, start, end) == 0 ) {
+        victim->fetch->end = start - 1;
+    } else {
+        drop_source(job, source, 0, strerror(errno));
+    }
+}
+
+/* Remember which mirror sent data for each block */
+static void mark_blocks(segment_job *job, segment_source *source,
+                        off_t start, off_t len)
+{
+    int block, last;
+
+    block = (int)(start / job->blocks->block_size);
+    last = (int)((start + len - 1) / job->blocks->block_size);
+    if ( last >= job->blocks->num_blocks ) {
+        last = job->blocks->num_blocks - 1;
+    }
+    while ( block <= last ) {
+        job->block_sources[block++] |= (1 << (source - job->sources));
+    }
+}
+
+/* Write received data into place in the file */
+static int write_body(segment_job *job, segment_source *source,
+                      const char *data, int len)
+{
+    segment_fetch *fetch;
+    ssize_t written;
+
+    fetch = source->fetch;
+    if ( (fetch->end >= 0) && ((fetch->pos + len) > (fetch->end + 1)) ) {
+        len = (int)(fetch->end + 1 - fetch->pos);
+    }
+    while ( len > 0 ) {
+        written = pwrite(job->fd, data, len, fetch->pos);
+        if ( written < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            log(LOG_ERROR, _("Unable to write downloaded data: %s\n"),
+                strerror(errno));
+            return(-1);
+        }
+        if ( job->blocks ) {
+            mark_blocks(job, source, fetch->pos, written);
+        }
+        data += written;
+        len -= written;
+        fetch->pos += written;
+        source->received += written;
+        job->received += written;
+    }
+    if ( (fetch->end >= 0) && (fetch->pos > fetch->end) ) {
+        finish_fetch(job, source, 1);
+    }
+    return(0);
+}
+
+/* Throw away the part of the file that was on disk when we started */
+static void restart_job(segment_job *job)
+{
+    ftruncate(job->fd, 0);
+    job->offset = 0;
+    job->digested = 0;
+    if ( job->digest ) {
+        digest_init(job->digest);
+    }
+    if ( job->blocks ) {
+        block_check_init(&job->check, job->blocks, 0);
+        memset(job->block_sources, 0,
+               job->blocks->num_blocks*(sizeof *job->block_sources));
+    }
+}
+
+/* Handle the response header for a fetch, returning 0 if we can go on */
+static int handle_header(segment_job *job, segment_source *source)
+{
+    segment_fetch *fetch;
+    const char *value;
+    int code;
+    off_t first, last, total;
+
+    fetch = source->fetch;
+    if ( strncmp(fetch->header, "HTTP/", 5) != 0 ) {
+        drop_source(job, source, 0, _("not an HTTP server"));
+        return(-1);
+    }
+    value = strchr(fetch->header, ' ');
+    code = value ? atoi(value+1) : 0;
+    switch (code) {
+        case 206:
+            if ( parse_content_range(find_header(fetch->header,
+                                     "Content-Range"),
+                                     &first, &last, &total) < 0 ||
+                 (first != fetch->start) || (total < 0) ) {
+                drop_source(job, source, 0, _("bad partial response"));
+                return(-1);
+            }
+            if ( job->total < 0 ) {
+                /* This was the first response, now we can split the file */
+                job->total = total;
+                if ( last < fetch->end ) {
+                    fetch->end = last;
+                }
+                split_pending_ranges(job, fetch->end+1);
+            } else
+            if ( total != job->total ) {
+                drop_source(job, source, 1, _("file size doesn't match"));
+                return(-1);
+            }
+            break;
+        case 200:
+            /* The server ignored the range, only useful from the start */
+            if ( fetch->start != 0 ) {
+                drop_source(job, source, 0, _("no byte range support"));
+                return(-1);
+            }
+            value = find_header(fetch->header, "Content-Length");
+            total = value ? (off_t)strtoll(value, NULL, 10) : -1;
+            if ( job->total < 0 ) {
+                job->total = total;
+                fetch->end = (total < 0) ? -1 : (total - 1);
+            } else
+            if ( (total >= 0) && (total != job->total) ) {
+                drop_source(job, source, 1, _("file size doesn't match"));
+                return(-1);
+            }
+            break;
+        case 416:
+            /* We might already have the whole file */
+            if ( (job->total < 0) &&
+                 (parse_content_range(find_header(fetch->header,
+                                      "Content-Range"),
+                                      &first, &last, &total) == 0) &&
+                 (total == job->offset) ) {
+                job->total = total;
+                finish_fetch(job, source, 1);
+                return(-1);
+            }
+            /* What we have is left over from an older copy of the file,
+               which isn't the mirror's fault, so start again from scratch */
+            if ( (job->total < 0) && (job->offset > 0) ) {
+                log(LOG_VERBOSE, _("Restarting the download of %s\n"),
+                    source->url);
+                finish_fetch(job, source, 0);
+                restart_job(job);
+                return(-1);
+            }
+            drop_source(job, source, 1, _("range not satisfiable"));
+            return(-1);
+        default:
+            if ( (code >= 300) && (code < 400) ) {
+                drop_source(job, source, 0, _("redirected"));
+            } else {
+                drop_source(job, source, 1, fetch->header);
+            }
+            return(-1);
+    }
+    return(0);
+}
+
+static void process_fetch(segment_job *job, segment_source *source,
+                          int readable, int writable)
+{
+    segment_fetch *fetch;
+    char buf[BUFSIZE];
+    char *body;
+    int count, error;
+    socklen_t error_size;
+
+    fetch = source->fetch;
+    switch (fetch->state) {
+        case FETCH_CONNECTING:
+            if ( ! writable ) {
+                break;
+            }
+            error = 0;
+            error_size = sizeof(error);
+            getsockopt(fetch->sock, SOL_SOCKET, SO_ERROR, &error, &error_size);
+            if ( error ) {
+                drop_source(job, source, 1, strerror(error));
+                break;
+            }
+            fetch->state = FETCH_SENDING;
+            /* Fall through, the socket is writable */
+        case FETCH_SENDING:
+            count = write(fetch->sock, fetch->request+fetch->request_sent,
+                          fetch->request_len-fetch->request_sent);
+            if ( count < 0 ) {
+                if ( (errno != EAGAIN) && (errno != EINTR) ) {
+                    source_error(job, source);
+                }
+                break;
+            }
+            fetch->request_sent += count;
+            if ( fetch->request_sent == fetch->request_len ) {
+                fetch->state = FETCH_HEADER;
+            }
+            break;
+        case FETCH_HEADER:
+            if ( ! readable ) {
+                break;
+            }
+            count = read(fetch->sock, fetch->header+fetch->header_len,
+                         BUFSIZE-fetch->header_len);
+            if ( count <= 0 ) {
+                if ( (count == 0) || ((errno != EAGAIN) && (errno != EINTR)) ) {
+                    source_error(job, source);
+                }
+                break;
+            }
+            fetch->header_len += count;
+            fetch->header[fetch->header_len] = '\0';
+            body = strstr(fetch->header, "\r\n\r\n");
+            if ( body ) {
+                body += 4;
+            } else {
+                body = strstr(fetch->header, "\n\n");
+                if ( body ) {
+                    body += 2;
+                }
+            }
+            if ( ! body ) {
+                if ( fetch->header_len == BUFSIZE ) {
+                    drop_source(job, source, 0, _("header too long"));
+                }
+                break;
+            }
+            count = fetch->header_len - (body - fetch->header);
+            memcpy(buf, body, count);
+            *body = '\0';
+            if ( handle_header(job, source) < 0 ) {
+                break;
+            }
+            fetch->state = FETCH_BODY;
+            if ( count > 0 ) {
+                if ( write_body(job, source, buf, count) < 0 ) {
+                    drop_source(job, source, 0, strerror(errno));
+                }
+            }
+            break;
+        case FETCH_BODY:
+            if ( ! readable ) {
+                break;
+            }
+            count = read(fetch->sock, buf, sizeof(buf));
+            if ( count > 0 ) {
+                if ( write_body(job, source, buf, count) < 0 ) {
+                    drop_source(job, source, 0, strerror(errno));
+                }
+            } else
+            if ( count == 0 ) {
+                if ( fetch->end < 0 ) {
+                    /* Size was never known, the end of data is the end */
+                    job->total = fetch->pos;
+                    finish_fetch(job, source, 1);
+                } else {
+                    source_error(job, source);
+                }
+            } else
+            if ( (errno != EAGAIN) && (errno != EINTR) ) {
+                source_error(job, source);
+            }
+            break;
+    }
+}
+
+/* Set up the mirror to fetch from, returning 0 if it can be used */
+static int init_source(segment_job *job, segment_source *source,
+                       struct mirror_url *mirror, const char *file,
+                       update_callback update, void *udata)
+{
+    Url *u;
+    const char *host;
+
+    source->mirror = mirror;
+    source->url = (char *)safe_malloc(strlen(mirror->url)+1+strlen(file)+1);
+    sprintf(source->url, "%s/%s", mirror->url, file);
+    source->usable = 0;
+    source->errors = 0;
+    source->received = 0;
+    source->busy_time = 0.0;
+    source->fetch = NULL;
+
+    source->parsed = url_new();
+    if ( ! source->parsed || ! url_init(source->parsed, source->url) ) {
+        return(-1);
+    }
+    u = source->parsed;
+    if ( ! u->path ) {
+        u->path = strdup("/");
+    }
+    if ( ! u->file ) {
+        u->file = strdup("");
+    }
+
+    /* Look up the address of the mirror, or the proxy */
+    if ( job->proxy ) {
+        host = job->proxy->host;
+        source->addr.sin_port = htons(job->proxy->port ? job->proxy->port : 80);
+    } else {
+        host = u->host;
+        source->addr.sin_port = htons(u->port ? u->port : 80);
+    }
+    source->addr.sin_family = AF_INET;
+    source->addr.sin_addr.s_addr = inet_addr(host);
+    if ( source->addr.sin_addr.s_addr == INADDR_NONE ) {
+        if ( lookup_mirror_address(host, &source->addr, update, udata) < 0 ) {
+            return(-1);
+        }
+    }
+    source->usable = 1;
+    return(0);
+}
+
+/* A block didn't match the block list, so fetch it again, keeping the
+   rest of the file, and don't trust the mirrors that sent it.
+ */
+static void bad_block(segment_job *job)
+{
+    off_t start, end;
+    unsigned int sent;
+    int i, block;
+
+    start = job->check.offset;
+    end = start + job->blocks->block_size - 1;
+    if ( end >= job->total ) {
+        end = job->total - 1;
+    }
+    block = (int)(start / job->blocks->block_size);
+    sent = job->block_sources[block];
+    job->block_sources[block] = 0;
+    for ( i=0; i<job->num_sources; ++i ) {
+        if ( !(sent & (1 << i)) || ! job->sources[i].usable ) {
+            continue;
+        }
+        if ( (sent == (1 << i)) ||
+             (++job->sources[i].errors >= MAX_SOURCE_ERRORS) ) {
+            drop_source(job, &job->sources[i], 1, _("corrupt data"));
+        }
+    }
+
+    /* Back up the checksums to the start of the block */
+    if ( job->digest ) {
+        *job->digest = job->block_digest;
+    }
+    job->digested = start;
+    if ( sent ) {
+        job->received -= (end - start + 1);
+    } else {
+        /* It was already on disk when we started */
+        job->offset = start;
+    }
+    add_pending_range(job, start, end);
+}
+
+/* Checksum and check the part of the file that is now complete.  The data
+   arrives out of order, so it's read back while it's still in the page
+   cache.  With a block list, the data is read a block at a time, so the
+   checksums can be backed up if a block turns out to be corrupt.
+ */
+static int update_digest(segment_job *job)
+{
+    char buf[BUFSIZE];
+    off_t done, block;
+    ssize_t count;
+
+    done = contiguous_offset(job);
+    while ( job->digested < done ) {
+        count = done - job->digested;
+        if ( count > sizeof(buf) ) {
+            count = sizeof(buf);
+        }
+        if ( job->blocks ) {
+            block = BLOCK_START(job->blocks, job->digested);
+            if ( (job->digested == block) && job->digest ) {
+                job->block_digest = *job->digest;
+            }
+            if ( count > (block + job->blocks->block_size - job->digested) ) {
+                count = block + job->blocks->block_size - job->digested;
+            }
+        }
+        count = pread(job->fd, buf, count, job->digested);
+        if ( count <= 0 ) {
+            return(-1);
+        }
+        if ( job->digest ) {
+            digest_update(job->digest, buf, count);
+        }
+        job->digested += count;
+        if ( job->blocks && (block_check_update(&job->check, buf, count) < 0) ) {
+            bad_block(job);
+            return(0);
+        }
+    }
+    if ( job->blocks && (job->total >= 0) && (job->digested == job->total) &&
+         (block_check_final(&job->check) < 0) ) {
+        bad_block(job);
+    }
+    return(0);
+}
+
+static void free_job(segment_job *job)
+{
+    int i;
+
+    for ( i=0; i<job->num_sources; ++i ) {
+        if ( job->sources[i].fetch ) {
+            finish_fetch(job, &job->sources[i], 0);
+        }
+        if ( job->sources[i].parsed ) {
+            url_destroy(job->sources[i].parsed);
+        }
+        free(job->sources[i].url);
+    }
+    free(job->sources);
+    safe_free(job->pending);
+    safe_free(job->block_sources);
+    if ( job->proxy ) {
+        url_destroy(job->proxy);
+    }
+    if ( job->fd >= 0 ) {
+        close(job->fd);
+    }
+}
+
+/* Run all the fetches until the file is complete or nobody can help */
+static int run_job(segment_job *job, update_callback update, void *udata)
+{
+    segment_source *source;
+    fd_set rfds, wfds;
+    struct timeval tv;
+    double start_time, elapsed, now;
+    float percentage, rate;
+    int i, maxfd, active, cancelled;
+    int readable, writable, stall_timeout;
+
+    stall_timeout = get_stall_timeout();
+    start_time = double_time();
+    cancelled = 0;
+    while ( ! cancelled ) {
+        /* Hand out work to any idle mirrors */
+        for ( i=0; i<job->num_sources; ++i ) {
+            source = &job->sources[i];
+            if ( source->usable && ! source->fetch ) {
+                dispatch_source(job, source);
+            }
+        }
+
+        /* Are we done? */
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        maxfd = -1;
+        active = 0;
+        for ( i=0; i<job->num_sources; ++i ) {
+            segment_fetch *fetch = job->sources[i].fetch;
+            if ( fetch ) {
+                if ( (fetch->state == FETCH_CONNECTING) ||
+                     (fetch->state == FETCH_SENDING) ) {
+                    FD_SET(fetch->sock, &wfds);
+                } else {
+                    FD_SET(fetch->sock, &rfds);
+                }
+                if ( fetch->sock > maxfd ) {
+                    maxfd = fetch->sock;
+                }
+                ++active;
+            }
+        }
+        if ( ! active ) {
+            break;
+        }
+
+        /* Wait for something to happen */
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        if ( select(maxfd+1, &rfds, &wfds, NULL, &tv) > 0 ) {
+            for ( i=0; i<job->num_sources; ++i ) {
+                segment_fetch *fetch = job->sources[i].fetch;
+                if ( fetch ) {
+                    readable = FD_ISSET(fetch->sock, &rfds);
+                    writable = FD_ISSET(fetch->sock, &wfds);
+                    if ( readable || writable ) {
+                        fetch->last_active = double_time();
+                    }
+                    process_fetch(job, &job->sources[i], readable, writable);
+                }
+            }
+        }
+
+        /* Give up on any mirrors that have stopped sending data */
+        if ( stall_timeout ) {
+            now = double_time();
+            for ( i=0; i<job->num_sources; ++i ) {
+                segment_fetch *fetch = job->sources[i].fetch;
+                if ( fetch && ((now - fetch->last_active) >= stall_timeout) ) {
+                    stall_source(job, &job->sources[i]);
+                }
+            }
+        }
+
+        /* Checksum whatever data is now in order */
+        if ( (job->digest || job->blocks) && (update_digest(job) < 0) ) {
+            log(LOG_ERROR, _("Unable to read downloaded data: %s\n"),
+                strerror(errno));
+            break;
+        }
+
+        /* Update the UI */
+        if ( update ) {
+            if ( job->total > 0 ) {
+                percentage = (float)(job->offset + job->received) * 100.0f /
+                             (float)job->total;
+            } else {
+                percentage = 0.0f;
+            }
+            elapsed = double_time() - start_time;
+            if ( elapsed > 0.0 ) {
+                rate = (float)((job->received / elapsed) / 1024.0);
+            } else {
+                rate = 0.0f;
+            }
+            cancelled = update(0, NULL, percentage,
+                               (int)((job->offset + job->received)/1024),
+                               (int)(job->total > 0 ? job->total/1024 : 0),
+                               rate, udata);
+        }
+    }
+    return(cancelled);
+}
+
+int get_url_segmented(urlset *mirrors, const char *file,
+                      char *path, int maxpath, digest_sums *sums,
+                      block_sums *blocks, update_callback update, void *udata)
+{
+    segment_job job;
+    digest_context digest;
+    struct mirror_url *mirror;
+    char *proxy;
+    char text[1024];
+    off_t done;
+    int i, num_sources, cancelled, status, failed;
+
+    /* Count the mirrors we could use */
+    num_sources = 0;
+    for ( mirror = mirrors->list; mirror; mirror = mirror->next ) {
+        if ( (mirror->status == URL_OK) &&
+             (strncasecmp(mirror->url, "http://", 7) == 0) ) {
+            ++num_sources;
+        }
+    }
+    if ( num_sources > segmented_mirrors ) {
+        num_sources = segmented_mirrors;
+    }
+
+    /* If we can't split the download, just get the current URL */
+    if ( num_sources < 2 ) {
+        if ( ! mirrors->current ) {
+            return(-1);
+        }
+        return(get_url_checked(mirrors->full_url, path, maxpath, sums, blocks,
+                               update, udata));
+    }
+
+    /* Figure out where the file goes, and how much we already have */
+    if ( get_url_path(file, path, maxpath, update, udata) < 0 ) {
+        return(-1);
+    }
+    memset(&job, 0, sizeof(job));
+    job.fd = open(path, O_RDWR|O_CREAT, 0644);
+    if ( job.fd < 0 ) {
+        sprintf(text, _("Unable to open %s"), path);
+        update_message(LOG_ERROR, text, update, udata);
+        return(-1);
+    }
+    job.offset = get_file_size(path);
+    job.total = -1;
+    if ( sums ) {
+        digest_init(&digest);
+        job.digest = &digest;
+    }
+    if ( blocks ) {
+        job.blocks = blocks;
+        block_check_init(&job.check, blocks, 0);
+        job.block_sources = (unsigned int *)safe_malloc(blocks->num_blocks *
+                                                (sizeof *job.block_sources));
+        memset(job.block_sources, 0,
+               blocks->num_blocks*(sizeof *job.block_sources));
+    }
+    proxy = get_proxy("HTTP_PROXY");
+    if ( proxy ) {
+        job.proxy = url_new();
+        if ( ! url_init(job.proxy, proxy) || ! job.proxy->host ) {
+            url_destroy(job.proxy);
+            job.proxy = NULL;
+        }
+    }
+
+    /* Set up the mirrors we'll be using */
+    job.sources = (segment_source *)safe_malloc(num_sources *
+                                                (sizeof *job.sources));
+    memset(job.sources, 0, num_sources*(sizeof *job.sources));
+    for ( mirror = mirrors->list;
+          mirror && (job.num_sources < num_sources);
+          mirror = mirror->next ) {
+        if ( (mirror->status == URL_OK) &&
+             (strncasecmp(mirror->url, "http://", 7) == 0) ) {
+            init_source(&job, &job.sources[job.num_sources++], mirror, file,
+                        update, udata);
+        }
+    }
+    sprintf(text, _("Downloading from %d mirrors"), job.num_sources);
+    update_message(LOG_VERBOSE, text, update, udata);
+
+    /* Go! */
+    cancelled = run_job(&job, update, udata);
+
+    /* See how much of the file we actually have */
+    if ( ! cancelled && (job.digest || job.blocks) &&
+         (update_digest(&job) < 0) ) {
+        cancelled = 1;
+    }
+    done = contiguous_offset(&job);
+    if ( ! cancelled && (job.total >= 0) && (done >= job.total) ) {
+        ftruncate(job.fd, job.total);
+        if ( sums ) {
+            digest_final(&digest, sums);
+        }
+        if ( update ) {
+            update(0, NULL, 100.0, 0, 0, 0.0f, udata);
+        }
+        status = 0;
+    } else {
+        /* Keep only the data that can safely be resumed */
+        ftruncate(job.fd, done);
+        status = -1;
+    }
+    for ( i=0; i<job.num_sources; ++i ) {
+        log(LOG_DEBUG, "%s: %lld bytes at %.2f K/s\n", job.sources[i].url,
+            (long long)job.sources[i].received,
+            source_rate(&job.sources[i]) / 1024.0);
+        failed = ((job.sources[i].mirror->status == URL_FAILED) ||
+                  (job.sources[i].mirror->status == URL_SLOW));
+        if ( ! cancelled && (job.sources[i].received || failed) ) {
+            record_mirror_transfer(job.sources[i].url, -1.0,
+                                   source_rate(&job.sources[i]) / 1024.0,
+                                   (long)job.sources[i].received, failed);
+        }
+    }
+    free_job(&job);
+    return(status);
+}
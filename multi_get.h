@@ -0,0 +1,55 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to retrieve files over several HTTP connections at once */
+
+#ifndef _multi_get_h
+#define _multi_get_h
+
+#include "update.h"
+#include "urlset.h"
+#include "digest.h"
+#include "block_sums.h"
+
+/* Patches smaller than this (in K) aren't worth splitting across mirrors */
+#define SEGMENT_THRESHOLD   1024
+
+/* Set the maximum number of mirrors used for a segmented download,
+   or 0 to disable segmented downloads entirely.
+ */
+extern void set_segmented_download(int max_mirrors);
+extern int get_segmented_download(void);
+
+/* Download a file from several usable mirrors in the set at once, splitting
+   it into byte ranges and handing more of the file to the faster mirrors.
+   The file is assembled in place at the same path get_url() would use,
+   and if 'sums' is not NULL it is filled in as with get_url_digest().
+   If 'blocks' is not NULL, corrupt blocks are fetched again from other
+   mirrors, as with get_url_checked().
+   Returns 0 on success, or -1 if the file couldn't be retrieved, in which
+   case any partial file is left truncated to the last contiguous byte.
+ */
+extern int get_url_segmented(urlset *mirrors, const char *file,
+                             char *path, int maxpath, digest_sums *sums,
+                             block_sums *blocks,
+                             update_callback update, void *udata);
+
+#endif /* _multi_get_h */
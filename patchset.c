@@ -26,6 +26,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "safe_malloc.h"
 #include "log_output.h"
@@ -33,7 +35,28 @@
 #include "load_products.h"
 #include "setupdb.h"
 #include "patchset.h"
+#include "digest.h"
 
+/* The most threads used to calculate patch paths at once */
+#define MAX_PATH_THREADS    16
+
+/* Temporary memory used by the shortest path algorithm, one per thread */
+typedef struct path_scratch {
+    int *seen;
+    int *dist;
+    version_node **parent;
+    version_node **fringe;
+} path_scratch;
+
+/* The component roots waiting for their paths, shared by the threads */
+typedef struct path_tasks {
+    pthread_mutex_t lock;
+    version_node **roots;
+    struct patchset **patchsets;
+    int num_tasks;
+    int next_task;
+    int max_nodes;
+} path_tasks;
 
 static const char *get_version_extension(version_node *node)
 {
@@ -286,6 +309,9 @@ static void free_patch(patch *patch)
     if ( patch ) {
         free(patch->description);
         free(patch->file);
+        safe_free(patch->md5);
+        safe_free(patch->sha256);
+        safe_free(patch->signature);
         safe_free(patch->apply);
         free_patch(patch->next);
         free(patch);
@@ -303,36 +329,28 @@ void free_patchset(struct patchset *patchset)
     }
 }
 
-patchset *create_patchset(const char *product)
+patchset *create_patchset(update_session *session, const char *product)
 {
-    product_t *loki_product;
     struct patchset *patchset;
     version_node *root;
+    int i;
 
     patchset = (struct patchset *)safe_malloc(sizeof *patchset);
+    patchset->session = session;
+    patchset->product = get_product_handle(session, product);
     patchset->product_name = product;
-    root = create_version_node(NULL, get_default_component(product),
-                                     get_product_version(product));
+    root = create_version_node(NULL, get_handle_component(patchset->product),
+                                     get_handle_version(patchset->product));
     root->invisible = 1;
     root->top_root = 1;
     patchset->root = root;
-    loki_product = loki_openproduct(product);
-    if ( loki_product ) {
-        product_component_t *component;
-
-        for ( component = loki_getfirst_component(loki_product);
-              component;
-              component = loki_getnext_component(component) ) {
-            if ( ! loki_isdefault_component(component) ) {
-                root = create_version_node(NULL,
-                                       loki_getname_component(component),
-                                       loki_getversion_component(component));
-                root->invisible = 1;
-                root->sibling = patchset->root->sibling;
-                patchset->root->sibling = root;
-            }
-        }
-        loki_closeproduct(loki_product);
+    for ( i=0; i<get_num_components(patchset->product); ++i ) {
+        root = create_version_node(NULL,
+                               get_component_name(patchset->product, i),
+                               get_component_version(patchset->product, i));
+        root->invisible = 1;
+        root->sibling = patchset->root->sibling;
+        patchset->root->sibling = root;
     }
     patchset->patches = NULL;
     patchset->mirrors = create_urlset();
@@ -441,6 +459,63 @@ static int sizeK_from_string(const char *string)
     Installed Size:
     URL:
 */
+/* Copy a hex checksum from the update list, if it looks valid */
+static char *copy_checksum(const char *sum, int len, const char *name)
+{
+    char *copy;
+    int i;
+
+    if ( ! sum ) {
+        return(NULL);
+    }
+    for ( i=0; isxdigit((int)sum[i]); ++i ) {
+        continue;
+    }
+    if ( (i != len) || sum[i] ) {
+        log(LOG_WARNING, _("Ignoring invalid %s checksum: %s\n"), name, sum);
+        return(NULL);
+    }
+    copy = safe_strdup(sum);
+    for ( i=0; copy[i]; ++i ) {
+        copy[i] = tolower(copy[i]);
+    }
+    return(copy);
+}
+
+/* The signature field is the base64 text of an ASCII armored detached
+   signature, on one line, optionally followed by the "=" checksum line.
+   Put the armor back around it so it can be handed straight to GPG.
+ */
+static char *armor_signature(const char *signature)
+{
+    static const char header[] = "-----BEGIN PGP SIGNATURE-----\n\n";
+    static const char footer[] = "\n-----END PGP SIGNATURE-----\n";
+    char *armor, *dst;
+
+    if ( ! signature ) {
+        return(NULL);
+    }
+    armor = (char *)safe_malloc(strlen(header) + strlen(signature) +
+                                strlen(footer) + 1);
+    strcpy(armor, header);
+    dst = armor + strlen(armor);
+    while ( *signature ) {
+        if ( isspace((int)*signature) ) {
+            /* The checksum line starts with '=', which base64 never does */
+            while ( isspace((int)*signature) ) {
+                ++signature;
+            }
+            if ( *signature ) {
+                *dst++ = '\n';
+            }
+        } else {
+            *dst++ = *signature++;
+        }
+    }
+    strcpy(dst, footer);
+    return(armor);
+}
+
 int add_patch(const char *product,
               const char *component,
               const char *version,
@@ -450,6 +525,9 @@ int add_patch(const char *product,
               const char *note,
               const char *size,
               const char *file,
+              const char *md5,
+              const char *sha256,
+              const char *signature,
               struct patchset *patchset)
 {
     const char *next;
@@ -462,7 +540,7 @@ int add_patch(const char *product,
     if ( component ) {
         snprintf(description, sizeof(description), "%s %s", component, version);
     } else {
-        component = get_default_component(patchset->product_name);
+        component = get_handle_component(patchset->product);
         snprintf(description, sizeof(description), "Patch %s", version);
     }
     log(LOG_DEBUG, "Potential patch:\n");
@@ -538,6 +616,9 @@ int add_patch(const char *product,
     } else {
         patch->size = 0;
     }
+    patch->md5 = copy_checksum(md5, MD5_DIGEST_SIZE*2, "MD5");
+    patch->sha256 = copy_checksum(sha256, SHA256_DIGEST_SIZE*2, "SHA256");
+    patch->signature = armor_signature(signature);
     patch->node = node;
     patch->refcount = 0;
     patch->installed = 0;
@@ -564,7 +645,7 @@ int add_patch(const char *product,
         for ( next=copy_word(applies, word, sizeof(word));
               next; 
               next=copy_word(next, word, sizeof(word)) ) {
-            if ( component == get_default_component(patchset->product_name) ) {
+            if ( component == get_handle_component(patchset->product) ) {
                 snprintf(description, sizeof(description), "Patch %s", word);
             } else {
                 snprintf(description, sizeof(description), "%s %s",
@@ -624,7 +705,8 @@ static patch *find_linking_patch(patchset *patchset,
 /* Find the shortest path from root to leaf, using Dijkstra's algorithm */
 static patch_path *find_shortest_path(version_node *root,
                                        version_node *leaf,
-                                       patchset *patchset)
+                                       patchset *patchset,
+                                       path_scratch *scratch)
 {
     patch_path *path, *newpath;
     version_node *node, **parent, **fringe;
@@ -635,10 +717,10 @@ static patch_path *find_shortest_path(version_node *root,
     int num_fringes;
 
     /* All nodes except root are unseen */
-    seen = patchset->seen;
-    dist = patchset->dist;
-    parent = patchset->parent;
-    fringe = patchset->fringe;
+    seen = scratch->seen;
+    dist = scratch->dist;
+    parent = scratch->parent;
+    fringe = scratch->fringe;
     for ( node=root; node; node=node->next ) {
         a = node->index;
         if ( node == root ) {
@@ -809,57 +891,172 @@ static void trim_unused_patches(patchset *patchset)
     }
 }
 
-/* Generate valid patch paths, trimming out versions that don't apply */
-void calculate_paths(patchset *patchset)
+/* Generate a path from the root to every node in its tree, and trim
+   the nodes that can't be reached.  Only the nodes and patches of this
+   root are changed, so the roots can be handled by different threads.
+ */
+static void calculate_root_paths(version_node *root, patchset *patchset,
+                                 path_scratch *scratch)
 {
-    version_node *node, *trunk, *root;
+    version_node *node, *trunk;
     int depth;
+
+    /* For all the nodes in the tree, generate a path from the root to it */
+    depth = 0;
+    for ( trunk=root->child; trunk; trunk=trunk->child ) {
+        for ( node=trunk; node; node=node->sibling ) {
+            node->depth = depth;
+            node->shortest_path = find_shortest_path(root, node,
+                                                     patchset, scratch);
+        }
+        ++depth;
+    }
+    /* Trim all the nodes that don't have a path to the root */
+    trim_unconnected_nodes(root, root->child);
+}
+
+/* Add the component roots of a patchset to the list of path tasks */
+static void add_path_tasks(path_tasks *tasks, patchset *patchset)
+{
+    version_node *node, *root;
     int num_nodes;
 
     log(LOG_DEBUG, "Calculating patch paths for %s %s\n",
-        get_product_description(patchset->product_name),
-        get_product_version(patchset->product_name));
+        get_handle_description(patchset->product),
+        get_handle_version(patchset->product));
 
-    /* Allocate memory for the shortest path algorithm */
-    num_nodes = 0;
+    trim_unconnected_roots(patchset->root);
     for ( root = patchset->root; root; root = root->sibling ) {
+        /* Each root is searched on its own, so number its nodes from 0 */
+        num_nodes = 0;
         for ( node = root; node; node = node->next ) {
             node->index = num_nodes++;
         }
+        if ( num_nodes > tasks->max_nodes ) {
+            tasks->max_nodes = num_nodes;
+        }
+        tasks->roots = (version_node **)safe_realloc(tasks->roots,
+                        (tasks->num_tasks+1)*(sizeof *tasks->roots));
+        tasks->patchsets = (struct patchset **)safe_realloc(tasks->patchsets,
+                        (tasks->num_tasks+1)*(sizeof *tasks->patchsets));
+        tasks->roots[tasks->num_tasks] = root;
+        tasks->patchsets[tasks->num_tasks] = patchset;
+        ++tasks->num_tasks;
     }
-    if ( num_nodes == 0 ) {
+}
+
+/* Calculate the paths for roots until there are none left */
+static void *path_worker(void *data)
+{
+    path_tasks *tasks;
+    path_scratch scratch;
+    update_session *session;
+    int task;
+
+    /* Allocate memory for the shortest path algorithm */
+    tasks = (path_tasks *)data;
+    scratch.seen = (int *)safe_malloc(tasks->max_nodes*(sizeof *scratch.seen));
+    scratch.dist = (int *)safe_malloc(tasks->max_nodes*(sizeof *scratch.dist));
+    scratch.parent = (version_node **)safe_malloc(
+                        tasks->max_nodes*(sizeof *scratch.parent));
+    scratch.fringe = (version_node **)safe_malloc(
+                        tasks->max_nodes*(sizeof *scratch.fringe));
+
+    session = get_session();
+    for ( ; ; ) {
+        pthread_mutex_lock(&tasks->lock);
+        task = tasks->next_task;
+        if ( task < tasks->num_tasks ) {
+            ++tasks->next_task;
+        }
+        pthread_mutex_unlock(&tasks->lock);
+        if ( task == tasks->num_tasks ) {
+            break;
+        }
+
+        /* Log with the settings of the product being planned */
+        set_thread_session(tasks->patchsets[task]->session);
+        calculate_root_paths(tasks->roots[task], tasks->patchsets[task],
+                             &scratch);
+    }
+    set_thread_session(session);
+
+    /* Free shortest path memory */
+    free(scratch.seen);
+    free(scratch.dist);
+    free(scratch.parent);
+    free(scratch.fringe);
+    return(NULL);
+}
+
+/* Calculate the paths for all of the roots in the task list at once */
+static void run_path_tasks(path_tasks *tasks)
+{
+    pthread_t threads[MAX_PATH_THREADS];
+    long num_cpus;
+    int i, num_threads;
+
+    if ( tasks->num_tasks == 0 ) {
         /* Nothing to do, return */
         return;
     }
-    patchset->seen = (int *)safe_malloc(num_nodes*(sizeof *patchset->seen));
-    patchset->dist = (int *)safe_malloc(num_nodes*(sizeof *patchset->dist));
-    patchset->parent = (version_node **)safe_malloc(num_nodes*(sizeof *patchset->parent));
-    patchset->fringe = (version_node **)safe_malloc(num_nodes*(sizeof *patchset->fringe));
 
-    root = patchset->root;
-    trim_unconnected_roots(root);
-    while ( root ) {
-        /* For all the nodes in the tree, generate a path from the root to it */
-        depth = 0;
-        for ( trunk=root->child; trunk; trunk=trunk->child ) {
-            for ( node=trunk; node; node=node->sibling ) {
-                node->depth = depth;
-                node->shortest_path = find_shortest_path(root, node, patchset);
-            }
-            ++depth;
+    /* Use a thread for each processor, this thread being one of them */
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( num_cpus < 1 ) {
+        num_cpus = 1;
+    }
+    if ( num_cpus > MAX_PATH_THREADS ) {
+        num_cpus = MAX_PATH_THREADS;
+    }
+    if ( num_cpus > tasks->num_tasks ) {
+        num_cpus = tasks->num_tasks;
+    }
+    pthread_mutex_init(&tasks->lock, NULL);
+    tasks->next_task = 0;
+    num_threads = 0;
+    for ( i=1; i<num_cpus; ++i ) {
+        if ( pthread_create(&threads[num_threads], NULL,
+                            path_worker, tasks) == 0 ) {
+            ++num_threads;
         }
-        /* Trim all the nodes that don't have a path to the root */
-        trim_unconnected_nodes(root, root->child);
-
-        root = root->sibling;
     }
+    path_worker(tasks);
+    for ( i=0; i<num_threads; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&tasks->lock);
+}
+
+/* Generate valid patch paths, trimming out versions that don't apply */
+void calculate_paths(patchset *patchset)
+{
+    path_tasks tasks;
+
+    memset(&tasks, 0, sizeof(tasks));
+    add_path_tasks(&tasks, patchset);
+    run_path_tasks(&tasks);
     trim_unused_patches(patchset);
+    safe_free(tasks.roots);
+    safe_free(tasks.patchsets);
+}
 
-    /* Free shortest path memory */
-    free(patchset->seen);
-    free(patchset->dist);
-    free(patchset->parent);
-    free(patchset->fringe);
+/* Generate the patch paths for every product in the list at once */
+void calculate_all_paths(patchset *patchsets)
+{
+    path_tasks tasks;
+    patchset *patchset;
+
+    memset(&tasks, 0, sizeof(tasks));
+    for ( patchset = patchsets; patchset; patchset = patchset->next ) {
+        add_path_tasks(&tasks, patchset);
+    }
+    run_path_tasks(&tasks);
+    for ( patchset = patchsets; patchset; patchset = patchset->next ) {
+        trim_unused_patches(patchset);
+    }
+    safe_free(tasks.roots);
+    safe_free(tasks.patchsets);
 }
 
 /* Select a particular version node and set toggled state */
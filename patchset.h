@@ -23,6 +23,8 @@
 #define _patchset_h
 
 #include "urlset.h"
+#include "session.h"
+#include "load_products.h"
 
 /* Forward declarations */
 struct patchset;
@@ -70,6 +72,10 @@ typedef struct patch {
     char *description;
     char *file;
     int size;
+    /* Optional checksums and GPG signature from the update list */
+    char *md5;
+    char *sha256;
+    char *signature;
     struct version_node *node;
     int refcount;
     int installed;
@@ -79,6 +85,8 @@ typedef struct patch {
 } patch;
 
 typedef struct patchset {
+    update_session *session;
+    product_handle *product;
     const char *product_name;
 
     version_node *root;
@@ -86,16 +94,11 @@ typedef struct patchset {
     urlset *mirrors;
 
     struct patchset *next;
-
-    /* Temporary memory used by the shortest path algorithm */
-    int *seen;
-    int *dist;
-    version_node **parent;
-    version_node **fringe;
 } patchset;
 
 
-extern patchset *create_patchset(const char *product);
+extern patchset *create_patchset(update_session *session,
+                                 const char *product);
 extern void free_patchset(struct patchset *patchset);
 
 /*
@@ -104,6 +107,9 @@ extern void free_patchset(struct patchset *patchset);
     Applies to:
     Installed Size:
     URL:
+    MD5:
+    SHA256:
+    Signature:
 */
 extern int add_patch(const char *product,
                      const char *component,
@@ -114,11 +120,21 @@ extern int add_patch(const char *product,
                      const char *note,
                      const char *size,
                      const char *file,
+                     const char *md5,
+                     const char *sha256,
+                     const char *signature,
                      struct patchset *patchset);
 
-/* Generate valid patch paths, trimming out versions that don't apply */
+/* Generate valid patch paths, trimming out versions that don't apply.
+   The paths for each component root are found on a pool of threads.
+ */
 extern void calculate_paths(patchset *patchset);
 
+/* Generate the patch paths for a list of patchsets, linked by their
+   next pointers, planning the roots of all the products at once.
+ */
+extern void calculate_all_paths(patchset *patchsets);
+
 /* Select a particular version node and set toggled state */
 extern void select_node(version_node *selected_node, int selected);
 
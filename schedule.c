@@ -0,0 +1,1042 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to download the updates for several products at once */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef VERSION
+#undef VERSION
+#endif
+#include "config.h"
+#include "url.h"
+#include "util.h"
+/* We want our own versions of these, not the snarf macros */
+#undef safe_free
+#undef safe_strdup
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "load_products.h"
+#include "urlset.h"
+#include "mirror_stats.h"
+#include "get_url.h"
+#include "gpg_verify.h"
+#include "artifact_cache.h"
+#include "digest.h"
+#include "block_sums.h"
+#include "transfer.h"
+#include "event_loop.h"
+#include "schedule.h"
+
+static int max_downloads = DEFAULT_MAX_DOWNLOADS;
+static int max_host_downloads = DEFAULT_MAX_HOST_DOWNLOADS;
+static int shortest_first = 1;
+
+struct install_chain;
+
+/* An update waiting to be downloaded, verified and applied */
+typedef struct scheduled_update {
+    patch *patch;
+    struct install_chain *chain;
+    enum {
+        UPDATE_WAITING,
+        UPDATE_DOWNLOADING,
+        UPDATE_SIGNED,              /* Waiting for its signature check */
+        UPDATE_DOWNLOADED,
+        UPDATE_QUEUED,
+        UPDATE_DROPPED
+    } state;
+    url_transfer *transfer;
+    struct mirror_url *mirror;      /* The mirror it's downloaded from */
+    mirror_host *host;
+    verify_result verified;
+    char file[PATH_MAX];
+    int order;                      /* Its place in the chain */
+    int applied_roots;
+    int failed_roots;
+    struct scheduled_update *next;
+} scheduled_update;
+
+/* An install path the updates in a chain are applied to.  Each one has
+   its own queue, so the updates are applied to all of them at once.
+ */
+typedef struct install_root {
+    const char *path;
+    apply_queue *queue;
+    int finished;                   /* The updates it's done with */
+    int failed;
+    struct install_chain *chain;
+    struct install_root *next;
+} install_root;
+
+/* The updates for a product, in the order they are applied, downloaded
+   once for all of the install paths of that version of the product.
+ */
+typedef struct install_chain {
+    const char *install_path;
+    scheduled_update *list;
+    scheduled_update *next_queued;
+    scheduled_update *next_applied;
+    install_root *roots;
+    int failed;
+    struct update_schedule *schedule;
+    struct install_chain *next;
+} install_chain;
+
+typedef struct update_schedule {
+    install_chain *chains;
+    int running;
+    int applied;
+    int failed;
+    long start_done;
+    applied_callback applied_func;
+    void *applied_data;
+    update_callback update;
+    void *udata;
+} update_schedule;
+
+
+void set_download_limits(int max, int max_host)
+{
+    max_downloads = (max > 0) ? max : 1;
+    max_host_downloads = (max_host > 0) ? max_host : 1;
+}
+
+void set_shortest_first(int enabled)
+{
+    shortest_first = enabled;
+}
+
+/* Log the messages from a download, without showing its progress */
+static int child_update(int status_level, const char *status,
+                        float percentage,
+                        int size, int total, float rate, void *udata)
+{
+    if ( status ) {
+        if ( status_level == LOG_STATUS ) {
+            log(status_level, "%s\n", status);
+        } else {
+            log(status_level, "%s", status);
+        }
+    }
+    return(0);
+}
+
+/* Save a signature for the parent to check with the others */
+static int save_signature(const char *path, const char *data, int size)
+{
+    char sig_file[PATH_MAX];
+    FILE *fp;
+    int okay;
+
+    sprintf(sig_file, "%s.sig", path);
+    fp = fopen(sig_file, "wb");
+    if ( ! fp ) {
+        return(0);
+    }
+    okay = (fwrite(data, 1, size, fp) == size);
+    if ( (fclose(fp) != 0) || ! okay ) {
+        unlink(sig_file);
+        return(0);
+    }
+    return(1);
+}
+
+/* Check a downloaded update against its signature and checksum.
+   The signatures of small updates are saved next to the update, to be
+   checked in the parent along with the others that are ready.
+ */
+static verify_result check_update(patch *patch, const char *url,
+                                  const char *path, digest_sums *sums,
+                                  update_callback update, void *udata)
+{
+    char sum_url[PATH_MAX];
+    char sig[1024];
+    char *data;
+    int size, checked;
+    gpg_result gpg_code;
+
+    sprintf(sum_url, "%s.sig", path);
+    unlink(sum_url);
+
+    /* First check the GPG signature */
+    gpg_code = GPG_NOTINSTALLED;
+    if ( patch->signature ) {
+        data = safe_strdup(patch->signature);
+        size = strlen(data);
+    } else {
+        sprintf(sum_url, "%s.sig", url);
+        if ( get_url_data(sum_url, &data, &size, MAX_SUM_DOWNLOAD,
+                          update, udata) != 0 ) {
+            data = NULL;
+        }
+    }
+    if ( data && (patch->size <= GPG_BATCH_MAX_SIZE) &&
+         save_signature(path, data, size) ) {
+        free(data);
+        data = NULL;
+    }
+    if ( data ) {
+        gpg_code = gpg_verify_data(path, data, size, sig, sizeof(sig),
+                                   update, udata);
+        if ( gpg_code == GPG_NOPUBKEY ) {
+            get_publickey(sig, update, udata);
+            gpg_code = gpg_verify_data(path, data, size, sig, sizeof(sig),
+                                       update, udata);
+        }
+        free(data);
+        switch (gpg_code) {
+            case GPG_VERIFYOK:
+                store_artifact(url, patch->file, path, sums,
+                               VERIFY_OK, gpg_code, sig);
+                return(VERIFY_OK);
+            case GPG_VERIFYFAIL:
+                return(VERIFY_FAILED);
+            default:
+                break;
+        }
+    }
+
+    /* Now check the checksum, using SHA-256 if there is one */
+    if ( patch->sha256 ) {
+        checked = digest_check(patch->sha256, sums->sha256);
+    } else
+    if ( patch->md5 ) {
+        checked = digest_check(patch->md5, sums->md5);
+    } else {
+        sprintf(sum_url, "%s.sha256", url);
+        if ( get_url_data(sum_url, &data, &size, MAX_SUM_DOWNLOAD,
+                          update, udata) == 0 ) {
+            checked = digest_check(data, sums->sha256);
+            free(data);
+        } else {
+            sprintf(sum_url, "%s.md5", url);
+            if ( get_url_data(sum_url, &data, &size, MAX_SUM_DOWNLOAD,
+                              update, udata) == 0 ) {
+                checked = digest_check(data, sums->md5);
+                free(data);
+            } else {
+                checked = -1;
+            }
+        }
+    }
+    if ( checked > 0 ) {
+        store_artifact(url, patch->file, path, sums,
+                       VERIFY_UNKNOWN, gpg_code, NULL);
+    }
+    return((checked == 0) ? VERIFY_FAILED : VERIFY_UNKNOWN);
+}
+
+/* Download and verify an update in a child process, starting with the
+   mirror chosen for it and moving on to the others if it fails.  What
+   happens to each mirror is reported back to the parent, along with the
+   mirror the update came from.
+ */
+static int fetch_update(void *data, char *text, int maxlen,
+                        update_callback update, void *udata)
+{
+    scheduled_update *job = (scheduled_update *)data;
+    patch *patch = job->patch;
+    urlset *mirrors;
+    const char *url;
+    char path[PATH_MAX];
+    digest_sums sums;
+    block_sums *blocks;
+    int blocks_tried, status;
+    verify_result verified;
+
+    mirrors = patch->patchset->mirrors;
+    blocks = NULL;
+    blocks_tried = 0;
+    verified = DOWNLOAD_FAILED;
+    for ( url = set_current_url(mirrors, job->mirror, patch->file); url;
+          url = get_next_url(mirrors, patch->file) ) {
+        if ( ! blocks_tried && (patch->size >= BLOCK_SUMS_THRESHOLD) ) {
+            blocks = get_block_sums(url, update, udata);
+            blocks_tried = 1;
+        }
+        status = get_url_checked(url, path, sizeof(path), &sums, blocks,
+                                 update, udata);
+        if ( status != 0 ) {
+            set_url_status(mirrors, (status == -2) ? URL_SLOW : URL_FAILED);
+            continue;
+        }
+        verified = check_update(patch, url, path, &sums, update, udata);
+        if ( verified != VERIFY_FAILED ) {
+            break;
+        }
+        set_url_status(mirrors, URL_FAILED);
+        unlink(path);
+    }
+    if ( (verified != DOWNLOAD_FAILED) && mirrors->current ) {
+        strncpy(text, mirrors->current->url, maxlen-1);
+        text[maxlen-1] = '\0';
+    }
+    free_block_sums(blocks);
+    return((int)verified);
+}
+
+/* Find the first usable mirror for an update that isn't already busy.
+   Hosts that have failed or been slow for any product, in this process
+   or in a download's child, are only used once no others are left.
+   Returns 1 if one was found, 0 if they're all busy, or -1 if there are
+   no usable mirrors left.
+ */
+static int choose_mirror(patch *patch, struct mirror_url **mirror)
+{
+    struct mirror_url *entry;
+    int health, usable;
+
+    usable = 0;
+    for ( health = MIRROR_OK; health <= MIRROR_FAILED; ++health ) {
+        for ( entry = patch->patchset->mirrors->list; entry;
+              entry = entry->next ) {
+            if ( (entry->status != URL_OK) ||
+                 ((entry->host ? entry->host->health : MIRROR_OK) != health) ) {
+                continue;
+            }
+            usable = 1;
+            if ( ! entry->host ||
+                 (entry->host->connections < max_host_downloads) ) {
+                *mirror = entry;
+                return(1);
+            }
+        }
+
+        /* Wait for a better mirror rather than use a worse one */
+        if ( usable ) {
+            break;
+        }
+    }
+    return(usable ? 0 : -1);
+}
+
+static void report_update(patch *patch, const char *message,
+                          update_callback update, void *udata)
+{
+    char text[1024];
+
+    snprintf(text, sizeof(text), "%s: %s: %s",
+             get_handle_description(patch->patchset->product),
+             patch->description, message);
+    update_message(LOG_STATUS, text, update, udata);
+}
+
+/* Stop a download in progress */
+static void stop_download(update_schedule *schedule, scheduled_update *job)
+{
+    char sig_file[PATH_MAX];
+
+    if ( job->state == UPDATE_SIGNED ) {
+        sprintf(sig_file, "%s.sig", job->file);
+        unlink(sig_file);
+    }
+    if ( job->state == UPDATE_DOWNLOADING ) {
+        transfer_free(job->transfer);
+        job->transfer = NULL;
+        if ( job->host ) {
+            --job->host->connections;
+        }
+        --schedule->running;
+    }
+    job->state = UPDATE_DROPPED;
+}
+
+/* Nothing more is done for an install path once an update for it fails */
+static void fail_chain(install_chain *chain)
+{
+    scheduled_update *job;
+
+    chain->failed = 1;
+    chain->schedule->failed = 1;
+    for ( job = chain->list; job; job = job->next ) {
+        if ( job->state != UPDATE_QUEUED ) {
+            stop_download(chain->schedule, job);
+        }
+    }
+}
+
+/* Pass on the messages from the updates being applied, but not their
+   progress, which would get mixed up with the download progress.
+ */
+static int apply_update(int status_level, const char *status,
+                        float percentage,
+                        int size, int total, float rate, void *udata)
+{
+    update_schedule *schedule = (update_schedule *)udata;
+
+    if ( status && schedule->update ) {
+        schedule->update(status_level, status, 0.0f, 0, 0, 0.0f,
+                         schedule->udata);
+    }
+    return(0);
+}
+
+/* Let the UI know about the updates every install path is done with,
+   in order.  An update that failed for any of them counts as failed.
+ */
+static void finish_applied(install_chain *chain)
+{
+    update_schedule *schedule = chain->schedule;
+    install_root *root;
+    scheduled_update *job;
+    int status;
+
+    while ( (job = chain->next_applied) && (job->state == UPDATE_QUEUED) ) {
+        for ( root = chain->roots; root; root = root->next ) {
+            if ( ! root->failed && (root->finished <= job->order) ) {
+                return;
+            }
+        }
+        chain->next_applied = job->next;
+
+        /* Updates thrown away after failures aren't reported, as usual */
+        if ( ! job->applied_roots && ! job->failed_roots ) {
+            continue;
+        }
+        status = job->failed_roots ? -1 : 0;
+        if ( schedule->applied_func ) {
+            schedule->applied_func(job->patch, job->file, status,
+                                   schedule->applied_data);
+        }
+    }
+}
+
+/* Called as each update in an apply queue finishes */
+static void applied_update(patch *patch, const char *file,
+                           int status, void *data)
+{
+    install_root *root = (install_root *)data;
+    install_chain *chain = root->chain;
+    update_schedule *schedule = chain->schedule;
+    install_root *other;
+    scheduled_update *job;
+    char text[PATH_MAX];
+
+    for ( job = chain->list; job && (job->patch != patch); job = job->next ) {
+        continue;
+    }
+    ++root->finished;
+    if ( status == 0 ) {
+        ++schedule->applied;
+        if ( job ) {
+            ++job->applied_roots;
+        }
+    } else {
+        /* The later updates for this install path are thrown away */
+        root->failed = 1;
+        schedule->failed = 1;
+        if ( job ) {
+            ++job->failed_roots;
+            if ( chain->roots->next ) {
+                snprintf(text, sizeof(text), _("Update failed in %s"),
+                         root->path);
+                report_update(patch, text,
+                              schedule->update, schedule->udata);
+            }
+        }
+
+        /* Nothing more is needed once every install path has failed */
+        for ( other = chain->roots; other && other->failed;
+              other = other->next ) {
+            continue;
+        }
+        if ( ! other ) {
+            fail_chain(chain);
+        }
+    }
+    finish_applied(chain);
+}
+
+static install_chain *get_chain(update_schedule *schedule,
+                                const char *install_path)
+{
+    install_chain *chain, *last;
+
+    last = NULL;
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        if ( strcmp(chain->install_path, install_path) == 0 ) {
+            return(chain);
+        }
+        last = chain;
+    }
+    chain = (install_chain *)safe_malloc(sizeof *chain);
+    chain->install_path = install_path;
+    chain->list = NULL;
+    chain->next_queued = NULL;
+    chain->next_applied = NULL;
+    chain->roots = NULL;
+    chain->failed = 0;
+    chain->schedule = schedule;
+    chain->next = NULL;
+    if ( last ) {
+        last->next = chain;
+    } else {
+        schedule->chains = chain;
+    }
+    return(chain);
+}
+
+/* Add the install paths of a product to the chain of its updates */
+static void add_roots(install_chain *chain, patchset *patchset)
+{
+    const char *paths[MAX_PRODUCT_ROOTS];
+    install_root *root, *last;
+    int i, count;
+
+    count = get_handle_roots(patchset->product, paths, MAX_PRODUCT_ROOTS);
+    for ( i=0; i<count; ++i ) {
+        last = NULL;
+        for ( root = chain->roots; root; root = root->next ) {
+            if ( strcmp(root->path, paths[i]) == 0 ) {
+                break;
+            }
+            last = root;
+        }
+        if ( root ) {
+            continue;
+        }
+        root = (install_root *)safe_malloc(sizeof *root);
+        root->path = paths[i];
+        root->queue = NULL;
+        root->finished = 0;
+        root->failed = 0;
+        root->chain = chain;
+        root->next = NULL;
+        if ( last ) {
+            last->next = root;
+        } else {
+            chain->roots = root;
+        }
+    }
+}
+
+/* Add the selected updates in the patchsets, in the order they're applied */
+static void build_schedule(update_schedule *schedule, patchset *patchsets,
+                           update_callback update, void *udata)
+{
+    patchset *patchset;
+    version_node *root;
+    patch_path *path;
+    install_chain *chain;
+    install_root *install;
+    scheduled_update *job, *last;
+    const char *install_path;
+
+    for ( patchset = patchsets; patchset; patchset = patchset->next ) {
+        install_path = get_handle_root(patchset->product);
+        if ( ! install_path ) {
+            continue;
+        }
+        chain = get_chain(schedule, install_path);
+        add_roots(chain, patchset);
+        for ( last = chain->list; last && last->next; last = last->next ) {
+            continue;
+        }
+        for ( root = patchset->root; root; root = root->sibling ) {
+            if ( ! root->selected ) {
+                continue;
+            }
+            for ( path = root->selected->shortest_path; path;
+                  path = path->next ) {
+                if ( path->patch->installed ) {
+                    continue;
+                }
+                path->patch->installed = 1;
+                job = (scheduled_update *)safe_malloc(sizeof *job);
+                job->patch = path->patch;
+                job->chain = chain;
+                job->state = UPDATE_WAITING;
+                job->transfer = NULL;
+                job->mirror = NULL;
+                job->host = NULL;
+                job->verified = DOWNLOAD_FAILED;
+                job->order = last ? (last->order + 1) : 0;
+                job->applied_roots = 0;
+                job->failed_roots = 0;
+                if ( get_url_path(job->patch->file, job->file,
+                                  sizeof(job->file), update, udata) < 0 ) {
+                    job->file[0] = '\0';
+                } else
+                if ( find_artifact(job->patch->file, job->patch->sha256,
+                                   job->patch->md5,
+                                   job->patch->patchset->mirrors, job->file,
+                                   &job->verified, NULL, 0, update, udata) ) {
+                    /* Verified on an earlier try, or for another product */
+                    report_update(job->patch,
+                                  _("Update was already downloaded"),
+                                  update, udata);
+                    job->state = UPDATE_DOWNLOADED;
+                }
+                job->next = NULL;
+                if ( last ) {
+                    last->next = job;
+                } else {
+                    chain->list = job;
+                }
+                last = job;
+            }
+        }
+    }
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        chain->next_queued = chain->list;
+        chain->next_applied = chain->list;
+        for ( install = chain->roots; install; install = install->next ) {
+            if ( update ) {
+                install->queue = create_apply_queue(apply_update, schedule,
+                                                    applied_update, install);
+            } else {
+                install->queue = create_apply_queue(NULL, NULL,
+                                                    applied_update, install);
+            }
+        }
+    }
+}
+
+/* Pick the next update to download, shortest first if wanted */
+static scheduled_update *next_download(update_schedule *schedule,
+                                       struct mirror_url **mirror,
+                                       update_callback update, void *udata)
+{
+    install_chain *chain;
+    scheduled_update *job, *best;
+    struct mirror_url *best_mirror;
+
+    best = NULL;
+    best_mirror = NULL;
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        for ( job = chain->list; job && ! chain->failed; job = job->next ) {
+            if ( (job->state != UPDATE_WAITING) ||
+                 (best && (! shortest_first ||
+                           (job->patch->size >= best->patch->size))) ) {
+                continue;
+            }
+            switch (choose_mirror(job->patch, mirror)) {
+                case 1:
+                    best = job;
+                    best_mirror = *mirror;
+                    break;
+                case -1:
+                    report_update(job->patch, _("Unable to retrieve update"),
+                                  update, udata);
+                    fail_chain(chain);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    *mirror = best_mirror;
+    return(best);
+}
+
+static void start_download(update_schedule *schedule, scheduled_update *job,
+                           struct mirror_url *mirror,
+                           update_callback update, void *udata)
+{
+    report_update(job->patch, _("Downloading update"), update, udata);
+    job->mirror = mirror;
+    job->transfer = transfer_start_task(fetch_update, job,
+                                        job->patch->patchset->mirrors,
+                                        child_update, NULL);
+    if ( ! job->transfer ) {
+        fail_chain(job->chain);
+        return;
+    }
+    job->state = UPDATE_DOWNLOADING;
+    job->host = mirror->host;
+    if ( job->host ) {
+        ++job->host->connections;
+    }
+    ++schedule->running;
+}
+
+/* Find the mirror a child downloaded an update from */
+static struct mirror_url *find_mirror(urlset *mirrors, const char *url)
+{
+    struct mirror_url *entry;
+
+    for ( entry = mirrors->list; entry; entry = entry->next ) {
+        if ( strcmp(entry->url, url) == 0 ) {
+            break;
+        }
+    }
+    return(entry);
+}
+
+/* See how the finished downloads went */
+static void reap_downloads(update_schedule *schedule,
+                           update_callback update, void *udata)
+{
+    install_chain *chain;
+    scheduled_update *job;
+    verify_result verified;
+    char sig_file[PATH_MAX];
+
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        for ( job = chain->list; job; job = job->next ) {
+            if ( (job->state != UPDATE_DOWNLOADING) ||
+                 (transfer_poll(job->transfer) > 0) ) {
+                continue;
+            }
+            if ( job->host ) {
+                --job->host->connections;
+            }
+            --schedule->running;
+            if ( job->transfer->state == TRANSFER_DONE ) {
+                verified = (verify_result)job->transfer->status;
+                job->mirror = find_mirror(job->patch->patchset->mirrors,
+                                          job->transfer->file);
+            } else {
+                verified = DOWNLOAD_FAILED;
+            }
+            transfer_free(job->transfer);
+            job->transfer = NULL;
+            job->verified = verified;
+            switch (verified) {
+                case VERIFY_OK:
+                case VERIFY_UNKNOWN:
+                    sprintf(sig_file, "%s.sig", job->file);
+                    if ( access(sig_file, R_OK) == 0 ) {
+                        job->state = UPDATE_SIGNED;
+                        break;
+                    }
+                    report_update(job->patch, _("Verification succeeded"),
+                                  update, udata);
+                    job->state = UPDATE_DOWNLOADED;
+                    break;
+                case VERIFY_FAILED:
+                    job->state = UPDATE_DROPPED;
+                    report_update(job->patch, _("Update corrupted"),
+                                  update, udata);
+                    fail_chain(chain);
+                    break;
+                default:
+                    job->state = UPDATE_DROPPED;
+                    report_update(job->patch, _("Unable to retrieve update"),
+                                  update, udata);
+                    fail_chain(chain);
+                    break;
+            }
+        }
+    }
+}
+
+/* Check the signatures of a batch of updates with one run of GPG */
+static void check_signatures(scheduled_update **jobs, int count,
+                             update_callback update, void *udata)
+{
+    gpg_batch_file *files, *again;
+    char (*sig_files)[PATH_MAX];
+    int *index;
+    int i, j, num_again;
+
+    files = (gpg_batch_file *)safe_malloc(count*(sizeof *files));
+    sig_files = safe_malloc(count*(sizeof *sig_files));
+    for ( i=0; i<count; ++i ) {
+        sprintf(sig_files[i], "%s.sig", jobs[i]->file);
+        files[i].file = jobs[i]->file;
+        files[i].sigfile = sig_files[i];
+    }
+    gpg_verify_batch(files, count, update, udata);
+
+    /* Download any missing keys, and check those updates again */
+    again = (gpg_batch_file *)safe_malloc(count*(sizeof *again));
+    index = (int *)safe_malloc(count*(sizeof *index));
+    num_again = 0;
+    for ( i=0; i<count; ++i ) {
+        if ( files[i].result != GPG_NOPUBKEY ) {
+            continue;
+        }
+        for ( j=0; j<i; ++j ) {
+            if ( (files[j].result == GPG_NOPUBKEY) &&
+                 (strcmp(files[j].sig, files[i].sig) == 0) ) {
+                break;
+            }
+        }
+        if ( j == i ) {
+            get_publickey(files[i].sig, update, udata);
+        }
+        again[num_again] = files[i];
+        index[num_again] = i;
+        ++num_again;
+    }
+    if ( num_again ) {
+        gpg_verify_batch(again, num_again, update, udata);
+        for ( i=0; i<num_again; ++i ) {
+            files[index[i]].result = again[i].result;
+        }
+    }
+    free(again);
+    free(index);
+
+    /* Anything GPG couldn't check keeps the checksum result */
+    for ( i=0; i<count; ++i ) {
+        switch (files[i].result) {
+            case GPG_VERIFYOK:
+                jobs[i]->verified = VERIFY_OK;
+                store_artifact(NULL, jobs[i]->patch->file, jobs[i]->file,
+                               NULL, VERIFY_OK, files[i].result,
+                               files[i].sig);
+                break;
+            case GPG_VERIFYFAIL:
+                jobs[i]->verified = VERIFY_FAILED;
+                break;
+            default:
+                break;
+        }
+        unlink(sig_files[i]);
+    }
+    free(sig_files);
+    free(files);
+}
+
+/* Check the signatures of the updates waiting for it, once nothing is
+   being downloaded or an update can't be applied until it's checked.
+ */
+static void verify_downloads(update_schedule *schedule,
+                             update_callback update, void *udata)
+{
+    install_chain *chain;
+    scheduled_update *job;
+    scheduled_update **jobs;
+    int i, count, needed;
+
+    count = 0;
+    needed = (schedule->running == 0);
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        for ( job = chain->list; job; job = job->next ) {
+            if ( job->state == UPDATE_SIGNED ) {
+                ++count;
+                if ( job == chain->next_queued ) {
+                    needed = 1;
+                }
+            }
+        }
+    }
+    if ( ! count || ! needed ) {
+        return;
+    }
+
+    jobs = (scheduled_update **)safe_malloc(count*(sizeof *jobs));
+    count = 0;
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        for ( job = chain->list; job; job = job->next ) {
+            if ( job->state == UPDATE_SIGNED ) {
+                jobs[count++] = job;
+            }
+        }
+    }
+    check_signatures(jobs, count, update, udata);
+    for ( i=0; i<count; ++i ) {
+        job = jobs[i];
+        if ( job->state != UPDATE_SIGNED ) {
+            continue;
+        }
+        if ( job->verified == VERIFY_FAILED ) {
+            unlink(job->file);
+            report_update(job->patch, _("Update corrupted"), update, udata);
+
+            /* Download it again from the next mirror, as the child does
+               when an update fails its signature check there.
+             */
+            if ( job->mirror ) {
+                set_mirror_url_status(job->patch->patchset->mirrors,
+                                      job->mirror->url, URL_FAILED);
+                job->mirror = NULL;
+                job->verified = DOWNLOAD_FAILED;
+                job->state = UPDATE_WAITING;
+            } else {
+                job->state = UPDATE_DROPPED;
+                fail_chain(job->chain);
+            }
+        } else {
+            report_update(job->patch, _("Verification succeeded"),
+                          update, udata);
+            job->state = UPDATE_DOWNLOADED;
+        }
+    }
+    free(jobs);
+}
+
+/* Queue the updates that are ready to be applied, in order */
+static int queue_downloads(update_schedule *schedule)
+{
+    install_chain *chain;
+    install_root *root;
+    scheduled_update *job;
+    int busy;
+
+    busy = 0;
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        while ( ! chain->failed && (job = chain->next_queued) &&
+                (job->state == UPDATE_DOWNLOADED) ) {
+            job->state = UPDATE_QUEUED;
+            chain->next_queued = job->next;
+            for ( root = chain->roots; root; root = root->next ) {
+                queue_update(root->queue, job->patch, job->file, root->path);
+            }
+        }
+        for ( root = chain->roots; root; root = root->next ) {
+            if ( poll_apply_queue(root->queue) ) {
+                busy = 1;
+            }
+        }
+    }
+    return(busy);
+}
+
+/* Show the overall progress, returning nonzero if cancelled */
+static int show_progress(update_schedule *schedule, double start_time,
+                         update_callback update, void *udata)
+{
+    install_chain *chain;
+    scheduled_update *job;
+    long done, total;
+    off_t size;
+    float percentage, rate;
+    double elapsed;
+
+    if ( ! update ) {
+        return(0);
+    }
+    done = 0;
+    total = 0;
+    for ( chain = schedule->chains; chain; chain = chain->next ) {
+        for ( job = chain->list; job; job = job->next ) {
+            total += job->patch->size;
+            if ( job->state == UPDATE_WAITING ) {
+                continue;
+            }
+            if ( job->state == UPDATE_DOWNLOADING ) {
+                size = get_file_size(job->file);
+                if ( size > 0 ) {
+                    done += (long)(size / 1024);
+                }
+            } else {
+                done += job->patch->size;
+            }
+        }
+    }
+
+    /* The rate doesn't count what was already downloaded before */
+    if ( schedule->start_done < 0 ) {
+        schedule->start_done = done;
+    }
+    percentage = total ? ((float)done * 100.0f) / total : 0.0f;
+    elapsed = double_time() - start_time;
+    if ( elapsed > 0.0 ) {
+        rate = (float)((done - schedule->start_done) / elapsed);
+    } else {
+        rate = 0.0f;
+    }
+    return(update(0, NULL, percentage, (int)done, (int)total, rate, udata));
+}
+
+int schedule_updates(patchset *patchsets,
+                     applied_callback applied, void *data,
+                     update_callback update, void *udata)
+{
+    update_schedule schedule;
+    install_chain *chain, *next_chain;
+    install_root *root;
+    scheduled_update *job, *next_job;
+    struct mirror_url *mirror;
+    double start_time;
+    int busy, cancelled;
+
+    schedule.chains = NULL;
+    schedule.running = 0;
+    schedule.applied = 0;
+    schedule.failed = 0;
+    schedule.start_done = -1;
+    schedule.applied_func = applied;
+    schedule.applied_data = data;
+    schedule.update = update;
+    schedule.udata = udata;
+    build_schedule(&schedule, patchsets, update, udata);
+
+    start_time = double_time();
+    cancelled = 0;
+    do {
+        /* Start as many downloads as the limits allow */
+        while ( (schedule.running < max_downloads) &&
+                (job = next_download(&schedule, &mirror, update, udata)) ) {
+            start_download(&schedule, job, mirror, update, udata);
+        }
+
+        /* Apply the updates that are ready */
+        reap_downloads(&schedule, update, udata);
+        verify_downloads(&schedule, update, udata);
+        busy = queue_downloads(&schedule);
+
+        /* See if anything is still waiting to be downloaded */
+        for ( chain = schedule.chains; chain && ! busy; chain = chain->next ) {
+            for ( job = chain->list; job && ! chain->failed; job = job->next ) {
+                if ( job->state == UPDATE_WAITING ) {
+                    busy = 1;
+                    break;
+                }
+            }
+        }
+        if ( schedule.running ) {
+            busy = 1;
+        }
+        if ( busy ) {
+            if ( show_progress(&schedule, start_time, update, udata) ) {
+                cancelled = 1;
+                break;
+            }
+            /* Wait for news from the downloads or the updates */
+            event_poll(100);
+        }
+    } while ( busy );
+
+    /* Clean up, stopping anything still running if we were cancelled */
+    for ( chain = schedule.chains; chain; chain = next_chain ) {
+        next_chain = chain->next;
+        for ( root = chain->roots; root; root = root->next ) {
+            free_apply_queue(root->queue);
+            root->queue = NULL;
+        }
+        while ( chain->roots ) {
+            root = chain->roots;
+            chain->roots = root->next;
+            free(root);
+        }
+        for ( job = chain->list; job; job = next_job ) {
+            next_job = job->next;
+            stop_download(&schedule, job);
+            free(job);
+        }
+        free(chain);
+    }
+    if ( cancelled || schedule.failed ) {
+        return(-1);
+    }
+    return(schedule.applied);
+}
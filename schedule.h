@@ -0,0 +1,61 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Functions to download the updates for several products at once.
+
+   The downloads run in the background, limited in total and for each
+   mirror host, and the updates for each install path are applied one at
+   a time, in order, as soon as they have been downloaded and verified.
+   When a product is installed in several places, each update is
+   downloaded once and applied to all of them at the same time.
+*/
+
+#ifndef _schedule_h
+#define _schedule_h
+
+#include "update.h"
+#include "patchset.h"
+#include "apply_queue.h"
+
+/* The default number of downloads at once, in total and from one host */
+#define DEFAULT_MAX_DOWNLOADS       4
+#define DEFAULT_MAX_HOST_DOWNLOADS  2
+
+/* Set the number of downloads run at once, in total and from one host */
+extern void set_download_limits(int max_downloads, int max_host_downloads);
+
+/* Set whether the smallest updates are downloaded first, which is the
+   default, or in the order they are applied.
+ */
+extern void set_shortest_first(int enabled);
+
+/* Download, verify and apply all the selected updates in a list of
+   patchsets.  The 'applied' callback is called as each update finishes
+   for all of the install paths of its product, with a failure if it
+   failed for any of them, and the update callback shows the overall
+   progress and may cancel.
+   Returns the number of updates applied, or -1 if any of them failed.
+ */
+extern int schedule_updates(patchset *patchsets,
+                            applied_callback applied, void *data,
+                            update_callback update, void *udata);
+
+#endif /* _schedule_h */
@@ -0,0 +1,72 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* The state of a run of the update tool, and the session each thread uses */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log_output.h"
+#include "session.h"
+
+static update_session main_session;
+static pthread_key_t session_key;
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+
+static void init_session(update_session *session)
+{
+    session->product_list = NULL;
+    memset(session->product_hash, 0, sizeof(session->product_hash));
+    session->products_sorted = 1;
+    session->current_product = NULL;
+    session->num_products = 0;
+    session->override_update_url = NULL;
+    session->linked_product = NULL;
+    session->tmppath = "tmp";
+    session->working_path[0] = '\0';
+    session->log_level = LOG_NORMAL;
+}
+
+static void init_sessions(void)
+{
+    init_session(&main_session);
+    pthread_key_create(&session_key, NULL);
+}
+
+void set_thread_session(update_session *session)
+{
+    pthread_once(&session_once, init_sessions);
+    pthread_setspecific(session_key, session);
+}
+
+update_session *get_session(void)
+{
+    update_session *session;
+
+    pthread_once(&session_once, init_sessions);
+    session = (update_session *)pthread_getspecific(session_key);
+    if ( ! session ) {
+        session = &main_session;
+    }
+    return(session);
+}
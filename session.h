@@ -0,0 +1,74 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+
+/* The state of a run of the update tool: the installed products, where
+   updates are downloaded, and what is logged.  The functions that work
+   with products take the session they belong to, rather than using
+   globals, so the update lists of a session can be parsed and their
+   paths planned on worker threads.
+
+   Each thread also has a current session, used by the functions that
+   are called from everywhere, like log() and the download functions.
+   It's the main session unless the thread sets another one, as the
+   path planning threads do.  There is only the one session in a run:
+   what is known about the mirrors is kept for the whole process, and
+   downloads run in child processes rather than threads.
+*/
+
+#ifndef _session_h
+#define _session_h
+
+#include <limits.h>
+
+/* The number of hash buckets for finding products by name */
+#define PRODUCT_HASH_SIZE   64
+
+struct product_entry;
+
+typedef struct update_session {
+    /* The installed products, kept by load_products.c.  The list is
+       sorted by name when it's iterated, and the hash is for lookups. */
+    struct product_entry *product_list;
+    struct product_entry *product_hash[PRODUCT_HASH_SIZE];
+    int products_sorted;
+    struct product_entry *current_product;
+    int num_products;
+    const char *override_update_url;
+    char *linked_product;
+
+    /* Where updates are downloaded to */
+    const char *tmppath;
+
+    /* The original working directory, for relative paths and URLs */
+    char working_path[PATH_MAX];
+
+    /* The least important messages that are logged */
+    int log_level;
+} update_session;
+
+/* Set the session used by the calling thread, or NULL for the main one */
+extern void set_thread_session(update_session *session);
+
+/* Get the session used by the calling thread */
+extern update_session *get_session(void);
+
+#endif /* _session_h */
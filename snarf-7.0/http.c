@@ -16,7 +16,6 @@
 
 extern int default_opts;
 
-int redirect_count = 0;
 #define REDIRECT_MAX 10
 
 #define USER_AGENT "snarf/" VERSION " (http://www.xach.com/snarf)"
@@ -268,10 +267,10 @@ http_transfer(UrlResource *rsrc)
 
         /* make sure we haven't recursed too much */
 
-        if( redirect_count > REDIRECT_MAX ) {
+        if( rsrc->redirect_count > REDIRECT_MAX ) {
                 report(rsrc, ERR, "redirection max count exceeded " 
                                   "(looping redirect?)");
-                redirect_count = 0;
+                rsrc->redirect_count = 0;
                 return 0;
         }
 
@@ -382,7 +381,7 @@ http_transfer(UrlResource *rsrc)
                         retval = 0;
                         goto cleanup;
                 }
-                write(fileno(out), buf, bytes_read);
+                write_data(rsrc, out, buf, bytes_read);
         } else {
                 /* skip the header */
                 buf[bytes_read] = '\0';
@@ -407,7 +406,7 @@ http_transfer(UrlResource *rsrc)
 
                         url_init(redir_u, new_location);
                         rsrc->url = redir_u;
-                        redirect_count++;
+                        rsrc->redirect_count++;
                         retval = transfer(rsrc);
                         goto cleanup;
                 }
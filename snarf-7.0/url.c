@@ -309,6 +309,22 @@ url_resource_new(void)
         new_resource->progress		= NULL;
         new_resource->progress_percent	= 0.0f;
         new_resource->progress_udata	= NULL;
+        new_resource->outbuf		= NULL;
+        new_resource->outbuf_len	= 0;
+        new_resource->outbuf_size	= 0;
+        new_resource->outbuf_max	= 0;
+        new_resource->data_hook		= NULL;
+        new_resource->data_hook_udata	= NULL;
+        new_resource->transfer_start	= 0.0;
+        new_resource->connect_time	= -1.0;
+        new_resource->transfer_rate	= 0.0f;
+        new_resource->transfer_bytes	= 0;
+        new_resource->cancelled		= 0;
+        new_resource->stall_timeout	= 0;
+        new_resource->min_rate		= 0.0f;
+        new_resource->rate_window	= 0;
+        new_resource->stalled		= 0;
+        new_resource->redirect_count	= 0;
 
         return new_resource;
 }
@@ -324,6 +340,7 @@ url_resource_destroy(UrlResource *rsrc)
                 url_destroy(rsrc->url);
 
         safe_free(rsrc->outfile);
+        safe_free(rsrc->outbuf);
 
         free(rsrc);
 }
@@ -40,6 +40,30 @@ struct _UrlResource {
             void *udata);
 	float progress_percent;
         void *progress_udata;
+        /* If outbuf_max is set, data is saved here instead of outfile */
+        char *outbuf;
+        int outbuf_len;
+        int outbuf_size;
+        int outbuf_max;
+        /* If set, this is called with each block of data as it's saved,
+           and the transfer stops if it returns nonzero */
+        int (*data_hook)(const char *data, int len, void *udata);
+        void *data_hook_udata;
+        /* How the last transfer went, used to choose faster mirrors */
+        double transfer_start;
+        double connect_time;            /* Seconds until the data began */
+        float transfer_rate;            /* K/s */
+        long transfer_bytes;
+        int cancelled;
+        /* If set, the transfer is stopped when no data arrives for
+           stall_timeout seconds, or when less than min_rate K/s arrives
+           over the last rate_window seconds, and stalled is set */
+        int stall_timeout;
+        float min_rate;
+        int rate_window;
+        int stalled;
+        /* The number of redirects followed so far for this resource */
+        int redirect_count;
 };
 
 
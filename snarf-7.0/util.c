@@ -156,16 +156,124 @@ get_proxy(const char *firstchoice)
 }
 
 
+/* Write data to the output file, or the memory buffer if one is in use.
+   Returns -1 on error, or -2 if the data hook rejected the data. */
+int
+write_data(UrlResource *rsrc, FILE *out, const char *buf, int len)
+{
+        char *outbuf;
+        int size;
+
+        if( ! rsrc->outbuf_max ) {
+                size = write(fileno(out), buf, len);
+                if( (size > 0) && rsrc->data_hook &&
+                    rsrc->data_hook(buf, size, rsrc->data_hook_udata) )
+                        return -2;
+                return size;
+        }
+
+        if( (rsrc->outbuf_len + len) > rsrc->outbuf_max ) {
+                errno = EFBIG;
+                return -1;
+        }
+        if( (rsrc->outbuf_len + len) >= rsrc->outbuf_size ) {
+                size = rsrc->outbuf_size ? rsrc->outbuf_size : BUFSIZE;
+                while( (rsrc->outbuf_len + len) >= size )
+                        size *= 2;
+                if( size > (rsrc->outbuf_max + 1) )
+                        size = rsrc->outbuf_max + 1;
+                outbuf = realloc(rsrc->outbuf, size);
+                if( ! outbuf )
+                        return -1;
+                rsrc->outbuf = outbuf;
+                rsrc->outbuf_size = size;
+        }
+        memcpy(rsrc->outbuf + rsrc->outbuf_len, buf, len);
+        rsrc->outbuf_len += len;
+        rsrc->outbuf[rsrc->outbuf_len] = '\0';
+        if( rsrc->data_hook &&
+            rsrc->data_hook(buf, len, rsrc->data_hook_udata) )
+                return -2;
+        return len;
+}
+
+
+/* The longest time the transfer rate is averaged over, in seconds */
+#define MAX_RATE_WINDOW	60
+
+typedef struct {
+        double start;
+        double last_data;
+        long second;
+        long total;
+        long bytes[MAX_RATE_WINDOW];
+} RateWindow;
+
+static void
+rate_window_init(RateWindow *w)
+{
+        memset(w, 0, sizeof(*w));
+        w->start = double_time();
+        w->last_data = w->start;
+}
+
+/* Count the data that just arrived, returning 1 if the transfer has
+   stalled or fallen below the minimum rate */
+static int
+rate_window_check(UrlResource *rsrc, RateWindow *w, int bytes_read)
+{
+        double now, span;
+        long second;
+        int window;
+
+        now = double_time();
+        if( bytes_read > 0 )
+                w->last_data = now;
+        if( rsrc->stall_timeout &&
+            ((now - w->last_data) >= rsrc->stall_timeout) ) {
+                report(rsrc, ERR, "no data received for %d seconds",
+                       rsrc->stall_timeout);
+                return 1;
+        }
+
+        window = rsrc->rate_window;
+        if( (rsrc->min_rate <= 0.0f) || (window < 2) )
+                return 0;
+        if( window > MAX_RATE_WINDOW )
+                window = MAX_RATE_WINDOW;
+
+        /* Slide the window along, one second at a time */
+        second = (long)(now - w->start);
+        while( w->second < second ) {
+                ++w->second;
+                w->total -= w->bytes[w->second % window];
+                w->bytes[w->second % window] = 0;
+        }
+        w->bytes[second % window] += bytes_read;
+        w->total += bytes_read;
+
+        /* Wait for a full window of data before judging the rate */
+        if( second < window )
+                return 0;
+        span = now - w->start - (second - window + 1);
+        if( ((w->total / 1024.0) / span) < rsrc->min_rate ) {
+                report(rsrc, ERR, "less than %.1f K/s over %d seconds",
+                       rsrc->min_rate, window);
+                return 1;
+        }
+        return 0;
+}
+
 int
 dump_data(UrlResource *rsrc, int sock, FILE *out)
 {
 	int done		= 0;
 	int okay		= 1;
-        int out_fd 		= fileno(out);
         Progress *p		= NULL;
         int bytes_read		= 0;
         ssize_t written		= 0;
         char buf[BUFSIZE];
+        RateWindow window;
 
         /* if we already have all of it */
         if( !(rsrc->options & OPT_NORESUME) ) {
@@ -186,6 +294,7 @@ dump_data(UrlResource *rsrc, int sock, FILE *out)
                 p->offset = rsrc->outfile_offset;
         }
 
+        rate_window_init(&window);
 
 	done = 0;
 	okay = 1;
@@ -209,16 +318,25 @@ dump_data(UrlResource *rsrc, int sock, FILE *out)
 			bytes_read = 0;
 		}
 		if ( bytes_read > 0 ) {
-                	written = write(out_fd, buf, bytes_read);
+                	written = write_data(rsrc, out, buf, bytes_read);
                 	if ( written == -1 ) {
                         	report(rsrc, ERR, "write failed: %s", strerror(errno));
                         	okay = 0;
 			}
+                	if ( written == -2 ) {
+                        	report(rsrc, ERR, "downloaded data was rejected");
+                        	okay = 0;
+			}
                 }
                 if ( progress_update(p, bytes_read) ) {
 			/* Cancelled? */
 			okay = 0;
 		}
+                if ( okay && ! done &&
+                     rate_window_check(rsrc, &window, bytes_read) ) {
+                        rsrc->stalled = 1;
+                        okay = 0;
+                }
         }
 
         progress_destroy(p, okay);
@@ -280,6 +398,8 @@ progress_init(Progress *p, UrlResource *rsrc, long int len)
 
         p->rsrc = rsrc;
         p->length = len;
+        if( rsrc->transfer_start > 0.0 )
+                rsrc->connect_time = p->start_time - rsrc->transfer_start;
 
 
 #ifndef PROGRESS_DEFAULT_OFF
@@ -355,9 +475,15 @@ progress_update(Progress *	p,
         unsigned int units;
         char *anim = "-\\|/";
 	int cancelled = 0;
+        double elapsed;
 
         p->current += increment;
 
+        elapsed = double_time() - p->start_time;
+        p->rsrc->transfer_bytes = p->current - p->offset;
+        if( elapsed > 0.0 )
+                p->rsrc->transfer_rate = (p->rsrc->transfer_bytes / elapsed) / 1024;
+
 	if( p->tty ) {
         	fprintf(stderr, "\r");
         	fprintf(stderr, "%-25.25s [", p->rsrc->outfile);
@@ -366,7 +492,6 @@ progress_update(Progress *	p,
 
         if( p->length ) {
                 float percent_done = (float )p->current / p->length;
-                double elapsed;
                 float rate;
 
 		if( p->tty ) {
@@ -378,8 +503,6 @@ progress_update(Progress *	p,
                 	fprintf(stderr, "%7dK", (int )(p->current / 1024));
 		}
 
-                elapsed = double_time() - p->start_time;
-
                 if (elapsed) 
                         rate = ((p->current - p->offset) / elapsed) / 1024;
                 else
@@ -396,6 +519,8 @@ progress_update(Progress *	p,
 			                   p->current/1024, p->length/1024,
 			                   rate,
 			                   p->rsrc->progress_udata);
+			if( cancelled )
+				p->rsrc->cancelled = 1;
 		}
        
 		if( p->tty ) {
@@ -574,6 +699,13 @@ report(UrlResource *rsrc, enum report_levels lev, char *format, ...)
 }
 
 
+int (*gethostbyname_hook)(const char *remote_host, struct sockaddr_in *sa,
+    int (*update)(int status_level, const char *status,
+                  float percentage, int size, int total, float rate,
+                  void *udata), void *udata) = NULL;
+
+int (*connected_socket_hook)(const char *remote_host, int port) = NULL;
+
 int
 tcp_connect(char *remote_host, int port) 
 {
@@ -581,9 +713,25 @@ tcp_connect(char *remote_host, int port)
         struct sockaddr_in sa;
         int sock_fd;
 
-        if((host = (struct hostent *)gethostbyname(remote_host)) == NULL) {
-                herror(remote_host);
-                return 0;
+        if( connected_socket_hook &&
+            ((sock_fd = connected_socket_hook(remote_host, port)) >= 0) )
+                return sock_fd;
+
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(port);
+        if( gethostbyname_hook ) {
+                sa.sin_addr.s_addr = inet_addr(remote_host);
+                if( (sa.sin_addr.s_addr == INADDR_NONE) &&
+                    (gethostbyname_hook(remote_host, &sa, NULL, NULL) < 0) ) {
+                        report(NULL, ERR, "unable to look up %s", remote_host);
+                        return 0;
+                }
+        } else {
+                if((host = (struct hostent *)gethostbyname(remote_host)) == NULL) {
+                        herror(remote_host);
+                        return 0;
+                }
+                memcpy(&sa.sin_addr, host->h_addr,host->h_length);
         }
 
         /* get the socket */
@@ -593,10 +741,6 @@ tcp_connect(char *remote_host, int port)
         }
 
         /* connect the socket, filling in the important stuff */
-        sa.sin_family = AF_INET;
-        sa.sin_port = htons(port);
-        memcpy(&sa.sin_addr, host->h_addr,host->h_length);
-  
         if(connect(sock_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0){
                 perror(remote_host);
                 return 0;
@@ -605,18 +749,38 @@ tcp_connect(char *remote_host, int port)
         return sock_fd;
 }
 
+/* Copy up to 'max_addrs' addresses of a host, returning the number copied */
+static int
+copy_host_addrs(struct hostent *host, struct in_addr *addrs, int max_addrs)
+{
+	int i;
+
+	for ( i=0; (i < max_addrs) && host->h_addr_list[i]; ++i ) {
+		memcpy(&addrs[i], host->h_addr_list[i], sizeof(addrs[i]));
+	}
+	return i;
+}
+
 #if defined(HAVE_ARES_H)
+struct host_lookup {
+	struct in_addr *addrs;
+	int max_addrs;
+	int num_addrs;
+};
+
 static void snarf_host_callback(void *arg, int status, struct hostent *host)
 {
-	struct sockaddr_in *sa = (struct sockaddr_in *)arg;
+	struct host_lookup *lookup = (struct host_lookup *)arg;
 
 	if ( status == ARES_SUCCESS ) {
-		memcpy(&sa->sin_addr, host->h_addr, host->h_length);
+		lookup->num_addrs = copy_host_addrs(host, lookup->addrs,
+		                                    lookup->max_addrs);
 	}
 }
 	
-static int
-gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
+int
+gethostbyname_list_async(const char *remote_host,
+    struct in_addr *addrs, int max_addrs,
     int (*update)(int status_level, const char *status,
                   float percentage, int size, int total, float rate,
                   void *udata), void *udata)
@@ -628,16 +792,18 @@ gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
 	struct timeval tv, maxtv;
 	struct timeval *tvp;
 	int cancelled;
-	int status;
+	struct host_lookup lookup;
 
 	/* Initialize to no host entry */
-	sa->sin_addr.s_addr = INADDR_NONE;
+	lookup.addrs = addrs;
+	lookup.max_addrs = max_addrs;
+	lookup.num_addrs = 0;
 	if ( ares_init(&channel) != ARES_SUCCESS ) {
 		return(-1);
 	}
 
 	/* Perform the lookup */
-	ares_gethostbyname(channel, remote_host, AF_INET, snarf_host_callback, sa);
+	ares_gethostbyname(channel, remote_host, AF_INET, snarf_host_callback, &lookup);
 
 	/* Drive the lookup, periodically calling the UI update */
 	cancelled = 0;
@@ -651,7 +817,8 @@ gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
 		maxtv.tv_sec = 0;
 		maxtv.tv_usec = 100000;
 		tvp = ares_timeout(channel, &maxtv, &tv);
-		if ( select(nfds, &read_fds, &write_fds, NULL, tvp) == 0 ) {
+		if ( (select(nfds, &read_fds, &write_fds, NULL, tvp) == 0) &&
+		     update ) {
 			/* No activity, run UI update */
 			cancelled = update(0, NULL, 0.0f, 0, 0, 0.0f, udata);
 		}
@@ -659,16 +826,15 @@ gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
 	}
 	ares_destroy(channel);
 
-	if ( sa->sin_addr.s_addr == INADDR_NONE ) {
-		status = -1;
-	} else {
-		status = 0;
+	if ( lookup.num_addrs == 0 ) {
+		return(-1);
 	}
-	return status;
+	return lookup.num_addrs;
 }
 #else
-static int
-gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
+int
+gethostbyname_list_async(const char *remote_host,
+    struct in_addr *addrs, int max_addrs,
     int (*update)(int status_level, const char *status,
                   float percentage, int size, int total, float rate,
                   void *udata), void *udata)
@@ -678,8 +844,7 @@ gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
 
 	host = (struct hostent *)gethostbyname(remote_host);
 	if ( host ) {
-		memcpy(&sa->sin_addr, host->h_addr, host->h_length);
-		status = 0;
+		status = copy_host_addrs(host, addrs, max_addrs);
 	} else {
 		status = -1;
 	}
@@ -687,6 +852,20 @@ gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
 }
 #endif /* HAVE_ARES */
 
+int
+gethostbyname_async(const char *remote_host, struct sockaddr_in *sa,
+    int (*update)(int status_level, const char *status,
+                  float percentage, int size, int total, float rate,
+                  void *udata), void *udata)
+{
+	if ( gethostbyname_list_async(remote_host, &sa->sin_addr, 1,
+	                              update, udata) < 0 ) {
+		sa->sin_addr.s_addr = INADDR_NONE;
+		return(-1);
+	}
+	return(0);
+}
+
 static int set_blocking(int sock_fd, int blocking)
 {
 	int flags;
@@ -728,6 +907,13 @@ tcp_connect_async(char *remote_host, int port,
 		return tcp_connect(remote_host, port);
 	}
 
+	/* Use a connection that's already been made, if there is one */
+	if( connected_socket_hook &&
+	    ((sock_fd = connected_socket_hook(remote_host, port)) >= 0) ) {
+		update(STATUS, "Connected", 0.0f, 0, 0, 0.0f, udata);
+		return sock_fd;
+	}
+
         /* Start off with zero percent complete (opening connection) */
 	cancelled = update(0, NULL, 0.0f, 0, 0, 0.0f, udata);
         if ( cancelled ) {
@@ -741,7 +927,9 @@ tcp_connect_async(char *remote_host, int port,
 	sa.sin_port = htons(port);
 	sa.sin_addr.s_addr = inet_addr(remote_host);
 	if ( sa.sin_addr.s_addr == INADDR_NONE ) {
-		if( gethostbyname_async(remote_host, &sa, update, udata) < 0 ) {
+		if( (gethostbyname_hook ?
+		     gethostbyname_hook(remote_host, &sa, update, udata) :
+		     gethostbyname_async(remote_host, &sa, update, udata)) < 0 ) {
 			/* FIXME: Print an error message */
 			return(0);
 		}
@@ -834,6 +1022,7 @@ transfer(UrlResource *rsrc)
 {
         int i;
 
+        rsrc->transfer_start = double_time();
         switch (rsrc->url->service_type) {
         case SERVICE_FILE:
                 i = file_transfer(rsrc);
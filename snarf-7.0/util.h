@@ -38,11 +38,20 @@ double double_time(void);
 char *string_lowercase(char *);
 char *get_proxy(const char *);
 int dump_data(UrlResource *, int, FILE *);
+int write_data(UrlResource *, FILE *, const char *, int);
 char *strconcat(const char *, ...);
 char *base64(char *, int);
 void report(UrlResource *, enum report_levels, char *, ...);
 int tcp_connect(char *, int);
 int tcp_connect_async(char *remote_host, int port, int (*update)(int status_level, const char *status, float percentage, int size, int total, float rate, void *udata), void *udata);
+struct sockaddr_in;
+struct in_addr;
+int gethostbyname_async(const char *remote_host, struct sockaddr_in *sa, int (*update)(int status_level, const char *status, float percentage, int size, int total, float rate, void *udata), void *udata);
+/* If set, host names are looked up with this instead, so they can be cached */
+extern int (*gethostbyname_hook)(const char *remote_host, struct sockaddr_in *sa, int (*update)(int status_level, const char *status, float percentage, int size, int total, float rate, void *udata), void *udata);
+int gethostbyname_list_async(const char *remote_host, struct in_addr *addrs, int max_addrs, int (*update)(int status_level, const char *status, float percentage, int size, int total, float rate, void *udata), void *udata);
+/* If set, this is asked for an already connected socket before connecting */
+extern int (*connected_socket_hook)(const char *remote_host, int port);
 off_t get_file_size(const char *);
 void repchar(FILE *fp, char ch, int count);
 int transfer(UrlResource *rsrc);
@@ -55,7 +64,7 @@ char *strdup(const char *s);
 
 extern int debug_enabled;
 
-#define open_outfile(x)  (((x)->outfile[0] == '-') ? stdout : real_open_outfile(x))
+#define open_outfile(x)  ((x)->outbuf_max ? fopen("/dev/null", "w") : ((x)->outfile[0] == '-') ? stdout : real_open_outfile(x))
 #define real_open_outfile(x)  (((x)->options & OPT_RESUME && !((x)->options & OPT_NORESUME)) ? (fopen((x)->outfile, "a")) : (fopen((x)->outfile, "w")))
 
 #define safe_free(x)		if(x) free(x)
@@ -47,10 +47,36 @@ void text_close(struct text_fp *textfp)
     free(textfp);
 }
 
+/* Set up parsing of text in a buffer allocated with malloc() */
+struct text_fp *text_open_data(char *data, int size)
+{
+    struct text_fp *textfp;
+
+    /* Allocate memory for the file structure */
+    textfp = (struct text_fp *)malloc(sizeof *textfp);
+    if ( ! textfp ) {
+        fprintf(stderr, _("Out of memory\n"));
+        free(data);
+        return(NULL);
+    }
+    memset(textfp, 0, (sizeof *textfp));
+    textfp->data = data;
+    textfp->pos = textfp->data;
+    textfp->end = textfp->data+size;
+    *textfp->end = '\0';
+
+    /* See whether the file is in HTML mode */
+    textfp->html_mode = (strstr(textfp->data, "<body") ||
+                         strstr(textfp->data, "<BODY"));
+
+    /* We're all set */
+    return textfp;
+}
+
 struct text_fp *text_open(const char *file)
 {
     struct stat sb;
-    struct text_fp *textfp;
+    char *data;
     FILE *fp;
     int was_read;
 
@@ -60,17 +86,9 @@ struct text_fp *text_open(const char *file)
         return(NULL);
     }
 
-    /* Allocate memory for the file structure */
-    textfp = (struct text_fp *)malloc(sizeof *textfp);
-    if ( ! textfp ) {
-        fprintf(stderr, _("Out of memory\n"));
-        return(NULL);
-    }
-    memset(textfp, 0, (sizeof *textfp));
-
     /* Allocate memory to hold the file */
-    textfp->data = (char *)malloc(sb.st_size+1);
-    if ( ! textfp->data ) {
+    data = (char *)malloc(sb.st_size+1);
+    if ( ! data ) {
         fprintf(stderr, _("Out of memory\n"));
         return(NULL);
     }
@@ -79,26 +97,17 @@ struct text_fp *text_open(const char *file)
     fp = fopen(file, "r");
     if ( ! fp ) {
         fprintf(stderr, _("Unable to open %s\n"), file);
-        text_close(textfp);
+        free(data);
         return(NULL);
     }
-    was_read = fread(textfp->data, sb.st_size, 1, fp);
+    was_read = fread(data, sb.st_size, 1, fp);
     fclose(fp);
     if ( ! was_read ) {
         fprintf(stderr, _("Unable to read %s\n"), file);
-        text_close(textfp);
+        free(data);
         return(NULL);
     }
-    textfp->pos = textfp->data;
-    textfp->end = textfp->data+sb.st_size;
-    *textfp->end = '\0';
-
-    /* See whether the file is in HTML mode */
-    textfp->html_mode = (strstr(textfp->data, "<body") ||
-                         strstr(textfp->data, "<BODY"));
-
-    /* We're all set */
-    return textfp;
+    return text_open_data(data, sb.st_size);
 }
 
 char *text_line(char *line, int maxlen, struct text_fp *textfp)
@@ -29,6 +29,11 @@ extern void text_close(struct text_fp *textfp);
 
 extern struct text_fp *text_open(const char *file);
 
+/* Parse text already in memory.  The data must have room for a terminating
+   nul after 'size' bytes, and is freed by text_close().
+ */
+extern struct text_fp *text_open_data(char *data, int size);
+
 extern char *text_line(char *line, int maxlen, struct text_fp *textfp);
 
 extern int text_parsefield(struct text_fp *textfp, char *key, int keylen,
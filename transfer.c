@@ -0,0 +1,542 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Transfers running in child processes, serviced by the event loop.
+
+   The children of downloads and lookups report back with lines of text:
+        P <percentage> <size> <total> <rate>    Progress
+        M <level> <text>                        A message
+        F <status> <md5> <sha256> <file>        A finished download
+        A <address>                             An address of a host
+        D <size>                                <size> bytes of data follow
+   along with the lines about the mirrors read by read_mirror_report().
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef VERSION
+#undef VERSION
+#endif
+#include "config.h"
+#include "url.h"
+#include "util.h"
+/* We want our own versions of these, not the snarf macros */
+#undef safe_free
+#undef safe_strdup
+
+#include "safe_malloc.h"
+#include "log_output.h"
+#include "get_url.h"
+#include "event_loop.h"
+#include "transfer.h"
+
+/* The child only reports progress this often, unless it's finished */
+#define PROGRESS_INTERVAL   0.2
+
+/* The pipe back to the parent, in a child process */
+static int report_fd = -1;
+static double last_report = 0.0;
+
+static void send_report(const char *text, int len)
+{
+    int count;
+
+    while ( len > 0 ) {
+        count = write(report_fd, text, len);
+        if ( count <= 0 ) {
+            _exit(1);
+        }
+        text += count;
+        len -= count;
+    }
+}
+
+/* The update callback used in the child, sending everything to the parent */
+static int child_report(int status_level, const char *status,
+                        float percentage,
+                        int size, int total, float rate, void *udata)
+{
+    char text[1024];
+    char *newline;
+    double now;
+
+    if ( status ) {
+        sprintf(text, "M %d ", status_level);
+        strncat(text, status, sizeof(text)-strlen(text)-2);
+        while ( (newline = strchr(text, '\n')) != NULL ) {
+            *newline = ' ';
+        }
+        strcat(text, "\n");
+        send_report(text, strlen(text));
+    } else {
+        /* Don't flood the parent with tiny steps of progress */
+        now = double_time();
+        if ( (percentage < 100.0) &&
+             ((now - last_report) < PROGRESS_INTERVAL) ) {
+            return(0);
+        }
+        last_report = now;
+        sprintf(text, "P %.1f %d %d %.2f\n", percentage, size, total, rate);
+        send_report(text, strlen(text));
+    }
+    return(0);
+}
+
+static void child_file(const char *url, int want_sums, block_sums *blocks)
+{
+    char file[PATH_MAX];
+    char text[PATH_MAX+128];
+    digest_sums sums;
+    int status;
+
+    status = get_url_checked(url, file, sizeof(file),
+                             want_sums ? &sums : NULL, blocks,
+                             child_report, NULL);
+    if ( status < 0 ) {
+        file[0] = '\0';
+    }
+    sprintf(text, "F %d %s %s %s\n", status,
+            (want_sums && ! status) ? sums.md5 : "-",
+            (want_sums && ! status) ? sums.sha256 : "-", file);
+    send_report(text, strlen(text));
+}
+
+static void child_data(const char *url, int maxsize)
+{
+    char text[128];
+    char *data;
+    int size;
+
+    if ( get_url_data(url, &data, &size, maxsize, child_report, NULL) < 0 ) {
+        _exit(1);
+    }
+    sprintf(text, "D %d\n", size);
+    send_report(text, strlen(text));
+    send_report(data, size);
+}
+
+static void child_task(transfer_func func, void *data)
+{
+    char result[PATH_MAX];
+    char text[PATH_MAX+128];
+    int status;
+
+    result[0] = '\0';
+    status = func(data, result, sizeof(result), child_report, NULL);
+    sprintf(text, "F %d - - %s\n", status, result);
+    send_report(text, strlen(text));
+}
+
+static void child_lookup(const char *host)
+{
+    struct in_addr addrs[MAX_MIRROR_ADDRS];
+    char text[128];
+    int i, count;
+
+    count = gethostbyname_list_async(host, addrs, MAX_MIRROR_ADDRS,
+                                     child_report, NULL);
+    for ( i=0; i<count; ++i ) {
+        sprintf(text, "A %s\n", inet_ntoa(addrs[i]));
+        send_report(text, strlen(text));
+    }
+    if ( count <= 0 ) {
+        _exit(1);
+    }
+}
+
+/* Handle a line reported by the child */
+static void parse_report(url_transfer *transfer, char *line)
+{
+    char *text;
+    int level, offset;
+
+    switch (line[0]) {
+        case 'P':
+            sscanf(line+2, "%f %d %d %f", &transfer->percentage,
+                   &transfer->size, &transfer->total, &transfer->rate);
+            if ( transfer->update &&
+                 transfer->update(0, NULL, transfer->percentage,
+                                  transfer->size, transfer->total,
+                                  transfer->rate, transfer->udata) ) {
+                transfer_cancel(transfer);
+            }
+            break;
+        case 'M':
+            level = strtol(line+2, &text, 10);
+            if ( *text == ' ' ) {
+                ++text;
+            }
+            update_message(level, text, transfer->update, transfer->udata);
+            break;
+        case 'F':
+            transfer->status = strtol(line+2, &text, 10);
+            if ( sscanf(text, " %32s %64s %n", transfer->sums.md5,
+                        transfer->sums.sha256, &offset) >= 2 ) {
+                transfer->have_sums = (transfer->sums.md5[0] != '-');
+                strncpy(transfer->file, text+offset, sizeof(transfer->file)-1);
+            }
+            break;
+        case 'A':
+            if ( (transfer->num_addrs < MAX_MIRROR_ADDRS) &&
+                 inet_aton(line+2,
+                           &transfer->addrs[transfer->num_addrs]) ) {
+                ++transfer->num_addrs;
+            }
+            break;
+        case 'D':
+            transfer->maxsize = atoi(line+2);
+            transfer->data = (char *)safe_malloc(transfer->maxsize+1);
+            transfer->data[0] = '\0';
+            break;
+        default:
+            read_mirror_report(line, transfer->mirrors);
+            break;
+    }
+}
+
+/* The child has closed the pipe, see how it went */
+static void finish_transfer(url_transfer *transfer)
+{
+    int status;
+
+    event_unwatch(transfer->fd);
+    close(transfer->fd);
+    transfer->fd = -1;
+    if ( waitpid(transfer->child, &status, 0) < 0 ) {
+        status = -1;
+    }
+    transfer->child = -1;
+    if ( transfer->state != TRANSFER_RUNNING ) {
+        return;
+    }
+
+    if ( ! WIFEXITED(status) ) {
+        transfer->state = TRANSFER_FAILED;
+        return;
+    }
+    switch (transfer->type) {
+        case TRANSFER_FILE:
+            if ( transfer->file[0] && (transfer->status == 0) ) {
+                transfer->state = TRANSFER_DONE;
+            } else {
+                transfer->state = TRANSFER_FAILED;
+            }
+            break;
+        case TRANSFER_DATA:
+            if ( transfer->data && (transfer->len == transfer->maxsize) ) {
+                transfer->data[transfer->len] = '\0';
+                transfer->state = TRANSFER_DONE;
+            } else {
+                transfer->state = TRANSFER_FAILED;
+            }
+            break;
+        case TRANSFER_LOOKUP:
+            if ( transfer->num_addrs > 0 ) {
+                transfer->state = TRANSFER_DONE;
+            } else {
+                transfer->state = TRANSFER_FAILED;
+            }
+            break;
+        case TRANSFER_TASK:
+            /* Whatever the function returned, it ran to the end */
+            if ( WEXITSTATUS(status) == 0 ) {
+                transfer->state = TRANSFER_DONE;
+            } else {
+                transfer->state = TRANSFER_FAILED;
+            }
+            break;
+    }
+}
+
+/* Read what the child has sent, called from the event loop */
+static void read_transfer(int fd, void *data)
+{
+    url_transfer *transfer = (url_transfer *)data;
+    char buf[BUFSIZ];
+    int i, count, used;
+
+    count = read(fd, buf, sizeof(buf));
+    if ( count <= 0 ) {
+        if ( transfer->line_len > 0 ) {
+            transfer->line[transfer->line_len] = '\0';
+            transfer->line_len = 0;
+            parse_report(transfer, transfer->line);
+        }
+        if ( transfer->child > 0 ) {
+            finish_transfer(transfer);
+        }
+        return;
+    }
+    for ( i=0; (i < count) && (transfer->state == TRANSFER_RUNNING); ) {
+        /* Data downloaded into memory comes straight through */
+        if ( transfer->data && (transfer->len < transfer->maxsize) ) {
+            used = count - i;
+            if ( used > (transfer->maxsize - transfer->len) ) {
+                used = transfer->maxsize - transfer->len;
+            }
+            memcpy(&transfer->data[transfer->len], &buf[i], used);
+            transfer->len += used;
+            i += used;
+            continue;
+        }
+        if ( buf[i] == '\n' ) {
+            transfer->line[transfer->line_len] = '\0';
+            transfer->line_len = 0;
+            parse_report(transfer, transfer->line);
+        } else
+        if ( transfer->line_len < (sizeof(transfer->line)-1) ) {
+            transfer->line[transfer->line_len++] = buf[i];
+        }
+        ++i;
+    }
+}
+
+static void redirect_stdin(void)
+{
+    int fd;
+
+    fd = open("/dev/null", O_RDONLY);
+    if ( (fd >= 0) && (fd != 0) ) {
+        dup2(fd, 0);
+        close(fd);
+    }
+}
+
+static url_transfer *new_transfer(transfer_type type,
+                                  update_callback update, void *udata)
+{
+    url_transfer *transfer;
+
+    transfer = (url_transfer *)safe_malloc(sizeof *transfer);
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->type = type;
+    transfer->state = TRANSFER_RUNNING;
+    transfer->child = -1;
+    transfer->fd = -1;
+    transfer->update = update;
+    transfer->udata = udata;
+    transfer->status = -1;
+    return(transfer);
+}
+
+/* Fork the child for a transfer, returning 0 in the child, 1 in the
+   parent, or -1 if it couldn't be started.
+ */
+static int fork_transfer(url_transfer *transfer)
+{
+    int pipefd[2];
+
+    /* Create a pipe the results will be sent back over */
+    if ( pipe(pipefd) < 0 ) {
+        update_message(LOG_ERROR, _("Couldn't create IPC pipe"),
+                       transfer->update, transfer->udata);
+        return(-1);
+    }
+    fflush(stdout);
+    transfer->child = fork();
+    switch (transfer->child) {
+        case -1:
+            /* Fork failed */
+            update_message(LOG_ERROR, _("Couldn't fork process"),
+                           transfer->update, transfer->udata);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return(-1);
+        case 0:
+            /* Child process, don't run any of the parent's exit handlers.
+               It gets an event loop of its own, without the pipes of the
+               other transfers.  Standard input is kept open on /dev/null,
+               since the snarf code takes a socket on descriptor 0 for a
+               failed connect.
+             */
+            event_loop_after_fork();
+            redirect_stdin();
+            close(pipefd[0]);
+            forget_mirror_sockets();
+            report_fd = pipefd[1];
+            report_mirrors(report_fd);
+            return(0);
+        default:
+            break;
+    }
+    close(pipefd[1]);
+    transfer->fd = pipefd[0];
+    if ( event_watch(transfer->fd, read_transfer, transfer) < 0 ) {
+        transfer_cancel(transfer);
+        return(-1);
+    }
+    return(1);
+}
+
+url_transfer *transfer_start_file(const char *url, int want_sums,
+                                  block_sums *blocks,
+                                  update_callback update, void *udata)
+{
+    url_transfer *transfer;
+
+    transfer = new_transfer(TRANSFER_FILE, update, udata);
+    switch (fork_transfer(transfer)) {
+        case 0:
+            child_file(url, want_sums, blocks);
+            _exit(0);
+        case -1:
+            free(transfer);
+            return(NULL);
+        default:
+            break;
+    }
+    return(transfer);
+}
+
+url_transfer *transfer_start_data(const char *url, int maxsize,
+                                  update_callback update, void *udata)
+{
+    url_transfer *transfer;
+
+    transfer = new_transfer(TRANSFER_DATA, update, udata);
+    switch (fork_transfer(transfer)) {
+        case 0:
+            child_data(url, maxsize);
+            _exit(0);
+        case -1:
+            free(transfer);
+            return(NULL);
+        default:
+            break;
+    }
+    return(transfer);
+}
+
+url_transfer *transfer_start_task(transfer_func func, void *data,
+                                  urlset *mirrors,
+                                  update_callback update, void *udata)
+{
+    url_transfer *transfer;
+
+    transfer = new_transfer(TRANSFER_TASK, update, udata);
+    transfer->mirrors = mirrors;
+    switch (fork_transfer(transfer)) {
+        case 0:
+            child_task(func, data);
+            _exit(0);
+        case -1:
+            free(transfer);
+            return(NULL);
+        default:
+            break;
+    }
+    return(transfer);
+}
+
+url_transfer *transfer_start_lookup(const char *host,
+                                    update_callback update, void *udata)
+{
+    url_transfer *transfer;
+
+    transfer = new_transfer(TRANSFER_LOOKUP, update, udata);
+    switch (fork_transfer(transfer)) {
+        case 0:
+            child_lookup(host);
+            _exit(0);
+        case -1:
+            free(transfer);
+            return(NULL);
+        default:
+            break;
+    }
+    return(transfer);
+}
+
+int transfer_poll(url_transfer *transfer)
+{
+    if ( transfer->state == TRANSFER_RUNNING ) {
+        event_poll(0);
+    }
+    switch (transfer->state) {
+        case TRANSFER_RUNNING:
+            return(1);
+        case TRANSFER_DONE:
+            return(0);
+        default:
+            return(-1);
+    }
+}
+
+int transfer_wait(url_transfer *transfer, update_callback update, void *udata)
+{
+    while ( transfer->state == TRANSFER_RUNNING ) {
+        if ( update && update(0, NULL, 0.0, 0, 0, 0.0f, udata) ) {
+            transfer_cancel(transfer);
+            break;
+        }
+        event_poll(100);
+    }
+    return(transfer_poll(transfer));
+}
+
+void transfer_cancel(url_transfer *transfer)
+{
+    if ( transfer->state == TRANSFER_RUNNING ) {
+        transfer->state = TRANSFER_CANCELLED;
+    }
+    if ( transfer->fd >= 0 ) {
+        event_unwatch(transfer->fd);
+        close(transfer->fd);
+        transfer->fd = -1;
+    }
+    if ( transfer->child > 0 ) {
+        kill(transfer->child, SIGTERM);
+        waitpid(transfer->child, NULL, 0);
+        transfer->child = -1;
+    }
+}
+
+char *transfer_take_data(url_transfer *transfer, int *size)
+{
+    char *data;
+
+    data = transfer->data;
+    *size = transfer->len;
+    transfer->data = NULL;
+    transfer->len = 0;
+    return(data);
+}
+
+void transfer_free(url_transfer *transfer)
+{
+    if ( transfer ) {
+        transfer_cancel(transfer);
+        if ( transfer->data ) {
+            free(transfer->data);
+        }
+        free(transfer);
+    }
+}
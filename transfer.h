@@ -0,0 +1,152 @@
+/*
+    Loki_Update - A tool for updating Loki products over the Internet
+    Copyright (C) 2000  Loki Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    info@lokigames.com
+*/
+
+/* Transfers running in the background while the caller gets on with
+   something else: downloads to disk or into memory, host name lookups
+   and downloads of the caller's own.  Each one runs in a child process
+   and reports back over a pipe, including what it found out about the
+   mirrors, and the pipes of all of them are waited on together with
+   the event loop, so any number can run at once.
+
+   Nothing happens to a transfer unless the event loop is run, either
+   with event_poll() or by polling or waiting for a transfer.
+*/
+
+#ifndef _transfer_h
+#define _transfer_h
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <limits.h>
+
+#include "update.h"
+#include "digest.h"
+#include "block_sums.h"
+#include "mirror_stats.h"
+
+typedef enum {
+    TRANSFER_FILE,              /* A URL downloaded to the update directory */
+    TRANSFER_DATA,              /* A URL downloaded into memory */
+    TRANSFER_LOOKUP,            /* The addresses of a host */
+    TRANSFER_TASK               /* A function run in the child */
+} transfer_type;
+
+typedef enum {
+    TRANSFER_RUNNING,
+    TRANSFER_DONE,
+    TRANSFER_FAILED,
+    TRANSFER_CANCELLED
+} transfer_state;
+
+typedef struct url_transfer {
+    transfer_type type;
+    transfer_state state;
+    pid_t child;
+    int fd;
+
+    /* Called from the event loop with the progress of the transfer.
+       If it returns nonzero, the transfer is cancelled.
+     */
+    update_callback update;
+    void *udata;
+
+    /* The mirrors the child reports the status of, or NULL */
+    urlset *mirrors;
+
+    /* The latest progress reported by the child */
+    float percentage;
+    int size;
+    int total;
+    float rate;
+
+    /* The results, once the transfer is finished */
+    int status;                 /* As returned by get_url_checked() */
+    char file[PATH_MAX];        /* The downloaded file, or a task's text */
+    digest_sums sums;           /* Its checksums, if they were asked for */
+    int have_sums;
+    char *data;                 /* Data downloaded into memory */
+    int len;
+    int maxsize;
+    int num_addrs;              /* Addresses found by a lookup */
+    struct in_addr addrs[MAX_MIRROR_ADDRS];
+
+    /* A partial report from the child */
+    char line[1024];
+    int line_len;
+} url_transfer;
+
+/* Start downloading a URL to the update directory, as get_url_checked()
+   would.  The checksums are computed if 'want_sums' is set, and the block
+   list, if any, must stay around until the transfer is finished.
+   Returns NULL if the transfer couldn't be started.
+ */
+extern url_transfer *transfer_start_file(const char *url, int want_sums,
+                                         block_sums *blocks,
+                                         update_callback update, void *udata);
+
+/* Start downloading a small file into memory, as get_url_data() would */
+extern url_transfer *transfer_start_data(const char *url, int maxsize,
+                                         update_callback update, void *udata);
+
+/* A function run in a child process by transfer_start_task().  It's
+   given the callback to report its progress to, and may leave a line of
+   text for the parent in 'text'.  It returns the status of the transfer.
+ */
+typedef int (*transfer_func)(void *data, char *text, int maxlen,
+                             update_callback update, void *udata);
+
+/* Run a function in a child process as a transfer, e.g. a download that
+   moves on from one mirror to the next.  Its messages and progress are
+   passed on as for a download, and so is what it finds out about the
+   mirrors, with the status of the mirrors in 'mirrors' if it isn't NULL.
+   When it's done, the status of the transfer is what the function
+   returned and its file is the text it left.
+ */
+extern url_transfer *transfer_start_task(transfer_func func, void *data,
+                                         urlset *mirrors,
+                                         update_callback update, void *udata);
+
+/* Start looking up the addresses of a host */
+extern url_transfer *transfer_start_lookup(const char *host,
+                                           update_callback update, void *udata);
+
+/* Run the event loop once without waiting, and return 1 if the transfer
+   is still running, 0 if it finished successfully or -1 if it failed.
+ */
+extern int transfer_poll(url_transfer *transfer);
+
+/* Run the event loop until the transfer has finished, returning as for
+   transfer_poll().  The update callback is called while waiting and may
+   cancel the transfer.
+ */
+extern int transfer_wait(url_transfer *transfer,
+                         update_callback update, void *udata);
+
+/* Stop a transfer that is still running */
+extern void transfer_cancel(url_transfer *transfer);
+
+/* Take the data downloaded into memory, which the caller must free */
+extern char *transfer_take_data(url_transfer *transfer, int *size);
+
+/* Cancel the transfer if it's running, and free it */
+extern void transfer_free(url_transfer *transfer);
+
+#endif /* _transfer_h */
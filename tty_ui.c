@@ -31,10 +31,15 @@
 #include "load_patchset.h"
 #include "url_paths.h"
 #include "get_url.h"
-#include "md5.h"
+#include "multi_get.h"
+#include "mirror_race.h"
 #include "gpg_verify.h"
+#include "artifact_cache.h"
+#include "apply_queue.h"
+#include "schedule.h"
 #include "update.h"
 #include "log_output.h"
+#include "safe_malloc.h"
 
 static patchset *update_patchset;
 static version_node *update_root;
@@ -46,9 +51,11 @@ static char update_url[PATH_MAX];
 static int update_status = 0;
 static patchset *product_patchset = NULL;
 static int download_cancelled = 0;
+static apply_queue *update_queue = NULL;
+static update_session *session = NULL;
 
 /* Forward declarations for the meat of the operation */
-static void download_update(void);
+static void download_updates(void);
 
 
 static void remove_update(void)
@@ -136,47 +143,65 @@ static void enable_gpg_details(const char *url, char *sig)
     log(LOG_NORMAL, "%s", text);
 }
 
-static gpg_result do_gpg_verify(const char *file, char *sig, int maxsig)
+static gpg_result do_gpg_verify(const char *file,
+                                const char *sigdata, int sigsize,
+                                char *sig, int maxsig,
+                                update_callback update)
 {
     gpg_result gpg_code;
 
     set_status_message(_("Running GPG..."));
-    gpg_code = gpg_verify(file, sig, maxsig, NULL, NULL);
+    gpg_code = gpg_verify_data(file, sigdata, sigsize, sig, maxsig,
+                               update, NULL);
     if ( gpg_code == GPG_NOPUBKEY ) {
         set_status_message(_("Downloading public key"));
-        get_publickey(sig, NULL, NULL);
-        gpg_code = gpg_verify(file, sig, maxsig, NULL, NULL);
+        get_publickey(sig, update, NULL);
+        gpg_code = gpg_verify_data(file, sigdata, sigsize, sig, maxsig,
+                                   update, NULL);
     }
     return gpg_code;
 }
 
-static void cleanup_update(const char *status_msg, int update_obsolete)
+/* Show the download messages and keep the update being applied going */
+static int pipeline_update(int status_level, const char *status,
+                           float percentage,
+                           int size, int total, float rate, void *udata)
 {
-    /* Remove the update patch file */
-    if ( update_obsolete ) {
-        remove_update();
+    if ( status ) {
+        if ( status_level == LOG_STATUS ) {
+            log(status_level, "%s\n", status);
+        } else {
+            log(status_level, "%s", status);
+        }
     }
+    poll_apply_queue(update_queue);
+    return(download_cancelled);
+}
 
-    /* Deselect the current patch path */
-    select_node(update_patch->node, 0);
-
-    /* We succeeded, update the status */
-    if ( status_msg ) {
-        set_status_message(status_msg);
+/* Called as each update in the queue finishes */
+static void applied_update(patch *patch, const char *file,
+                           int status, void *data)
+{
+    /* Deselect the patch path */
+    select_node(patch->node, 0);
+
+    if ( status == 0 ) {
+        /* We're done!  A successful update! */
+        ++update_status;
+        unlink(file);
+        set_status_message(_("Update complete"));
     } else {
-        /* User cancelled the update? */
-        return;
-    }
-
-    /* Handle auto-update of the next set of patches, if any */
-    if ( update_status >= 0 ) {
-        download_update();
+        update_status = -1;
+        set_status_message(_("Update failed"));
     }
 }
 
 static void update_product(const char *product_name)
 {
     patchset *patchset;
+    const char *roots[MAX_PRODUCT_ROOTS];
+    char *data;
+    int size;
 
     /* Clean up any product patchsets that may be around */
     if ( product_patchset ) {
@@ -185,7 +210,7 @@ static void update_product(const char *product_name)
     }
 
     /* Create a patchset for this product */
-    patchset = create_patchset(product_name);
+    patchset = create_patchset(session, product_name);
     if ( ! patchset ) {
         log(LOG_WARNING, "Unable to open product '%s'\n", product_name);
         return;
@@ -193,12 +218,11 @@ static void update_product(const char *product_name)
 
     /* Reset the panel */
     set_status_message("");
-    set_status_message(get_product_description(product_name));
+    set_status_message(get_product_description(session, product_name));
     
     /* Download the patch list */
-    strcpy(update_url, get_product_url(patchset->product_name));
-    if ( get_url(update_url, update_url, sizeof(update_url), NULL,NULL) != 0 ) {
-        remove_update();
+    if ( get_url_data(get_product_url(session, patchset->product_name),
+                      &data, &size, MAX_TEXT_DOWNLOAD, NULL, NULL) != 0 ) {
         /* Tell the user what happened, and wait before continuing */
         if ( download_cancelled ) {
             set_status_message(_("Download cancelled"));
@@ -211,8 +235,7 @@ static void update_product(const char *product_name)
     set_status_message(_("Retrieved update list"));
     
     /* Turn the patch list into a set of patches */
-    load_patchset(patchset, update_url);
-    remove_update();
+    load_patchset_data(patchset, data, size);
     
     /* Add this patchset to our list */
     product_patchset = patchset;
@@ -224,53 +247,132 @@ static void update_product(const char *product_name)
     if ( ! product_patchset || ! update_patch ) {
         /* The continue button becomes a finished button, no updates */
         set_status_message(_("No new updates available"));
+    } else
+    if ( get_product_roots(session, product_name,
+                           roots, MAX_PRODUCT_ROOTS) > 1 ) {
+        /* Download the updates once for all of the install paths */
+        if ( schedule_updates(product_patchset, applied_update, NULL,
+                              NULL, NULL) < 0 ) {
+            update_status = -1;
+        }
     } else {
         /* Handle auto-update mode */
-        download_update();
+        download_updates();
     }
 }
 
-static void download_update(void)
+/* Download and verify an update, leaving it in update_url */
+static verify_result download_update(patch *patch)
 {
-    patch *patch;
+    update_callback update;
     char text[1024];
     const char *url;
     char sig[1024];
-    char sum_file[PATH_MAX];
-    char md5_real[CHECKSUM_SIZE+1];
-    char md5_calc[CHECKSUM_SIZE+1];
-    FILE *fp;
+    char sum_url[PATH_MAX];
+    digest_sums sums;
+    char *data;
+    int size;
+    url_download sig_download = { -1, -1, NULL, 0 };
+    url_download sum_download = { -1, -1, NULL, 0 };
+    url_download sha_download = { -1, -1, NULL, 0 };
+    block_sums *blocks;
+    int segmented, checked, blocks_tried, downloaded;
     verify_result verified;
+    gpg_result gpg_code;
 
-    /* Verify that we have an update to perform */
-    patch = skip_to_selected_update();
-    if ( ! patch ) {
-        return;
+    /* Keep the update queue going while this downloads */
+    if ( poll_apply_queue(update_queue) ) {
+        update = pipeline_update;
+    } else {
+        update = NULL;
     }
-    patch->installed = 1;
 
     /* Show the initial status for this update */
     snprintf(text, (sizeof text), "%s: %s",
-             get_product_description(patch->patchset->product_name),
+             get_handle_description(patch->patchset->product),
              patch->description);
     set_status_message(text);
 
-    /* Download the update from the server */
+    /* Large updates are first tried from several mirrors at once */
+    segmented = (get_segmented_download() && (patch->size >= SEGMENT_THRESHOLD));
+    blocks = NULL;
+    blocks_tried = 0;
+
+    /* Use a copy of the update verified earlier, if there is one */
     verified = DOWNLOAD_FAILED;
-    do {
-        /* Grab the next URL to try */
-        url = get_next_url(patch->patchset->mirrors, patch->file);
+    gpg_code = GPG_NOTINSTALLED;
+    if ( (get_url_path(patch->file, update_url, sizeof(update_url),
+                       update, NULL) == 0) &&
+         find_artifact(patch->file, patch->sha256, patch->md5,
+                       patch->patchset->mirrors, update_url,
+                       &verified, sig, sizeof(sig), update, NULL) ) {
+        set_status_message(_("Update was already downloaded"));
+        if ( verified == VERIFY_OK ) {
+            enable_gpg_details(update_url, sig);
+        }
+    }
+
+    /* Download the update from the server */
+    while ( ((verified == DOWNLOAD_FAILED) || (verified == VERIFY_FAILED)) &&
+            !download_cancelled ) {
+        /* Grab the next URL to try, connecting to a few at once to find
+           one that answers, unless they'll all be used anyway */
+        if ( segmented ) {
+            url = get_next_url(patch->patchset->mirrors, patch->file);
+        } else {
+            url = race_next_url(patch->patchset->mirrors, patch->file,
+                                update, NULL);
+        }
         if ( ! url ) {
             break;
         }
 
+        /* Fetch the signature and checksum while the update downloads,
+           unless the update list already has them */
+        if ( ! patch->signature ) {
+            sprintf(sum_url, "%s.sig", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sig_download, update, NULL);
+        }
+        if ( ! patch->sha256 && ! patch->md5 ) {
+            sprintf(sum_url, "%s.md5", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sum_download, update, NULL);
+            sprintf(sum_url, "%s.sha256", url);
+            get_url_start(sum_url, MAX_SUM_DOWNLOAD, &sha_download, update, NULL);
+        }
+
+        /* Get the list of block checksums the first time through, so
+           a corrupt mirror can be caught while the update downloads */
+        if ( ! blocks_tried && (patch->size >= BLOCK_SUMS_THRESHOLD) ) {
+            blocks = get_block_sums(url, update, NULL);
+            blocks_tried = 1;
+        }
+
         /* Download the update */
         set_status_message(_("Downloading update"));
         strcpy(update_url, url);
-        if ( get_url(update_url, update_url, sizeof(update_url),
-                     NULL, NULL) != 0 ) {
-            /* The download was cancelled or the download failed */
-            set_url_status(patch->patchset->mirrors, URL_FAILED);
+        if ( segmented ) {
+            /* If this fails, fall back to one mirror at a time */
+            segmented = 0;
+            if ( get_url_segmented(patch->patchset->mirrors, patch->file,
+                                   update_url, sizeof(update_url), &sums,
+                                   blocks,
+                                   update, NULL) != 0 ) {
+                verified = DOWNLOAD_FAILED;
+            } else {
+                verified = VERIFY_UNKNOWN;
+            }
+        } else
+        if ( (downloaded = get_url_checked(update_url, update_url,
+                                           sizeof(update_url), &sums,
+                                           blocks, update, NULL)) != 0 ) {
+            /* The download was cancelled or the download failed.
+               If the mirror was just too slow, the next one picks up
+               the download where this one left off. */
+            if ( downloaded == -2 ) {
+                set_url_status(patch->patchset->mirrors, URL_SLOW);
+            } else {
+                set_url_status(patch->patchset->mirrors, URL_FAILED);
+            }
             verified = DOWNLOAD_FAILED;
         } else {
             verified = VERIFY_UNKNOWN;
@@ -281,10 +383,18 @@ static void download_update(void)
         /* First check the GPG signature */
         if ( verified == VERIFY_UNKNOWN ) {
             set_status_message(_("Verifying GPG signature"));
-            sprintf(sum_file, "%s.sig", url);
-            if ( get_url(sum_file, sum_file, sizeof(sum_file),
-                         NULL, NULL) == 0 ) {
-                switch (do_gpg_verify(sum_file, sig, sizeof(sig))) {
+            if ( patch->signature ) {
+                data = safe_strdup(patch->signature);
+                size = strlen(data);
+            } else
+            if ( get_url_finish(&sig_download, &data, &size, update, NULL) != 0 ) {
+                data = NULL;
+            }
+            gpg_code = GPG_NOTINSTALLED;
+            if ( data ) {
+                gpg_code = do_gpg_verify(update_url, data, size,
+                                         sig, sizeof(sig), update);
+                switch (gpg_code) {
                     case GPG_NOTINSTALLED:
                         set_status_message(_("GPG not installed"));
                         verified = VERIFY_UNKNOWN;
@@ -307,73 +417,185 @@ static void download_update(void)
                         break;
                     case GPG_VERIFYOK:
                         set_status_message(_("GPG verify succeeded"));
+                        store_artifact(url, patch->file, update_url, &sums,
+                                       VERIFY_OK, gpg_code, sig);
                         enable_gpg_details(update_url, sig);
                         verified = VERIFY_OK;
                         break;
                 }
+                free(data);
             } else {
                 set_status_message(_("GPG signature not available"));
             }
-            unlink(sum_file);
+        } else {
+            get_url_abort(&sig_download);
         }
-        /* Now download the MD5 checksum file */
+
+        /* Now check the checksum from the update list or checksum file,
+           using SHA-256 if there is one */
         if ( verified == VERIFY_UNKNOWN ) {
-            set_status_message(_("Verifying MD5 checksum"));
-            sprintf(sum_file, "%s.md5", url);
-            if ( get_url(sum_file, sum_file, sizeof(sum_file),
-                         NULL, NULL) == 0 ) {
-                fp = fopen(sum_file, "r");
-                if ( fp ) {
-                    if ( fgets(md5_calc, sizeof(md5_calc), fp) ) {
-                        set_status_message(_("Calculating MD5 checksum"));
-                        md5_compute(update_url, md5_real, 0);
-                        if ( strcmp(md5_calc, md5_real) != 0 ) {
-                            set_url_status(patch->patchset->mirrors,URL_FAILED);
-                            verified = VERIFY_FAILED;
-                        }
-                    }
-                    fclose(fp);
-                }
+            set_status_message(_("Verifying checksum"));
+            if ( patch->sha256 ) {
+                checked = digest_check(patch->sha256, sums.sha256);
+            } else
+            if ( patch->md5 ) {
+                checked = digest_check(patch->md5, sums.md5);
+            } else
+            if ( get_url_finish(&sha_download, &data, &size, update, NULL) == 0 ) {
+                get_url_abort(&sum_download);
+                checked = digest_check(data, sums.sha256);
+                free(data);
+            } else
+            if ( get_url_finish(&sum_download, &data, &size, update, NULL) == 0 ) {
+                checked = digest_check(data, sums.md5);
+                free(data);
             } else {
-                set_status_message(_("MD5 checksum not available"));
+                set_status_message(_("Checksum not available"));
+                checked = -1;
+            }
+            if ( checked == 0 ) {
+                set_url_status(patch->patchset->mirrors, URL_FAILED);
+                verified = VERIFY_FAILED;
+            } else
+            if ( checked > 0 ) {
+                store_artifact(url, patch->file, update_url, &sums,
+                               VERIFY_UNKNOWN, gpg_code, NULL);
             }
-            unlink(sum_file);
+        } else {
+            get_url_abort(&sum_download);
+            get_url_abort(&sha_download);
         }
-    } while ( ((verified == DOWNLOAD_FAILED) || (verified == VERIFY_FAILED)) &&
-              !download_cancelled );
+    }
+    free_block_sums(blocks);
 
     /* We either ran out of update URLs or we downloaded a valid update */
     switch (verified) {
         case VERIFY_UNKNOWN:
-            set_status_message(_("Verification succeeded"));
-            break;
         case VERIFY_OK:
             set_status_message(_("Verification succeeded"));
             break;
         case VERIFY_FAILED:
             set_status_message(_("Verification failed"));
-            update_status = -1;
-            cleanup_update(_("Update corrupted"), 1);
-            return;
+            break;
         case DOWNLOAD_FAILED:
-            update_status = -1;
-            cleanup_update(_("Unable to retrieve update"), 0);
-            return;
+            break;
     }
+    return(verified);
+}
+
+/* Download, verify and apply the selected updates.  The next few updates
+   are downloaded and verified while each one is being applied, but they
+   are still applied one at a time, in order.
+ */
+static void download_updates(void)
+{
+    patch *patch;
+    verify_result verified;
+
+    update_queue = create_apply_queue(NULL, NULL, applied_update, NULL);
+    while ( (update_status >= 0) && ! download_cancelled ) {
+        /* Wait for an update to finish if enough are ready */
+        if ( apply_queue_full(update_queue) ) {
+            wait_apply_queue(update_queue);
+            continue;
+        }
+
+        /* Verify that we have an update to perform */
+        patch = skip_to_selected_update();
+        if ( ! patch ) {
+            break;
+        }
+        patch->installed = 1;
+
+        verified = download_update(patch);
+        if ( (verified == VERIFY_OK) || (verified == VERIFY_UNKNOWN) ) {
+            queue_update(update_queue, patch, update_url,
+                         get_handle_root(patch->patchset->product));
+            update_url[0] = '\0';
+            continue;
+        }
 
-    /* Actually perform the update */
-    set_status_message(_("Performing update"));
-    if ( perform_update(update_url,
-                        get_product_root(update_patchset->product_name),
-                        NULL, NULL) != 0 ) {
+        /* The updates before this one can still be applied */
+        finish_apply_queue(update_queue);
+        select_node(patch->node, 0);
         update_status = -1;
-        cleanup_update(_("Update failed"), 0);
-        return;
+        if ( verified == VERIFY_FAILED ) {
+            remove_update();
+            set_status_message(_("Update corrupted"));
+        } else {
+            set_status_message(_("Unable to retrieve update"));
+        }
+    }
+    finish_apply_queue(update_queue);
+    free_apply_queue(update_queue);
+    update_queue = NULL;
+}
+
+/* Update every installed product, downloading their updates at once */
+static void update_all_products(void)
+{
+    const char *product_name;
+    patchset *patchset, *loaded, *last, *next;
+    char *data;
+    int size;
+
+    /* Clean up any product patchsets that may be around */
+    if ( product_patchset ) {
+        free_patchset(product_patchset);
+        product_patchset = NULL;
+    }
+
+    /* Get the list of updates for each product */
+    loaded = NULL;
+    last = NULL;
+    for ( product_name = get_first_product(session); product_name;
+          product_name = get_next_product(session) ) {
+        if ( strcasecmp(product_name, PRODUCT) == 0 ) {
+            continue;
+        }
+        patchset = create_patchset(session, product_name);
+        if ( ! patchset ) {
+            log(LOG_WARNING, "Unable to open product '%s'\n", product_name);
+            continue;
+        }
+        set_status_message(get_product_description(session, product_name));
+        if ( get_url_data(get_product_url(session, patchset->product_name),
+                          &data, &size, MAX_TEXT_DOWNLOAD, NULL, NULL) != 0 ) {
+            set_status_message(_("Unable to retrieve update list"));
+            free_patchset(patchset);
+            continue;
+        }
+        read_patchset_data(patchset, data, size);
+        if ( last ) {
+            last->next = patchset;
+        } else {
+            loaded = patchset;
+        }
+        last = patchset;
     }
 
-    /* We're done!  A successful update! */
-    ++update_status;
-    cleanup_update(_("Update complete"), 1);
+    /* Plan the updates for all of the products at once */
+    finish_patchsets(loaded);
+    for ( patchset = loaded; patchset; patchset = next ) {
+        next = patchset->next;
+        patchset->next = NULL;
+        if ( ! patchset->patches ) {
+            free_patchset(patchset);
+            continue;
+        }
+        patchset->next = product_patchset;
+        product_patchset = patchset;
+    }
+
+    reset_selected_update();
+    if ( ! update_patch ) {
+        set_status_message(_("No new updates available"));
+        return;
+    }
+    if ( schedule_updates(product_patchset, applied_update, NULL,
+                          NULL, NULL) < 0 ) {
+        update_status = -1;
+    }
 }
 
 static int ttyui_detect(void)
@@ -381,8 +603,10 @@ static int ttyui_detect(void)
     return 1;
 }
 
-static int ttyui_init(int argc, char *argv[])
+static int ttyui_init(update_session *product_session, int argc, char *argv[])
 {
+    session = product_session;
+
     /* Terminal output should always be verbose */
     if ( (get_logging() > LOG_VERBOSE) && (get_logging() != LOG_NONE) ) {
         set_logging(LOG_VERBOSE);
@@ -414,7 +638,7 @@ static int ttyui_perform_updates(const char *product)
 {
     update_status = 0;
     if ( product ) {
-        if ( is_valid_product(product) ) {
+        if ( is_valid_product(session, product) ) {
             update_product(product);
         } else {
             log(LOG_ERROR,
@@ -423,8 +647,7 @@ static int ttyui_perform_updates(const char *product)
             update_status = -1;
         }
     } else {
-        log(LOG_ERROR, _("Interactive updates require X11\n"));
-        update_status = -1;
+        update_all_products();
     }
     return update_status;
 }
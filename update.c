@@ -36,6 +36,7 @@
 #include "safe_malloc.h"
 #include "log_output.h"
 #include "update.h"
+#include "child_process.h"
 
 void update_message(int level, const char *message,
                     update_callback update, void *udata)
@@ -56,134 +57,121 @@ void update_message(int level, const char *message,
     }
 }
 
-int perform_update(const char *update_file, const char *install_path,
-                   update_callback update, void *udata)
+/* Handle a line of output from the update */
+static void parse_update_output(child_process *child, char *line, void *data)
 {
-    char text[PATH_MAX];
-    int pipefd[2];
-    int argc;
-    char *args[32];
-    pid_t child;
-    int status;
-    int cancelled;
-    int len, count;
-    char line[1024];
+    update_job *job = (update_job *)data;
     char *spot;
-    int status_updated;
-    float percentage;
-    fd_set fdset;
-    struct timeval tv;
-
-    /* First create a pipe for communicating between child and parent */
-    signal(SIGPIPE, SIG_IGN);
-    if ( pipe(pipefd) < 0 ) {
-        update_message(LOG_ERROR, _("Couldn't create IPC pipe"), update, udata);
-        return(-1);
+
+    /* Check for N% output */
+    spot = strchr(line, '%');
+    if ( spot ) {
+        while ( (spot > line) &&
+                (isdigit(*(spot-1)) || (*(spot-1) == '.')) ) {
+            --spot;
+        }
+        child->percentage = (float)atoi(spot);
+        if ( ! job->status_updated ) {
+            update_message(LOG_STATUS, _("Updating files"),
+                           child->update, child->udata);
+            job->status_updated = 1;
+        }
+    } else {
+        /* Log the update output */
+        if ( strncmp(line, "ERROR: ", 7) == 0 ) {
+            update_message(LOG_ERROR, line+7, child->update, child->udata);
+        } else
+        if ( strncmp(line, "WARNING: ", 8) == 0 ) {
+            update_message(LOG_WARNING, line+8, child->update, child->udata);
+        } else {
+            update_message(LOG_VERBOSE, line, child->update, child->udata);
+        }
     }
+}
+
+int perform_update_start(const char *update_file, const char *install_path,
+                         update_job *job, update_callback update, void *udata)
+{
+    char text[PATH_MAX];
+    char *args[4];
+
+    job->process = NULL;
+    job->percentage = 0.0f;
+    job->status_updated = 0;
+    job->status = -1;
+
     chmod(update_file, 0700);
 
     /* Show what update file is being executed */
     sprintf(text, _("Update: %s"), update_file);
     update_message(LOG_VERBOSE, text, update, udata);
     update_message(LOG_STATUS, _("Unpacking archive"), update, udata);
-    status_updated = 0;
-
-    child = fork();
-    switch (child) {
-        case -1:
-            /* Fork failed */
-            update_message(LOG_ERROR, _("Couldn't fork process"), update, udata);
-            return(-1);
-        case 0:
-            /* Child process */
-            close(2);
-            dup(pipefd[1]);
-            close(1);
-            dup(pipefd[1]);
-            close(0);
-            dup(pipefd[1]);
-            argc = 0;
-            args[argc++] = strdup(update_file);
-            args[argc++] = "--nox11";
-            args[argc++] = strdup(install_path);
-            args[argc] = NULL;
-            execv(args[0], args);
-            fprintf(stderr, _("Couldn't exec %s\n"), args[0]);
-            _exit(-1);
-        default:
-            break;
-    }
 
-    /* Parent, read status from child */
-    cancelled = 0;
-    percentage = 0.0;
-    close(pipefd[1]);
-    len = 0;
-    while ( !cancelled ) {
-        count = 0;
-
-        /* See if there is data to read */
-        FD_ZERO(&fdset);
-        FD_SET(pipefd[0], &fdset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        if ( select(pipefd[0]+1, &fdset, NULL, NULL, &tv) ) {
-            count = read(pipefd[0], &line[len], 1);
-            if ( count <= 0 ) {
-                break;
-            }
-        }
+    args[0] = (char *)update_file;
+    args[1] = "--nox11";
+    args[2] = (char *)install_path;
+    args[3] = NULL;
+    job->process = (child_process *)safe_malloc(sizeof *job->process);
+    if ( child_start(job->process, args, CHILD_STDOUT|CHILD_STDERR,
+                     NULL, 0, parse_update_output, job, update, udata) < 0 ) {
+        free(job->process);
+        job->process = NULL;
+        return(-1);
+    }
+    return(0);
+}
 
-        /* Parse output lines */
-        if ( (len == (sizeof(line)-1)) ||
-             (line[len] == '\r') || (line[len] == '\n') ) {
-            line[len] = '\0';
-
-            /* Check for N% output */
-            spot = strchr(line, '%');
-            if ( spot ) {
-                while ( (spot > line) &&
-                        (isdigit(*(spot-1)) || (*(spot-1) == '.')) ) {
-                    --spot;
-                }
-                percentage = (float)atoi(spot);
-                if ( ! status_updated ) {
-                    update_message(LOG_STATUS, _("Updating files"), update, udata);
-                    status_updated = 1;
-                }
-            } else {
-                /* Log the update output */
-                if ( strncmp(line, "ERROR: ", 7) == 0 ) {
-                    update_message(LOG_ERROR, line+7, update, udata);
-                } else
-                if ( strncmp(line, "WARNING: ", 8) == 0 ) {
-                    update_message(LOG_WARNING, line+8, update, udata);
-                } else {
-                    update_message(LOG_VERBOSE, line, update, udata);
-                }
-            }
-            len = 0;
-        } else {
-            len += count;
-        }
+/* Clean up after an update that has finished */
+static void finish_job(update_job *job)
+{
+    job->percentage = job->process->percentage;
+    job->status = job->process->status;
+    free(job->process);
+    job->process = NULL;
+}
 
-        /* Update the UI */
-        if ( update ) {
-            cancelled = update(0, NULL, percentage, 0, 0, 0.0f, udata);
-        }
+int perform_update_poll(update_job *job, update_callback update, void *udata)
+{
+    if ( ! job->process ) {
+        return(0);
+    }
+    job->process->update = update;
+    job->process->udata = udata;
+    if ( child_poll(job->process) ) {
+        job->percentage = job->process->percentage;
+        return(1);
+    }
+    finish_job(job);
+    return(0);
+}
 
-        /* Why doesn't the pipe close? */
-        if ( (count == 0) && (waitpid(child, &status, WNOHANG) == child) ) {
-            break;
-        }
+int perform_update_finish(update_job *job, update_callback update, void *udata)
+{
+    if ( job->process ) {
+        job->process->update = update;
+        job->process->udata = udata;
+        child_wait(job->process, update, udata);
+        finish_job(job);
     }
-    if ( cancelled ) {
-        kill(child, SIGTERM);
+    return(job->status);
+}
+
+void perform_update_abort(update_job *job)
+{
+    if ( job->process ) {
+        child_kill(job->process);
+        finish_job(job);
     }
-    waitpid(child, &status, 0);
-    close(pipefd[0]);
-    if ( cancelled ) {
-        status = 256;
+}
+
+int perform_update(const char *update_file, const char *install_path,
+                   update_callback update, void *udata)
+{
+    update_job job;
+
+    if ( perform_update_start(update_file, install_path,
+                              &job, update, udata) < 0 ) {
+        return(-1);
     }
-    return(status);
+    return(perform_update_finish(&job, update, udata));
 }
@@ -24,6 +24,8 @@
 #ifndef _UPDATE_H
 #define _UPDATE_H
 
+#include <sys/types.h>
+
 #include "log_output.h"
 
 typedef int (*update_callback)(int status_level, const char *status,
@@ -33,7 +35,41 @@ typedef int (*update_callback)(int status_level, const char *status,
 extern void update_message(int level, const char *message,
                            update_callback update, void *udata);
 
+/* Run an update, returning its exit status, which is 0 if it succeeded.
+   The update callback is called while it runs and may cancel it.
+ */
 extern int perform_update(const char *update_file, const char *install_path,
                           update_callback update, void *udata);
 
+/* An update being applied in the background */
+struct child_process;
+typedef struct {
+    struct child_process *process;     /* NULL when not running */
+    float percentage;
+    int status_updated;
+    int status;
+} update_job;
+
+/* Start running an update in the background, so the next one can be
+   downloaded while it runs.  Returns 0, or -1 if it couldn't be started.
+ */
+extern int perform_update_start(const char *update_file,
+                                const char *install_path, update_job *job,
+                                update_callback update, void *udata);
+
+/* Pass on any output from a background update, returning 1 if it is still
+   running, or 0 once it has finished and its exit status is in the job.
+ */
+extern int perform_update_poll(update_job *job,
+                               update_callback update, void *udata);
+
+/* Wait for a background update, returning its exit status.
+   The update callback is called while waiting and may cancel the update.
+ */
+extern int perform_update_finish(update_job *job,
+                                 update_callback update, void *udata);
+
+/* Stop a background update */
+extern void perform_update_abort(update_job *job);
+
 #endif /* _UPDATE_H */
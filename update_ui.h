@@ -21,11 +21,13 @@
 
 /* The user interface plugin API */
 
+#include "session.h"
+
 #define PRODUCT     "Loki_Update"
 
 typedef struct {
     int (*detect)(void);
-    int (*init)(int argc, char *argv[]);
+    int (*init)(update_session *session, int argc, char *argv[]);
     int (*auto_update)(const char *product);
     int (*perform_updates)(const char *product);
     void (*cleanup)(void);
@@ -24,21 +24,22 @@
 
 #include "url_paths.h"
 
-static char working_path[PATH_MAX];
-
-void set_working_path(const char *cwd)
+void set_working_path(update_session *session, const char *cwd)
 {
-    strncpy(working_path, cwd, sizeof(working_path));
+    strncpy(session->working_path, cwd, sizeof(session->working_path));
+    session->working_path[sizeof(session->working_path)-1] = '\0';
 }
 
-const char *get_working_path(void)
+const char *get_working_path(update_session *session)
 {
-    return(working_path);
+    return(session->working_path);
 }
 
 /* Compose a full URL from a base and a relative URL */
-char *compose_url(const char *base, const char *url, char *full, int maxlen)
+char *compose_url(update_session *session,
+                  const char *base, const char *url, char *full, int maxlen)
 {
+    const char *working_path = session->working_path;
     char *bufp;
 
     bufp = strstr(url, "://");
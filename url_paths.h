@@ -19,11 +19,14 @@
     info@lokigames.com
 */
 
+#include "session.h"
+
 /* Set/Get the original working directory for local relative path expansion */
-extern void set_working_path(const char *cwd);
-extern const char *get_working_path(void);
+extern void set_working_path(update_session *session, const char *cwd);
+extern const char *get_working_path(update_session *session);
 
 /* Compose a full URL from a base and a relative URL */
-extern char *compose_url(const char *base, const char *url,
+extern char *compose_url(update_session *session,
+                         const char *base, const char *url,
                          char *full, int maxlen);
 
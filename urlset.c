@@ -24,17 +24,21 @@
 #include <limits.h>
 
 #include "safe_malloc.h"
-#include "prefpath.h"
 #include "log_output.h"
+#include "mirror_stats.h"
 #include "urlset.h"
 
+/* How often a mirror other than the best one is tried first, in percent,
+   so that the statistics for the other mirrors stay up to date.
+ */
+#define EXPLORE_PERCENT     10
+
 
 /* Create a set of mirror URLs */
 urlset *create_urlset(void)
 {
     urlset *mirrors;
-    FILE *fp;
-    char preferred_mirror[PATH_MAX];
+    const char *preferred_site;
 
     /* Allocate the set of URLs */
     mirrors = (urlset *)safe_malloc(sizeof *mirrors);
@@ -43,17 +47,12 @@ urlset *create_urlset(void)
     mirrors->current = NULL;
     mirrors->full_url[0] = '\0';
 
-    /* Read the preferred mirror site */
-    mirrors->preferred_site = NULL;
-    preferences_path("preferred_mirror.txt",
-                     preferred_mirror, sizeof(preferred_mirror));
-    fp = fopen(preferred_mirror, "r");
-    if ( fp ) {
-        if ( fgets(preferred_mirror, sizeof(preferred_mirror), fp) ) {
-            preferred_mirror[strlen(preferred_mirror)-1] = '\0';
-            mirrors->preferred_site = safe_strdup(preferred_mirror);
-        }
-        fclose(fp);
+    /* Use the preferred mirror site */
+    preferred_site = get_preferred_mirror();
+    if ( preferred_site ) {
+        mirrors->preferred_site = safe_strdup(preferred_site);
+    } else {
+        mirrors->preferred_site = NULL;
     }
     return(mirrors);
 }
@@ -67,6 +66,8 @@ void add_url(urlset *urlset, const char *url)
     mirror = (struct mirror_url *)safe_malloc(sizeof *mirror);
     mirror->url = safe_strdup(url);
     mirror->status = URL_OK;
+    mirror->times_slow = 0;
+    mirror->host = get_mirror_host(url);
     mirror->next = NULL;
 
     /* Add the URL to our list */
@@ -108,11 +109,66 @@ int get_url_host(const char *url, char *dst, int maxlen)
     return(i != 0);
 }
 
-/* Randomize the order of the mirrors */
+/* Sort mirrors by how well they have done in the past, best first.
+   The sort is stable, so mirrors with the same score stay in random order.
+ */
+static void sort_urls(struct mirror_url **list, int count)
+{
+    double *scores, score, total;
+    struct mirror_url *mirror;
+    int i, j, known;
+
+    scores = (double *)safe_malloc(count*(sizeof *scores));
+    total = 0.0;
+    known = 0;
+    for ( i=0; i<count; ++i ) {
+        scores[i] = score_mirror(list[i]->url);
+        if ( scores[i] >= 0.0 ) {
+            total += scores[i];
+            ++known;
+        }
+    }
+    if ( known == 0 ) {
+        free(scores);
+        return;
+    }
+
+    /* Mirrors we know nothing about are given an average score */
+    for ( i=0; i<count; ++i ) {
+        if ( scores[i] < 0.0 ) {
+            scores[i] = total / known;
+        }
+    }
+    for ( i=1; i<count; ++i ) {
+        mirror = list[i];
+        score = scores[i];
+        for ( j=i; (j > 0) && (scores[j-1] < score); --j ) {
+            list[j] = list[j-1];
+            scores[j] = scores[j-1];
+        }
+        list[j] = mirror;
+        scores[j] = score;
+    }
+    free(scores);
+
+    /* Every so often give one of the other mirrors a chance */
+    if ( (count > 1) && ((rand()%100) < EXPLORE_PERCENT) ) {
+        i = (rand()%(count-1))+1;
+        mirror = list[i];
+        for ( j=i; j > 0; --j ) {
+            list[j] = list[j-1];
+        }
+        list[0] = mirror;
+    }
+}
+
+/* Randomize the order of the mirrors, putting local files, the preferred
+   mirror and then the mirrors that have been fastest before first.
+ */
 void randomize_urls(urlset *urlset)
 {
     struct mirror_url **list, *current;
-    int i, index, left;
+    int i, index, left, first;
     char host[PATH_MAX];
 
     /* If there is less than two mirrors, there's nothing to do */
@@ -150,6 +206,7 @@ void randomize_urls(urlset *urlset)
             }
         }
     }
+    first = index;
     left = urlset->num_mirrors - index;
 
     /* Randomize the rest of the URLs */
@@ -172,6 +229,7 @@ void randomize_urls(urlset *urlset)
         list[index] = current;
         current->status = URL_USED;
     }
+    sort_urls(&list[first], urlset->num_mirrors - first);
 
     /* Now turn our list into a real URL list */
     for ( i=0; i<(urlset->num_mirrors-1); ++i ) {
@@ -183,22 +241,46 @@ void randomize_urls(urlset *urlset)
     free(list);
 }
 
+/* Is this a mirror that hasn't had trouble anywhere during this run? */
+static int healthy_url(struct mirror_url *mirror)
+{
+    return((mirror->status == URL_OK) &&
+           (! mirror->host || (mirror->host->health == MIRROR_OK)));
+}
+
+/* Move to the next mirror with the given status, returning 0 if none.
+   If 'healthy' is set, mirrors whose host has had problems are skipped.
+ */
+static int find_url_status(urlset *urlset, enum url_status status,
+                           int healthy)
+{
+    struct mirror_url *stop;
+
+    stop = urlset->current;
+    while ( (urlset->current->status != status) ||
+            (healthy && ! healthy_url(urlset->current)) ) {
+        urlset->current = urlset->current->next;
+        if ( ! urlset->current ) {
+            urlset->current = urlset->list;
+        }
+        if ( urlset->current == stop ) {
+            return(0);
+        }
+    }
+    return(1);
+}
+
 static const char *get_current_url(urlset *urlset, const char *file)
 {
     const char *url;
 
-    /* Skip past URLs marked bad */
-    if ( urlset->current->status != URL_OK ) {
-        struct mirror_url *stop;
-
-        stop = urlset->current;
-        do {
-            urlset->current = urlset->current->next;
-            if ( ! urlset->current ) {
-                urlset->current = urlset->list;
-            }
-        } while ( (urlset->current != stop) &&
-                  (urlset->current->status != URL_OK) );
+    /* Skip past URLs marked bad, and hosts that failed for another
+       product, giving slow mirrors another chance when there's nothing
+       else left */
+    if ( ! find_url_status(urlset, URL_OK, 1) &&
+         ! find_url_status(urlset, URL_OK, 0) &&
+         find_url_status(urlset, URL_SLOW, 0) ) {
+        urlset->current->status = URL_OK;
     }
 
     /* If we found a valid mirror, use it */
@@ -230,6 +312,34 @@ const char *get_next_url(urlset *urlset, const char *file)
     return(get_current_url(urlset, file));
 }
 
+/* Make a mirror in the set the current one */
+const char *set_current_url(urlset *urlset, struct mirror_url *mirror,
+                            const char *file)
+{
+    urlset->current = mirror;
+    sprintf(urlset->full_url, "%s/%s", mirror->url, file);
+    return(urlset->full_url);
+}
+
+/* Set the status of a mirror in the set */
+static void set_mirror_status(struct mirror_url *mirror, enum url_status status)
+{
+    if ( (status == URL_SLOW) && (++mirror->times_slow > 1) ) {
+        status = URL_FAILED;
+    }
+    mirror->status = status;
+
+    /* Let the other sets of mirrors know about trouble with this host */
+    if ( mirror->host ) {
+        if ( status == URL_FAILED ) {
+            set_mirror_health(mirror->host, MIRROR_FAILED);
+        } else
+        if ( status == URL_SLOW ) {
+            set_mirror_health(mirror->host, MIRROR_SLOW);
+        }
+    }
+}
+
 /* Set the status of the current URL */
 void set_url_status(urlset *urlset, enum url_status status)
 {
@@ -237,7 +347,22 @@ void set_url_status(urlset *urlset, enum url_status status)
     if ( ! urlset->current ) {
         return;
     }
-    urlset->current->status = status;
+    report_url_status(urlset->current->url, status);
+    set_mirror_status(urlset->current, status);
+}
+
+/* Set the status of the mirror with the given URL */
+void set_mirror_url_status(urlset *urlset, const char *url,
+                           enum url_status status)
+{
+    struct mirror_url *mirror;
+
+    for ( mirror = urlset->list; mirror; mirror = mirror->next ) {
+        if ( strcmp(mirror->url, url) == 0 ) {
+            set_mirror_status(mirror, status);
+            break;
+        }
+    }
 }
 
 /* Set and save the preferred URL */
@@ -249,23 +374,12 @@ void set_preferred_url(urlset *urlset, const char *url)
     if ( get_url_host(urlset->full_url, mirror_host, sizeof(mirror_host)) ) {
         free(urlset->preferred_site);
         urlset->preferred_site = safe_strdup(mirror_host);
+        set_preferred_mirror(mirror_host);
     }
 }
 void save_preferred_url(urlset *urlset)
 {
-    FILE *fp;
-    char mirror_file[PATH_MAX];
-
-    /* Write it out to disk */
-    preferences_path("preferred_mirror.txt", mirror_file, sizeof(mirror_file));
-    fp = fopen(mirror_file, "w");
-    if ( fp ) {
-        fprintf(fp, "%s\n", urlset->preferred_site ?
-                            urlset->preferred_site : "");
-        fclose(fp);
-    } else {
-        log(LOG_WARNING, _("Unable to write to %s\n"), mirror_file);
-    }
+    save_preferred_mirror();
 }
 
 /* Reset the status of a set or URLs */
@@ -275,6 +389,7 @@ void reset_urlset(urlset *urlset)
 
     for ( mirror = urlset->list; mirror; mirror = mirror->next ) {
         mirror->status = URL_OK;
+        mirror->times_slow = 0;
     }
     urlset->current = NULL;
     urlset->num_okay = urlset->num_mirrors;
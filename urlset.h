@@ -19,6 +19,9 @@
     info@lokigames.com
 */
 
+#ifndef _urlset_h
+#define _urlset_h
+
 #include <limits.h>
 
 /* A set of URLs used as mirror locations */
@@ -27,8 +30,11 @@ struct mirror_url {
     enum url_status {
         URL_OK,
         URL_USED,
-        URL_FAILED
+        URL_FAILED,
+        URL_SLOW                /* Stalled, tried again after the others */
     } status;
+    int times_slow;
+    struct mirror_host *host;   /* Shared with every other set of mirrors */
     void *data;
     struct mirror_url *next;
 };
@@ -50,7 +56,7 @@ extern int get_url_host(const char *url, char *dst, int maxlen);
 /* Add a URL to a set of update URLs */
 extern void add_url(urlset *urlset, const char *url);
 
-/* Randomize the order of the mirrors */
+/* Randomize the order of the mirrors, trying the best known mirrors first */
 extern void randomize_urls(urlset *urlset);
 
 /* Set and save the preferred URL */
@@ -60,11 +66,26 @@ extern void save_preferred_url(urlset *urlset);
 /* Get the next URL to be tried for an update */
 extern const char *get_next_url(urlset *urlset, const char *file);
 
-/* Set the status of the current URL */
+/* Make a mirror in the set the current one, returning its URL for a file */
+extern const char *set_current_url(urlset *urlset, struct mirror_url *mirror,
+                                   const char *file);
+
+/* Set the status of the current URL.  A mirror marked URL_SLOW is only
+   used again once no other mirrors are left, and if it is too slow a
+   second time it is marked URL_FAILED.
+ */
 extern void set_url_status(urlset *urlset, enum url_status status);
 
+/* Set the status of the mirror with the given URL, as reported by a
+   download in a child process.
+ */
+extern void set_mirror_url_status(urlset *urlset, const char *url,
+                                  enum url_status status);
+
 /* Reset the status of a set or URLs */
 extern void reset_urlset(urlset *urlset);
 
 /* Free a set of update URLs */
 extern void free_urlset(urlset *urlset);
+
+#endif /* _urlset_h */